@@ -14,7 +14,16 @@
 
 /* include all of the parts */
 #include <vrt/atomic.h>
+#include <vrt/copy.h>
+#include <vrt/cpu.h>
+#include <vrt/lanes.h>
+#include <vrt/pool.h>
 #include <vrt/queue.h>
+#include <vrt/router.h>
+#include <vrt/rpc.h>
+#include <vrt/sink.h>
+#include <vrt/source.h>
+#include <vrt/topology.h>
 #include <vrt/value.h>
 #include <vrt/yield.h>
 
@@ -82,6 +82,28 @@ vrt_atomic_write_barrier(void)
 #endif
 
 
+/*-----------------------------------------------------------------------
+ * Schedule points
+ */
+
+/* Every access to a shared padded value is a "schedule point".  In a
+ * normal build these compile away to nothing.  If you define
+ * VRT_SCHEDULE_HOOK (as the interleaving simulator in the test suite
+ * does), each one calls vrt_schedule_point, which you must provide, and
+ * which can switch to a different thread of control before the access
+ * happens.  The parameter tells the hook whether the access is a write
+ * (or read-modify-write). */
+
+#if defined(VRT_SCHEDULE_HOOK)
+void
+vrt_schedule_point(bool is_write);
+
+#define VRT_SCHEDULE_POINT(is_write)  vrt_schedule_point(is_write)
+#else
+#define VRT_SCHEDULE_POINT(is_write)  /* do nothing */
+#endif
+
+
 /*-----------------------------------------------------------------------
  * Padded values
  */
@@ -98,6 +120,7 @@ static inline int
 vrt_padded_int_get(struct vrt_padded_int *padded)
 {
     /* We need a read barrier before reading */
+    VRT_SCHEDULE_POINT(false);
     vrt_atomic_read_barrier();
     return padded->value;
 }
@@ -107,6 +130,7 @@ static inline void
 vrt_padded_int_set(struct vrt_padded_int *padded, int v)
 {
     /* We need a write barrier after writing */
+    VRT_SCHEDULE_POINT(true);
     padded->value = v;
     vrt_atomic_write_barrier();
 }
@@ -116,8 +140,37 @@ static inline int
 vrt_padded_int_atomic_add(struct vrt_padded_int *padded, int delta)
 {
     /* The atomic instruction includes a memory barrier already */
+    VRT_SCHEDULE_POINT(true);
     return cork_int_atomic_add(&padded->value, delta);
 }
 
+CORK_ATTR_UNUSED
+static inline int
+vrt_padded_int_cas(struct vrt_padded_int *padded,
+                   int old_value, int new_value)
+{
+    /* The atomic instruction includes a memory barrier already */
+    VRT_SCHEDULE_POINT(true);
+    return cork_int_cas(&padded->value, old_value, new_value);
+}
+
+/* Raises a padded int to @a v, unless it's already there or past it.
+ * The comparison uses modular arithmetic, so this works for cursors that
+ * have wrapped around.  When several threads race to raise the same
+ * value, the largest one wins. */
+CORK_ATTR_UNUSED
+static inline void
+vrt_padded_int_advance(struct vrt_padded_int *padded, int v)
+{
+    int  current = vrt_padded_int_get(padded);
+    while (0 < (v - current)) {
+        int  actual = vrt_padded_int_cas(padded, current, v);
+        if (actual == current) {
+            return;
+        }
+        current = actual;
+    }
+}
+
 
 #endif /* VRT_ATOMIC */
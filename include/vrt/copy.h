@@ -0,0 +1,89 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_COPY_H
+#define VRT_COPY_H
+
+#include <libcork/core.h>
+
+
+/*-----------------------------------------------------------------------
+ * Payload copies
+ */
+
+/* A producer that fills large values (packet copies, serialized
+ * records) with ordinary stores pulls every destination cache line into
+ * its own cache, only for a consumer on some other core to read it from
+ * there.  That evicts the producer's working set, and makes each line
+ * take a cache-to-cache transfer.  These helpers use non-temporal
+ * (streaming) stores instead, which write around the producer's caches,
+ * for payloads at or above a threshold; smaller payloads are cheaper to
+ * copy the ordinary way.
+ *
+ * Non-temporal stores aren't ordered with respect to other stores, so
+ * after filling a batch of values, and before publishing any of them,
+ * the producer must call vrt_copy_fence. */
+
+/** The default payload size at which vrt_copy_payload and
+ * vrt_fill_payload switch to non-temporal stores.  Below this, the
+ * test-perf-copy benchmark measures ordinary stores as faster; run it to
+ * find the crossover on a particular machine. */
+#define VRT_COPY_DEFAULT_NT_THRESHOLD  65536
+
+/** Return whether non-temporal stores are available on this platform.
+ * If not, every function in this file falls back on memcpy and
+ * memset. */
+bool
+vrt_copy_nt_available(void);
+
+/** Return or change the payload size at which vrt_copy_payload and
+ * vrt_fill_payload switch to non-temporal stores.  A threshold of 0
+ * means always; SIZE_MAX means never.  This is process-wide. */
+size_t
+vrt_copy_get_nt_threshold(void);
+
+void
+vrt_copy_set_nt_threshold(size_t threshold);
+
+/** Copy @a size bytes from @a src to @a dest, using non-temporal stores
+ * if the payload is at least as large as the threshold. */
+void
+vrt_copy_payload(void *dest, const void *src, size_t size);
+
+/** Fill @a size bytes at @a dest with the byte @a c, using non-temporal
+ * stores if the payload is at least as large as the threshold. */
+void
+vrt_fill_payload(void *dest, int c, size_t size);
+
+/** Copy or fill a payload with non-temporal stores, regardless of its
+ * size.  (Any part of the payload that doesn't fill an aligned 16-byte
+ * chunk still uses ordinary stores.) */
+void
+vrt_copy_nt(void *dest, const void *src, size_t size);
+
+void
+vrt_fill_nt(void *dest, int c, size_t size);
+
+/** Make every earlier non-temporal store visible before any later
+ * store.  Call this after filling a batch of values, and before
+ * publishing them. */
+CORK_ATTR_UNUSED
+static inline void
+vrt_copy_fence(void)
+{
+#if defined(__GNUC__) && defined(__SSE2__)
+    __asm__ __volatile__ ("sfence" ::: "memory");
+#else
+    __asm__ __volatile__ ("" ::: "memory");
+#endif
+}
+
+
+#endif /* VRT_COPY_H */
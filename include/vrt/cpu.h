@@ -0,0 +1,173 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_CPU_H
+#define VRT_CPU_H
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+
+/*-----------------------------------------------------------------------
+ * CPU topology
+ */
+
+/** One logical CPU, and where it sits in the machine's cache
+ * hierarchy.  The core, l2, and llc fields are the ID of the lowest
+ * numbered CPU in the group, so two CPUs share a core, an L2 cache, or
+ * a last-level cache exactly when the corresponding fields are equal. */
+struct vrt_cpu {
+    /** The CPU number, as used by sched_setaffinity */
+    int  id;
+    /** The physical package (socket) */
+    int  package;
+    /** The physical core; SMT siblings share this */
+    int  core;
+    /** The CPUs that share this CPU's L2 cache */
+    int  l2;
+    /** The CPUs that share this CPU's last-level cache */
+    int  llc;
+};
+
+/** A list of CPU IDs. */
+typedef cork_array(int)  vrt_cpu_list;
+
+/** Parse a CPU list in the kernel's format (for instance "0-3,8"),
+ * appending each CPU to @a dest.  Returns -1 if the list is malformed. */
+int
+vrt_cpu_list_parse(const char *list, vrt_cpu_list *dest);
+
+/** Append the CPUs that the kernel has isolated from the general
+ * scheduler (the isolcpus boot parameter) to @a dest.  Returns -1 if
+ * the list isn't available. */
+int
+vrt_cpu_list_isolated(vrt_cpu_list *dest);
+
+/** Return whether @a list contains @a id. */
+bool
+vrt_cpu_list_contains(const vrt_cpu_list *list, int id);
+
+
+/** The CPUs that this process can run on. */
+struct vrt_cpu_topology {
+    cork_array(struct vrt_cpu)  cpus;
+};
+
+/** Read the CPU topology from a sysfs directory laid out like
+ * /sys/devices/system/cpu.  If @a root is NULL, we read the real
+ * topology, restricted to the CPUs in this process's affinity mask.  If
+ * the topology isn't available, every CPU is treated as a separate core
+ * with its own caches. */
+struct vrt_cpu_topology *
+vrt_cpu_topology_new(const char *root);
+
+/** Read the CPU topology of every online CPU, whether or not it's in
+ * this process's affinity mask.  CPUs that the kernel has isolated
+ * aren't in the default mask, so this is the one to use when you're
+ * going to pin threads to CPUs that you've chosen explicitly.  If @a
+ * root is NULL, we read the real topology. */
+struct vrt_cpu_topology *
+vrt_cpu_topology_new_online(const char *root);
+
+void
+vrt_cpu_topology_free(struct vrt_cpu_topology *topo);
+
+/** Remove every CPU that isn't in @a cpus from a topology. */
+void
+vrt_cpu_topology_restrict(struct vrt_cpu_topology *topo,
+                          const vrt_cpu_list *cpus);
+
+/** Return the CPU with the given ID, or NULL. */
+struct vrt_cpu *
+vrt_cpu_topology_get(struct vrt_cpu_topology *topo, int id);
+
+/** Return how far apart two CPUs are: 0 for the same CPU, 1 for SMT
+ * siblings, 2 for cores that share an L2 cache, 3 for a shared
+ * last-level cache, 4 for the same package, and 5 otherwise. */
+unsigned int
+vrt_cpu_distance(const struct vrt_cpu *a, const struct vrt_cpu *b);
+
+
+/*-----------------------------------------------------------------------
+ * Placement
+ */
+
+enum vrt_cpu_policy {
+    /** Don't pin anything. */
+    VRT_CPU_POLICY_NONE,
+    /** Put each stage as close as possible to the previous one, so that
+     * values are handed off through the nearest shared cache. */
+    VRT_CPU_POLICY_COMPACT,
+    /** Spread the stages across as many packages and caches as
+     * possible.  This is mostly useful as a baseline. */
+    VRT_CPU_POLICY_SCATTER
+};
+
+/** Return the policy with the given name ("none", "compact", or
+ * "scatter"), or -1 if there isn't one. */
+int
+vrt_cpu_policy_by_name(const char *name);
+
+const char *
+vrt_cpu_policy_name(enum vrt_cpu_policy policy);
+
+/** Choose a CPU for each of @a count stages, filling in @a cpus (or
+ * setting every entry to -1 for VRT_CPU_POLICY_NONE).  The stages
+ * should be listed in pipeline order, so that adjacent stages hand
+ * values to each other.  A stage that busy-waits (@a spinning) always
+ * gets a physical core to itself, since an SMT sibling would steal its
+ * execution resources from the stage that's doing real work.  If there
+ * are more stages than CPUs, some stages share CPUs.  Returns the
+ * number of stages that had to share. */
+size_t
+vrt_cpu_place(struct vrt_cpu_topology *topo, enum vrt_cpu_policy policy,
+              size_t count, const bool *spinning, int *cpus);
+
+
+/*-----------------------------------------------------------------------
+ * CPU budget
+ */
+
+/* In a container, the process can usually run on every CPU in the
+ * machine, but a cgroup CPU quota limits how much time it can use on
+ * them in each period.  Once the quota for a period is used up, every
+ * thread in the cgroup is throttled until the next period starts. */
+
+/** Return the tightest cgroup v2 CPU quota ("cpu.max") of a cgroup
+ * directory and each of its ancestors, in CPUs, or 0 if there is no
+ * quota.  If @a cgroup is NULL, we use this process's cgroup. */
+double
+vrt_cpu_quota(const char *cgroup);
+
+/** Return the number of CPUs' worth of time that this process can use:
+ * the smaller of its CPU quota and the number of CPUs in its affinity
+ * mask. */
+double
+vrt_cpu_budget(void);
+
+/** Throttling statistics for a cgroup, from its cpu.stat file. */
+struct vrt_cpu_throttling {
+    /** The number of enforcement periods that have elapsed */
+    uint64_t  periods;
+    /** The number of periods in which the cgroup was throttled */
+    uint64_t  throttled_periods;
+    /** The total time that the cgroup has spent throttled */
+    uint64_t  throttled_usec;
+};
+
+/** Read the throttling statistics of a cgroup directory (or of this
+ * process's cgroup, if @a cgroup is NULL).  If the statistics aren't
+ * available, they're all reported as 0. */
+void
+vrt_cpu_throttling_get(const char *cgroup,
+                       struct vrt_cpu_throttling *throttling);
+
+
+#endif /* VRT_CPU_H */
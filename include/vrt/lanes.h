@@ -0,0 +1,218 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_LANES_H
+#define VRT_LANES_H
+
+#include <libcork/core.h>
+
+#include <vrt/atomic.h>
+#include <vrt/queue.h>
+#include <vrt/value.h>
+#include <vrt/yield.h>
+
+
+/*-----------------------------------------------------------------------
+ * Error codes
+ */
+
+/** The error code used when a set of lanes is misconfigured. */
+#define VRT_LANES_ERROR  0x7c25e1a4
+
+
+/*-----------------------------------------------------------------------
+ * Priority lanes
+ */
+
+/* A set of priority lanes is a small, fixed number of queues (the lanes)
+ * that share the same consumers.  Lane 0 has the highest priority.  A
+ * producer chooses a lane for each value, and a consumer drains the
+ * higher lanes before the lower ones, so an urgent value doesn't have
+ * to wait behind a backlog of bulk traffic.  Each lane is an ordinary
+ * queue, with its own ring and cursors; what the lanes share is a
+ * single doorbell, which every lane producer rings after it publishes,
+ * so that a consumer can wait for all of its lanes at once.
+ *
+ * By default, the lanes are drained in strict priority order, so a
+ * lower lane only gets a turn when every lane above it is empty.  A
+ * consumer can instead give each lane a weight: it then takes at most
+ * that many values from each lane per round, still highest lane first,
+ * so that a busy high lane can't starve the lanes below it. */
+
+/** The most lanes that a set can have */
+#define VRT_LANES_MAX  8
+
+/** A set of priority lanes. */
+struct vrt_lanes {
+    /** A name for the set of lanes */
+    const char  *name;
+
+    /** The number of lanes */
+    unsigned int  lane_count;
+
+    /** The queue for each lane, highest priority first */
+    struct vrt_queue  *lanes[VRT_LANES_MAX];
+
+    /** Incremented whenever a value is published to any lane */
+    struct vrt_padded_int  doorbell;
+};
+
+/** Allocate a new set of @a lane_count lanes, each of which is a queue
+ * of @a size values of the given type. */
+struct vrt_lanes *
+vrt_lanes_new(const char *name, struct vrt_value_type *value_type,
+              unsigned int lane_count, unsigned int size);
+
+/** Free a set of lanes, along with their queues, and every producer and
+ * consumer of those queues. */
+void
+vrt_lanes_free(struct vrt_lanes *lanes);
+
+/** Cancel every lane.  (See vrt_queue_cancel.) */
+void
+vrt_lanes_cancel(struct vrt_lanes *lanes);
+
+
+/*-----------------------------------------------------------------------
+ * Lane producers
+ */
+
+/** A producer that can publish to any of a set of lanes.  It has an
+ * ordinary producer for each lane, each of which claims values in
+ * batches of its own.  A value isn't visible to the consumers until its
+ * lane's batch is published, so a lane that needs low latency should use
+ * a batch size of 1, or the producer should flush regularly. */
+struct vrt_lanes_producer {
+    /** A name for the producer */
+    const char  *name;
+
+    /** The lanes that this producer feeds */
+    struct vrt_lanes  *lanes;
+
+    /** The producer for each lane.  They belong to the lanes' queues.
+     * You must give each of them a yield strategy before using this
+     * producer. */
+    struct vrt_producer  *producers[VRT_LANES_MAX];
+};
+
+/** Allocate a new producer for a set of lanes.  Each lane's producer
+ * claims @a batch_size values at once (or a reasonable default if it's
+ * 0). */
+struct vrt_lanes_producer *
+vrt_lanes_producer_new(const char *name, struct vrt_lanes *lanes,
+                       unsigned int batch_size);
+
+/** Free a lane producer.  (Its per-lane producers belong to the lanes'
+ * queues, and are freed along with them.) */
+void
+vrt_lanes_producer_free(struct vrt_lanes_producer *lp);
+
+/** Claim the next value in @a lane. */
+int
+vrt_lanes_producer_claim(struct vrt_lanes_producer *lp, unsigned int lane,
+                         struct vrt_value **value);
+
+/** Publish the value that was most recently claimed in @a lane. */
+int
+vrt_lanes_producer_publish(struct vrt_lanes_producer *lp,
+                           unsigned int lane);
+
+/** Flush every lane. */
+int
+vrt_lanes_producer_flush(struct vrt_lanes_producer *lp);
+
+/** Send an EOF on every lane. */
+int
+vrt_lanes_producer_eof(struct vrt_lanes_producer *lp);
+
+
+/*-----------------------------------------------------------------------
+ * Lane consumers
+ */
+
+/** A consumer that drains a set of lanes, highest priority first. */
+struct vrt_lanes_consumer {
+    /** A name for the consumer */
+    const char  *name;
+
+    /** The lanes that this consumer drains */
+    struct vrt_lanes  *lanes;
+
+    /** The consumer for each lane.  They belong to the lanes' queues,
+     * and never wait themselves.  Other consumers can depend on these,
+     * but these can't depend on anything; vrt_lanes_consumer_next
+     * reports an error if they do. */
+    struct vrt_consumer  *consumers[VRT_LANES_MAX];
+
+    /** The yield strategy to use while every lane is empty.  You must
+     * set this before calling vrt_lanes_consumer_next. */
+    struct vrt_yield_strategy  *yield;
+
+    /** How many values to take from each lane per round, or all 0 for
+     * strict priority */
+    unsigned int  weights[VRT_LANES_MAX];
+
+    /** How many more values each lane can have in the current round */
+    unsigned int  credits[VRT_LANES_MAX];
+
+    /** Whether each lane has seen an EOF from all of its producers, and
+     * how many lanes have */
+    bool  finished[VRT_LANES_MAX];
+    unsigned int  finished_count;
+
+    /** The lane of the value (or FLUSH) that vrt_lanes_consumer_next
+     * most recently returned */
+    unsigned int  lane;
+
+    /** The number of values returned from each lane */
+    uint64_t  value_counts[VRT_LANES_MAX];
+
+    /** The number of times we had to wait because every lane was
+     * empty */
+    uint64_t  wait_count;
+};
+
+/** Allocate a new consumer for a set of lanes.  It gets an ordinary
+ * consumer on each lane right away. */
+struct vrt_lanes_consumer *
+vrt_lanes_consumer_new(const char *name, struct vrt_lanes *lanes);
+
+/** Free a lane consumer, along with its yield strategy.  (Its per-lane
+ * consumers belong to the lanes' queues, and are freed along with
+ * them.) */
+void
+vrt_lanes_consumer_free(struct vrt_lanes_consumer *lc);
+
+/** Give each lane a weight, which must be at least 1, instead of
+ * draining them in strict priority order.  @a weights must have an
+ * entry for each lane; NULL goes back to strict priority. */
+int
+vrt_lanes_consumer_set_weights(struct vrt_lanes_consumer *lc,
+                               const unsigned int *weights);
+
+/** Retrieve the next value from the highest priority lane that has one
+ * (and that has credit left in this round, if the lanes are weighted),
+ * waiting if every lane is empty.  The consumer's lane field tells you
+ * which lane the value came from.  Returns VRT_QUEUE_FLUSH when a lane
+ * is flushed, VRT_QUEUE_EOF once every lane has seen an EOF from all of
+ * its producers, and VRT_QUEUE_CANCELLED if any lane is cancelled.
+ * Returns an error if any of the consumer's per-lane consumers has been
+ * given a dependency. */
+int
+vrt_lanes_consumer_next(struct vrt_lanes_consumer *lc,
+                        struct vrt_value **value);
+
+/** Print the number of values taken from each lane, and the number of
+ * times the consumer had to wait. */
+void
+vrt_report_lanes_consumer(struct vrt_lanes_consumer *lc);
+
+
+#endif /* VRT_LANES_H */
@@ -0,0 +1,242 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_POOL_H
+#define VRT_POOL_H
+
+#include <pthread.h>
+
+#include <libcork/core.h>
+
+#include <vrt/atomic.h>
+#include <vrt/queue.h>
+#include <vrt/value.h>
+#include <vrt/yield.h>
+
+
+/*-----------------------------------------------------------------------
+ * Error codes
+ */
+
+/** The error code used when a pool's workers can't be started, or one
+ * of them fails. */
+#define VRT_POOL_ERROR  0x51c4e08b
+
+
+/*-----------------------------------------------------------------------
+ * Elastic consumer pools
+ */
+
+/* A pool is a consumer whose values are processed by a varying number
+ * of worker threads.  The workers share a single claim sequence, so
+ * each value is processed by exactly one of them, in no particular
+ * order.  A controller thread samples the pool's lag (the number of
+ * values that have been published but not yet processed) and adds a
+ * worker when the lag keeps growing or the queue is filling up, and
+ * retires one when the lag has stayed low for a while.
+ *
+ * The rest of the queue sees the pool as an ordinary consumer: the
+ * producers won't overwrite a value until the pool has finished with
+ * it, and other consumers can depend on the pool.  The pool's cursor is
+ * the minimum of its workers' progress, which they publish whenever
+ * they're about to wait, and every so often while they're busy. */
+
+struct vrt_pool;
+struct vrt_pool_worker;
+
+/** A function that processes the values passing through a pool.
+ * @a event is 0 and @a value is the next value that this worker should
+ * process; or @a event is @ref VRT_QUEUE_FLUSH, and @a value is NULL.
+ * Only one worker sees each FLUSH.  Each worker's handler is called
+ * once with @ref VRT_QUEUE_EOF right before the worker stops, whether
+ * because it was retired or because the queue is finished.  Any other
+ * return value is treated as an error, and stops the whole pool. */
+typedef int
+(*vrt_pool_handler_f)(struct vrt_pool_worker *worker, int event,
+                      struct vrt_value *value);
+
+/** One of the threads that processes a pool's values. */
+struct vrt_pool_worker {
+    /** The pool that this worker belongs to */
+    struct vrt_pool  *pool;
+
+    /** The index of this worker within the pool */
+    unsigned int  index;
+
+    /** Every value up to this one that this worker has claimed has been
+     * processed, and it won't claim any others. */
+    struct vrt_padded_int  cursor;
+
+    /** Whether this worker's cursor counts towards the pool's */
+    volatile int  active;
+
+    /** Whether this worker's thread has finished */
+    volatile int  exited;
+
+    /** Whether this worker's thread has been started, and not yet
+     * joined.  Only the controller touches this. */
+    bool  running;
+
+    /** The last value that we know is available for processing */
+    vrt_value_id  last_available_id;
+
+    /** The yield strategy to use when there aren't any values to
+     * process */
+    struct vrt_yield_strategy  *yield;
+
+    /** Per-worker storage for the handler.  This starts off NULL each
+     * time the worker starts, and is otherwise never touched by the
+     * pool. */
+    void  *state;
+
+    /** The number of values that this worker has processed */
+    uint64_t  value_count;
+
+    /** The result of running this worker's loop */
+    int  result;
+
+    /** The thread that runs this worker */
+    pthread_t  thread;
+};
+
+/** Statistics about how a pool has scaled. */
+struct vrt_pool_stats {
+    /** The number of workers that are currently running */
+    unsigned int  workers;
+
+    /** The most workers that have been running at once */
+    unsigned int  peak_workers;
+
+    /** The number of times a worker has been added */
+    unsigned int  scale_ups;
+
+    /** The number of times a worker has been retired */
+    unsigned int  scale_downs;
+
+    /** The lag at the most recent sample */
+    unsigned int  lag;
+
+    /** The largest lag that's been sampled */
+    unsigned int  max_lag;
+
+    /** The number of times the controller has sampled the lag */
+    uint64_t  sample_count;
+};
+
+/** A consumer whose values are processed by an elastic pool of worker
+ * threads. */
+struct vrt_pool {
+    /** A name for the pool */
+    const char  *name;
+
+    /** The queue that the pool drains */
+    struct vrt_queue  *queue;
+
+    /** The consumer that represents the pool to the rest of the queue.
+     * Its cursor is the pool's progress, and you can add dependencies
+     * to it before starting the pool.  It belongs to the queue. */
+    struct vrt_consumer  *consumer;
+
+    /** The last value that a worker has claimed */
+    struct vrt_padded_int  claimed;
+
+    /** The number of retirements that the controller has asked for,
+     * which the next idle workers will pick up */
+    struct vrt_padded_int  retiring;
+
+    /** The number of EOFs that the workers have seen */
+    struct vrt_padded_int  eof_count;
+
+    /** Whether every producer has sent its EOF, or a worker has failed,
+     * so the workers should stop */
+    volatile int  finished;
+
+    /** The function that processes each value */
+    vrt_pool_handler_f  handler;
+
+    /** The user data that was given along with the handler */
+    void  *ud;
+
+    /** The name of the yield strategy that each worker uses */
+    const char  *yield_name;
+
+    /** Every worker that the pool can run, running or not */
+    struct vrt_pool_worker  *workers;
+
+    /** The fewest and most workers to run at once.  These must be set
+     * before the pool starts. */
+    unsigned int  min_workers;
+    unsigned int  max_workers;
+
+    /** How often to sample the lag, in nanoseconds */
+    uint64_t  sample_interval;
+
+    /** Add a worker once the lag has grown (or stayed above
+     * high_water) for this many samples in a row */
+    unsigned int  grow_samples;
+
+    /** A lag that always counts as falling behind, since the producers
+     * are about to block; half of the queue by default */
+    unsigned int  high_water;
+
+    /** Retire a worker once the lag has stayed at or below idle_lag for
+     * this many samples in a row */
+    unsigned int  idle_samples;
+
+    /** A lag that counts as idle; 1/32 of the queue by default */
+    unsigned int  idle_lag;
+
+    /** Statistics about how the pool has scaled */
+    struct vrt_pool_stats  stats;
+
+    /** The first error that a worker's handler returned, or 0 */
+    int  result;
+
+    /** The thread that samples the lag and scales the pool */
+    pthread_t  controller;
+
+    /** Whether the pool's threads are running */
+    bool  started;
+};
+
+/** Allocate a new pool that will drain the given queue, starting with
+ * one worker and growing to at most one per CPU in the process's CPU
+ * budget.  The pool's consumer is added to the queue right away. */
+struct vrt_pool *
+vrt_pool_new(const char *name, struct vrt_queue *q,
+             vrt_pool_handler_f handler, void *ud);
+
+/** Free a pool.  Its threads must not be running.  (The pool's consumer
+ * belongs to the queue, and is freed along with it.) */
+void
+vrt_pool_free(struct vrt_pool *pool);
+
+/** Set the fewest and most workers to run at once.  This must be called
+ * before the pool starts. */
+int
+vrt_pool_set_workers(struct vrt_pool *pool, unsigned int min_workers,
+                     unsigned int max_workers);
+
+/** Start the pool's controller and its first workers. */
+int
+vrt_pool_start(struct vrt_pool *pool);
+
+/** Wait until the pool has processed every producer's EOF, or has been
+ * cancelled, and all of its threads have finished.  Returns an error if
+ * any worker's handler failed. */
+int
+vrt_pool_join(struct vrt_pool *pool);
+
+/** Print the pool's scaling statistics. */
+void
+vrt_report_pool(struct vrt_pool *pool);
+
+
+#endif /* VRT_POOL_H */
@@ -36,11 +36,24 @@
  * FLUSH. */
 #define VRT_QUEUE_FLUSH  -3
 
+/** The result code used to signify that one of a consumer's periodic
+ * ticks is due. */
+#define VRT_QUEUE_TICK  -4
+
+/** The result code used to signify that the queue has been cancelled,
+ * and that the client should stop right away. */
+#define VRT_QUEUE_CANCELLED  -5
+
+/** The error code used when a queue can't be quiesced in time. */
+#define VRT_QUEUE_ERROR  0x4ab3d95e
+
 struct vrt_producer;
 struct vrt_consumer;
+struct vrt_barrier;
 
 typedef cork_array(struct vrt_producer *)  vrt_producer_array;
 typedef cork_array(struct vrt_consumer *)  vrt_consumer_array;
+typedef cork_array(struct vrt_barrier *)  vrt_barrier_array;
 
 /** A FIFO queue modeled after the Java Disruptor project. */
 struct vrt_queue {
@@ -61,6 +74,9 @@ struct vrt_queue {
     /** The consumers feeding this queue. */
     vrt_consumer_array  consumers;
 
+    /** The barriers shared by this queue's consumers. */
+    vrt_barrier_array  barriers;
+
     /** The last item that we know every consumer has finished
      * processing. */
     vrt_value_id  last_consumed_id;
@@ -74,6 +90,19 @@ struct vrt_queue {
     /** The next value ID that can be written into the queue. */
     struct vrt_padded_int  cursor;
 
+    /** The number of outstanding vrt_queue_quiesce calls.  While this
+     * is nonzero, producers won't publish any values. */
+    struct vrt_padded_int  quiesced;
+
+    /** Whether vrt_queue_quiesce can force a memory barrier onto every
+     * producer thread.  If so, producers can check for a quiesce
+     * without a barrier of their own. */
+    bool  heavy_barrier;
+
+    /** Whether vrt_queue_cancel has been called.  Every wait loop
+     * checks this, so that blocked clients can bail out. */
+    struct vrt_padded_int  cancelled;
+
     /** A name for the queue */
     const char  *name;
 };
@@ -87,6 +116,33 @@ vrt_queue_new(const char *name, struct vrt_value_type *value_type,
 void
 vrt_queue_free(struct vrt_queue *q);
 
+/** Stop the queue's producers from publishing any more values, and
+ * wait until every consumer has finished processing every value that
+ * has already been published.  Producers block at their next publish;
+ * they can keep filling in values that they've already claimed.  If
+ * the queue doesn't drain within @a timeout nanoseconds (or never, if
+ * @a timeout is 0), we undo the quiesce and return an error.  Every
+ * successful call must be matched by a call to vrt_queue_resume. */
+int
+vrt_queue_quiesce(struct vrt_queue *q, uint64_t timeout);
+
+/** Let the queue's producers publish values again. */
+void
+vrt_queue_resume(struct vrt_queue *q);
+
+/** Cancel the queue.  Every client that is waiting on the queue, or
+ * that tries to claim, publish, or consume a value from now on, gets a
+ * VRT_QUEUE_CANCELLED result, so that its thread can shut down
+ * immediately without draining the queue.  Values that were in flight
+ * are abandoned.  This cannot be undone; the only thing you can do with
+ * a cancelled queue is free it, once its clients have stopped. */
+void
+vrt_queue_cancel(struct vrt_queue *q);
+
+/** Return whether the queue has been cancelled. */
+#define vrt_queue_is_cancelled(q) \
+    ((q)->cancelled.value != 0)
+
 /* Compare two integers on the modular-arithmetic ring that fits into an int. */
 #define vrt_mod_lt(a, b) (0 < ((b)-(a)))
 #define vrt_mod_le(a, b) (0 <= ((b)-(a)))
@@ -120,6 +176,14 @@ vrt_queue_set_cursor(struct vrt_queue *q, vrt_value_id value)
     vrt_padded_int_set(&q->cursor, value);
 }
 
+/** Return the smallest cursor of any of the queue's consumers: the
+ * last value that every consumer has finished with.  Fills in @a watch
+ * with that consumer's cursor, so that a producer that needs the slot
+ * back can wait for it to change.  If the queue doesn't have any
+ * consumers, this is the queue's own cursor. */
+vrt_value_id
+vrt_queue_slowest_cursor(struct vrt_queue *q, volatile int **watch);
+
 
 /*-----------------------------------------------------------------------
  * Producers
@@ -185,6 +249,11 @@ struct vrt_producer {
      * block. */
     struct vrt_yield_strategy  *yield;
 
+    /** Whether the producer is about to publish a batch of values.
+     * vrt_queue_quiesce uses this to make sure that no producer
+     * publishes anything after it has returned. */
+    struct vrt_padded_int  publishing;
+
     /** A name for the producer */
     const char  *name;
 
@@ -291,6 +360,19 @@ struct vrt_consumer {
      * consumers have processed it. */
     vrt_consumer_array  dependencies;
 
+    /** A barrier that this consumer shares with other consumers that
+     * have the same dependencies, or NULL.  If this is set, we use the
+     * barrier's cached view of how far the dependencies have gotten,
+     * rather than checking each of their cursors ourselves. */
+    struct vrt_barrier  *barrier;
+
+    /** Any consumers whose values are processed by this consumer's
+     * client, right after it processes them itself.  Whenever this
+     * consumer's cursor moves, we move theirs to match, so that the
+     * producers and any consumers that depend on them see their
+     * progress.  Only this consumer's client can touch this array. */
+    vrt_consumer_array  followers;
+
     /** The yield strategy to use when the consumer operations would
      * block. */
     struct vrt_yield_strategy  *yield;
@@ -298,6 +380,26 @@ struct vrt_consumer {
     /** A name for the consumer */
     const char  *name;
 
+    /** How often (in nanoseconds) to return VRT_QUEUE_TICK, or 0 if
+     * the consumer doesn't want ticks. */
+    uint64_t  tick_interval;
+
+    /** When (on the monotonic clock, in nanoseconds) the next tick is
+     * due. */
+    uint64_t  next_tick;
+
+    /** The fewest values that the consumer wants to wake up for.  While
+     * fewer than this are available, it keeps waiting, until
+     * max_batch_delay nanoseconds have passed since it first saw one of
+     * them.  0 or 1 means that any value will do. */
+    unsigned int  min_batch_size;
+    uint64_t  max_batch_delay;
+
+    /** When (on the monotonic clock, in nanoseconds) the values that
+     * we're holding back must be delivered, or 0 if we aren't holding
+     * any back. */
+    uint64_t  batch_deadline;
+
 #if VRT_QUEUE_STATS
     /** The number of batches of values that we process */
     unsigned int  batch_count;
@@ -319,6 +421,31 @@ vrt_consumer_free(struct vrt_consumer *c);
 #define vrt_consumer_add_dependency(c1, c2) \
     (cork_array_append(&(c1)->dependencies, (c2)))
 
+/** Adds a follower to a consumer.  The follower must depend on the
+ * consumer (directly, or through another follower), since its cursor
+ * will be moved along with the consumer's. */
+#define vrt_consumer_add_follower(c1, c2) \
+    (cork_array_append(&(c1)->followers, (c2)))
+
+/** Ask for a VRT_QUEUE_TICK result from vrt_consumer_next every
+ * @a interval nanoseconds, even if no values arrive.  Ticks are checked
+ * whenever the consumer reaches the end of the values that it knows are
+ * available, and while it waits for more; a tick that's missed
+ * entirely (because the consumer was busy) is skipped rather than
+ * delivered late.  An interval of 0 turns ticks off. */
+void
+vrt_consumer_set_tick(struct vrt_consumer *c, uint64_t interval);
+
+/** Don't wake up the consumer until at least @a count values are
+ * available, or @a max_delay nanoseconds have passed since the first of
+ * them was.  This trades a bit of latency for fuller batches, for
+ * consumers with an expensive per-batch cost.  A flush or EOF is
+ * always delivered right away, as is a full queue's worth of values.
+ * A count of 0 or 1 turns this off. */
+void
+vrt_consumer_set_min_batch(struct vrt_consumer *c, unsigned int count,
+                           uint64_t max_delay);
+
 /** Retrieve the next value from the consumer's queue.  If this function
  * returns successfully, then @ref value will be filled in with the next
  * value in the queue.  The caller then has full read access to the
@@ -349,8 +476,69 @@ vrt_consumer_set_cursor(struct vrt_consumer *c, vrt_value_id value)
     vrt_padded_int_set(&c->cursor, value);
 }
 
+/** Return the last value that the consumer is allowed to process,
+ * without waiting: the queue's cursor if the consumer doesn't have any
+ * dependencies, and otherwise the smallest of their cursors.  If the
+ * consumer has a barrier, and its cached minimum is already past @a
+ * known_id, we use that instead of checking each dependency.  Fills in
+ * @a watch with the cursor to wait on if the result isn't far enough.
+ * This is for clients that drive a consumer's cursor themselves,
+ * instead of calling vrt_consumer_next. */
+vrt_value_id
+vrt_consumer_last_available(struct vrt_consumer *c, vrt_value_id known_id,
+                            volatile int **watch);
+
 void
 vrt_report_consumer(struct vrt_consumer *c);
 
 
+/*-----------------------------------------------------------------------
+ * Barriers
+ */
+
+/**
+ * A barrier caches the smallest cursor of a set of consumers, for
+ * several consumers that all depend on that same set.  Without one,
+ * each of those consumers checks every dependency's cursor whenever it
+ * runs out of values, so the traffic on those cursors' cache lines
+ * grows with the number of consumers.  With a barrier, a consumer first
+ * checks the barrier's cached minimum, and only when that doesn't show
+ * it anything new does it check the dependencies itself, and then
+ * raises the cached minimum for everyone else.
+ *
+ * A barrier belongs to its queue, and is freed along with it.
+ */
+struct vrt_barrier {
+    /** The smallest cursor of the barrier's dependencies, as of the last
+     * time that any consumer checked them.  This never moves
+     * backwards. */
+    struct vrt_padded_int  cursor;
+
+    /** The consumers that the barrier waits for */
+    vrt_consumer_array  dependencies;
+};
+
+/** Allocate a new barrier for the given queue.  The barrier belongs to
+ * the queue, and is freed along with it; there's no way to free it
+ * yourself. */
+struct vrt_barrier *
+vrt_barrier_new(struct vrt_queue *q);
+
+/** Adds a dependency to a barrier */
+#define vrt_barrier_add_dependency(b, c) \
+    (cork_array_append(&(b)->dependencies, (c)))
+
+/** Attach a consumer to a barrier.  If the consumer doesn't have any
+ * dependencies yet, it gets the barrier's; otherwise, its dependencies
+ * must be the same as the barrier's. */
+int
+vrt_consumer_set_barrier(struct vrt_consumer *c, struct vrt_barrier *b);
+
+/** Give every set of two or more consumers of a queue that have exactly
+ * the same dependencies a barrier to share.  Consumers that already
+ * have a barrier are left alone. */
+void
+vrt_queue_share_barriers(struct vrt_queue *q);
+
+
 #endif /* VRT_QUEUE_H */
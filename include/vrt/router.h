@@ -0,0 +1,143 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_ROUTER_H
+#define VRT_ROUTER_H
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include <vrt/queue.h>
+#include <vrt/value.h>
+
+
+/*-----------------------------------------------------------------------
+ * Error codes
+ */
+
+/** The error code used when a router can't route one of its values. */
+#define VRT_ROUTER_ERROR  0x2f61c8d3
+
+
+/*-----------------------------------------------------------------------
+ * Routers
+ */
+
+/* A router is a ready-made consumer that scatters the values of one
+ * queue across several downstream queues, choosing each value's
+ * destination by key.  Claiming and publishing a value on a different
+ * queue for each input value would defeat the batching of every
+ * downstream producer, so instead the router collects the values bound
+ * for each destination, and then claims and publishes them as one
+ * contiguous batch.  Each value is copied exactly once, straight from
+ * its upstream slot into its downstream slot.
+ *
+ * The router holds on to a value only until it reaches the end of the
+ * values that it knows are available upstream (or until it has a full
+ * batch for that value's destination), so it never delays a value by
+ * more than the time it takes to route one upstream batch.  The router
+ * is the only producer of each downstream queue, so every downstream
+ * producer runs the single-producer fast path. */
+
+struct vrt_router;
+
+/** A function that chooses the destination for a value, as an index
+ * into the router's outputs, in the order that they were added.
+ * Returning an index past the last output is an error. */
+typedef unsigned int
+(*vrt_router_key_f)(void *ud, struct vrt_value *value);
+
+/** A function that copies a value into a freshly claimed value on its
+ * destination queue.  Any return value other than 0 stops the
+ * router. */
+typedef int
+(*vrt_router_copy_f)(void *ud, struct vrt_value *dest,
+                     struct vrt_value *src);
+
+/** One of a router's downstream queues. */
+struct vrt_router_output {
+    /** The producer that feeds this output's queue.  It belongs to the
+     * queue.  You must give it a yield strategy before running the
+     * router. */
+    struct vrt_producer  *producer;
+
+    /** The values that are bound for this output, but haven't been
+     * copied yet */
+    struct vrt_value  **pending;
+    unsigned int  pending_count;
+
+    /** The most values to publish to this output at once.  This is the
+     * router's batch size, unless that's too big for the queue. */
+    unsigned int  max_batch_size;
+
+    /** The number of values and batches published to this output */
+    uint64_t  value_count;
+    uint64_t  batch_count;
+};
+
+typedef cork_array(struct vrt_router_output *)  vrt_router_output_array;
+
+/** A consumer that routes values to several downstream queues. */
+struct vrt_router {
+    /** A name for the router */
+    const char  *name;
+
+    /** The consumer that drains the upstream queue.  You can add
+     * dependencies to it, and you must give it a yield strategy,
+     * before running the router.  It belongs to the queue. */
+    struct vrt_consumer  *consumer;
+
+    /** The downstream queues */
+    vrt_router_output_array  outputs;
+
+    /** The functions that route and copy each value, and the user data
+     * that was given along with them */
+    vrt_router_key_f  key;
+    vrt_router_copy_f  copy;
+    void  *ud;
+
+    /** The batch size to use for each output's producer */
+    unsigned int  batch_size;
+};
+
+/** Allocate a new router that drains the given queue.  The router's
+ * consumer is added to the queue right away.  The router publishes at
+ * most @a batch_size values to an output at once (or a reasonable
+ * default if it's 0). */
+struct vrt_router *
+vrt_router_new(const char *name, struct vrt_queue *q,
+               unsigned int batch_size, vrt_router_key_f key,
+               vrt_router_copy_f copy, void *ud);
+
+/** Free a router.  (Its consumer and producers belong to their queues,
+ * and are freed along with them.) */
+void
+vrt_router_free(struct vrt_router *router);
+
+/** Add a downstream queue to a router, and return its producer.  The
+ * router must be the queue's only producer.  Outputs are numbered from
+ * 0, in the order that they're added. */
+struct vrt_producer *
+vrt_router_add_output(struct vrt_router *router, struct vrt_queue *q);
+
+/** Route values until every upstream producer has sent its EOF, and
+ * then send an EOF to every output.  A FLUSH is passed along to every
+ * output.  Returns VRT_QUEUE_CANCELLED if either the upstream queue or
+ * one of the outputs is cancelled first.  Call this from the thread
+ * that should drive the router. */
+int
+vrt_router_run(struct vrt_router *router);
+
+/** Print the number of values and batches published to each output. */
+void
+vrt_report_router(struct vrt_router *router);
+
+
+#endif /* VRT_ROUTER_H */
@@ -0,0 +1,206 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_RPC_H
+#define VRT_RPC_H
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include <vrt/atomic.h>
+#include <vrt/queue.h>
+#include <vrt/value.h>
+
+
+/*-----------------------------------------------------------------------
+ * Error codes
+ */
+
+/** The error code used when the request/reply protocol is misused. */
+#define VRT_RPC_ERROR  0x2d7a96c1
+
+
+/*-----------------------------------------------------------------------
+ * Request/reply
+ */
+
+/* Many requesters send requests through a single queue to one service
+ * consumer, which answers each of them.  Each requester has a private
+ * single-producer, single-consumer ring for its replies, and each
+ * request carries a reply handle that identifies the ring.  The service
+ * writes each reply straight into the right ring, and publishes all of
+ * the replies it has written whenever it runs out of requests to
+ * process, so replies are published in batches without any locks.
+ *
+ * The service answers each requester's requests in the order they were
+ * sent, so replies don't need any other correlation.  A requester can
+ * have up to one less than its ring's size outstanding requests at
+ * once; since each reply has a reserved slot, the service never has to
+ * wait for a slow requester. */
+
+/** The superclass of every request value.  A request type's values
+ * must start with this struct. */
+struct vrt_rpc_request {
+    struct vrt_value  parent;
+
+    /** Identifies the requester that the reply goes to.  This is filled
+     * in for you when the request is published. */
+    unsigned int  reply_to;
+};
+
+struct vrt_rpc;
+
+/** One client that sends requests to the service, and receives the
+ * replies. */
+struct vrt_rpc_requester {
+    /** The request/reply pair that this requester belongs to */
+    struct vrt_rpc  *rpc;
+
+    /** This requester's reply handle */
+    unsigned int  index;
+
+    /** The producer that feeds the request queue */
+    struct vrt_producer  *producer;
+
+    /** The reply ring.  The service writes replies into these values. */
+    struct vrt_value  **replies;
+
+    /** One less than the number of values in the reply ring */
+    unsigned int  reply_mask;
+
+    /** The number of replies that the service has published */
+    struct vrt_padded_int  published;
+
+    /** The number of replies that the service has written (but maybe
+     * not published).  Only the service touches this. */
+    unsigned int  written;
+
+    /** Whether the service has written replies that it hasn't published
+     * yet.  Only the service touches this. */
+    bool  dirty;
+
+    /** The number of requests that we've sent, and the number of
+     * replies that we've received.  Only the requester touches these. */
+    unsigned int  sent;
+    unsigned int  received;
+
+    /** The number of published replies that we know about.  Only the
+     * requester touches this. */
+    unsigned int  last_published;
+};
+
+/** The consumer that answers requests. */
+struct vrt_rpc_service {
+    /** The request/reply pair that this service belongs to */
+    struct vrt_rpc  *rpc;
+
+    /** The consumer that drains the request queue */
+    struct vrt_consumer  *consumer;
+
+    /** The requester whose request we're currently processing, or NULL
+     * if we've already replied to it. */
+    struct vrt_rpc_requester  *current;
+};
+
+typedef cork_array(struct vrt_rpc_requester *)  vrt_rpc_requester_array;
+
+/** A request queue, along with the reply rings of its requesters. */
+struct vrt_rpc {
+    /** A name for the request/reply pair */
+    const char  *name;
+
+    /** The queue that requests are sent through */
+    struct vrt_queue  *requests;
+
+    /** The type of the values in each reply ring */
+    struct vrt_value_type  *reply_type;
+
+    /** The number of values in each reply ring */
+    unsigned int  reply_ring_size;
+
+    /** The requesters that have been created */
+    vrt_rpc_requester_array  requesters;
+
+    /** The service, once it has been created */
+    struct vrt_rpc_service  *service;
+};
+
+/** Allocate a new request/reply pair.  @a request_type's values must
+ * start with a struct vrt_rpc_request.  Each requester's reply ring
+ * has room for @a reply_ring_size replies, rounded up to a power of 2;
+ * if it's 0, we choose a default size. */
+struct vrt_rpc *
+vrt_rpc_new(const char *name,
+            struct vrt_value_type *request_type, unsigned int queue_size,
+            struct vrt_value_type *reply_type, unsigned int reply_ring_size);
+
+/** Free a request/reply pair, along with its requesters and service. */
+void
+vrt_rpc_free(struct vrt_rpc *rpc);
+
+/** Create a new requester.  It claims @a batch_size requests at a time
+ * (see vrt_producer_new); whatever's left of a batch is flushed when
+ * the requester waits for a reply.  You must fill in the yield strategy
+ * of the requester's producer, which is also used while waiting for
+ * replies.  Every requester must be created before any of them start
+ * sending requests. */
+struct vrt_rpc_requester *
+vrt_rpc_requester_new(struct vrt_rpc *rpc, const char *name,
+                      unsigned int batch_size);
+
+/** Claim a request to fill in.  Returns an error if the requester
+ * already has as many outstanding requests as its reply ring can
+ * hold. */
+int
+vrt_rpc_requester_claim(struct vrt_rpc_requester *r,
+                        struct vrt_value **request);
+
+/** Publish the most recently claimed request. */
+int
+vrt_rpc_requester_publish(struct vrt_rpc_requester *r);
+
+/** Wait for the reply to the oldest outstanding request.  The reply is
+ * valid until the next call to vrt_rpc_requester_receive or
+ * vrt_rpc_requester_claim. */
+int
+vrt_rpc_requester_receive(struct vrt_rpc_requester *r,
+                          struct vrt_value **reply);
+
+/** Signal that this requester won't send any more requests. */
+int
+vrt_rpc_requester_eof(struct vrt_rpc_requester *r);
+
+/** Return the number of requests that haven't been answered yet. */
+#define vrt_rpc_requester_outstanding(r) \
+    ((r)->sent - (r)->received)
+
+/** Create the service.  There can only be one. */
+struct vrt_rpc_service *
+vrt_rpc_service_new(struct vrt_rpc *rpc, const char *name);
+
+/** Retrieve the next request.  Returns VRT_QUEUE_EOF once every
+ * requester has signaled EOF.  Before waiting for more requests, this
+ * publishes every reply that's been written so far.  You must reply to
+ * each request before retrieving the next one. */
+int
+vrt_rpc_service_next(struct vrt_rpc_service *s,
+                     struct vrt_value **request);
+
+/** Return the reply value for the current request, to fill in.  It's
+ * published along with the rest of the current batch of replies. */
+int
+vrt_rpc_service_reply(struct vrt_rpc_service *s, struct vrt_value **reply);
+
+/** Publish every reply that's been written so far. */
+void
+vrt_rpc_service_flush(struct vrt_rpc_service *s);
+
+
+#endif /* VRT_RPC_H */
@@ -0,0 +1,197 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_SINK_H
+#define VRT_SINK_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <libcork/core.h>
+
+#include <vrt/queue.h>
+#include <vrt/value.h>
+
+
+/*-----------------------------------------------------------------------
+ * Error codes
+ */
+
+/** The error code used when a file sink can't write its values. */
+#define VRT_SINK_ERROR  0x3e9a5d17
+
+
+/*-----------------------------------------------------------------------
+ * File sinks
+ */
+
+/* A file sink is a ready-made consumer that writes the contents of each
+ * value to a file descriptor.  It gathers every value that's available
+ * into an array of iovecs that point straight into the queue's slots,
+ * and writes each batch with a single vectored write.  On Linux, the
+ * writes are submitted through io_uring, with several batches in
+ * flight at once; elsewhere, or if io_uring isn't available, they're
+ * made synchronously with pwritev (or writev, for pipes and sockets).
+ *
+ * The kernel reads the values straight out of the queue, so the sink's
+ * cursor only moves past a batch once its write has completed; until
+ * then, the producers can't overwrite those slots. */
+
+struct vrt_file_sink;
+struct vrt_file_sink_ring;
+
+/** A function that tells a file sink which bytes to write for a value,
+ * by filling in @a iov.  The bytes must live in the value itself (or
+ * somewhere else that stays valid until the value is overwritten), since
+ * they'll be read after this function returns.  An empty iovec means
+ * that there's nothing to write for this value.  Any return value other
+ * than 0 stops the sink. */
+typedef int
+(*vrt_file_sink_encode_f)(void *ud, struct vrt_value *value,
+                          struct iovec *iov);
+
+/** How a file sink writes its batches. */
+enum vrt_file_sink_backend {
+    /** Use io_uring if the kernel supports it, and pwritev otherwise */
+    VRT_FILE_SINK_AUTO,
+
+    /** Submit each batch through io_uring */
+    VRT_FILE_SINK_IO_URING,
+
+    /** Write each batch synchronously with pwritev or writev */
+    VRT_FILE_SINK_PWRITEV
+};
+
+/** One batch of values that's being written. */
+struct vrt_file_sink_batch {
+    /** The bytes of each value in the batch */
+    struct iovec  *iov;
+
+    /** The number of iovecs that still have to be written */
+    unsigned int  iov_count;
+
+    /** The index of the first iovec that still has to be written */
+    unsigned int  iov_start;
+
+    /** The number of bytes that still have to be written */
+    size_t  remaining;
+
+    /** Where in the file the rest of the batch goes, or -1 to write at
+     * the current file position */
+    off_t  offset;
+
+    /** The last value in the batch.  Once the batch has been written,
+     * the sink's cursor can move up to here. */
+    vrt_value_id  last_id;
+
+    /** Whether the batch's write has been submitted and hasn't
+     * completed yet */
+    bool  in_flight;
+};
+
+/** Statistics about a file sink. */
+struct vrt_file_sink_stats {
+    /** The number of values written */
+    uint64_t  value_count;
+
+    /** The number of bytes written */
+    uint64_t  byte_count;
+
+    /** The number of batches written */
+    uint64_t  batch_count;
+
+    /** The number of writes that only wrote part of their batch, and
+     * had to be resubmitted */
+    uint64_t  short_count;
+
+    /** The number of system calls made to write batches or wait for
+     * them */
+    uint64_t  syscall_count;
+};
+
+/** A consumer that writes each value to a file descriptor. */
+struct vrt_file_sink {
+    /** A name for the sink */
+    const char  *name;
+
+    /** The consumer that represents the sink to the rest of the queue.
+     * You can add dependencies to it, and must give it a yield
+     * strategy, before running the sink.  It belongs to the queue. */
+    struct vrt_consumer  *consumer;
+
+    /** The file descriptor that values are written to.  The sink never
+     * closes it. */
+    int  fd;
+
+    /** The function that finds the bytes of each value */
+    vrt_file_sink_encode_f  encode;
+
+    /** The user data that was given along with the encode function */
+    void  *ud;
+
+    /** The backend that was asked for, and (once the sink is running)
+     * the one that's actually being used */
+    enum vrt_file_sink_backend  backend;
+
+    /** The most batches to have in flight at once.  Writes to pipes and
+     * sockets are never overlapped, since they'd land out of order. */
+    unsigned int  depth;
+
+    /** The most values to gather into a single batch */
+    unsigned int  batch_size;
+
+    /** Where in the file the next batch goes, or -1 if the file
+     * descriptor isn't seekable */
+    off_t  offset;
+
+    /** The batches, used in order as a ring */
+    struct vrt_file_sink_batch  *batches;
+
+    /** The oldest batch that hasn't been retired yet, and the number
+     * of batches that haven't.  A batch is retired (and the cursor moved
+     * past it) once it and every batch before it has been written. */
+    unsigned int  head;
+    unsigned int  pending;
+
+    /** The number of EOFs seen by the sink */
+    unsigned int  eof_count;
+
+    /** The io_uring instance, if we're using one */
+    struct vrt_file_sink_ring  *ring;
+
+    /** Statistics about the sink */
+    struct vrt_file_sink_stats  stats;
+};
+
+/** Allocate a new file sink that will write the values of the given
+ * queue to @a fd, starting at the file descriptor's current position.
+ * The sink's consumer is added to the queue right away. */
+struct vrt_file_sink *
+vrt_file_sink_new(const char *name, struct vrt_queue *q, int fd,
+                  vrt_file_sink_encode_f encode, void *ud);
+
+/** Free a file sink.  (The sink's consumer belongs to the queue, and is
+ * freed along with it.) */
+void
+vrt_file_sink_free(struct vrt_file_sink *sink);
+
+/** Write values until every producer has sent its EOF, and all of the
+ * writes have completed.  Returns VRT_QUEUE_CANCELLED if the queue is
+ * cancelled first, and an error if a write fails.  Call this from the
+ * thread that should drive the sink. */
+int
+vrt_file_sink_run(struct vrt_file_sink *sink);
+
+/** Print the sink's statistics. */
+void
+vrt_report_file_sink(struct vrt_file_sink *sink);
+
+
+#endif /* VRT_SINK_H */
@@ -0,0 +1,195 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_SOURCE_H
+#define VRT_SOURCE_H
+
+#include <sys/types.h>
+
+#include <libcork/core.h>
+
+#include <vrt/queue.h>
+#include <vrt/value.h>
+
+
+/*-----------------------------------------------------------------------
+ * Error codes
+ */
+
+/** The error code used when a file descriptor source can't read or
+ * frame its records. */
+#define VRT_SOURCE_ERROR  0x6b0d4a92
+
+
+/*-----------------------------------------------------------------------
+ * File descriptor sources
+ */
+
+/* A file descriptor source is a ready-made producer that reads records
+ * from a file, pipe, or socket.  Rather than reading into a private
+ * buffer and copying each record into a value, it reads straight into
+ * a contiguous byte arena, one read per batch, and each value that it
+ * publishes points at its record's bytes within the arena.  A splitter
+ * function finds the record boundaries, and a fill function sets up
+ * each value.
+ *
+ * A record's bytes stay valid for as long as its value is live in the
+ * queue: the source won't reuse a region of the arena until every
+ * consumer has moved past the values that point into it.  A record
+ * can't be longer than half of the arena. */
+
+struct vrt_fd_source;
+
+/** A function that finds the first record in @a buf, which holds
+ * @a length bytes that haven't been framed yet.  Return the length of
+ * the record, 0 if @a buf doesn't hold a complete record yet, or -1 (with
+ * an error set) if the input is invalid.  If @a eof is true, there's no
+ * more input coming, and a trailing partial record can be returned in
+ * full; any bytes left over after that are an error. */
+typedef ssize_t
+(*vrt_fd_source_split_f)(struct vrt_fd_source *source, const char *buf,
+                         size_t length, bool eof);
+
+/** A function that fills in a freshly claimed value for a record.  The
+ * record's bytes stay valid until the value is overwritten, so the value
+ * can point at them.  Any return value other than 0 stops the source. */
+typedef int
+(*vrt_fd_source_fill_f)(struct vrt_fd_source *source,
+                        struct vrt_value *value,
+                        const char *record, size_t length);
+
+/** Newline-terminated records.  Each record includes its newline,
+ * except possibly the last one. */
+ssize_t
+vrt_fd_source_split_lines(struct vrt_fd_source *source, const char *buf,
+                          size_t length, bool eof);
+
+/** Fixed-size records, whose size is given by the source's record_size
+ * field. */
+ssize_t
+vrt_fd_source_split_fixed(struct vrt_fd_source *source, const char *buf,
+                          size_t length, bool eof);
+
+/** A batch of values whose records are still in use. */
+struct vrt_fd_source_batch {
+    /** The last value in the batch */
+    vrt_value_id  last_id;
+
+    /** The stream position just past the batch's last record */
+    uint64_t  end_pos;
+};
+
+/** Statistics about a file descriptor source. */
+struct vrt_fd_source_stats {
+    /** The number of records published */
+    uint64_t  record_count;
+
+    /** The number of bytes read */
+    uint64_t  byte_count;
+
+    /** The number of read calls made */
+    uint64_t  read_count;
+
+    /** The number of times the source had to wait for the consumers to
+     * free up room in the arena */
+    uint64_t  wait_count;
+
+    /** The number of partial records that were moved from the end of
+     * the arena to its start */
+    uint64_t  move_count;
+};
+
+/** A producer that reads records from a file descriptor. */
+struct vrt_fd_source {
+    /** A name for the source */
+    const char  *name;
+
+    /** The producer that represents the source to the rest of the
+     * queue.  You must give it a yield strategy before running the
+     * source.  It belongs to the queue.  The source changes the
+     * producer's batch size for each batch, so that it only ever claims
+     * as many values as it has records to fill them with. */
+    struct vrt_producer  *producer;
+
+    /** The file descriptor that records are read from.  The source
+     * never closes it. */
+    int  fd;
+
+    /** The functions that frame each record and fill in its value */
+    vrt_fd_source_split_f  split;
+    vrt_fd_source_fill_f  fill;
+
+    /** The user data that was given along with those functions */
+    void  *ud;
+
+    /** The record size for vrt_fd_source_split_fixed */
+    size_t  record_size;
+
+    /** The arena that records are read into */
+    char  *arena;
+    size_t  arena_size;
+
+    /* Positions within the stream of bytes that passes through the
+     * arena.  Byte n of the stream lives at arena[n % arena_size].
+     * Everything before released_pos can be overwritten; everything
+     * from there to parsed_pos belongs to values in the queue; and
+     * everything from there to read_pos is a partial record that hasn't
+     * been framed yet. */
+    uint64_t  released_pos;
+    uint64_t  parsed_pos;
+    uint64_t  read_pos;
+
+    /** The batches whose records are still in use, as a ring */
+    struct vrt_fd_source_batch  *batches;
+    unsigned int  batch_head;
+    unsigned int  batch_count;
+    unsigned int  batch_capacity;
+
+    /** The lengths of the records in the batch being published */
+    size_t  *lengths;
+
+    /** The most records to publish in a single batch */
+    unsigned int  max_batch_size;
+
+    /** Statistics about the source */
+    struct vrt_fd_source_stats  stats;
+};
+
+/** Allocate a new source that reads records from @a fd into an arena of
+ * @a arena_size bytes, and publishes them to the given queue.  The
+ * source's producer is added to the queue right away, and claims up to
+ * @a batch_size values at once (or a reasonable default if it's 0). */
+struct vrt_fd_source *
+vrt_fd_source_new(const char *name, struct vrt_queue *q, int fd,
+                  size_t arena_size, unsigned int batch_size,
+                  vrt_fd_source_split_f split, vrt_fd_source_fill_f fill,
+                  void *ud);
+
+/** Free a source.  (The source's producer belongs to the queue, and is
+ * freed along with it.)  The queue's consumers must be finished with
+ * every record before you free the source, since that frees the
+ * arena. */
+void
+vrt_fd_source_free(struct vrt_fd_source *source);
+
+/** Read and publish records until the end of the file, then send an
+ * EOF.  Returns VRT_QUEUE_CANCELLED if the queue is cancelled first
+ * (although a read that's blocked waiting for input won't notice until
+ * it returns), and an error if a read fails or the input can't be
+ * framed.  Call this from the thread that should drive the source. */
+int
+vrt_fd_source_run(struct vrt_fd_source *source);
+
+/** Print the source's statistics. */
+void
+vrt_report_fd_source(struct vrt_fd_source *source);
+
+
+#endif /* VRT_SOURCE_H */
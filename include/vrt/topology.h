@@ -0,0 +1,388 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_TOPOLOGY_H
+#define VRT_TOPOLOGY_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include <vrt/cpu.h>
+#include <vrt/queue.h>
+#include <vrt/value.h>
+
+
+/*-----------------------------------------------------------------------
+ * Error codes
+ */
+
+/** The error code used when a topology specification is invalid. */
+#define VRT_TOPOLOGY_ERROR  0x7c5b12e4
+
+
+/*-----------------------------------------------------------------------
+ * Topologies
+ */
+
+/* A topology describes a set of queues, along with the producers and
+ * consumers that feed and drain them, in a small INI-style text format:
+ *
+ *     # Comments start with '#' or ';'
+ *     [queue ints]
+ *     size = 4096
+ *     type = int
+ *
+ *     [producer generate]
+ *     queue = ints
+ *     batch_size = 64
+ *     yield = hybrid
+ *     cpu = auto
+ *     handler = generate
+ *     param.count = 1000000
+ *
+ *     [consumer sum]
+ *     queue = ints
+ *     depends = multiply
+ *     yield = threaded
+ *     handler = sum
+ *
+ * An optional runtime section runs the client threads with a real-time
+ * scheduling policy, on a dedicated set of CPUs:
+ *
+ *     [runtime realtime]
+ *     sched = fifo
+ *     priority = 10
+ *     cpus = isolated
+ *     mlock = yes
+ *
+ * Value types and handler functions are registered by name before the
+ * specification is loaded; building the topology creates all of the
+ * queue objects and binds each client to its handler.  Running it
+ * starts one thread per client. */
+
+struct vrt_topology;
+struct vrt_topology_client;
+struct vrt_topology_section;
+
+/** A function that processes the values passing through a topology
+ * client.
+ *
+ * For a producer, @a event is always 0, and @a value is a freshly
+ * claimed value to fill in.  Return 0 to publish it, @ref
+ * VRT_QUEUE_FLUSH to skip it and flush the queue, or @ref VRT_QUEUE_EOF
+ * to skip it and signal that the producer is finished.
+ *
+ * For a consumer, @a event is 0 and @a value is the next value in the
+ * queue; or @a event is @ref VRT_QUEUE_FLUSH, @ref VRT_QUEUE_TICK, or
+ * @ref VRT_QUEUE_EOF, and @a value is NULL.  Ticks are only delivered
+ * to consumers with a "tick_usec" key.  The EOF event is delivered
+ * exactly once, right before the client's thread finishes, unless the
+ * topology is cancelled.
+ *
+ * Any other return value is treated as an error, and stops the client. */
+typedef int
+(*vrt_topology_handler_f)(struct vrt_topology_client *client, int event,
+                          struct vrt_value *value);
+
+/** Whether a consumer's handler runs in the thread of the consumer that
+ * it depends on, from the consumer's "fuse" key. */
+enum vrt_topology_fuse {
+    /** The consumer gets its own thread. */
+    VRT_TOPOLOGY_FUSE_NO,
+
+    /** The consumer's handler always runs right after its dependency's,
+     * in the same thread. */
+    VRT_TOPOLOGY_FUSE_YES,
+
+    /** The consumer starts out fused, but moves to its own thread if
+     * its handler turns out to be too expensive to share one. */
+    VRT_TOPOLOGY_FUSE_AUTO
+};
+
+/** Statistics about one consumer's handler.  Only one in every
+ * VRT_TOPOLOGY_SAMPLE_INTERVAL values is timed, to keep the clock from
+ * costing more than a cheap handler does. */
+struct vrt_topology_stage_stats {
+    /** The number of values passed to the handler */
+    uint64_t  value_count;
+
+    /** The number of handler calls that were timed */
+    uint64_t  sample_count;
+
+    /** The total duration of the timed calls, in nanoseconds */
+    uint64_t  sample_ns;
+};
+
+#define VRT_TOPOLOGY_SAMPLE_INTERVAL  64
+
+/** One producer or consumer within a topology. */
+struct vrt_topology_client {
+    /** The topology that this client belongs to */
+    struct vrt_topology  *topology;
+
+    /** The name of the client, taken from its section header */
+    const char  *name;
+
+    /** The producer that this client drives, or NULL if it's a
+     * consumer. */
+    struct vrt_producer  *producer;
+
+    /** The consumer that this client drives, or NULL if it's a
+     * producer. */
+    struct vrt_consumer  *consumer;
+
+    /** The function that processes this client's values.  A producer
+     * without a handler is passive; it doesn't get its own thread, and
+     * is instead fed by the handler of some other client. */
+    vrt_topology_handler_f  handler;
+
+    /** The user data that was registered along with the handler */
+    void  *ud;
+
+    /** Per-client storage for the handler.  This starts off NULL, and
+     * is otherwise never touched by the topology. */
+    void  *state;
+
+    /** The CPU that this client's thread is pinned to, or -1 if the
+     * thread can run anywhere. */
+    int  cpu;
+
+    /** Whether the topology chose this client's CPU ("cpu = auto") */
+    bool  cpu_auto;
+
+    /** Whether the runtime replaced this client's yield strategy, which
+     * never sleeps, with the hybrid one, because the client didn't have
+     * a dedicated core to busy-wait on. */
+    bool  yield_fallback;
+
+    /** Whether this consumer should be fused with the one it depends
+     * on */
+    enum vrt_topology_fuse  fuse;
+
+    /** For VRT_TOPOLOGY_FUSE_AUTO, the most that the handler can cost
+     * per value, in nanoseconds, before the consumer gets its own
+     * thread */
+    uint64_t  fuse_max_ns;
+
+    /** The consumer whose thread currently runs this consumer's
+     * handler, right after its own, or NULL if this client runs in its
+     * own thread. */
+    struct vrt_topology_client  *fused_prev;
+
+    /** The consumer whose handler currently runs right after this
+     * one's, in the same thread, or NULL. */
+    struct vrt_topology_client  *fused_next;
+
+    /** Statistics about this consumer's handler */
+    struct vrt_topology_stage_stats  stats;
+
+    /** The parsed specification of this client */
+    struct vrt_topology_section  *section;
+
+    /** The thread that runs this client */
+    pthread_t  thread;
+
+    /** Whether the client's thread has been started */
+    bool  started;
+
+    /** The result of running this client's handler loop */
+    int  result;
+};
+
+/** A value type that has been registered with a topology. */
+struct vrt_topology_type {
+    const char  *name;
+    struct vrt_value_type  *type;
+};
+
+/** A handler that has been registered with a topology. */
+struct vrt_topology_handler {
+    const char  *name;
+    vrt_topology_handler_f  handler;
+    void  *ud;
+};
+
+/** How a topology runs its client threads, from its runtime section. */
+struct vrt_topology_runtime {
+    /** Whether the specification has a runtime section */
+    bool  enabled;
+
+    /** The scheduling policy for client threads: SCHED_OTHER,
+     * SCHED_FIFO, or SCHED_RR */
+    int  sched_policy;
+
+    /** The real-time priority for client threads */
+    int  priority;
+
+    /** The CPUs that client threads run on.  If this is empty, client
+     * threads can run anywhere. */
+    vrt_cpu_list  cpus;
+
+    /** Whether to lock the process's memory with mlockall */
+    bool  mlock;
+};
+
+typedef cork_array(struct vrt_queue *)  vrt_queue_array;
+typedef cork_array(struct vrt_topology_client *)  vrt_topology_client_array;
+
+/** A set of queues and queue clients built from a text specification. */
+struct vrt_topology {
+    /** The named value types that queues can refer to */
+    cork_array(struct vrt_topology_type)  types;
+
+    /** The named handlers that clients can refer to */
+    cork_array(struct vrt_topology_handler)  handlers;
+
+    /** The parsed sections of the specification */
+    cork_array(struct vrt_topology_section *)  sections;
+
+    /** The queues that have been built */
+    vrt_queue_array  queues;
+
+    /** The clients that have been built */
+    vrt_topology_client_array  clients;
+
+    /** How to run the client threads */
+    struct vrt_topology_runtime  runtime;
+
+    /** How to place clients whose CPU is "auto" */
+    enum vrt_cpu_policy  cpu_policy;
+
+    /** Whether we've built the queue objects yet */
+    bool  built;
+
+    /** Whether the client threads are currently running */
+    bool  running;
+
+    /** Protects each client's thread and started fields, since a
+     * fused consumer's thread is started by the thread that it was
+     * fused into. */
+    pthread_mutex_t  lock;
+};
+
+/** Allocate a new, empty topology. */
+struct vrt_topology *
+vrt_topology_new(void);
+
+/** Free a topology, along with all of the queues and clients that it
+ * built.  The client threads must not be running. */
+void
+vrt_topology_free(struct vrt_topology *topo);
+
+/** Register a value type that queues in the specification can refer to
+ * using their "type" key. */
+int
+vrt_topology_register_type(struct vrt_topology *topo, const char *name,
+                           struct vrt_value_type *type);
+
+/** Register a handler that clients in the specification can refer to
+ * using their "handler" key.  @a ud is made available to the handler
+ * via the client's ud field. */
+int
+vrt_topology_register_handler(struct vrt_topology *topo, const char *name,
+                              vrt_topology_handler_f handler, void *ud);
+
+/** Parse a topology specification from a string.  You can load more
+ * than one specification into the same topology, as long as the
+ * section names don't collide. */
+int
+vrt_topology_load_string(struct vrt_topology *topo, const char *spec);
+
+/** Parse a topology specification from a file. */
+int
+vrt_topology_load_file(struct vrt_topology *topo, const char *path);
+
+/** Override (or add) a single key in an already loaded section.  This
+ * lets a caller retune a specification without editing the file. */
+int
+vrt_topology_set(struct vrt_topology *topo, const char *section,
+                 const char *key, const char *value);
+
+/** Create all of the queues, producers, and consumers described by the
+ * loaded specification, and bind each client to its handler. */
+int
+vrt_topology_build(struct vrt_topology *topo);
+
+/** Choose how the topology places clients whose "cpu" key is "auto".
+ * The default is VRT_CPU_POLICY_COMPACT.  This must be called before
+ * the topology is built. */
+int
+vrt_topology_set_cpu_policy(struct vrt_topology *topo,
+                            enum vrt_cpu_policy policy);
+
+/** Print the CPU that each client is pinned to, and any clients whose
+ * yield strategy the runtime had to change. */
+void
+vrt_topology_report_placement(struct vrt_topology *topo, FILE *out);
+
+/** Start a thread for each client in the topology.  Builds the
+ * topology first if needed.  If there is a runtime section, this locks
+ * the process's memory and sets each thread's scheduling policy, which
+ * will usually need extra privileges. */
+int
+vrt_topology_start(struct vrt_topology *topo);
+
+/** Wait for every client thread to finish.  Returns an error if any of
+ * the clients' handler loops failed. */
+int
+vrt_topology_join(struct vrt_topology *topo);
+
+/** Cancel every queue in the topology, so that each client thread
+ * stops as soon as it next touches its queue, without draining it or
+ * delivering an EOF event to its handler.  Call vrt_topology_join
+ * afterwards to wait for the threads to finish.  A client that stops
+ * because of the cancellation isn't counted as a failure.  The
+ * topology can't be started again. */
+void
+vrt_topology_cancel(struct vrt_topology *topo);
+
+/** Start the topology and wait for it to finish. */
+int
+vrt_topology_run(struct vrt_topology *topo);
+
+/** Print the statistics of each consumer's handler, and which thread
+ * it's running in. */
+void
+vrt_topology_report_stages(struct vrt_topology *topo, FILE *out);
+
+/** Return the average cost of a consumer's handler per value, in
+ * nanoseconds, or 0 if it hasn't been measured yet. */
+uint64_t
+vrt_topology_client_cost(struct vrt_topology_client *client);
+
+/** Return the queue with the given name, or NULL. */
+struct vrt_queue *
+vrt_topology_queue(struct vrt_topology *topo, const char *name);
+
+/** Return the client with the given name, or NULL. */
+struct vrt_topology_client *
+vrt_topology_client(struct vrt_topology *topo, const char *name);
+
+/** Return the producer with the given name, or NULL.  This is how a
+ * consumer's handler finds the passive producer that it feeds. */
+struct vrt_producer *
+vrt_topology_producer(struct vrt_topology *topo, const char *name);
+
+/** Return the value of a "param.<name>" key from a client's section, or
+ * @a default_value if the section doesn't contain that key. */
+const char *
+vrt_topology_client_param(struct vrt_topology_client *client,
+                          const char *name, const char *default_value);
+
+/** Return an integer "param.<name>" key from a client's section. */
+long
+vrt_topology_client_param_long(struct vrt_topology_client *client,
+                               const char *name, long default_value);
+
+
+#endif /* VRT_TOPOLOGY_H */
@@ -20,7 +20,13 @@
 
 /* Each producer and consumer will yield to other queue clients when one
  * of their operations wouldn't succeed immediately.  Right now, we
- * support a number of different yielding strategies. */
+ * support a number of different yielding strategies.
+ *
+ * A custom strategy must fill in yield and free.  Every other field is
+ * an optional hook that the strategy opts into by setting it; any field
+ * that it doesn't set must be zero, so allocate the strategy with
+ * cork_calloc (or memset it) or give it a static initializer.  A stray
+ * non-NULL hook would be called like any other. */
 
 struct vrt_yield_strategy {
     /** Yields control to other producers and consumers. */
@@ -31,11 +37,27 @@ struct vrt_yield_strategy {
     /** Frees this yield strategy. */
     void
     (*free)(struct vrt_yield_strategy *self);
+
+    /** Optional.  Waits for the value at @a addr to change from @a
+     * expected.  If this is set, it's used instead of yield when the
+     * queue knows which cursor it's waiting on.  It's allowed to return
+     * early, since the caller checks the cursor again either way.
+     * Strategies that can't make use of the address must leave this
+     * NULL. */
+    int
+    (*wait)(struct vrt_yield_strategy *self, bool first,
+            volatile int *addr, int expected,
+            const char *queue_name, const char *name);
 };
 
 #define vrt_yield_strategy_yield(self, first, qn, n) \
     ((self)->yield((self), (first), (qn), (n)))
 
+#define vrt_yield_strategy_wait(self, first, addr, expected, qn, n) \
+    (((self)->wait == NULL)? \
+     (self)->yield((self), (first), (qn), (n)): \
+     (self)->wait((self), (first), (addr), (expected), (qn), (n)))
+
 #define vrt_yield_strategy_free(self) \
     ((self)->free((self)))
 
@@ -56,5 +78,51 @@ vrt_yield_strategy_threaded(void);
 struct vrt_yield_strategy *
 vrt_yield_strategy_hybrid(void);
 
+/* A yield strategy that sleeps until the cursor that it's waiting on
+ * changes, using the UMONITOR and UMWAIT instructions, which put the
+ * core into a light sleep that ends when the cursor's cache line is
+ * written.  On CPUs without these instructions (the WAITPKG feature),
+ * this returns the hybrid strategy instead. */
+struct vrt_yield_strategy *
+vrt_yield_strategy_umwait(void);
+
+/* Return whether this CPU supports the UMWAIT yield strategy. */
+bool
+vrt_yield_strategy_umwait_available(void);
+
+/* The threaded, hybrid, and UMWAIT strategies spin for a while before
+ * they give up the CPU.  If there are more clients using these
+ * strategies than there are CPUs' worth of time available to the
+ * process (including any cgroup CPU quota; see vrt_cpu_budget), each
+ * client spins for proportionally less time, and the hybrid and UMWAIT
+ * strategies go straight from spinning to sleeping.  The budget is
+ * detected the first time it's needed; you can override it, or set it
+ * to 0 to detect it again. */
+void
+vrt_yield_strategy_set_cpu_budget(double budget);
+
+double
+vrt_yield_strategy_cpu_budget(void);
+
+/* Wake every client that's sleeping in the hybrid or UMWAIT strategy,
+ * so that it returns to its wait loop right away and rechecks whatever
+ * it's waiting for.  vrt_queue_cancel uses this so that cancellation
+ * isn't delayed by a long sleep. */
+void
+vrt_yield_strategy_alert(void);
+
+/* Return whether a yield strategy eventually puts its thread to sleep
+ * while it waits, so that other threads on the same CPU get to run.
+ * Only the hybrid strategy does; the spin-wait, threaded, and UMWAIT
+ * strategies all keep the CPU busy. */
+bool
+vrt_yield_strategy_blocks(struct vrt_yield_strategy *self);
+
+/* Create a new instance of the yield strategy with the given name
+ * ("spin", "threaded", "hybrid", or "umwait").  Returns NULL if there's no
+ * strategy with that name. */
+struct vrt_yield_strategy *
+vrt_yield_strategy_by_name(const char *name);
+
 
 #endif /* VRT_YIELD_H */
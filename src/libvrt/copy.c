@@ -0,0 +1,177 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libcork/core.h>
+
+#include "vrt/copy.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define VRT_HAVE_NT_STORES  1
+#else
+#define VRT_HAVE_NT_STORES  0
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Thresholds
+ */
+
+static size_t  nt_threshold = VRT_COPY_DEFAULT_NT_THRESHOLD;
+
+bool
+vrt_copy_nt_available(void)
+{
+    return VRT_HAVE_NT_STORES;
+}
+
+size_t
+vrt_copy_get_nt_threshold(void)
+{
+    return nt_threshold;
+}
+
+void
+vrt_copy_set_nt_threshold(size_t threshold)
+{
+    nt_threshold = threshold;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Non-temporal stores
+ */
+
+#if VRT_HAVE_NT_STORES
+
+/* Streaming stores have to be aligned, so we use ordinary stores for
+ * the bytes before the first aligned chunk and after the last one.  We
+ * stream a whole cache line per iteration where we can, so that the
+ * write-combining buffers only ever hold complete lines. */
+
+#define NT_CHUNK  16
+#define NT_LINE  64
+
+static size_t
+vrt_nt_head(void *dest, size_t size)
+{
+    size_t  head = (-(uintptr_t) dest) & (NT_CHUNK - 1);
+    return (head > size)? size: head;
+}
+
+void
+vrt_copy_nt(void *vdest, const void *vsrc, size_t size)
+{
+    char  *dest = vdest;
+    const char  *src = vsrc;
+    size_t  head = vrt_nt_head(dest, size);
+
+    memcpy(dest, src, head);
+    dest += head;
+    src += head;
+    size -= head;
+
+    while (size >= NT_LINE) {
+        __m128i  a = _mm_loadu_si128((const __m128i *) (src + 0));
+        __m128i  b = _mm_loadu_si128((const __m128i *) (src + 16));
+        __m128i  c = _mm_loadu_si128((const __m128i *) (src + 32));
+        __m128i  d = _mm_loadu_si128((const __m128i *) (src + 48));
+        _mm_stream_si128((__m128i *) (dest + 0), a);
+        _mm_stream_si128((__m128i *) (dest + 16), b);
+        _mm_stream_si128((__m128i *) (dest + 32), c);
+        _mm_stream_si128((__m128i *) (dest + 48), d);
+        dest += NT_LINE;
+        src += NT_LINE;
+        size -= NT_LINE;
+    }
+
+    while (size >= NT_CHUNK) {
+        _mm_stream_si128((__m128i *) dest,
+                         _mm_loadu_si128((const __m128i *) src));
+        dest += NT_CHUNK;
+        src += NT_CHUNK;
+        size -= NT_CHUNK;
+    }
+
+    memcpy(dest, src, size);
+}
+
+void
+vrt_fill_nt(void *vdest, int c, size_t size)
+{
+    char  *dest = vdest;
+    size_t  head = vrt_nt_head(dest, size);
+    __m128i  fill = _mm_set1_epi8((char) c);
+
+    memset(dest, c, head);
+    dest += head;
+    size -= head;
+
+    while (size >= NT_LINE) {
+        _mm_stream_si128((__m128i *) (dest + 0), fill);
+        _mm_stream_si128((__m128i *) (dest + 16), fill);
+        _mm_stream_si128((__m128i *) (dest + 32), fill);
+        _mm_stream_si128((__m128i *) (dest + 48), fill);
+        dest += NT_LINE;
+        size -= NT_LINE;
+    }
+
+    while (size >= NT_CHUNK) {
+        _mm_stream_si128((__m128i *) dest, fill);
+        dest += NT_CHUNK;
+        size -= NT_CHUNK;
+    }
+
+    memset(dest, c, size);
+}
+
+#else
+
+void
+vrt_copy_nt(void *dest, const void *src, size_t size)
+{
+    memcpy(dest, src, size);
+}
+
+void
+vrt_fill_nt(void *dest, int c, size_t size)
+{
+    memset(dest, c, size);
+}
+
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Payloads
+ */
+
+void
+vrt_copy_payload(void *dest, const void *src, size_t size)
+{
+    if (size >= nt_threshold) {
+        vrt_copy_nt(dest, src, size);
+    } else {
+        memcpy(dest, src, size);
+    }
+}
+
+void
+vrt_fill_payload(void *dest, int c, size_t size)
+{
+    if (size >= nt_threshold) {
+        vrt_fill_nt(dest, c, size);
+    } else {
+        memset(dest, c, size);
+    }
+}
@@ -0,0 +1,660 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <ctype.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "vrt/cpu.h"
+
+
+#ifndef VRT_DEBUG_CPU
+#define VRT_DEBUG_CPU 0
+#endif
+#if VRT_DEBUG_CPU
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* do nothing */
+#endif
+
+
+#define SYSFS_CPU_ROOT  "/sys/devices/system/cpu"
+#define CGROUP_ROOT  "/sys/fs/cgroup"
+#define PROC_CGROUP  "/proc/self/cgroup"
+#define MAX_CACHE_INDEX  16
+#define MAX_DISTANCE  5
+
+
+/*-----------------------------------------------------------------------
+ * Reading sysfs
+ */
+
+static int
+vrt_cpu_read_line(const char *path, char *buf, size_t size)
+{
+    FILE  *fp = fopen(path, "r");
+    size_t  length;
+    if (fp == NULL) {
+        return -1;
+    }
+    if (fgets(buf, size, fp) == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    length = strlen(buf);
+    while (length > 0 && isspace((unsigned char) buf[length - 1])) {
+        buf[--length] = '\0';
+    }
+    return 0;
+}
+
+static int
+vrt_cpu_read_int(const char *path, int *dest)
+{
+    char  buf[64];
+    char  *end;
+    long  value;
+    if (vrt_cpu_read_line(path, buf, sizeof(buf)) != 0) {
+        return -1;
+    }
+    value = strtol(buf, &end, 10);
+    if (end == buf) {
+        return -1;
+    }
+    *dest = value;
+    return 0;
+}
+
+int
+vrt_cpu_list_parse(const char *list, vrt_cpu_list *ids)
+{
+    const char  *curr = list;
+    while (*curr != '\0') {
+        char  *end;
+        long  first = strtol(curr, &end, 10);
+        long  last = first;
+        long  i;
+        if (end == curr || first < 0) {
+            return -1;
+        }
+        curr = end;
+        if (*curr == '-') {
+            curr++;
+            last = strtol(curr, &end, 10);
+            if (end == curr || last < first) {
+                return -1;
+            }
+            curr = end;
+        }
+        for (i = first; i <= last; i++) {
+            cork_array_append(ids, (int) i);
+        }
+        if (*curr == ',') {
+            curr++;
+        } else if (*curr != '\0') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Return the lowest CPU in a CPU list file, or -1. */
+static int
+vrt_cpu_read_list_min(const char *path)
+{
+    char  buf[4096];
+    vrt_cpu_list  ids;
+    int  result = -1;
+    size_t  i;
+
+    if (vrt_cpu_read_line(path, buf, sizeof(buf)) != 0) {
+        return -1;
+    }
+
+    cork_array_init(&ids);
+    if (vrt_cpu_list_parse(buf, &ids) == 0) {
+        for (i = 0; i < cork_array_size(&ids); i++) {
+            int  id = cork_array_at(&ids, i);
+            if (result == -1 || id < result) {
+                result = id;
+            }
+        }
+    }
+    cork_array_done(&ids);
+    return result;
+}
+
+int
+vrt_cpu_list_isolated(vrt_cpu_list *dest)
+{
+    char  buf[4096];
+    if (vrt_cpu_read_line(SYSFS_CPU_ROOT "/isolated", buf, sizeof(buf))
+        != 0) {
+        return -1;
+    }
+    return vrt_cpu_list_parse(buf, dest);
+}
+
+bool
+vrt_cpu_list_contains(const vrt_cpu_list *list, int id)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(list); i++) {
+        if (cork_array_at(list, i) == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+vrt_cpu_load(const char *root, struct vrt_cpu *cpu)
+{
+    char  path[PATH_MAX];
+    int  highest_level = 0;
+    int  i;
+
+    cpu->package = 0;
+    cpu->core = cpu->id;
+    cpu->l2 = -1;
+    cpu->llc = -1;
+
+    snprintf(path, sizeof(path), "%s/cpu%d/topology/physical_package_id",
+             root, cpu->id);
+    vrt_cpu_read_int(path, &cpu->package);
+
+    snprintf(path, sizeof(path), "%s/cpu%d/topology/thread_siblings_list",
+             root, cpu->id);
+    if ((i = vrt_cpu_read_list_min(path)) >= 0) {
+        cpu->core = i;
+    }
+
+    for (i = 0; i < MAX_CACHE_INDEX; i++) {
+        char  type[64];
+        int  level;
+        int  shared;
+
+        snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/level",
+                 root, cpu->id, i);
+        if (vrt_cpu_read_int(path, &level) != 0) {
+            break;
+        }
+
+        snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/type",
+                 root, cpu->id, i);
+        if (vrt_cpu_read_line(path, type, sizeof(type)) == 0 &&
+            strcmp(type, "Instruction") == 0) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path),
+                 "%s/cpu%d/cache/index%d/shared_cpu_list",
+                 root, cpu->id, i);
+        if ((shared = vrt_cpu_read_list_min(path)) < 0) {
+            continue;
+        }
+
+        if (level == 2) {
+            cpu->l2 = shared;
+        }
+        if (level > highest_level) {
+            highest_level = level;
+            cpu->llc = shared;
+        }
+    }
+
+    /* If we couldn't find the caches, assume that each core has its
+     * own. */
+    if (cpu->l2 == -1) {
+        cpu->l2 = cpu->core;
+    }
+    if (cpu->llc == -1) {
+        cpu->llc = cpu->l2;
+    }
+
+    DEBUG("CPU %d: package %d, core %d, L2 %d, LLC %d\n",
+          cpu->id, cpu->package, cpu->core, cpu->l2, cpu->llc);
+}
+
+/* Sort CPUs so that CPUs that share caches are next to each other. */
+static int
+vrt_cpu_compare(const void *va, const void *vb)
+{
+    const struct vrt_cpu  *a = va;
+    const struct vrt_cpu  *b = vb;
+#define compare_field(field) \
+    if (a->field != b->field) { return (a->field < b->field)? -1: 1; }
+    compare_field(package);
+    compare_field(llc);
+    compare_field(l2);
+    compare_field(core);
+    compare_field(id);
+#undef compare_field
+    return 0;
+}
+
+static struct vrt_cpu_topology *
+vrt_cpu_topology_load(const char *root, bool use_affinity)
+{
+    struct vrt_cpu_topology  *topo = cork_new(struct vrt_cpu_topology);
+    vrt_cpu_list  ids;
+    char  path[PATH_MAX];
+    char  buf[4096];
+    size_t  i;
+#if defined(__linux__)
+    cpu_set_t  allowed;
+#endif
+
+    cork_array_init(&topo->cpus);
+    cork_array_init(&ids);
+    if (root == NULL) {
+        root = SYSFS_CPU_ROOT;
+    }
+
+    snprintf(path, sizeof(path), "%s/online", root);
+    if (vrt_cpu_read_line(path, buf, sizeof(buf)) != 0 ||
+        vrt_cpu_list_parse(buf, &ids) != 0) {
+        long  count = sysconf(_SC_NPROCESSORS_ONLN);
+        cork_array_clear(&ids);
+        for (i = 0; i < (size_t) ((count < 1)? 1: count); i++) {
+            cork_array_append(&ids, (int) i);
+        }
+    }
+
+#if defined(__linux__)
+    if (use_affinity &&
+        sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        use_affinity = false;
+    }
+#else
+    use_affinity = false;
+#endif
+
+    for (i = 0; i < cork_array_size(&ids); i++) {
+        struct vrt_cpu  cpu;
+        cpu.id = cork_array_at(&ids, i);
+#if defined(__linux__)
+        if (use_affinity && !CPU_ISSET(cpu.id, &allowed)) {
+            continue;
+        }
+#endif
+        vrt_cpu_load(root, &cpu);
+        cork_array_append(&topo->cpus, cpu);
+    }
+
+    cork_array_done(&ids);
+    qsort(topo->cpus.items, cork_array_size(&topo->cpus),
+          sizeof(struct vrt_cpu), vrt_cpu_compare);
+    return topo;
+}
+
+struct vrt_cpu_topology *
+vrt_cpu_topology_new(const char *root)
+{
+    return vrt_cpu_topology_load(root, root == NULL);
+}
+
+struct vrt_cpu_topology *
+vrt_cpu_topology_new_online(const char *root)
+{
+    return vrt_cpu_topology_load(root, false);
+}
+
+void
+vrt_cpu_topology_free(struct vrt_cpu_topology *topo)
+{
+    cork_array_done(&topo->cpus);
+    free(topo);
+}
+
+void
+vrt_cpu_topology_restrict(struct vrt_cpu_topology *topo,
+                          const vrt_cpu_list *cpus)
+{
+    size_t  i;
+    size_t  kept = 0;
+    for (i = 0; i < cork_array_size(&topo->cpus); i++) {
+        struct vrt_cpu  cpu = cork_array_at(&topo->cpus, i);
+        if (vrt_cpu_list_contains(cpus, cpu.id)) {
+            cork_array_at(&topo->cpus, kept++) = cpu;
+        }
+    }
+    topo->cpus.size = kept;
+}
+
+struct vrt_cpu *
+vrt_cpu_topology_get(struct vrt_cpu_topology *topo, int id)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->cpus); i++) {
+        if (cork_array_at(&topo->cpus, i).id == id) {
+            return &cork_array_at(&topo->cpus, i);
+        }
+    }
+    return NULL;
+}
+
+unsigned int
+vrt_cpu_distance(const struct vrt_cpu *a, const struct vrt_cpu *b)
+{
+    if (a->id == b->id) {
+        return 0;
+    } else if (a->core == b->core) {
+        return 1;
+    } else if (a->l2 == b->l2) {
+        return 2;
+    } else if (a->llc == b->llc) {
+        return 3;
+    } else if (a->package == b->package) {
+        return 4;
+    } else {
+        return MAX_DISTANCE;
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Placement
+ */
+
+static const char  *vrt_cpu_policy_names[] = {
+    "none",
+    "compact",
+    "scatter"
+};
+
+int
+vrt_cpu_policy_by_name(const char *name)
+{
+    int  i;
+    for (i = VRT_CPU_POLICY_NONE; i <= VRT_CPU_POLICY_SCATTER; i++) {
+        if (strcmp(name, vrt_cpu_policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *
+vrt_cpu_policy_name(enum vrt_cpu_policy policy)
+{
+    return vrt_cpu_policy_names[policy];
+}
+
+/* Placement state for each CPU, parallel to topo->cpus. */
+struct vrt_cpu_slot {
+    unsigned int  stages;
+    bool  spinning;
+};
+
+/* Whether a stage can go on the given CPU.  On the strict pass, a CPU
+ * must be unused, and a spinning stage can't share a physical core with
+ * any other stage (nor can any stage share a core with a spinning
+ * one).  On the relaxed pass, we only require the CPU to be unused. */
+static bool
+vrt_cpu_slot_allowed(struct vrt_cpu_topology *topo,
+                     struct vrt_cpu_slot *slots, size_t index,
+                     bool spinning, bool strict)
+{
+    const struct vrt_cpu  *cpu = &cork_array_at(&topo->cpus, index);
+    size_t  i;
+
+    if (slots[index].stages > 0) {
+        return false;
+    }
+    if (!strict) {
+        return true;
+    }
+
+    for (i = 0; i < cork_array_size(&topo->cpus); i++) {
+        const struct vrt_cpu  *other = &cork_array_at(&topo->cpus, i);
+        if (other->core == cpu->core && slots[i].stages > 0 &&
+            (spinning || slots[i].spinning)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Score a candidate CPU; lower is better. */
+static unsigned int
+vrt_cpu_score(struct vrt_cpu_topology *topo, struct vrt_cpu_slot *slots,
+              enum vrt_cpu_policy policy, size_t index, int previous)
+{
+    const struct vrt_cpu  *cpu = &cork_array_at(&topo->cpus, index);
+
+    if (policy == VRT_CPU_POLICY_COMPACT) {
+        /* As close as possible to the previous stage */
+        return (previous < 0)? 0:
+            vrt_cpu_distance(cpu, &cork_array_at(&topo->cpus, previous));
+    } else {
+        /* As far as possible from the nearest stage we've placed */
+        unsigned int  nearest = MAX_DISTANCE;
+        size_t  i;
+        for (i = 0; i < cork_array_size(&topo->cpus); i++) {
+            if (slots[i].stages > 0) {
+                unsigned int  distance =
+                    vrt_cpu_distance(cpu, &cork_array_at(&topo->cpus, i));
+                if (distance < nearest) {
+                    nearest = distance;
+                }
+            }
+        }
+        return MAX_DISTANCE - nearest;
+    }
+}
+
+size_t
+vrt_cpu_place(struct vrt_cpu_topology *topo, enum vrt_cpu_policy policy,
+              size_t count, const bool *spinning, int *cpus)
+{
+    size_t  cpu_count = cork_array_size(&topo->cpus);
+    struct vrt_cpu_slot  *slots;
+    int  previous = -1;
+    size_t  shared = 0;
+    size_t  stage;
+
+    if (policy == VRT_CPU_POLICY_NONE || cpu_count == 0) {
+        for (stage = 0; stage < count; stage++) {
+            cpus[stage] = -1;
+        }
+        return 0;
+    }
+
+    slots = cork_calloc(cpu_count, sizeof(struct vrt_cpu_slot));
+    for (stage = 0; stage < count; stage++) {
+        bool  spins = (spinning != NULL && spinning[stage]);
+        int  best = -1;
+        unsigned int  best_score = UINT_MAX;
+        int  pass;
+        size_t  i;
+
+        for (pass = 0; pass < 2 && best == -1; pass++) {
+            for (i = 0; i < cpu_count; i++) {
+                unsigned int  score;
+                if (!vrt_cpu_slot_allowed
+                    (topo, slots, i, spins, pass == 0)) {
+                    continue;
+                }
+                score = vrt_cpu_score(topo, slots, policy, i, previous);
+                if (score < best_score) {
+                    best = i;
+                    best_score = score;
+                }
+            }
+        }
+
+        /* Every CPU is in use, so share the least loaded one. */
+        if (best == -1) {
+            shared++;
+            best = 0;
+            for (i = 1; i < cpu_count; i++) {
+                if (slots[i].stages < slots[best].stages) {
+                    best = i;
+                }
+            }
+        }
+
+        slots[best].stages++;
+        slots[best].spinning |= spins;
+        cpus[stage] = cork_array_at(&topo->cpus, best).id;
+        previous = best;
+        DEBUG("Placed stage %zu on CPU %d\n", stage, cpus[stage]);
+    }
+
+    free(slots);
+    return shared;
+}
+
+
+/*-----------------------------------------------------------------------
+ * CPU budget
+ */
+
+/* Find this process's cgroup v2 directory, from the "0::<path>" line in
+ * /proc/self/cgroup. */
+static int
+vrt_cpu_cgroup_dir(char *dest, size_t size)
+{
+    char  line[PATH_MAX];
+    FILE  *fp = fopen(PROC_CGROUP, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            size_t  length = strlen(line);
+            if (length > 0 && line[length - 1] == '\n') {
+                line[length - 1] = '\0';
+            }
+            snprintf(dest, size, "%s%s", CGROUP_ROOT, line + 3);
+            fclose(fp);
+            return 0;
+        }
+    }
+    fclose(fp);
+    return -1;
+}
+
+double
+vrt_cpu_quota(const char *cgroup)
+{
+    char  dir[PATH_MAX];
+    double  result = 0;
+
+    if (cgroup == NULL) {
+        if (vrt_cpu_cgroup_dir(dir, sizeof(dir)) != 0) {
+            return 0;
+        }
+    } else {
+        snprintf(dir, sizeof(dir), "%s", cgroup);
+    }
+
+    /* Walk up the hierarchy until we reach a directory without a
+     * cpu.max file, which will be the root cgroup (or a cgroup without
+     * the cpu controller). */
+    while (true) {
+        char  path[PATH_MAX + 16];
+        char  buf[128];
+        char  *slash;
+        long  quota;
+        long  period;
+
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        if (vrt_cpu_read_line(path, buf, sizeof(buf)) != 0) {
+            break;
+        }
+
+        if (sscanf(buf, "%ld %ld", &quota, &period) == 2 &&
+            quota > 0 && period > 0) {
+            double  cpus = ((double) quota) / period;
+            DEBUG("Quota of %s is %.2lf CPUs\n", dir, cpus);
+            if (result == 0 || cpus < result) {
+                result = cpus;
+            }
+        }
+
+        slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir) {
+            break;
+        }
+        *slash = '\0';
+    }
+
+    return result;
+}
+
+double
+vrt_cpu_budget(void)
+{
+    double  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double  quota = vrt_cpu_quota(NULL);
+#if defined(__linux__)
+    cpu_set_t  allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        cpus = CPU_COUNT(&allowed);
+    }
+#endif
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    return (quota > 0 && quota < cpus)? quota: cpus;
+}
+
+void
+vrt_cpu_throttling_get(const char *cgroup,
+                       struct vrt_cpu_throttling *throttling)
+{
+    char  dir[PATH_MAX];
+    char  path[PATH_MAX + 16];
+    char  line[128];
+    FILE  *fp;
+
+    memset(throttling, 0, sizeof(struct vrt_cpu_throttling));
+    if (cgroup == NULL) {
+        if (vrt_cpu_cgroup_dir(dir, sizeof(dir)) != 0) {
+            return;
+        }
+        cgroup = dir;
+    }
+
+    snprintf(path, sizeof(path), "%s/cpu.stat", cgroup);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char  key[64];
+        unsigned long long  value;
+        if (sscanf(line, "%63s %llu", key, &value) != 2) {
+            continue;
+        }
+        if (strcmp(key, "nr_periods") == 0) {
+            throttling->periods = value;
+        } else if (strcmp(key, "nr_throttled") == 0) {
+            throttling->throttled_periods = value;
+        } else if (strcmp(key, "throttled_usec") == 0) {
+            throttling->throttled_usec = value;
+        }
+    }
+    fclose(fp);
+}
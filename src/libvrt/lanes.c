@@ -0,0 +1,447 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/lanes.h"
+#include "vrt/queue.h"
+#include "vrt/yield.h"
+
+
+#ifndef VRT_DEBUG_LANES
+#define VRT_DEBUG_LANES 0
+#endif
+#if VRT_DEBUG_LANES
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* do nothing */
+#endif
+
+
+#define vrt_lanes_error(...) \
+    cork_error_set_printf(VRT_LANES_ERROR, __VA_ARGS__)
+
+/* Returned internally when a lane doesn't have a value for us right
+ * now. */
+#define VRT_LANES_EMPTY  1
+
+
+/*-----------------------------------------------------------------------
+ * Priority lanes
+ */
+
+struct vrt_lanes *
+vrt_lanes_new(const char *name, struct vrt_value_type *value_type,
+              unsigned int lane_count, unsigned int size)
+{
+    struct vrt_lanes  *lanes;
+    unsigned int  i;
+
+    if (lane_count == 0 || lane_count > VRT_LANES_MAX) {
+        vrt_lanes_error("Lanes %s must have between 1 and %u lanes",
+                        name, VRT_LANES_MAX);
+        return NULL;
+    }
+
+    lanes = cork_new(struct vrt_lanes);
+    memset(lanes, 0, sizeof(struct vrt_lanes));
+    lanes->name = cork_strdup(name);
+    lanes->lane_count = lane_count;
+    for (i = 0; i < lane_count; i++) {
+        lanes->lanes[i] = vrt_queue_new(name, value_type, size);
+        if (lanes->lanes[i] == NULL) {
+            vrt_lanes_free(lanes);
+            return NULL;
+        }
+    }
+    return lanes;
+}
+
+void
+vrt_lanes_free(struct vrt_lanes *lanes)
+{
+    unsigned int  i;
+    for (i = 0; i < lanes->lane_count; i++) {
+        if (lanes->lanes[i] != NULL) {
+            vrt_queue_free(lanes->lanes[i]);
+        }
+    }
+    cork_strfree(lanes->name);
+    free(lanes);
+}
+
+void
+vrt_lanes_cancel(struct vrt_lanes *lanes)
+{
+    unsigned int  i;
+    for (i = 0; i < lanes->lane_count; i++) {
+        vrt_queue_cancel(lanes->lanes[i]);
+    }
+}
+
+/* Lets any waiting consumers know that some lane has something new.
+ * The atomic add is a full memory barrier, so the lane's new cursor is
+ * visible before the doorbell changes. */
+#define vrt_lanes_ring(lanes) \
+    (vrt_padded_int_atomic_add(&(lanes)->doorbell, 1))
+
+
+/*-----------------------------------------------------------------------
+ * Lane producers
+ */
+
+/* Takes a producer that we've just created back out of its queue, so
+ * that the queue's consumers don't wait for an EOF that it will never
+ * send.  It must be the queue's newest producer, and nothing can have
+ * used it yet. */
+static void
+vrt_lanes_remove_producer(struct vrt_producer *p)
+{
+    struct vrt_queue  *q = p->queue;
+    cork_array_size(&q->producers)--;
+    vrt_producer_free(p);
+}
+
+struct vrt_lanes_producer *
+vrt_lanes_producer_new(const char *name, struct vrt_lanes *lanes,
+                       unsigned int batch_size)
+{
+    struct vrt_lanes_producer  *lp;
+    unsigned int  i;
+
+    lp = cork_new(struct vrt_lanes_producer);
+    memset(lp, 0, sizeof(struct vrt_lanes_producer));
+    lp->name = cork_strdup(name);
+    lp->lanes = lanes;
+    for (i = 0; i < lanes->lane_count; i++) {
+        lp->producers[i] =
+            vrt_producer_new(name, batch_size, lanes->lanes[i]);
+        if (lp->producers[i] == NULL) {
+            while (i-- > 0) {
+                vrt_lanes_remove_producer(lp->producers[i]);
+            }
+            vrt_lanes_producer_free(lp);
+            return NULL;
+        }
+    }
+    return lp;
+}
+
+void
+vrt_lanes_producer_free(struct vrt_lanes_producer *lp)
+{
+    cork_strfree(lp->name);
+    free(lp);
+}
+
+#define vrt_lanes_check_lane(lanes, lane, client) \
+    do { \
+        if (CORK_UNLIKELY((lane) >= (lanes)->lane_count)) { \
+            vrt_lanes_error("%s used lane %u of %s (out of %u)", \
+                            (client), (lane), (lanes)->name, \
+                            (lanes)->lane_count); \
+            return -1; \
+        } \
+    } while (0)
+
+int
+vrt_lanes_producer_claim(struct vrt_lanes_producer *lp, unsigned int lane,
+                         struct vrt_value **value)
+{
+    vrt_lanes_check_lane(lp->lanes, lane, lp->name);
+    return vrt_producer_claim(lp->producers[lane], value);
+}
+
+int
+vrt_lanes_producer_publish(struct vrt_lanes_producer *lp,
+                           unsigned int lane)
+{
+    struct vrt_producer  *p;
+    vrt_lanes_check_lane(lp->lanes, lane, lp->name);
+    p = lp->producers[lane];
+    rii_check(vrt_producer_publish(p));
+    /* vrt_producer_publish only makes anything visible at the end of a
+     * batch, so that's the only time we need to ring the doorbell. */
+    if (p->last_produced_id == p->last_claimed_id) {
+        vrt_lanes_ring(lp->lanes);
+    }
+    return 0;
+}
+
+int
+vrt_lanes_producer_flush(struct vrt_lanes_producer *lp)
+{
+    unsigned int  i;
+    for (i = 0; i < lp->lanes->lane_count; i++) {
+        rii_check(vrt_producer_flush(lp->producers[i]));
+    }
+    vrt_lanes_ring(lp->lanes);
+    return 0;
+}
+
+int
+vrt_lanes_producer_eof(struct vrt_lanes_producer *lp)
+{
+    unsigned int  i;
+    for (i = 0; i < lp->lanes->lane_count; i++) {
+        struct vrt_producer  *p = lp->producers[i];
+        /* Don't claim a whole batch just to fill it with holes. */
+        if (p->last_produced_id == p->last_claimed_id) {
+            p->batch_size = 1;
+        }
+        rii_check(vrt_producer_eof(p));
+    }
+    vrt_lanes_ring(lp->lanes);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lane consumers
+ */
+
+/* Likewise, so that the queue's producers don't wait for a consumer
+ * that will never move its cursor. */
+static void
+vrt_lanes_remove_consumer(struct vrt_consumer *c)
+{
+    struct vrt_queue  *q = c->queue;
+    cork_array_size(&q->consumers)--;
+    vrt_consumer_free(c);
+}
+
+struct vrt_lanes_consumer *
+vrt_lanes_consumer_new(const char *name, struct vrt_lanes *lanes)
+{
+    struct vrt_lanes_consumer  *lc;
+    unsigned int  i;
+
+    lc = cork_new(struct vrt_lanes_consumer);
+    memset(lc, 0, sizeof(struct vrt_lanes_consumer));
+    lc->name = cork_strdup(name);
+    lc->lanes = lanes;
+    for (i = 0; i < lanes->lane_count; i++) {
+        lc->consumers[i] = vrt_consumer_new(name, lanes->lanes[i]);
+        if (lc->consumers[i] == NULL) {
+            while (i-- > 0) {
+                vrt_lanes_remove_consumer(lc->consumers[i]);
+            }
+            vrt_lanes_consumer_free(lc);
+            return NULL;
+        }
+    }
+    return lc;
+}
+
+void
+vrt_lanes_consumer_free(struct vrt_lanes_consumer *lc)
+{
+    if (lc->yield != NULL) {
+        vrt_yield_strategy_free(lc->yield);
+    }
+    cork_strfree(lc->name);
+    free(lc);
+}
+
+int
+vrt_lanes_consumer_set_weights(struct vrt_lanes_consumer *lc,
+                               const unsigned int *weights)
+{
+    unsigned int  i;
+
+    if (weights == NULL) {
+        memset(lc->weights, 0, sizeof(lc->weights));
+        memset(lc->credits, 0, sizeof(lc->credits));
+        return 0;
+    }
+
+    for (i = 0; i < lc->lanes->lane_count; i++) {
+        if (weights[i] == 0) {
+            vrt_lanes_error("Lane %u of %s needs a weight of at least 1",
+                            i, lc->lanes->name);
+            return -1;
+        }
+    }
+    for (i = 0; i < lc->lanes->lane_count; i++) {
+        lc->weights[i] = weights[i];
+        lc->credits[i] = weights[i];
+    }
+    return 0;
+}
+
+/* Returns the next value in a single lane, without waiting.  This
+ * follows vrt_consumer_next, except that when we run out of values that
+ * we know about, we check the lane's cursor once instead of waiting for
+ * it to move.  Returns VRT_QUEUE_EOF once the lane has seen an EOF from
+ * all of its producers, and VRT_LANES_EMPTY if there's nothing there
+ * yet.
+ *
+ * We only ever look at the lane's own cursor, and we only wait on the
+ * doorbell, which nothing rings when some other consumer moves its
+ * cursor.  So a lane consumer can't have dependencies; if someone gave
+ * one to it anyway, it's an error, rather than letting it overtake its
+ * upstream. */
+static int
+vrt_lanes_consumer_try(struct vrt_lanes_consumer *lc, unsigned int lane,
+                       struct vrt_value **value)
+{
+    struct vrt_consumer  *c = lc->consumers[lane];
+    struct vrt_queue  *q = c->queue;
+
+    while (true) {
+        struct vrt_value  *v;
+
+        if (c->current_id == c->last_available_id) {
+            /* We've finished with every value that we knew about, so
+             * the producers can reuse their slots. */
+            if (c->cursor.value != c->current_id) {
+                vrt_consumer_set_cursor(c, c->current_id);
+            }
+            if (CORK_UNLIKELY(!cork_array_is_empty(&c->dependencies))) {
+                vrt_lanes_error("Lane consumer %s can't depend on "
+                                "other consumers", lc->name);
+                return -1;
+            }
+            c->last_available_id = vrt_queue_get_cursor(q);
+            if (c->last_available_id == c->current_id) {
+                return VRT_LANES_EMPTY;
+            }
+            DEBUG("[%s] %s: Lane %u has values %d-%d\n",
+                  q->name, lc->name, lane,
+                  c->current_id + 1, c->last_available_id);
+        }
+
+        c->current_id++;
+        v = vrt_queue_get(q, c->current_id);
+        switch (v->special) {
+            case VRT_VALUE_NONE:
+                *value = v;
+                return 0;
+
+            case VRT_VALUE_HOLE:
+                break;
+
+            case VRT_VALUE_FLUSH:
+                return VRT_QUEUE_FLUSH;
+
+            case VRT_VALUE_EOF:
+                c->eof_count++;
+                if (c->eof_count == cork_array_size(&q->producers)) {
+                    vrt_consumer_set_cursor(c, c->current_id);
+                    return VRT_QUEUE_EOF;
+                }
+                break;
+
+            default:
+                cork_unreachable();
+        }
+    }
+}
+
+/* Takes a value from the highest lane that has one and that has credit
+ * left in the current round. */
+static int
+vrt_lanes_consumer_scan(struct vrt_lanes_consumer *lc,
+                        struct vrt_value **value)
+{
+    unsigned int  lane;
+    for (lane = 0; lane < lc->lanes->lane_count; lane++) {
+        int  rc;
+        if (lc->finished[lane] ||
+            (lc->weights[lane] != 0 && lc->credits[lane] == 0)) {
+            continue;
+        }
+
+        rc = vrt_lanes_consumer_try(lc, lane, value);
+        if (rc == VRT_LANES_EMPTY) {
+            continue;
+        } else if (rc == VRT_QUEUE_EOF) {
+            DEBUG("[%s] %s: Lane %u is finished\n",
+                  lc->lanes->name, lc->name, lane);
+            lc->finished[lane] = true;
+            if (++lc->finished_count == lc->lanes->lane_count) {
+                return VRT_QUEUE_EOF;
+            }
+            continue;
+        }
+
+        lc->lane = lane;
+        if (rc == 0) {
+            lc->value_counts[lane]++;
+            if (lc->weights[lane] != 0) {
+                lc->credits[lane]--;
+            }
+        }
+        return rc;
+    }
+    return VRT_LANES_EMPTY;
+}
+
+int
+vrt_lanes_consumer_next(struct vrt_lanes_consumer *lc,
+                        struct vrt_value **value)
+{
+    struct vrt_lanes  *lanes = lc->lanes;
+    bool  first = true;
+
+    if (lc->finished_count == lanes->lane_count) {
+        return VRT_QUEUE_EOF;
+    }
+
+    while (true) {
+        /* Read the doorbell before looking at any of the lanes, so that
+         * anything published after we've looked makes the wait below
+         * return right away. */
+        int  doorbell = vrt_padded_int_get(&lanes->doorbell);
+        unsigned int  i;
+        int  rc;
+
+        rc = vrt_lanes_consumer_scan(lc, value);
+        if (rc == VRT_LANES_EMPTY && lc->weights[0] != 0) {
+            /* Every lane with values left has used up its credit, so
+             * start a new round. */
+            memcpy(lc->credits, lc->weights, sizeof(lc->credits));
+            rc = vrt_lanes_consumer_scan(lc, value);
+        }
+        if (rc != VRT_LANES_EMPTY) {
+            return rc;
+        }
+
+        for (i = 0; i < lanes->lane_count; i++) {
+            if (vrt_queue_is_cancelled(lanes->lanes[i])) {
+                return VRT_QUEUE_CANCELLED;
+            }
+        }
+
+        DEBUG("[%s] %s: Waiting for any lane\n", lanes->name, lc->name);
+        lc->wait_count++;
+        rii_check(vrt_yield_strategy_wait
+                  (lc->yield, first, &lanes->doorbell.value, doorbell,
+                   lanes->name, lc->name));
+        first = false;
+    }
+}
+
+void
+vrt_report_lanes_consumer(struct vrt_lanes_consumer *lc)
+{
+    unsigned int  i;
+    printf("Lanes consumer %s:\n", lc->name);
+    for (i = 0; i < lc->lanes->lane_count; i++) {
+        printf("  lane %u %10" PRIu64 " values\n",
+               i, lc->value_counts[i]);
+    }
+    printf("  waits  %10" PRIu64 "\n", lc->wait_count);
+}
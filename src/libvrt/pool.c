@@ -0,0 +1,568 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/atomic.h"
+#include "vrt/cpu.h"
+#include "vrt/pool.h"
+#include "vrt/queue.h"
+#include "vrt/yield.h"
+
+
+#ifndef VRT_DEBUG_POOL
+#define VRT_DEBUG_POOL 0
+#endif
+#if VRT_DEBUG_POOL
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* do nothing */
+#endif
+
+
+#define DEFAULT_YIELD_STRATEGY  "hybrid"
+#define DEFAULT_SAMPLE_INTERVAL  1000000  /* 1ms */
+#define DEFAULT_GROW_SAMPLES  3
+#define DEFAULT_IDLE_SAMPLES  100
+
+/* How many values a busy worker processes between publishing its
+ * progress.  (A worker that's about to wait always publishes.) */
+#define CURSOR_UPDATE_INTERVAL  32
+
+/* A result code that's only used internally, when a worker has picked
+ * up one of the controller's retirement requests. */
+#define POOL_RETIRED  1
+
+#define vrt_pool_error(...) \
+    cork_error_set_printf(VRT_POOL_ERROR, __VA_ARGS__)
+
+
+/*-----------------------------------------------------------------------
+ * Pools
+ */
+
+struct vrt_pool *
+vrt_pool_new(const char *name, struct vrt_queue *q,
+             vrt_pool_handler_f handler, void *ud)
+{
+    struct vrt_pool  *pool = cork_new(struct vrt_pool);
+    double  budget = vrt_cpu_budget();
+    memset(pool, 0, sizeof(struct vrt_pool));
+    pool->name = cork_strdup(name);
+    pool->queue = q;
+    pool->handler = handler;
+    pool->ud = ud;
+    pool->yield_name = DEFAULT_YIELD_STRATEGY;
+
+    pool->consumer = vrt_consumer_new(name, q);
+    if (pool->consumer == NULL) {
+        cork_strfree(pool->name);
+        free(pool);
+        return NULL;
+    }
+    pool->claimed.value = vrt_consumer_get_cursor(pool->consumer);
+
+    pool->min_workers = 1;
+    /* Round the CPU budget up, so that a fractional CPU still gets a
+     * worker. */
+    pool->max_workers = (unsigned int) budget;
+    if (pool->max_workers < budget || pool->max_workers == 0) {
+        pool->max_workers++;
+    }
+    pool->sample_interval = DEFAULT_SAMPLE_INTERVAL;
+    pool->grow_samples = DEFAULT_GROW_SAMPLES;
+    pool->high_water = vrt_queue_size(q) / 2;
+    pool->idle_samples = DEFAULT_IDLE_SAMPLES;
+    pool->idle_lag = vrt_queue_size(q) / 32;
+    return pool;
+}
+
+void
+vrt_pool_free(struct vrt_pool *pool)
+{
+    if (pool->workers != NULL) {
+        free(pool->workers);
+    }
+    cork_strfree(pool->name);
+    free(pool);
+}
+
+int
+vrt_pool_set_workers(struct vrt_pool *pool, unsigned int min_workers,
+                     unsigned int max_workers)
+{
+    if (pool->started) {
+        vrt_pool_error("Pool %s has already been started", pool->name);
+        return -1;
+    }
+    if (min_workers == 0 || min_workers > max_workers) {
+        vrt_pool_error("Invalid worker range %u-%u for pool %s",
+                       min_workers, max_workers, pool->name);
+        return -1;
+    }
+    pool->min_workers = min_workers;
+    pool->max_workers = max_workers;
+    return 0;
+}
+
+/* Raises the pool's cursor to the minimum of its active workers'
+ * cursors.  Several workers can do this at once; since each of them
+ * computes a value that's safe, and the cursor only moves forward, the
+ * largest one wins.  A worker always publishes its own cursor (with a
+ * full barrier) before calling this, so of any two workers that are
+ * about to wait, at least one sees the other's final cursor. */
+static void
+vrt_pool_update_cursor(struct vrt_pool *pool)
+{
+    vrt_value_id  minimum = 0;
+    bool  found = false;
+    unsigned int  i;
+    for (i = 0; i < pool->max_workers; i++) {
+        struct vrt_pool_worker  *w = &pool->workers[i];
+        if (w->active) {
+            vrt_value_id  cursor = vrt_padded_int_get(&w->cursor);
+            if (!found || vrt_mod_lt(cursor, minimum)) {
+                minimum = cursor;
+                found = true;
+            }
+        }
+    }
+    if (found) {
+        vrt_padded_int_advance(&pool->consumer->cursor, minimum);
+    }
+}
+
+static void
+vrt_pool_worker_publish(struct vrt_pool_worker *w, vrt_value_id id)
+{
+    /* A worker's cursor only moves forward, and the atomic instruction
+     * gives us the full barrier that vrt_pool_update_cursor needs. */
+    vrt_padded_int_advance(&w->cursor, id);
+    vrt_pool_update_cursor(w->pool);
+}
+
+/* Tells every worker to stop, and wakes up any that are asleep. */
+static void
+vrt_pool_finish(struct vrt_pool *pool)
+{
+    DEBUG("[%s] Finishing\n", pool->name);
+    pool->finished = 1;
+    vrt_atomic_write_barrier();
+    vrt_yield_strategy_alert();
+}
+
+static bool
+vrt_pool_take_retirement(struct vrt_pool *pool)
+{
+    int  retiring = pool->retiring.value;
+    while (retiring > 0) {
+        int  actual =
+            vrt_padded_int_cas(&pool->retiring, retiring, retiring - 1);
+        if (actual == retiring) {
+            return true;
+        }
+        retiring = actual;
+    }
+    return false;
+}
+
+/* Waits for the value that the worker has claimed to become available.
+ * While we wait, we might notice that the pool has finished or been
+ * cancelled, or we might be able to give up our claim and retire. */
+static int
+vrt_pool_worker_wait(struct vrt_pool_worker *w, vrt_value_id id)
+{
+    struct vrt_pool  *pool = w->pool;
+    struct vrt_consumer  *c = pool->consumer;
+    volatile int  *watch;
+    vrt_value_id  available = vrt_consumer_last_available(c, id - 1, &watch);
+    bool  first = true;
+
+    while (vrt_mod_lt(available, id)) {
+        if (pool->finished) {
+            /* Every value before the last EOF has been published, so
+             * our claim might have become available since we last
+             * looked; if so, we still have to process it. */
+            available = vrt_consumer_last_available(c, id - 1, &watch);
+            if (vrt_mod_lt(available, id)) {
+                return VRT_QUEUE_EOF;
+            }
+            break;
+        }
+        if (vrt_queue_is_cancelled(pool->queue)) {
+            return VRT_QUEUE_CANCELLED;
+        }
+        /* We can only give up our claim if nobody has claimed anything
+         * after it; otherwise there'd be a hole in the sequence. */
+        if (vrt_pool_take_retirement(pool)) {
+            if (vrt_padded_int_cas(&pool->claimed, id, id - 1) == id) {
+                return POOL_RETIRED;
+            }
+            vrt_padded_int_atomic_add(&pool->retiring, 1);
+        }
+        rii_check(vrt_yield_strategy_wait
+                  (w->yield, first, watch, available,
+                   pool->queue->name, pool->name));
+        first = false;
+        available = vrt_consumer_last_available(c, id - 1, &watch);
+    }
+
+    w->last_available_id = available;
+    return 0;
+}
+
+/* Claims and processes values until the worker is retired, or the pool
+ * finishes.  When we return, @a done is the last value that the worker
+ * is responsible for. */
+static int
+vrt_pool_worker_run(struct vrt_pool_worker *w, vrt_value_id *done)
+{
+    struct vrt_pool  *pool = w->pool;
+    struct vrt_queue  *q = pool->queue;
+    int  producer_count = cork_array_size(&q->producers);
+    unsigned int  unpublished = 0;
+
+    while (true) {
+        vrt_value_id  id;
+        struct vrt_value  *v;
+
+        if (pool->finished) {
+            return VRT_QUEUE_EOF;
+        }
+        if (vrt_pool_take_retirement(pool)) {
+            return POOL_RETIRED;
+        }
+
+        id = vrt_padded_int_atomic_add(&pool->claimed, 1);
+        if (vrt_mod_lt(w->last_available_id, id)) {
+            int  rc;
+            /* Let everyone know how far we've gotten before we wait. */
+            *done = id - 1;
+            vrt_pool_worker_publish(w, *done);
+            unpublished = 0;
+            rc = vrt_pool_worker_wait(w, id);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+
+        /* Even if the handler fails, we're finished with this value. */
+        *done = id;
+        v = vrt_queue_get(q, id);
+        switch (v->special) {
+            case VRT_VALUE_NONE:
+                DEBUG("[%s] %s.%u: Processing value %d\n",
+                      q->name, pool->name, w->index, id);
+                rii_check(pool->handler(w, 0, v));
+                w->value_count++;
+                break;
+
+            case VRT_VALUE_HOLE:
+                break;
+
+            case VRT_VALUE_FLUSH:
+                rii_check(pool->handler(w, VRT_QUEUE_FLUSH, NULL));
+                break;
+
+            case VRT_VALUE_EOF:
+                DEBUG("[%s] %s.%u: Detected EOF at value %d\n",
+                      q->name, pool->name, w->index, id);
+                if (vrt_padded_int_atomic_add(&pool->eof_count, 1) ==
+                    producer_count) {
+                    vrt_pool_finish(pool);
+                }
+                break;
+
+            default:
+                cork_unreachable();
+        }
+
+        if (++unpublished == CURSOR_UPDATE_INTERVAL) {
+            vrt_pool_worker_publish(w, id);
+            unpublished = 0;
+        }
+    }
+}
+
+static void *
+vrt_pool_worker_thread(void *ud)
+{
+    struct vrt_pool_worker  *w = ud;
+    struct vrt_pool  *pool = w->pool;
+    vrt_value_id  done = vrt_padded_int_get(&w->cursor);
+    int  rc;
+
+    DEBUG("[%s] Starting worker %u\n", pool->name, w->index);
+    rc = vrt_pool_worker_run(w, &done);
+    if (rc == POOL_RETIRED) {
+        DEBUG("[%s] Retiring worker %u\n", pool->name, w->index);
+        rc = 0;
+        vrt_padded_int_advance(&w->cursor, done);
+        w->active = 0;
+        vrt_atomic_write_barrier();
+        vrt_pool_update_cursor(pool);
+    } else if (rc == VRT_QUEUE_EOF) {
+        /* Every EOF has been claimed, and this worker doesn't have any
+         * claims left to process, so it can vouch for everything that's
+         * been claimed so far.  (The workers that are still processing
+         * earlier values hold the pool's cursor back on their own.)  A
+         * worker that started right before the pool finished might not
+         * have claimed anything yet; without this, its initial cursor
+         * would keep the pool from ever reaching the last EOF. */
+        rc = 0;
+        vrt_pool_worker_publish(w, vrt_padded_int_get(&pool->claimed));
+    } else {
+        if (rc == VRT_QUEUE_CANCELLED) {
+            rc = 0;
+        } else {
+            vrt_pool_finish(pool);
+        }
+        vrt_pool_worker_publish(w, done);
+    }
+
+    if (rc == 0) {
+        rc = pool->handler(w, VRT_QUEUE_EOF, NULL);
+    }
+    w->result = rc;
+    DEBUG("[%s] Finished worker %u (%d)\n", pool->name, w->index, rc);
+    vrt_atomic_write_barrier();
+    w->exited = 1;
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Controller
+ */
+
+static int
+vrt_pool_start_worker(struct vrt_pool *pool)
+{
+    struct vrt_pool_worker  *w = NULL;
+    unsigned int  i;
+    int  rc;
+
+    for (i = 0; i < pool->max_workers; i++) {
+        if (!pool->workers[i].running) {
+            w = &pool->workers[i];
+            break;
+        }
+    }
+    if (w == NULL) {
+        return 0;
+    }
+
+    w->yield = vrt_yield_strategy_by_name(pool->yield_name);
+    if (w->yield == NULL) {
+        vrt_pool_error("Pool %s uses unknown yield strategy %s",
+                       pool->name, pool->yield_name);
+        return -1;
+    }
+
+    /* The new worker will only ever claim values after this one, so it
+     * won't hold the pool back. */
+    w->cursor.value = vrt_consumer_get_cursor(pool->consumer);
+    w->last_available_id = w->cursor.value;
+    w->state = NULL;
+    w->result = 0;
+    w->exited = 0;
+    w->active = 1;
+    vrt_atomic_write_barrier();
+
+    rc = pthread_create(&w->thread, NULL, vrt_pool_worker_thread, w);
+    if (rc != 0) {
+        w->active = 0;
+        vrt_yield_strategy_free(w->yield);
+        w->yield = NULL;
+        vrt_pool_error("Cannot start worker %u of pool %s: %s",
+                       w->index, pool->name, strerror(rc));
+        return -1;
+    }
+
+    w->running = true;
+    pool->stats.workers++;
+    if (pool->stats.workers > pool->stats.peak_workers) {
+        pool->stats.peak_workers = pool->stats.workers;
+    }
+    return 0;
+}
+
+/* Joins any workers that have exited (or every worker, if @a all is
+ * true). */
+static void
+vrt_pool_reap_workers(struct vrt_pool *pool, bool all)
+{
+    unsigned int  i;
+    for (i = 0; i < pool->max_workers; i++) {
+        struct vrt_pool_worker  *w = &pool->workers[i];
+        if (w->running && (all || w->exited)) {
+            pthread_join(w->thread, NULL);
+            w->running = false;
+            vrt_yield_strategy_free(w->yield);
+            w->yield = NULL;
+            pool->stats.workers--;
+            if (w->result != 0 && pool->result == 0) {
+                pool->result = w->result;
+            }
+        }
+    }
+}
+
+static void *
+vrt_pool_controller_thread(void *ud)
+{
+    struct vrt_pool  *pool = ud;
+    struct vrt_queue  *q = pool->queue;
+    unsigned int  last_lag = 0;
+    unsigned int  growing = 0;
+    unsigned int  idle = 0;
+
+    while (!pool->finished && !vrt_queue_is_cancelled(q)) {
+        unsigned int  lag;
+
+        usleep(pool->sample_interval / 1000);
+        vrt_pool_reap_workers(pool, false);
+
+        lag = vrt_queue_get_cursor(q) -
+            vrt_consumer_get_cursor(pool->consumer);
+        pool->stats.lag = lag;
+        pool->stats.sample_count++;
+        if (lag > pool->stats.max_lag) {
+            pool->stats.max_lag = lag;
+        }
+
+        if (lag >= pool->high_water ||
+            (lag > pool->idle_lag && lag > last_lag)) {
+            growing++;
+        } else {
+            growing = 0;
+        }
+        if (lag <= pool->idle_lag) {
+            idle++;
+        } else {
+            idle = 0;
+        }
+        last_lag = lag;
+
+        /* Only make one change at a time, and wait for any retirement
+         * to be picked up before changing anything else. */
+        if (pool->retiring.value != 0) {
+            continue;
+        }
+
+        if (growing >= pool->grow_samples &&
+            pool->stats.workers < pool->max_workers) {
+            DEBUG("[%s] Adding a worker (lag %u)\n", pool->name, lag);
+            if (vrt_pool_start_worker(pool) == 0) {
+                pool->stats.scale_ups++;
+            }
+            growing = 0;
+            idle = 0;
+        } else if (idle >= pool->idle_samples &&
+                   pool->stats.workers > pool->min_workers) {
+            DEBUG("[%s] Retiring a worker (lag %u)\n", pool->name, lag);
+            vrt_padded_int_atomic_add(&pool->retiring, 1);
+            pool->stats.scale_downs++;
+            growing = 0;
+            idle = 0;
+        }
+    }
+
+    vrt_pool_reap_workers(pool, true);
+    return NULL;
+}
+
+int
+vrt_pool_start(struct vrt_pool *pool)
+{
+    unsigned int  i;
+    int  rc;
+
+    if (pool->started) {
+        vrt_pool_error("Pool %s has already been started", pool->name);
+        return -1;
+    }
+
+    if (pool->workers == NULL) {
+        pool->workers =
+            cork_calloc(pool->max_workers, sizeof(struct vrt_pool_worker));
+        for (i = 0; i < pool->max_workers; i++) {
+            pool->workers[i].pool = pool;
+            pool->workers[i].index = i;
+        }
+    }
+
+    for (i = 0; i < pool->min_workers; i++) {
+        if (vrt_pool_start_worker(pool) != 0) {
+            vrt_pool_finish(pool);
+            vrt_pool_reap_workers(pool, true);
+            return -1;
+        }
+    }
+
+    rc = pthread_create(&pool->controller, NULL,
+                        vrt_pool_controller_thread, pool);
+    if (rc != 0) {
+        vrt_pool_finish(pool);
+        vrt_pool_reap_workers(pool, true);
+        vrt_pool_error("Cannot start controller of pool %s: %s",
+                       pool->name, strerror(rc));
+        return -1;
+    }
+
+    pool->started = true;
+    return 0;
+}
+
+int
+vrt_pool_join(struct vrt_pool *pool)
+{
+    if (!pool->started) {
+        vrt_pool_error("Pool %s isn't running", pool->name);
+        return -1;
+    }
+
+    pthread_join(pool->controller, NULL);
+    pool->started = false;
+
+    if (pool->result != 0) {
+        vrt_pool_error("A worker of pool %s failed with result %d",
+                       pool->name, pool->result);
+        return -1;
+    }
+    return 0;
+}
+
+void
+vrt_report_pool(struct vrt_pool *pool)
+{
+    uint64_t  value_count = 0;
+    unsigned int  i;
+    for (i = 0; pool->workers != NULL && i < pool->max_workers; i++) {
+        value_count += pool->workers[i].value_count;
+    }
+    printf("Pool %s:\n"
+           "  Values:  %" PRIu64 "\n"
+           "  Workers: %u (peak %u, %u-%u allowed)\n"
+           "  Scaling: %u up, %u down\n"
+           "  Lag:     %u (max %u over %" PRIu64 " samples)\n",
+           pool->name, value_count,
+           pool->stats.workers, pool->stats.peak_workers,
+           pool->min_workers, pool->max_workers,
+           pool->stats.scale_ups, pool->stats.scale_downs,
+           pool->stats.lag, pool->stats.max_lag, pool->stats.sample_count);
+}
@@ -8,6 +8,20 @@
  * ----------------------------------------------------------------------
  */
 
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_membarrier)
+#include <linux/membarrier.h>
+#define VRT_HAVE_MEMBARRIER  1
+#else
+#define VRT_HAVE_MEMBARRIER  0
+#endif
+
 #include <libcork/core.h>
 #include <libcork/ds.h>
 #include <libcork/helpers/errors.h>
@@ -32,12 +46,31 @@
 #define DEFAULT_QUEUE_SIZE  65536
 #define DEFAULT_BATCH_SIZE  4096
 #define DEFAULT_STARTING_VALUE  (INT_MAX - 2*DEFAULT_BATCH_SIZE)
+#define QUIESCE_POLL_USEC  10
 
 
 /*-----------------------------------------------------------------------
  * Queues
  */
 
+/* Every barrier belongs to the queue that it was created for, and is
+ * only freed along with that queue. */
+static void
+vrt_barrier_free(struct vrt_barrier *b)
+{
+    cork_array_done(&b->dependencies);
+    free(b);
+}
+
+/* Returns the current time on the monotonic clock, in nanoseconds. */
+static uint64_t
+vrt_queue_now(void)
+{
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 /** Returns the smallest power of 2 that is >= in. */
 static inline unsigned int
 min_power_of_2(unsigned int in)
@@ -54,6 +87,30 @@ min_power_of_2(unsigned int in)
 }
 
 
+/* A "heavy" barrier forces a full memory barrier onto every running
+ * thread in the process.  vrt_queue_quiesce uses one so that the
+ * producers, which check for a quiesce on every publish, don't need a
+ * barrier of their own. */
+static bool
+vrt_heavy_barrier_init(void)
+{
+#if VRT_HAVE_MEMBARRIER
+    /* Registering more than once is harmless. */
+    return syscall(__NR_membarrier,
+                   MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+static void
+vrt_heavy_barrier(void)
+{
+#if VRT_HAVE_MEMBARRIER
+    syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+#endif
+}
+
 struct vrt_queue *
 vrt_queue_new(const char *name, struct vrt_value_type *value_type,
               unsigned int size)
@@ -76,12 +133,14 @@ vrt_queue_new(const char *name, struct vrt_value_type *value_type,
     q->last_claimed_id.value = q->last_consumed_id;
     q->cursor.value = q->last_consumed_id;
     q->value_type = value_type;
+    q->heavy_barrier = vrt_heavy_barrier_init();
 
     q->values = cork_calloc(value_count, sizeof(struct vrt_value *));
     DEBUG("[%s] Created queue with %u values\n", q->name, value_count);
 
     cork_pointer_array_init(&q->producers, (cork_free_f) vrt_producer_free);
     cork_pointer_array_init(&q->consumers, (cork_free_f) vrt_consumer_free);
+    cork_pointer_array_init(&q->barriers, (cork_free_f) vrt_barrier_free);
 
     unsigned int  i;
     for (i = 0; i < value_count; i++) {
@@ -103,6 +162,7 @@ vrt_queue_free(struct vrt_queue *q)
 
     cork_array_done(&q->producers);
     cork_array_done(&q->consumers);
+    cork_array_done(&q->barriers);
 
     if (q->values != NULL) {
         for (i = 0; i <= q->value_mask; i++) {
@@ -117,25 +177,111 @@ vrt_queue_free(struct vrt_queue *q)
     free(q);
 }
 
+/* Returns the smallest cursor of a set of consumers, and fills in
+ * slowest with the consumer that it belongs to. */
 static vrt_value_id
-vrt_minimum_cursor(vrt_consumer_array *cs)
+vrt_slowest_cursor(vrt_consumer_array *cs, struct vrt_consumer **slowest)
 {
     /* We know there's always at least one consumer */
     unsigned int  i;
     vrt_value_id  minimum =
         vrt_consumer_get_cursor(cork_array_at(cs, 0));
+    *slowest = cork_array_at(cs, 0);
     for (i = 1; i < cork_array_size(cs); i++) {
         vrt_value_id  id =
             vrt_consumer_get_cursor(cork_array_at(cs, i));
         if (vrt_mod_lt(id, minimum)) {
             minimum = id;
+            *slowest = cork_array_at(cs, i);
         }
     }
     return minimum;
 }
 
-#define vrt_queue_find_last_consumed_id(q) \
-    (vrt_minimum_cursor(&(q)->consumers))
+vrt_value_id
+vrt_queue_slowest_cursor(struct vrt_queue *q, volatile int **watch)
+{
+    struct vrt_consumer  *slowest;
+    vrt_value_id  minimum;
+    if (CORK_UNLIKELY(cork_array_is_empty(&q->consumers))) {
+        *watch = &q->cursor.value;
+        return vrt_queue_get_cursor(q);
+    }
+    minimum = vrt_slowest_cursor(&q->consumers, &slowest);
+    *watch = &slowest->cursor.value;
+    return minimum;
+}
+
+static bool
+vrt_queue_is_drained(struct vrt_queue *q)
+{
+    size_t  i;
+    vrt_value_id  cursor;
+    struct vrt_consumer  *slowest;
+
+    /* If any producer might be publishing, the cursor isn't stable. */
+    for (i = 0; i < cork_array_size(&q->producers); i++) {
+        struct vrt_producer  *p = cork_array_at(&q->producers, i);
+        if (vrt_padded_int_get(&p->publishing) != 0) {
+            return false;
+        }
+    }
+
+    if (cork_array_is_empty(&q->consumers)) {
+        return true;
+    }
+    cursor = vrt_queue_get_cursor(q);
+    return vrt_slowest_cursor(&q->consumers, &slowest) == cursor;
+}
+
+int
+vrt_queue_quiesce(struct vrt_queue *q, uint64_t timeout)
+{
+    uint64_t  deadline = vrt_queue_now() + timeout;
+
+    /* The atomic add is a full memory barrier on our side; producers
+     * that publish without one need the heavy barrier, too.  See
+     * vrt_wait_for_resume. */
+    vrt_padded_int_atomic_add(&q->quiesced, 1);
+    if (q->heavy_barrier) {
+        vrt_heavy_barrier();
+    }
+    DEBUG("[%s] Quiescing\n", q->name);
+
+    while (!vrt_queue_is_drained(q)) {
+        if (vrt_queue_is_cancelled(q)) {
+            vrt_queue_resume(q);
+            return VRT_QUEUE_CANCELLED;
+        }
+        if (timeout != 0 && vrt_queue_now() >= deadline) {
+            vrt_queue_resume(q);
+            cork_error_set_printf
+                (VRT_QUEUE_ERROR, "Timed out quiescing queue %s", q->name);
+            return -1;
+        }
+        usleep(QUIESCE_POLL_USEC);
+    }
+
+    DEBUG("[%s] Quiesced at value %d\n", q->name, vrt_queue_get_cursor(q));
+    return 0;
+}
+
+void
+vrt_queue_resume(struct vrt_queue *q)
+{
+    DEBUG("[%s] Resuming\n", q->name);
+    vrt_padded_int_atomic_add(&q->quiesced, -1);
+}
+
+void
+vrt_queue_cancel(struct vrt_queue *q)
+{
+    DEBUG("[%s] Cancelling\n", q->name);
+    /* The atomic add is a full memory barrier, so the flag is visible
+     * before we wake up any sleeping clients. */
+    vrt_padded_int_atomic_add(&q->cancelled, 1);
+    vrt_yield_strategy_alert();
+}
 
 /* Waits for the slot given by the producer's last_claimed_id to become
  * free.  (This happens when every consumer has finished processing the
@@ -148,18 +294,26 @@ vrt_wait_for_slot(struct vrt_queue *q, struct vrt_producer *p)
         p->last_claimed_id - vrt_queue_size(q);
     DEBUG("[%s] %s: Waiting for value %d to be consumed\n",
           q->name, p->name, wrapped_id);
+    if (vrt_queue_is_cancelled(q)) {
+        return VRT_QUEUE_CANCELLED;
+    }
     if (vrt_mod_lt(q->last_consumed_id, wrapped_id)) {
-        vrt_value_id  minimum = vrt_queue_find_last_consumed_id(q);
+        struct vrt_consumer  *slowest;
+        vrt_value_id  minimum = vrt_slowest_cursor(&q->consumers, &slowest);
         while (vrt_mod_lt(minimum, wrapped_id)) {
             DEBUG("[%s] %s: Last consumed value is %d\n",
                   q->name, p->name, minimum);
 #if VRT_QUEUE_STATS
             p->yield_count++;
 #endif
-            rii_check(vrt_yield_strategy_yield
-                      (p->yield, first, q->name, p->name));
+            rii_check(vrt_yield_strategy_wait
+                      (p->yield, first, &slowest->cursor.value, minimum,
+                       q->name, p->name));
             first = false;
-            minimum = vrt_queue_find_last_consumed_id(q);
+            if (vrt_queue_is_cancelled(q)) {
+                return VRT_QUEUE_CANCELLED;
+            }
+            minimum = vrt_slowest_cursor(&q->consumers, &slowest);
         }
 #if VRT_QUEUE_STATS
         p->batch_count++;
@@ -171,6 +325,47 @@ vrt_wait_for_slot(struct vrt_queue *q, struct vrt_producer *p)
 }
 
 
+/* Announces that the producer is about to publish, unless the queue is
+ * quiesced, in which case we wait for it to be resumed first.  Paired
+ * with the check in vrt_queue_quiesce, this guarantees that either we
+ * see the quiesce, or vrt_queue_quiesce sees us publishing.  That needs
+ * a full barrier between our store and our load; if the quiescer can
+ * force one onto us with a heavy barrier, the publish path doesn't pay
+ * for it. */
+static int
+vrt_wait_for_resume(struct vrt_queue *q, struct vrt_producer *p)
+{
+    if (CORK_LIKELY(q->heavy_barrier)) {
+        VRT_SCHEDULE_POINT(true);
+        p->publishing.value = 1;
+        VRT_SCHEDULE_POINT(false);
+        if (CORK_LIKELY(q->quiesced.value == 0)) {
+            return 0;
+        }
+    } else {
+        /* The atomic add is a full memory barrier. */
+        vrt_padded_int_atomic_add(&p->publishing, 1);
+    }
+
+    while (vrt_padded_int_get(&q->quiesced) != 0) {
+        bool  first = true;
+        vrt_padded_int_atomic_add(&p->publishing, -1);
+        DEBUG("[%s] %s: Waiting for queue to be resumed\n",
+              q->name, p->name);
+        while (vrt_padded_int_get(&q->quiesced) != 0) {
+            rii_check(vrt_yield_strategy_wait
+                      (p->yield, first, &q->quiesced.value, 1,
+                       q->name, p->name));
+            first = false;
+            if (vrt_queue_is_cancelled(q)) {
+                return VRT_QUEUE_CANCELLED;
+            }
+        }
+        vrt_padded_int_atomic_add(&p->publishing, 1);
+    }
+    return 0;
+}
+
 static int
 vrt_claim_single_threaded(struct vrt_queue *q, struct vrt_producer *p)
 {
@@ -220,9 +415,11 @@ vrt_publish_single_threaded(struct vrt_queue *q, struct vrt_producer *p,
      * cursor.  We don't have to wait for anything, because the claim
      * function will have already ensured that this slot was free to
      * fill in and publish. */
+    rii_check(vrt_wait_for_resume(q, p));
     DEBUG("[%s] %s: Publishing value %d\n",
           q->name, p->name, last_published_id);
     vrt_queue_set_cursor(q, last_published_id);
+    vrt_padded_int_set(&p->publishing, 0);
     return 0;
 }
 
@@ -241,15 +438,21 @@ vrt_publish_multi_threaded(struct vrt_queue *q, struct vrt_producer *p,
     bool  first = true;
 
     while (vrt_mod_lt(current_cursor, expected_cursor)) {
-        rii_check(vrt_yield_strategy_yield
-                  (p->yield, first, q->name, p->name));
+        rii_check(vrt_yield_strategy_wait
+                  (p->yield, first, &q->cursor.value, current_cursor,
+                   q->name, p->name));
         first = false;
+        if (vrt_queue_is_cancelled(q)) {
+            return VRT_QUEUE_CANCELLED;
+        }
         current_cursor = vrt_queue_get_cursor(q);
     }
 
+    rii_check(vrt_wait_for_resume(q, p));
     DEBUG("[%s] %s: Publishing value %d\n",
           q->name, p->name, last_published_id);
     vrt_queue_set_cursor(q, last_published_id);
+    vrt_padded_int_set(&p->publishing, 0);
     return 0;
 }
 
@@ -470,12 +673,18 @@ vrt_consumer_new(const char *name, struct vrt_queue *q)
     memset(c, 0, sizeof(struct vrt_consumer));
     c->name = cork_strdup(name);
     cork_array_init(&c->dependencies);
+    cork_array_init(&c->followers);
 
     ei_check(vrt_queue_add_consumer(q, c));
     c->cursor.value = DEFAULT_STARTING_VALUE;
     c->last_available_id = DEFAULT_STARTING_VALUE;
     c->current_id = DEFAULT_STARTING_VALUE;
     c->eof_count = 0;
+    c->tick_interval = 0;
+    c->next_tick = 0;
+    c->min_batch_size = 0;
+    c->max_batch_delay = 0;
+    c->batch_deadline = 0;
 #if VRT_QUEUE_STATS
     c->batch_count = 0;
     c->yield_count = 0;
@@ -488,6 +697,7 @@ error:
     }
 
     cork_array_done(&c->dependencies);
+    cork_array_done(&c->followers);
     free(c);
     return NULL;
 }
@@ -504,11 +714,137 @@ vrt_consumer_free(struct vrt_consumer *c)
     }
 
     cork_array_done(&c->dependencies);
+    cork_array_done(&c->followers);
     free(c);
 }
 
-#define vrt_consumer_find_last_dependent_id(c) \
-    (vrt_minimum_cursor(&(c)->dependencies))
+void
+vrt_consumer_set_tick(struct vrt_consumer *c, uint64_t interval)
+{
+    c->tick_interval = interval;
+    if (interval != 0) {
+        c->next_tick = vrt_queue_now() + interval;
+    }
+}
+
+/* Returns whether the consumer's next tick is due, and if so, schedules
+ * the one after it. */
+static bool
+vrt_consumer_tick_due(struct vrt_consumer *c)
+{
+    uint64_t  now;
+    if (c->tick_interval == 0) {
+        return false;
+    }
+
+    now = vrt_queue_now();
+    if (now < c->next_tick) {
+        return false;
+    }
+
+    c->next_tick += c->tick_interval;
+    if (c->next_tick <= now) {
+        /* We've missed at least one whole tick; don't try to catch up. */
+        c->next_tick = now + c->tick_interval;
+    }
+    return true;
+}
+
+void
+vrt_consumer_set_min_batch(struct vrt_consumer *c, unsigned int count,
+                           uint64_t max_delay)
+{
+    c->min_batch_size = count;
+    c->max_batch_delay = max_delay;
+    c->batch_deadline = 0;
+}
+
+/* Returns whether enough values are available for the consumer to wake
+ * up for them.  The first time we see some values that aren't enough,
+ * we start the clock on them. */
+static bool
+vrt_consumer_batch_ready(struct vrt_queue *q, struct vrt_consumer *c,
+                         vrt_value_id last_consumed_id,
+                         vrt_value_id last_available_id)
+{
+    unsigned int  count;
+    uint64_t  now;
+
+    if (vrt_mod_le(last_available_id, last_consumed_id)) {
+        return false;
+    }
+    if (c->min_batch_size <= 1) {
+        return true;
+    }
+
+    /* A full queue can't get any fuller, and flushes and EOFs shouldn't
+     * be held back. */
+    count = last_available_id - last_consumed_id;
+    if (count >= c->min_batch_size || count >= vrt_queue_size(q) ||
+        vrt_queue_get(q, last_available_id)->special != VRT_VALUE_NONE) {
+        return true;
+    }
+
+    now = vrt_queue_now();
+    if (c->batch_deadline == 0) {
+        c->batch_deadline = now + c->max_batch_delay;
+    }
+    return now >= c->batch_deadline;
+}
+
+/* Returns how far the consumer's dependencies have gotten, and fills in
+ * watch with the cursor to wait on if that isn't far enough.  If the
+ * consumer has a barrier, and the barrier's cached minimum is past
+ * known_id, we use that without checking any of the dependencies'
+ * cursors ourselves.  Otherwise we check them, and raise the barrier's
+ * minimum for the other consumers that share it. */
+static vrt_value_id
+vrt_consumer_dependency_cursor(struct vrt_consumer *c,
+                               vrt_value_id known_id, volatile int **watch)
+{
+    struct vrt_consumer  *slowest;
+    vrt_value_id  minimum;
+
+    if (c->barrier == NULL) {
+        minimum = vrt_slowest_cursor(&c->dependencies, &slowest);
+        *watch = &slowest->cursor.value;
+        return minimum;
+    }
+
+    minimum = vrt_padded_int_get(&c->barrier->cursor);
+    if (vrt_mod_lt(known_id, minimum)) {
+        *watch = &c->barrier->cursor.value;
+        return minimum;
+    }
+
+    minimum = vrt_slowest_cursor(&c->barrier->dependencies, &slowest);
+    vrt_padded_int_advance(&c->barrier->cursor, minimum);
+    *watch = &slowest->cursor.value;
+    return minimum;
+}
+
+vrt_value_id
+vrt_consumer_last_available(struct vrt_consumer *c, vrt_value_id known_id,
+                            volatile int **watch)
+{
+    if (cork_array_is_empty(&c->dependencies)) {
+        *watch = &c->queue->cursor.value;
+        return vrt_queue_get_cursor(c->queue);
+    }
+    return vrt_consumer_dependency_cursor(c, known_id, watch);
+}
+
+/* Moves the consumer's cursor, along with the cursors of any consumers
+ * that follow it. */
+static void
+vrt_consumer_move_cursor(struct vrt_consumer *c, vrt_value_id value)
+{
+    size_t  i;
+    vrt_consumer_set_cursor(c, value);
+    for (i = 0; i < cork_array_size(&c->followers); i++) {
+        vrt_consumer_set_cursor(cork_array_at(&c->followers, i), value);
+    }
+}
 
 /* Retrieves the next value from the consumer's queue.  When this
  * returnc->current_id will be the ID of the next value.  You can
@@ -527,7 +863,22 @@ vrt_consumer_next_raw(struct vrt_queue *q, struct vrt_consumer *c)
 
     /* We've run out of values that we know can been processed.  Notify
      * the world how much we've processed so far. */
-    vrt_consumer_set_cursor(c, last_consumed_id);
+    vrt_consumer_move_cursor(c, last_consumed_id);
+
+    /* If a tick is due, deliver it before we look for more values.
+     * We'll pick up where we left off on the next call. */
+    if (vrt_consumer_tick_due(c)) {
+        DEBUG("[%s] %s: Tick\n", q->name, c->name);
+        c->current_id = last_consumed_id;
+        return VRT_QUEUE_TICK;
+    }
+
+    /* Likewise if the queue has been cancelled, although in that case
+     * there won't be a next call. */
+    if (vrt_queue_is_cancelled(q)) {
+        c->current_id = last_consumed_id;
+        return VRT_QUEUE_CANCELLED;
+    }
 
     /* Check to see if there are any more values that we can process. */
     if (cork_array_is_empty(&c->dependencies)) {
@@ -538,13 +889,24 @@ vrt_consumer_next_raw(struct vrt_queue *q, struct vrt_consumer *c)
         bool  first = true;
         vrt_value_id  last_available_id =
             vrt_queue_get_cursor(q);
-        while (vrt_mod_le(last_available_id, last_consumed_id)) {
+        while (!vrt_consumer_batch_ready
+               (q, c, last_consumed_id, last_available_id)) {
 #if VRT_QUEUE_STATS
             c->yield_count++;
 #endif
-            rii_check(vrt_yield_strategy_yield
-                      (c->yield, first, q->name, c->name));
+            rii_check(vrt_yield_strategy_wait
+                      (c->yield, first, &q->cursor.value, last_available_id,
+                       q->name, c->name));
             first = false;
+            if (vrt_consumer_tick_due(c)) {
+                DEBUG("[%s] %s: Tick\n", q->name, c->name);
+                c->current_id = last_consumed_id;
+                return VRT_QUEUE_TICK;
+            }
+            if (vrt_queue_is_cancelled(q)) {
+                c->current_id = last_consumed_id;
+                return VRT_QUEUE_CANCELLED;
+            }
             last_available_id = vrt_queue_get_cursor(q);
         }
         c->last_available_id = last_available_id;
@@ -554,19 +916,33 @@ vrt_consumer_next_raw(struct vrt_queue *q, struct vrt_consumer *c)
         /* If there are dependenciewe can only process what they've
          * *all* finished processing. */
         bool  first = true;
+        volatile int  *watch;
         vrt_value_id  last_available_id =
-            vrt_consumer_find_last_dependent_id(c);
-        while (vrt_mod_le(last_available_id, last_consumed_id)) {
+            vrt_consumer_dependency_cursor(c, last_consumed_id, &watch);
+        while (!vrt_consumer_batch_ready
+               (q, c, last_consumed_id, last_available_id)) {
 #if VRT_QUEUE_STATS
             c->yield_count++;
 #endif
-            rii_check(vrt_yield_strategy_yield
-                      (c->yield, first, q->name, c->name));
+            rii_check(vrt_yield_strategy_wait
+                      (c->yield, first, watch,
+                       last_available_id, q->name, c->name));
             first = false;
-            last_available_id = vrt_consumer_find_last_dependent_id(c);
+            if (vrt_consumer_tick_due(c)) {
+                DEBUG("[%s] %s: Tick\n", q->name, c->name);
+                c->current_id = last_consumed_id;
+                return VRT_QUEUE_TICK;
+            }
+            if (vrt_queue_is_cancelled(q)) {
+                c->current_id = last_consumed_id;
+                return VRT_QUEUE_CANCELLED;
+            }
+            last_available_id = vrt_consumer_dependency_cursor
+                (c, last_available_id, &watch);
         }
         c->last_available_id = last_available_id;
     }
+    c->batch_deadline = 0;
 
 #if VRT_QUEUE_STATS
     c->batch_count++;
@@ -585,6 +961,8 @@ vrt_consumer_next(struct vrt_consumer *c, struct vrt_value **value)
     do {
         unsigned int  producer_count;
         struct vrt_value  *v;
+        /* This might return VRT_QUEUE_TICK or VRT_QUEUE_CANCELLED,
+         * which we pass along. */
         rii_check(vrt_consumer_next_raw(c->queue, c));
         v = vrt_queue_get(c->queue, c->current_id);
 
@@ -606,7 +984,7 @@ vrt_consumer_next(struct vrt_consumer *c, struct vrt_value **value)
                     /* We've run out of values that we know can been
                      * processed.  Notify the world how much we've
                      * processed so far. */
-                    vrt_consumer_set_cursor(c, c->current_id);
+                    vrt_consumer_move_cursor(c, c->current_id);
                     return VRT_QUEUE_EOF;
                 } else {
                     /* There are other producers still producing values,
@@ -641,3 +1019,117 @@ vrt_report_consumer(struct vrt_consumer *c)
            c->yield_count);
 #endif
 }
+
+
+/*-----------------------------------------------------------------------
+ * Barriers
+ */
+
+struct vrt_barrier *
+vrt_barrier_new(struct vrt_queue *q)
+{
+    struct vrt_barrier  *b = cork_new(struct vrt_barrier);
+    memset(b, 0, sizeof(struct vrt_barrier));
+    cork_array_init(&b->dependencies);
+    /* No consumer can be more than a queue's length behind the queue's
+     * cursor, so this can't be past any of the dependencies. */
+    b->cursor.value = vrt_queue_get_cursor(q) - vrt_queue_size(q);
+    cork_array_append(&q->barriers, b);
+    return b;
+}
+
+static bool
+vrt_consumer_array_contains(vrt_consumer_array *cs, struct vrt_consumer *c)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(cs); i++) {
+        if (cork_array_at(cs, i) == c) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Returns whether two arrays hold the same set of consumers.  (A
+ * consumer never depends on the same consumer twice.) */
+static bool
+vrt_consumer_array_same(vrt_consumer_array *cs1, vrt_consumer_array *cs2)
+{
+    size_t  i;
+    if (cork_array_size(cs1) != cork_array_size(cs2)) {
+        return false;
+    }
+    for (i = 0; i < cork_array_size(cs1); i++) {
+        if (!vrt_consumer_array_contains(cs2, cork_array_at(cs1, i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+vrt_consumer_set_barrier(struct vrt_consumer *c, struct vrt_barrier *b)
+{
+    size_t  i;
+
+    if (cork_array_is_empty(&b->dependencies)) {
+        cork_error_set_printf
+            (VRT_QUEUE_ERROR, "Barrier for %s doesn't have any dependencies",
+             c->name);
+        return -1;
+    }
+
+    if (cork_array_is_empty(&c->dependencies)) {
+        for (i = 0; i < cork_array_size(&b->dependencies); i++) {
+            vrt_consumer_add_dependency
+                (c, cork_array_at(&b->dependencies, i));
+        }
+    } else if (!vrt_consumer_array_same(&c->dependencies, &b->dependencies)) {
+        cork_error_set_printf
+            (VRT_QUEUE_ERROR, "%s doesn't have the same dependencies as "
+             "its barrier", c->name);
+        return -1;
+    }
+
+    c->barrier = b;
+    return 0;
+}
+
+void
+vrt_queue_share_barriers(struct vrt_queue *q)
+{
+    size_t  i;
+    size_t  j;
+
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        struct vrt_barrier  *b = NULL;
+
+        if (c->barrier != NULL || cork_array_is_empty(&c->dependencies)) {
+            continue;
+        }
+
+        for (j = i + 1; j < cork_array_size(&q->consumers); j++) {
+            struct vrt_consumer  *other = cork_array_at(&q->consumers, j);
+            if (other->barrier != NULL ||
+                !vrt_consumer_array_same
+                (&c->dependencies, &other->dependencies)) {
+                continue;
+            }
+
+            if (b == NULL) {
+                size_t  k;
+                DEBUG("[%s] %s: Sharing a barrier\n", q->name, c->name);
+                b = vrt_barrier_new(q);
+                for (k = 0; k < cork_array_size(&c->dependencies); k++) {
+                    vrt_barrier_add_dependency
+                        (b, cork_array_at(&c->dependencies, k));
+                }
+                c->barrier = b;
+            }
+
+            DEBUG("[%s] %s: Sharing a barrier\n", q->name, other->name);
+            other->barrier = b;
+        }
+    }
+}
@@ -0,0 +1,238 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/queue.h"
+#include "vrt/router.h"
+
+
+#ifndef VRT_DEBUG_ROUTER
+#define VRT_DEBUG_ROUTER 0
+#endif
+#if VRT_DEBUG_ROUTER
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* do nothing */
+#endif
+
+
+#define vrt_router_error(...) \
+    cork_error_set_printf(VRT_ROUTER_ERROR, __VA_ARGS__)
+
+
+/*-----------------------------------------------------------------------
+ * Routers
+ */
+
+struct vrt_router *
+vrt_router_new(const char *name, struct vrt_queue *q,
+               unsigned int batch_size, vrt_router_key_f key,
+               vrt_router_copy_f copy, void *ud)
+{
+    struct vrt_router  *router = cork_new(struct vrt_router);
+    memset(router, 0, sizeof(struct vrt_router));
+    router->name = cork_strdup(name);
+    router->key = key;
+    router->copy = copy;
+    router->ud = ud;
+    router->batch_size = batch_size;
+    cork_array_init(&router->outputs);
+
+    router->consumer = vrt_consumer_new(name, q);
+    if (router->consumer == NULL) {
+        cork_array_done(&router->outputs);
+        cork_strfree(router->name);
+        free(router);
+        return NULL;
+    }
+    return router;
+}
+
+void
+vrt_router_free(struct vrt_router *router)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&router->outputs); i++) {
+        struct vrt_router_output  *output =
+            cork_array_at(&router->outputs, i);
+        free(output->pending);
+        free(output);
+    }
+    cork_array_done(&router->outputs);
+    cork_strfree(router->name);
+    free(router);
+}
+
+struct vrt_producer *
+vrt_router_add_output(struct vrt_router *router, struct vrt_queue *q)
+{
+    struct vrt_router_output  *output;
+    struct vrt_producer  *producer;
+
+    if (!cork_array_is_empty(&q->producers)) {
+        vrt_router_error("Router %s must be the only producer of %s",
+                         router->name, q->name);
+        return NULL;
+    }
+
+    rpp_check(producer = vrt_producer_new
+              (router->name, router->batch_size, q));
+    output = cork_new(struct vrt_router_output);
+    memset(output, 0, sizeof(struct vrt_router_output));
+    output->producer = producer;
+    output->max_batch_size = producer->batch_size;
+    output->pending = cork_calloc
+        (output->max_batch_size, sizeof(struct vrt_value *));
+    cork_array_append(&router->outputs, output);
+    return producer;
+}
+
+/* Copies the values that are bound for an output into its queue, as a
+ * single batch. */
+static int
+vrt_router_publish(struct vrt_router *router,
+                   struct vrt_router_output *output)
+{
+    struct vrt_producer  *p = output->producer;
+    unsigned int  i;
+
+    if (output->pending_count == 0) {
+        return 0;
+    }
+
+    /* Claim exactly as many values as we have to copy, so that the one
+     * real publish happens when we publish the last of them. */
+    p->batch_size = output->pending_count;
+    for (i = 0; i < output->pending_count; i++) {
+        struct vrt_value  *v;
+        rii_check(vrt_producer_claim(p, &v));
+        rii_check(router->copy(router->ud, v, output->pending[i]));
+        rii_check(vrt_producer_publish(p));
+    }
+
+    DEBUG("[%s] %s: Published %u values up to value %d\n",
+          p->queue->name, router->name, output->pending_count,
+          p->last_produced_id);
+    output->value_count += output->pending_count;
+    output->batch_count++;
+    output->pending_count = 0;
+    return 0;
+}
+
+static int
+vrt_router_publish_all(struct vrt_router *router)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&router->outputs); i++) {
+        rii_check(vrt_router_publish
+                  (router, cork_array_at(&router->outputs, i)));
+    }
+    return 0;
+}
+
+/* Returns whether the next call to vrt_consumer_next might move the
+ * consumer's cursor past the values that we're holding on to.  That
+ * happens once there aren't any more ordinary values that we know are
+ * available; any holes or EOFs before then are skipped over without
+ * returning. */
+static bool
+vrt_router_at_batch_end(struct vrt_consumer *c)
+{
+    vrt_value_id  id;
+    for (id = c->current_id + 1; vrt_mod_le(id, c->last_available_id);
+         id++) {
+        if (vrt_queue_get(c->queue, id)->special == VRT_VALUE_NONE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+vrt_router_run(struct vrt_router *router)
+{
+    struct vrt_consumer  *c = router->consumer;
+    unsigned int  output_count = cork_array_size(&router->outputs);
+    struct vrt_value  *value;
+    size_t  i;
+    int  rc;
+
+    if (output_count == 0) {
+        vrt_router_error("Router %s doesn't have any outputs",
+                         router->name);
+        return -1;
+    }
+
+    while ((rc = vrt_consumer_next(c, &value)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_router_output  *output;
+            unsigned int  index = router->key(router->ud, value);
+            if (CORK_UNLIKELY(index >= output_count)) {
+                vrt_router_error("Router %s sent value %d to output %u "
+                                 "(out of %u)", router->name,
+                                 c->current_id, index, output_count);
+                return -1;
+            }
+
+            output = cork_array_at(&router->outputs, index);
+            output->pending[output->pending_count++] = value;
+            if (output->pending_count == output->max_batch_size) {
+                rii_check(vrt_router_publish(router, output));
+            }
+
+            /* The upstream values are only ours until the consumer's
+             * cursor moves past them. */
+            if (vrt_router_at_batch_end(c)) {
+                rii_check(vrt_router_publish_all(router));
+            }
+        } else if (rc == VRT_QUEUE_FLUSH) {
+            rii_check(vrt_router_publish_all(router));
+            for (i = 0; i < output_count; i++) {
+                struct vrt_router_output  *output =
+                    cork_array_at(&router->outputs, i);
+                output->producer->batch_size = 1;
+                rii_check(vrt_producer_flush(output->producer));
+            }
+        } else {
+            return rc;
+        }
+    }
+
+    DEBUG("[%s] %s: End of input\n", c->queue->name, router->name);
+    rii_check(vrt_router_publish_all(router));
+    for (i = 0; i < output_count; i++) {
+        struct vrt_router_output  *output =
+            cork_array_at(&router->outputs, i);
+        output->producer->batch_size = 1;
+        rii_check(vrt_producer_eof(output->producer));
+    }
+    return 0;
+}
+
+void
+vrt_report_router(struct vrt_router *router)
+{
+    size_t  i;
+    printf("Router %s:\n", router->name);
+    for (i = 0; i < cork_array_size(&router->outputs); i++) {
+        struct vrt_router_output  *output =
+            cork_array_at(&router->outputs, i);
+        printf("  %-20s %10" PRIu64 " values %8" PRIu64 " batches\n",
+               output->producer->queue->name,
+               output->value_count, output->batch_count);
+    }
+}
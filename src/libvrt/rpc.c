@@ -0,0 +1,294 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/atomic.h"
+#include "vrt/queue.h"
+#include "vrt/rpc.h"
+#include "vrt/yield.h"
+
+
+#ifndef VRT_DEBUG_RPC
+#define VRT_DEBUG_RPC 0
+#endif
+#if VRT_DEBUG_RPC
+#include <stdio.h>
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* do nothing */
+#endif
+
+
+#define MINIMUM_REPLY_RING_SIZE  2
+#define DEFAULT_REPLY_RING_SIZE  1024
+
+#define vrt_rpc_error(...) \
+    cork_error_set_printf(VRT_RPC_ERROR, __VA_ARGS__)
+
+
+/*-----------------------------------------------------------------------
+ * Request/reply pairs
+ */
+
+static void
+vrt_rpc_requester_free(struct vrt_rpc_requester *r)
+{
+    unsigned int  i;
+    struct vrt_value_type  *type = r->rpc->reply_type;
+    for (i = 0; i <= r->reply_mask; i++) {
+        if (r->replies[i] != NULL) {
+            vrt_value_free(type, r->replies[i]);
+        }
+    }
+    free(r->replies);
+    free(r);
+}
+
+struct vrt_rpc *
+vrt_rpc_new(const char *name,
+            struct vrt_value_type *request_type, unsigned int queue_size,
+            struct vrt_value_type *reply_type, unsigned int reply_ring_size)
+{
+    struct vrt_rpc  *rpc = cork_new(struct vrt_rpc);
+    memset(rpc, 0, sizeof(struct vrt_rpc));
+    rpc->name = cork_strdup(name);
+    rpc->requests = vrt_queue_new(name, request_type, queue_size);
+    rpc->reply_type = reply_type;
+
+    if (reply_ring_size == 0) {
+        reply_ring_size = DEFAULT_REPLY_RING_SIZE;
+    } else if (reply_ring_size < MINIMUM_REPLY_RING_SIZE) {
+        reply_ring_size = MINIMUM_REPLY_RING_SIZE;
+    }
+    rpc->reply_ring_size = 1;
+    while (rpc->reply_ring_size < reply_ring_size) {
+        rpc->reply_ring_size <<= 1;
+    }
+
+    cork_pointer_array_init
+        (&rpc->requesters, (cork_free_f) vrt_rpc_requester_free);
+    DEBUG("[%s] Created request/reply pair with %u-value reply rings\n",
+          rpc->name, rpc->reply_ring_size);
+    return rpc;
+}
+
+void
+vrt_rpc_free(struct vrt_rpc *rpc)
+{
+    /* The request queue frees its own producers and consumer. */
+    cork_array_done(&rpc->requesters);
+    if (rpc->service != NULL) {
+        free(rpc->service);
+    }
+    vrt_queue_free(rpc->requests);
+    cork_strfree(rpc->name);
+    free(rpc);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Requesters
+ */
+
+struct vrt_rpc_requester *
+vrt_rpc_requester_new(struct vrt_rpc *rpc, const char *name,
+                      unsigned int batch_size)
+{
+    unsigned int  i;
+    struct vrt_rpc_requester  *r;
+    struct vrt_producer  *p;
+
+    rpp_check(p = vrt_producer_new(name, batch_size, rpc->requests));
+    r = cork_new(struct vrt_rpc_requester);
+    memset(r, 0, sizeof(struct vrt_rpc_requester));
+    r->rpc = rpc;
+    r->index = cork_array_size(&rpc->requesters);
+    r->producer = p;
+    r->reply_mask = rpc->reply_ring_size - 1;
+    r->replies = cork_calloc(rpc->reply_ring_size, sizeof(struct vrt_value *));
+    for (i = 0; i < rpc->reply_ring_size; i++) {
+        r->replies[i] = vrt_value_new(rpc->reply_type);
+        cork_abort_if_null(r->replies[i], "Cannot allocate values");
+    }
+    cork_array_append(&rpc->requesters, r);
+    return r;
+}
+
+int
+vrt_rpc_requester_claim(struct vrt_rpc_requester *r,
+                        struct vrt_value **request)
+{
+    /* Each outstanding request has a reserved slot in the reply ring, and
+     * we keep one more slot for the reply that the caller might still be
+     * looking at. */
+    if (vrt_rpc_requester_outstanding(r) >= r->reply_mask) {
+        vrt_rpc_error("%s has too many outstanding requests (%u)",
+                      r->producer->name, vrt_rpc_requester_outstanding(r));
+        return -1;
+    }
+    return vrt_producer_claim(r->producer, request);
+}
+
+int
+vrt_rpc_requester_publish(struct vrt_rpc_requester *r)
+{
+    struct vrt_value  *v =
+        vrt_queue_get(r->rpc->requests, r->producer->last_produced_id);
+    struct vrt_rpc_request  *request =
+        cork_container_of(v, struct vrt_rpc_request, parent);
+    request->reply_to = r->index;
+    r->sent++;
+    return vrt_producer_publish(r->producer);
+}
+
+int
+vrt_rpc_requester_receive(struct vrt_rpc_requester *r,
+                          struct vrt_value **reply)
+{
+    struct vrt_producer  *p = r->producer;
+
+    if (vrt_rpc_requester_outstanding(r) == 0) {
+        vrt_rpc_error("%s is waiting for a reply without a request",
+                      p->name);
+        return -1;
+    }
+
+    if (r->last_published == r->received) {
+        bool  first = true;
+        r->last_published = vrt_padded_int_get(&r->published);
+        if (r->last_published == r->received &&
+            vrt_mod_lt(p->last_produced_id, p->last_claimed_id)) {
+            /* The service can't answer a request that's sitting in a
+             * partial batch, so send it along before we wait. */
+            DEBUG("[%s] %s: Flushing partial batch before waiting\n",
+                  r->rpc->name, p->name);
+            rii_check(vrt_producer_flush(p));
+        }
+        while (r->last_published == r->received) {
+            rii_check(vrt_yield_strategy_wait
+                      (p->yield, first, &r->published.value,
+                       (int) r->received, r->rpc->name, p->name));
+            first = false;
+            if (vrt_queue_is_cancelled(r->rpc->requests)) {
+                return VRT_QUEUE_CANCELLED;
+            }
+            r->last_published = vrt_padded_int_get(&r->published);
+        }
+    }
+
+    *reply = r->replies[r->received++ & r->reply_mask];
+    return 0;
+}
+
+int
+vrt_rpc_requester_eof(struct vrt_rpc_requester *r)
+{
+    return vrt_producer_eof(r->producer);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Service
+ */
+
+struct vrt_rpc_service *
+vrt_rpc_service_new(struct vrt_rpc *rpc, const char *name)
+{
+    struct vrt_rpc_service  *s;
+    struct vrt_consumer  *c;
+
+    if (rpc->service != NULL) {
+        vrt_rpc_error("%s already has a service", rpc->name);
+        return NULL;
+    }
+
+    rpp_check(c = vrt_consumer_new(name, rpc->requests));
+    s = cork_new(struct vrt_rpc_service);
+    s->rpc = rpc;
+    s->consumer = c;
+    s->current = NULL;
+    rpc->service = s;
+    return s;
+}
+
+void
+vrt_rpc_service_flush(struct vrt_rpc_service *s)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&s->rpc->requesters); i++) {
+        struct vrt_rpc_requester  *r = cork_array_at(&s->rpc->requesters, i);
+        if (r->dirty) {
+            DEBUG("[%s] %s: Publishing replies up to %u to %s\n",
+                  s->rpc->name, s->consumer->name,
+                  r->written, r->producer->name);
+            vrt_padded_int_set(&r->published, r->written);
+            r->dirty = false;
+        }
+    }
+}
+
+int
+vrt_rpc_service_next(struct vrt_rpc_service *s, struct vrt_value **request)
+{
+    struct vrt_consumer  *c = s->consumer;
+    struct vrt_value  *v;
+    struct vrt_rpc_request  *req;
+    int  rc;
+
+    if (s->current != NULL) {
+        vrt_rpc_error("%s didn't reply to a request from %s",
+                      c->name, s->current->producer->name);
+        return -1;
+    }
+
+    /* If the next request might not have arrived yet, publish the
+     * replies that we've written so far before we wait for it.  A
+     * requester's FLUSH is followed by the holes that fill out the rest
+     * of its batch, which the consumer skips over without returning, so
+     * we also have to publish when we see one of those. */
+    if (!vrt_mod_lt(c->current_id, c->last_available_id)) {
+        vrt_rpc_service_flush(s);
+    }
+    while ((rc = vrt_consumer_next(c, &v)) != 0) {
+        vrt_rpc_service_flush(s);
+        if (rc != VRT_QUEUE_FLUSH) {
+            return rc;
+        }
+    }
+
+    req = cork_container_of(v, struct vrt_rpc_request, parent);
+    if (req->reply_to >= cork_array_size(&s->rpc->requesters)) {
+        vrt_rpc_error("Request %d has an invalid reply handle (%u)",
+                      v->id, req->reply_to);
+        return -1;
+    }
+    s->current = cork_array_at(&s->rpc->requesters, req->reply_to);
+    *request = v;
+    return 0;
+}
+
+int
+vrt_rpc_service_reply(struct vrt_rpc_service *s, struct vrt_value **reply)
+{
+    struct vrt_rpc_requester  *r = s->current;
+    if (r == NULL) {
+        vrt_rpc_error("%s has no request to reply to", s->consumer->name);
+        return -1;
+    }
+    *reply = r->replies[r->written++ & r->reply_mask];
+    r->dirty = true;
+    s->current = NULL;
+    return 0;
+}
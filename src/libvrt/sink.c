@@ -0,0 +1,700 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define VRT_HAVE_IO_URING  1
+#else
+#define VRT_HAVE_IO_URING  0
+#endif
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/atomic.h"
+#include "vrt/queue.h"
+#include "vrt/sink.h"
+#include "vrt/yield.h"
+
+
+#ifndef VRT_DEBUG_SINK
+#define VRT_DEBUG_SINK 0
+#endif
+#if VRT_DEBUG_SINK
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* do nothing */
+#endif
+
+
+#define DEFAULT_DEPTH  4
+#define DEFAULT_BATCH_SIZE  64
+
+#define vrt_sink_error(...) \
+    cork_error_set_printf(VRT_SINK_ERROR, __VA_ARGS__)
+
+
+/*-----------------------------------------------------------------------
+ * io_uring
+ */
+
+/* We talk to io_uring using its system calls directly, rather than
+ * depending on liburing; we only need to submit writes and reap their
+ * completions, and only from a single thread. */
+
+#if VRT_HAVE_IO_URING
+
+struct vrt_file_sink_ring {
+    int  fd;
+
+    void  *sq_ptr;
+    size_t  sq_size;
+    unsigned int  *sq_tail;
+    unsigned int  *sq_mask;
+    unsigned int  *sq_array;
+    struct io_uring_sqe  *sqes;
+    size_t  sqes_size;
+
+    void  *cq_ptr;
+    size_t  cq_size;
+    unsigned int  *cq_head;
+    unsigned int  *cq_tail;
+    unsigned int  *cq_mask;
+    struct io_uring_cqe  *cqes;
+};
+
+static void
+vrt_file_sink_ring_free(struct vrt_file_sink_ring *ring)
+{
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+static void *
+vrt_file_sink_ring_map(int fd, size_t size, off_t offset)
+{
+    void  *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (ptr == MAP_FAILED)? NULL: ptr;
+}
+
+/* Returns NULL if the kernel doesn't support io_uring (or won't let us
+ * use it), without setting an error. */
+static struct vrt_file_sink_ring *
+vrt_file_sink_ring_new(unsigned int entries)
+{
+    struct vrt_file_sink_ring  *ring;
+    struct io_uring_params  params;
+    int  fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        DEBUG("io_uring isn't available: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    ring = cork_new(struct vrt_file_sink_ring);
+    memset(ring, 0, sizeof(struct vrt_file_sink_ring));
+    ring->fd = fd;
+
+    ring->sq_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->sq_ptr = vrt_file_sink_ring_map(fd, ring->sq_size,
+                                          IORING_OFF_SQ_RING);
+    ring->cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->cq_ptr = vrt_file_sink_ring_map(fd, ring->cq_size,
+                                          IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = vrt_file_sink_ring_map(fd, ring->sqes_size,
+                                        IORING_OFF_SQES);
+    if (ring->sq_ptr == NULL || ring->cq_ptr == NULL || ring->sqes == NULL) {
+        DEBUG("Cannot map io_uring: %s\n", strerror(errno));
+        vrt_file_sink_ring_free(ring);
+        return NULL;
+    }
+
+    ring->sq_tail = (void *) ((char *) ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (void *) ((char *) ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (void *) ((char *) ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (void *) ((char *) ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (void *) ((char *) ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (void *) ((char *) ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (void *) ((char *) ring->cq_ptr + params.cq_off.cqes);
+    return ring;
+}
+
+/* Returns the number of SQEs that the kernel took, or -1 on error. */
+static int
+vrt_file_sink_ring_enter(struct vrt_file_sink *sink, unsigned int to_submit,
+                         unsigned int min_complete, unsigned int flags)
+{
+    int  rc;
+    do {
+        sink->stats.syscall_count++;
+        rc = syscall(__NR_io_uring_enter, sink->ring->fd,
+                     to_submit, min_complete, flags, NULL, 0);
+    } while (rc < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if (rc < 0) {
+        vrt_sink_error("Cannot submit writes for %s: %s",
+                       sink->name, strerror(errno));
+        return -1;
+    }
+    return rc;
+}
+
+static int
+vrt_file_sink_ring_submit(struct vrt_file_sink *sink, unsigned int index)
+{
+    struct vrt_file_sink_ring  *ring = sink->ring;
+    struct vrt_file_sink_batch  *batch = &sink->batches[index];
+    unsigned int  tail = *ring->sq_tail;
+    unsigned int  slot = tail & *ring->sq_mask;
+    struct io_uring_sqe  *sqe = &ring->sqes[slot];
+    int  rc;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = sink->fd;
+    sqe->addr = (uintptr_t) &batch->iov[batch->iov_start];
+    sqe->len = batch->iov_count;
+    sqe->off = (batch->offset < 0)? (uint64_t) -1: (uint64_t) batch->offset;
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* The batch is only in flight once the kernel has taken the SQE.  If
+     * it didn't, take the SQE back, so that it isn't left in the ring
+     * for a later io_uring_enter to pick up, and so that nobody waits
+     * for a completion that will never arrive. */
+    rc = vrt_file_sink_ring_enter(sink, 1, 0, 0);
+    if (rc < 1) {
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        if (rc == 0) {
+            vrt_sink_error("Cannot submit writes for %s", sink->name);
+        }
+        return -1;
+    }
+    batch->in_flight = true;
+    return 0;
+}
+
+#else /* !VRT_HAVE_IO_URING */
+
+struct vrt_file_sink_ring {
+    int  unused;
+};
+
+static void
+vrt_file_sink_ring_free(struct vrt_file_sink_ring *ring)
+{
+    free(ring);
+}
+
+static struct vrt_file_sink_ring *
+vrt_file_sink_ring_new(unsigned int entries)
+{
+    return NULL;
+}
+
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Batches
+ */
+
+/* Records that @a written bytes from the front of a batch have made it
+ * to the file. */
+static void
+vrt_file_sink_batch_consume(struct vrt_file_sink_batch *batch,
+                            size_t written)
+{
+    batch->remaining -= written;
+    if (batch->offset >= 0) {
+        batch->offset += written;
+    }
+    while (written > 0) {
+        struct iovec  *iov = &batch->iov[batch->iov_start];
+        if (written >= iov->iov_len) {
+            written -= iov->iov_len;
+            batch->iov_start++;
+            batch->iov_count--;
+        } else {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+            written = 0;
+        }
+    }
+}
+
+/* Moves the sink's cursor past every batch at the front of the ring
+ * that has been written. */
+static void
+vrt_file_sink_retire(struct vrt_file_sink *sink)
+{
+    vrt_value_id  last_id = 0;
+    bool  retired = false;
+    while (sink->pending > 0 && !sink->batches[sink->head].in_flight) {
+        last_id = sink->batches[sink->head].last_id;
+        retired = true;
+        sink->head = (sink->head + 1) % sink->depth;
+        sink->pending--;
+    }
+    if (retired) {
+        DEBUG("[%s] %s: Retiring up to value %d\n",
+              sink->consumer->queue->name, sink->name, last_id);
+        vrt_consumer_set_cursor(sink->consumer, last_id);
+    }
+}
+
+/* Writes a batch synchronously. */
+static int
+vrt_file_sink_write(struct vrt_file_sink *sink,
+                    struct vrt_file_sink_batch *batch)
+{
+    while (batch->remaining > 0) {
+        ssize_t  written;
+        sink->stats.syscall_count++;
+        if (batch->offset < 0) {
+            written = writev(sink->fd, &batch->iov[batch->iov_start],
+                             batch->iov_count);
+        } else {
+            written = pwritev(sink->fd, &batch->iov[batch->iov_start],
+                              batch->iov_count, batch->offset);
+        }
+
+        if (written < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            vrt_sink_error("Cannot write to %s: %s",
+                           sink->name, strerror(errno));
+            return -1;
+        }
+
+        if (written < batch->remaining) {
+            sink->stats.short_count++;
+        }
+        sink->stats.byte_count += written;
+        vrt_file_sink_batch_consume(batch, written);
+    }
+    return 0;
+}
+
+#if VRT_HAVE_IO_URING
+/* Handles every write that has completed, resubmitting any that were
+ * only partly written.  If @a wait is true, waits for at least one. */
+static int
+vrt_file_sink_reap(struct vrt_file_sink *sink, bool wait)
+{
+    struct vrt_file_sink_ring  *ring = sink->ring;
+    unsigned int  head;
+    unsigned int  tail;
+    int  rc = 0;
+
+    /* Synchronous writes are never in flight. */
+    if (ring == NULL) {
+        vrt_file_sink_retire(sink);
+        return 0;
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (wait && head == tail) {
+        if (vrt_file_sink_ring_enter
+            (sink, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            return -1;
+        }
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    while (head != tail) {
+        struct io_uring_cqe  *cqe = &ring->cqes[head & *ring->cq_mask];
+        unsigned int  index = cqe->user_data;
+        struct vrt_file_sink_batch  *batch = &sink->batches[index];
+        int  res = cqe->res;
+
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        batch->in_flight = false;
+
+        /* A failed batch is given up on, but we keep handling the rest
+         * of the completions, so that nothing is left in flight behind
+         * it. */
+        if (res < 0) {
+            if (res == -EINTR || res == -EAGAIN) {
+                if (vrt_file_sink_ring_submit(sink, index) != 0) {
+                    rc = -1;
+                }
+                continue;
+            }
+            if (rc == 0) {
+                vrt_sink_error("Cannot write to %s: %s",
+                               sink->name, strerror(-res));
+                rc = -1;
+            }
+            continue;
+        }
+
+        sink->stats.byte_count += res;
+        if (res < batch->remaining) {
+            DEBUG("[%s] %s: Short write (%d of %zu bytes)\n",
+                  sink->consumer->queue->name, sink->name,
+                  res, batch->remaining);
+            sink->stats.short_count++;
+            vrt_file_sink_batch_consume(batch, res);
+            if (vrt_file_sink_ring_submit(sink, index) != 0) {
+                rc = -1;
+            }
+        } else {
+            vrt_file_sink_batch_consume(batch, res);
+        }
+    }
+
+    vrt_file_sink_retire(sink);
+    return rc;
+}
+#else
+static int
+vrt_file_sink_reap(struct vrt_file_sink *sink, bool wait)
+{
+    vrt_file_sink_retire(sink);
+    return 0;
+}
+#endif
+
+/* Gathers the next batch of available values and starts writing it. */
+static int
+vrt_file_sink_gather(struct vrt_file_sink *sink, vrt_value_id available)
+{
+    struct vrt_consumer  *c = sink->consumer;
+    struct vrt_queue  *q = c->queue;
+    unsigned int  producer_count = cork_array_size(&q->producers);
+    unsigned int  index = (sink->head + sink->pending) % sink->depth;
+    struct vrt_file_sink_batch  *batch = &sink->batches[index];
+    unsigned int  value_count = 0;
+    bool  done = false;
+
+    batch->iov_count = 0;
+    batch->iov_start = 0;
+    batch->remaining = 0;
+    batch->in_flight = false;
+
+    while (!done && value_count < sink->batch_size &&
+           vrt_mod_lt(c->current_id, available)) {
+        vrt_value_id  id = ++c->current_id;
+        struct vrt_value  *v = vrt_queue_get(q, id);
+        value_count++;
+
+        switch (v->special) {
+            case VRT_VALUE_NONE:
+            {
+                struct iovec  *iov = &batch->iov[batch->iov_count];
+                rii_check(sink->encode(sink->ud, v, iov));
+                sink->stats.value_count++;
+                if (iov->iov_len > 0) {
+                    batch->remaining += iov->iov_len;
+                    batch->iov_count++;
+                }
+                break;
+            }
+
+            case VRT_VALUE_HOLE:
+                break;
+
+            case VRT_VALUE_FLUSH:
+                /* Don't wait for more values before writing these. */
+                done = true;
+                break;
+
+            case VRT_VALUE_EOF:
+                DEBUG("[%s] %s: Detected EOF at value %d\n",
+                      q->name, sink->name, id);
+                if (++sink->eof_count == producer_count) {
+                    done = true;
+                }
+                break;
+
+            default:
+                cork_unreachable();
+        }
+    }
+
+    batch->last_id = c->current_id;
+    batch->offset = sink->offset;
+    if (sink->offset >= 0) {
+        sink->offset += batch->remaining;
+    }
+    sink->pending++;
+
+    if (batch->remaining == 0) {
+        vrt_file_sink_retire(sink);
+        return 0;
+    }
+
+    DEBUG("[%s] %s: Writing %u values (%zu bytes) up to value %d\n",
+          q->name, sink->name, batch->iov_count, batch->remaining,
+          batch->last_id);
+    sink->stats.batch_count++;
+#if VRT_HAVE_IO_URING
+    if (sink->ring != NULL) {
+        if (vrt_file_sink_ring_submit(sink, index) != 0) {
+            /* The batch never made it to the kernel, and it's the newest
+             * one, so just forget about it. */
+            sink->pending--;
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    if (vrt_file_sink_write(sink, batch) != 0) {
+        /* Nothing else is in flight, so just forget about the batch. */
+        sink->pending--;
+        return -1;
+    }
+    vrt_file_sink_retire(sink);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * File sinks
+ */
+
+struct vrt_file_sink *
+vrt_file_sink_new(const char *name, struct vrt_queue *q, int fd,
+                  vrt_file_sink_encode_f encode, void *ud)
+{
+    struct vrt_file_sink  *sink = cork_new(struct vrt_file_sink);
+    memset(sink, 0, sizeof(struct vrt_file_sink));
+    sink->name = cork_strdup(name);
+    sink->fd = fd;
+    sink->encode = encode;
+    sink->ud = ud;
+    sink->backend = VRT_FILE_SINK_AUTO;
+    sink->depth = DEFAULT_DEPTH;
+    sink->batch_size = DEFAULT_BATCH_SIZE;
+
+    sink->consumer = vrt_consumer_new(name, q);
+    if (sink->consumer == NULL) {
+        cork_strfree(sink->name);
+        free(sink);
+        return NULL;
+    }
+    return sink;
+}
+
+void
+vrt_file_sink_free(struct vrt_file_sink *sink)
+{
+    cork_strfree(sink->name);
+    free(sink);
+}
+
+static int
+vrt_file_sink_setup(struct vrt_file_sink *sink)
+{
+    unsigned int  i;
+    off_t  position;
+
+    if (sink->depth == 0 || sink->batch_size == 0) {
+        vrt_sink_error("File sink %s needs a depth and batch size",
+                       sink->name);
+        return -1;
+    }
+
+    /* Pipes and sockets don't have a position, and overlapping writes
+     * to them could land out of order. */
+    position = lseek(sink->fd, 0, SEEK_CUR);
+    sink->offset = (position < 0)? -1: position;
+    if (sink->offset < 0) {
+        sink->depth = 1;
+    }
+
+    if (sink->backend != VRT_FILE_SINK_PWRITEV) {
+        sink->ring = vrt_file_sink_ring_new(sink->depth);
+        if (sink->ring != NULL) {
+            sink->backend = VRT_FILE_SINK_IO_URING;
+        } else if (sink->backend == VRT_FILE_SINK_IO_URING) {
+            vrt_sink_error("io_uring isn't available for %s", sink->name);
+            return -1;
+        } else {
+            sink->backend = VRT_FILE_SINK_PWRITEV;
+        }
+    }
+
+    sink->batches =
+        cork_calloc(sink->depth, sizeof(struct vrt_file_sink_batch));
+    for (i = 0; i < sink->depth; i++) {
+        sink->batches[i].iov =
+            cork_calloc(sink->batch_size, sizeof(struct iovec));
+    }
+    sink->head = 0;
+    sink->pending = 0;
+    sink->eof_count = 0;
+    return 0;
+}
+
+static void
+vrt_file_sink_teardown(struct vrt_file_sink *sink)
+{
+    unsigned int  i;
+    if (sink->batches != NULL) {
+        for (i = 0; i < sink->depth; i++) {
+            free(sink->batches[i].iov);
+        }
+        free(sink->batches);
+        sink->batches = NULL;
+    }
+    if (sink->ring != NULL) {
+        vrt_file_sink_ring_free(sink->ring);
+        sink->ring = NULL;
+    }
+}
+
+static bool
+vrt_file_sink_in_flight(struct vrt_file_sink *sink)
+{
+    unsigned int  i;
+    for (i = 0; i < sink->pending; i++) {
+        if (sink->batches[(sink->head + i) % sink->depth].in_flight) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Waits for every write that's in flight.  The kernel reads straight
+ * out of the queue, so we can't leave until they've all completed, even
+ * if something has gone wrong; if any of them fail, we keep going, and
+ * report the error once they're done. */
+static int
+vrt_file_sink_drain(struct vrt_file_sink *sink)
+{
+    int  rc = 0;
+    while (vrt_file_sink_in_flight(sink)) {
+        if (vrt_file_sink_reap(sink, true) != 0) {
+            rc = -1;
+        }
+    }
+    vrt_file_sink_retire(sink);
+    return rc;
+}
+
+static int
+vrt_file_sink_loop(struct vrt_file_sink *sink)
+{
+    struct vrt_consumer  *c = sink->consumer;
+    struct vrt_queue  *q = c->queue;
+    unsigned int  producer_count = cork_array_size(&q->producers);
+    bool  first = true;
+
+    while (sink->eof_count < producer_count) {
+        volatile int  *watch;
+        vrt_value_id  available;
+
+        if (sink->pending > 0) {
+            rii_check(vrt_file_sink_reap(sink, false));
+        }
+        if (vrt_queue_is_cancelled(q)) {
+            return VRT_QUEUE_CANCELLED;
+        }
+
+        available = vrt_consumer_last_available(c, c->current_id, &watch);
+        if (vrt_mod_lt(c->current_id, available)) {
+            if (sink->pending < sink->depth) {
+                rii_check(vrt_file_sink_gather(sink, available));
+                first = true;
+            } else {
+                rii_check(vrt_file_sink_reap(sink, true));
+            }
+        } else if (sink->pending > 0) {
+            /* Nothing new to write, so we might as well wait for the
+             * kernel to finish with what we've given it. */
+            rii_check(vrt_file_sink_reap(sink, true));
+        } else {
+            rii_check(vrt_yield_strategy_wait
+                      (c->yield, first, watch, available,
+                       q->name, sink->name));
+            first = false;
+        }
+    }
+    return 0;
+}
+
+int
+vrt_file_sink_run(struct vrt_file_sink *sink)
+{
+    int  rc;
+
+    rii_check(vrt_file_sink_setup(sink));
+    DEBUG("[%s] %s: Writing with %s\n", sink->consumer->queue->name,
+          sink->name,
+          (sink->backend == VRT_FILE_SINK_IO_URING)? "io_uring": "pwritev");
+
+    rc = vrt_file_sink_loop(sink);
+    if (vrt_file_sink_drain(sink) != 0 && rc == 0) {
+        rc = -1;
+    }
+
+    /* pwritev and io_uring don't move the file position, so move it
+     * past everything we've written. */
+    if (rc == 0 && sink->offset >= 0 &&
+        lseek(sink->fd, sink->offset, SEEK_SET) < 0) {
+        vrt_sink_error("Cannot seek in %s: %s", sink->name, strerror(errno));
+        rc = -1;
+    }
+
+    vrt_file_sink_teardown(sink);
+    return rc;
+}
+
+void
+vrt_report_file_sink(struct vrt_file_sink *sink)
+{
+    printf("Sink %s (%s):\n"
+           "  Values:   %" PRIu64 "\n"
+           "  Bytes:    %" PRIu64 "\n"
+           "  Batches:  %" PRIu64 " (%" PRIu64 " short)\n"
+           "  Syscalls: %" PRIu64 "\n",
+           sink->name,
+           (sink->backend == VRT_FILE_SINK_IO_URING)? "io_uring":
+           (sink->backend == VRT_FILE_SINK_PWRITEV)? "pwritev": "auto",
+           sink->stats.value_count, sink->stats.byte_count,
+           sink->stats.batch_count, sink->stats.short_count,
+           sink->stats.syscall_count);
+}
@@ -0,0 +1,367 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/queue.h"
+#include "vrt/source.h"
+#include "vrt/yield.h"
+
+
+#ifndef VRT_DEBUG_SOURCE
+#define VRT_DEBUG_SOURCE 0
+#endif
+#if VRT_DEBUG_SOURCE
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* do nothing */
+#endif
+
+
+#define vrt_source_error(...) \
+    cork_error_set_printf(VRT_SOURCE_ERROR, __VA_ARGS__)
+
+
+/*-----------------------------------------------------------------------
+ * Splitters
+ */
+
+ssize_t
+vrt_fd_source_split_lines(struct vrt_fd_source *source, const char *buf,
+                          size_t length, bool eof)
+{
+    const char  *newline = memchr(buf, '\n', length);
+    if (newline != NULL) {
+        return newline - buf + 1;
+    }
+    return eof? length: 0;
+}
+
+ssize_t
+vrt_fd_source_split_fixed(struct vrt_fd_source *source, const char *buf,
+                          size_t length, bool eof)
+{
+    if (source->record_size == 0) {
+        vrt_source_error("Source %s doesn't have a record size",
+                         source->name);
+        return -1;
+    }
+    if (length >= source->record_size) {
+        return source->record_size;
+    }
+    if (eof) {
+        vrt_source_error("Source %s ends with a partial record "
+                         "(%zu of %zu bytes)",
+                         source->name, length, source->record_size);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Sources
+ */
+
+struct vrt_fd_source *
+vrt_fd_source_new(const char *name, struct vrt_queue *q, int fd,
+                  size_t arena_size, unsigned int batch_size,
+                  vrt_fd_source_split_f split, vrt_fd_source_fill_f fill,
+                  void *ud)
+{
+    struct vrt_fd_source  *source = cork_new(struct vrt_fd_source);
+    memset(source, 0, sizeof(struct vrt_fd_source));
+    source->name = cork_strdup(name);
+    source->fd = fd;
+    source->split = split;
+    source->fill = fill;
+    source->ud = ud;
+
+    source->producer = vrt_producer_new(name, batch_size, q);
+    if (source->producer == NULL) {
+        cork_strfree(source->name);
+        free(source);
+        return NULL;
+    }
+    source->max_batch_size = source->producer->batch_size;
+
+    source->arena_size = arena_size;
+    source->arena = cork_malloc(arena_size);
+    source->batch_capacity = vrt_queue_size(q);
+    source->batches = cork_calloc
+        (source->batch_capacity, sizeof(struct vrt_fd_source_batch));
+    source->lengths = cork_calloc(source->max_batch_size, sizeof(size_t));
+    return source;
+}
+
+void
+vrt_fd_source_free(struct vrt_fd_source *source)
+{
+    free(source->lengths);
+    free(source->batches);
+    free(source->arena);
+    cork_strfree(source->name);
+    free(source);
+}
+
+/* Frees up the part of the arena that belongs to batches that every
+ * consumer has finished with. */
+static void
+vrt_fd_source_release(struct vrt_fd_source *source)
+{
+    if (source->batch_count > 0) {
+        volatile int  *watch;
+        vrt_value_id  cursor = vrt_queue_slowest_cursor
+            (source->producer->queue, &watch);
+        while (source->batch_count > 0) {
+            struct vrt_fd_source_batch  *batch =
+                &source->batches[source->batch_head];
+            if (vrt_mod_lt(cursor, batch->last_id)) {
+                break;
+            }
+            source->released_pos = batch->end_pos;
+            source->batch_head =
+                (source->batch_head + 1) % source->batch_capacity;
+            source->batch_count--;
+        }
+    }
+
+    if (source->batch_count == 0) {
+        source->released_pos = source->parsed_pos;
+    }
+}
+
+/* Waits until the consumers have finished with the oldest batch that's
+ * still holding on to part of the arena. */
+static int
+vrt_fd_source_wait(struct vrt_fd_source *source)
+{
+    struct vrt_producer  *p = source->producer;
+    struct vrt_queue  *q = p->queue;
+    struct vrt_fd_source_batch  *batch =
+        &source->batches[source->batch_head];
+    volatile int  *watch;
+    vrt_value_id  cursor = vrt_queue_slowest_cursor(q, &watch);
+    bool  first = true;
+
+    DEBUG("[%s] %s: Waiting for value %d to free up the arena\n",
+          q->name, source->name, batch->last_id);
+    source->stats.wait_count++;
+    while (vrt_mod_lt(cursor, batch->last_id)) {
+        if (vrt_queue_is_cancelled(q)) {
+            return VRT_QUEUE_CANCELLED;
+        }
+        rii_check(vrt_yield_strategy_wait
+                  (p->yield, first, watch, cursor,
+                   q->name, source->name));
+        first = false;
+        cursor = vrt_queue_slowest_cursor(q, &watch);
+    }
+
+    vrt_fd_source_release(source);
+    return 0;
+}
+
+/* Frames every complete record that we've read, and publishes them in
+ * batches. */
+static int
+vrt_fd_source_publish(struct vrt_fd_source *source, bool eof)
+{
+    struct vrt_producer  *p = source->producer;
+
+    while (true) {
+        struct vrt_fd_source_batch  *batch;
+        uint64_t  pos = source->parsed_pos;
+        unsigned int  count = 0;
+        unsigned int  i;
+
+        /* The unframed bytes are always contiguous in the arena. */
+        while (count < source->max_batch_size && pos < source->read_pos) {
+            size_t  length = source->read_pos - pos;
+            ssize_t  record = source->split
+                (source, source->arena + (pos % source->arena_size),
+                 length, eof);
+            if (record < 0) {
+                return -1;
+            }
+            if (record == 0) {
+                break;
+            }
+            if (record > length) {
+                vrt_source_error("Source %s framed a record past the end "
+                                 "of its input", source->name);
+                return -1;
+            }
+            source->lengths[count++] = record;
+            pos += record;
+        }
+
+        if (count == 0) {
+            break;
+        }
+
+        /* Claim exactly as many values as we have records. */
+        p->batch_size = count;
+        for (i = 0; i < count; i++) {
+            struct vrt_value  *v;
+            rii_check(vrt_producer_claim(p, &v));
+            rii_check(source->fill
+                      (source, v,
+                       source->arena +
+                       (source->parsed_pos % source->arena_size),
+                       source->lengths[i]));
+            source->parsed_pos += source->lengths[i];
+            rii_check(vrt_producer_publish(p));
+        }
+
+        DEBUG("[%s] %s: Published %u records up to value %d\n",
+              p->queue->name, source->name, count, p->last_produced_id);
+        source->stats.record_count += count;
+        if (source->batch_count == source->batch_capacity) {
+            vrt_fd_source_release(source);
+        }
+        batch = &source->batches
+            [(source->batch_head + source->batch_count) %
+             source->batch_capacity];
+        batch->last_id = p->last_produced_id;
+        batch->end_pos = source->parsed_pos;
+        source->batch_count++;
+    }
+
+    if (eof && source->parsed_pos != source->read_pos) {
+        vrt_source_error("Source %s ends with %" PRIu64 " unframed bytes",
+                         source->name,
+                         source->read_pos - source->parsed_pos);
+        return -1;
+    }
+    return 0;
+}
+
+/* Moves the partial record at the very end of the arena to its start,
+ * so that we can keep reading into contiguous memory. */
+static int
+vrt_fd_source_move_partial(struct vrt_fd_source *source)
+{
+    size_t  length = source->read_pos - source->parsed_pos;
+
+    if (2 * length > source->arena_size) {
+        vrt_source_error("Source %s has a record that's longer than half "
+                         "of its arena (%zu bytes)",
+                         source->name, source->arena_size);
+        return -1;
+    }
+
+    while (source->read_pos + length - source->released_pos >
+           source->arena_size) {
+        rii_check(vrt_fd_source_wait(source));
+    }
+
+    DEBUG("[%s] %s: Moving %zu bytes to the start of the arena\n",
+          source->producer->queue->name, source->name, length);
+    memmove(source->arena,
+            source->arena + (source->parsed_pos % source->arena_size),
+            length);
+    source->parsed_pos = source->read_pos;
+    source->read_pos += length;
+    source->stats.move_count++;
+    return 0;
+}
+
+int
+vrt_fd_source_run(struct vrt_fd_source *source)
+{
+    struct vrt_producer  *p = source->producer;
+    struct vrt_queue  *q = p->queue;
+
+    /* Nothing would ever release the arena, or the queue's slots. */
+    if (cork_array_is_empty(&q->consumers)) {
+        vrt_source_error("Source %s feeds %s, which doesn't have any "
+                         "consumers", source->name, q->name);
+        return -1;
+    }
+
+    while (true) {
+        size_t  offset;
+        size_t  space;
+        ssize_t  bytes_read;
+
+        vrt_fd_source_release(source);
+        if (vrt_queue_is_cancelled(q)) {
+            return VRT_QUEUE_CANCELLED;
+        }
+
+        offset = source->read_pos % source->arena_size;
+        if (offset == 0 && source->parsed_pos != source->read_pos) {
+            rii_check(vrt_fd_source_move_partial(source));
+            continue;
+        }
+
+        space = source->arena_size - offset;
+        if (space > source->arena_size -
+            (source->read_pos - source->released_pos)) {
+            space = source->arena_size -
+                (source->read_pos - source->released_pos);
+        }
+        if (space == 0) {
+            if (source->batch_count == 0) {
+                vrt_source_error("Source %s has a record that doesn't "
+                                 "fit into its arena (%zu bytes)",
+                                 source->name, source->arena_size);
+                return -1;
+            }
+            rii_check(vrt_fd_source_wait(source));
+            continue;
+        }
+
+        source->stats.read_count++;
+        bytes_read = read(source->fd, source->arena + offset, space);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            vrt_source_error("Cannot read from %s: %s",
+                             source->name, strerror(errno));
+            return -1;
+        }
+
+        if (bytes_read == 0) {
+            DEBUG("[%s] %s: End of input\n", q->name, source->name);
+            rii_check(vrt_fd_source_publish(source, true));
+            p->batch_size = 1;
+            return vrt_producer_eof(p);
+        }
+
+        source->read_pos += bytes_read;
+        source->stats.byte_count += bytes_read;
+        rii_check(vrt_fd_source_publish(source, false));
+    }
+}
+
+void
+vrt_report_fd_source(struct vrt_fd_source *source)
+{
+    printf("Source %s:\n"
+           "  Records: %" PRIu64 "\n"
+           "  Bytes:   %" PRIu64 "\n"
+           "  Reads:   %" PRIu64 "\n"
+           "  Waits:   %" PRIu64 "\n"
+           "  Moves:   %" PRIu64 "\n",
+           source->name, source->stats.record_count,
+           source->stats.byte_count, source->stats.read_count,
+           source->stats.wait_count, source->stats.move_count);
+}
@@ -0,0 +1,1776 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/cpu.h"
+#include "vrt/queue.h"
+#include "vrt/topology.h"
+#include "vrt/yield.h"
+
+
+#ifndef VRT_DEBUG_TOPOLOGY
+#define VRT_DEBUG_TOPOLOGY 0
+#endif
+#if VRT_DEBUG_TOPOLOGY
+#include <stdio.h>
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* do nothing */
+#endif
+
+
+#define DEFAULT_YIELD_STRATEGY  "hybrid"
+#define DEFAULT_FUSE_MAX_NS  1000
+#define DEFAULT_BATCH_DELAY_USEC  1000
+/* How many timed calls we need before deciding whether an automatically
+ * fused consumer should get its own thread. */
+#define FUSE_DECISION_SAMPLES  16
+#define PARAM_PREFIX  "param."
+
+#define vrt_topology_error(...) \
+    cork_error_set_printf(VRT_TOPOLOGY_ERROR, __VA_ARGS__)
+
+
+/*-----------------------------------------------------------------------
+ * Parsed sections
+ */
+
+enum vrt_topology_kind {
+    VRT_TOPOLOGY_QUEUE,
+    VRT_TOPOLOGY_PRODUCER,
+    VRT_TOPOLOGY_CONSUMER,
+    VRT_TOPOLOGY_RUNTIME
+};
+
+static const char  *vrt_topology_kind_names[] = {
+    "queue",
+    "producer",
+    "consumer",
+    "runtime"
+};
+
+static const char  *vrt_topology_kind_titles[] = {
+    "Queue",
+    "Producer",
+    "Consumer",
+    "Runtime"
+};
+
+/* The keys that are allowed in each kind of section, in addition to
+ * the "param.*" keys, which are passed through to the handlers. */
+static const char  *vrt_topology_queue_keys[] = {
+    "size", "type", NULL
+};
+
+static const char  *vrt_topology_producer_keys[] = {
+    "queue", "batch_size", "yield", "cpu", "handler", NULL
+};
+
+static const char  *vrt_topology_consumer_keys[] = {
+    "queue", "depends", "yield", "cpu", "handler", "tick_usec",
+    "fuse", "fuse_max_ns", "min_batch", "batch_delay_usec", NULL
+};
+
+static const char  *vrt_topology_runtime_keys[] = {
+    "sched", "priority", "cpus", "mlock", NULL
+};
+
+static const char  **vrt_topology_kind_keys[] = {
+    vrt_topology_queue_keys,
+    vrt_topology_producer_keys,
+    vrt_topology_consumer_keys,
+    vrt_topology_runtime_keys
+};
+
+struct vrt_topology_entry {
+    const char  *key;
+    const char  *value;
+};
+
+struct vrt_topology_section {
+    enum vrt_topology_kind  kind;
+    const char  *name;
+    unsigned int  line;
+    cork_array(struct vrt_topology_entry)  entries;
+};
+
+static struct vrt_topology_section *
+vrt_topology_section_new(enum vrt_topology_kind kind, const char *name,
+                         unsigned int line)
+{
+    struct vrt_topology_section  *section =
+        cork_new(struct vrt_topology_section);
+    section->kind = kind;
+    section->name = cork_strdup(name);
+    section->line = line;
+    cork_array_init(&section->entries);
+    return section;
+}
+
+static void
+vrt_topology_section_free(struct vrt_topology_section *section)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&section->entries); i++) {
+        struct vrt_topology_entry  *entry =
+            &cork_array_at(&section->entries, i);
+        cork_strfree(entry->key);
+        cork_strfree(entry->value);
+    }
+    cork_array_done(&section->entries);
+    cork_strfree(section->name);
+    free(section);
+}
+
+static struct vrt_topology_entry *
+vrt_topology_section_find(struct vrt_topology_section *section,
+                          const char *key)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&section->entries); i++) {
+        struct vrt_topology_entry  *entry =
+            &cork_array_at(&section->entries, i);
+        if (strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static const char *
+vrt_topology_section_get(struct vrt_topology_section *section,
+                         const char *key)
+{
+    struct vrt_topology_entry  *entry =
+        vrt_topology_section_find(section, key);
+    return (entry == NULL)? NULL: entry->value;
+}
+
+static void
+vrt_topology_section_set(struct vrt_topology_section *section,
+                         const char *key, const char *value)
+{
+    struct vrt_topology_entry  *entry =
+        vrt_topology_section_find(section, key);
+    if (entry == NULL) {
+        struct vrt_topology_entry  new_entry;
+        new_entry.key = cork_strdup(key);
+        new_entry.value = cork_strdup(value);
+        cork_array_append(&section->entries, new_entry);
+    } else {
+        cork_strfree(entry->value);
+        entry->value = cork_strdup(value);
+    }
+}
+
+static int
+vrt_topology_section_check_keys(struct vrt_topology_section *section)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&section->entries); i++) {
+        struct vrt_topology_entry  *entry =
+            &cork_array_at(&section->entries, i);
+        const char  **allowed;
+        bool  found = false;
+
+        if (strncmp(entry->key, PARAM_PREFIX, strlen(PARAM_PREFIX)) == 0) {
+            continue;
+        }
+
+        for (allowed = vrt_topology_kind_keys[section->kind];
+             *allowed != NULL; allowed++) {
+            if (strcmp(entry->key, *allowed) == 0) {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found) {
+            vrt_topology_error
+                ("Unknown key \"%s\" in [%s %s] (line %u)",
+                 entry->key, vrt_topology_kind_names[section->kind],
+                 section->name, section->line);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Parses an unsigned integer key.  Leaves *dest alone if the key isn't
+ * present. */
+static int
+vrt_topology_section_get_uint(struct vrt_topology_section *section,
+                              const char *key, unsigned int *dest)
+{
+    const char  *value = vrt_topology_section_get(section, key);
+    char  *end;
+    unsigned long  result;
+
+    if (value == NULL) {
+        return 0;
+    }
+
+    errno = 0;
+    result = strtoul(value, &end, 10);
+    if (value[0] == '\0' || value[0] == '-' || *end != '\0' ||
+        errno != 0 || result > UINT_MAX) {
+        vrt_topology_error
+            ("Invalid value \"%s\" for %s in [%s %s] (line %u)",
+             value, key, vrt_topology_kind_names[section->kind],
+             section->name, section->line);
+        return -1;
+    }
+
+    *dest = result;
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Topologies
+ */
+
+struct vrt_topology *
+vrt_topology_new(void)
+{
+    struct vrt_topology  *topo = cork_new(struct vrt_topology);
+    memset(topo, 0, sizeof(struct vrt_topology));
+    cork_array_init(&topo->types);
+    cork_array_init(&topo->handlers);
+    cork_array_init(&topo->sections);
+    cork_pointer_array_init(&topo->queues, (cork_free_f) vrt_queue_free);
+    cork_array_init(&topo->clients);
+    topo->cpu_policy = VRT_CPU_POLICY_COMPACT;
+    topo->runtime.sched_policy = SCHED_OTHER;
+    cork_array_init(&topo->runtime.cpus);
+    pthread_mutex_init(&topo->lock, NULL);
+    return topo;
+}
+
+void
+vrt_topology_free(struct vrt_topology *topo)
+{
+    size_t  i;
+
+    for (i = 0; i < cork_array_size(&topo->types); i++) {
+        cork_strfree(cork_array_at(&topo->types, i).name);
+    }
+    cork_array_done(&topo->types);
+
+    for (i = 0; i < cork_array_size(&topo->handlers); i++) {
+        cork_strfree(cork_array_at(&topo->handlers, i).name);
+    }
+    cork_array_done(&topo->handlers);
+
+    for (i = 0; i < cork_array_size(&topo->sections); i++) {
+        vrt_topology_section_free(cork_array_at(&topo->sections, i));
+    }
+    cork_array_done(&topo->sections);
+
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        free(client);
+    }
+    cork_array_done(&topo->clients);
+
+    cork_array_done(&topo->runtime.cpus);
+
+    /* This frees each queue's producers and consumers, too. */
+    cork_array_done(&topo->queues);
+    pthread_mutex_destroy(&topo->lock);
+    free(topo);
+}
+
+int
+vrt_topology_register_type(struct vrt_topology *topo, const char *name,
+                           struct vrt_value_type *type)
+{
+    struct vrt_topology_type  entry;
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->types); i++) {
+        if (strcmp(cork_array_at(&topo->types, i).name, name) == 0) {
+            vrt_topology_error("Value type %s is already registered", name);
+            return -1;
+        }
+    }
+
+    entry.name = cork_strdup(name);
+    entry.type = type;
+    cork_array_append(&topo->types, entry);
+    return 0;
+}
+
+int
+vrt_topology_register_handler(struct vrt_topology *topo, const char *name,
+                              vrt_topology_handler_f handler, void *ud)
+{
+    struct vrt_topology_handler  entry;
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->handlers); i++) {
+        if (strcmp(cork_array_at(&topo->handlers, i).name, name) == 0) {
+            vrt_topology_error("Handler %s is already registered", name);
+            return -1;
+        }
+    }
+
+    entry.name = cork_strdup(name);
+    entry.handler = handler;
+    entry.ud = ud;
+    cork_array_append(&topo->handlers, entry);
+    return 0;
+}
+
+static struct vrt_topology_section *
+vrt_topology_find_section(struct vrt_topology *topo, const char *name)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->sections); i++) {
+        struct vrt_topology_section  *section =
+            cork_array_at(&topo->sections, i);
+        if (strcmp(section->name, name) == 0) {
+            return section;
+        }
+    }
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Parsing
+ */
+
+static char *
+vrt_topology_trim(char *str)
+{
+    char  *end;
+    while (isspace((unsigned char) *str)) {
+        str++;
+    }
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return str;
+}
+
+static int
+vrt_topology_parse_header(struct vrt_topology *topo, char *line,
+                          unsigned int line_number,
+                          struct vrt_topology_section **section)
+{
+    char  *end = line + strlen(line) - 1;
+    char  *kind_name;
+    char  *name;
+    unsigned int  kind;
+
+    if (*end != ']') {
+        vrt_topology_error("Missing \"]\" on line %u", line_number);
+        return -1;
+    }
+    *end = '\0';
+
+    kind_name = vrt_topology_trim(line + 1);
+    name = kind_name;
+    while (*name != '\0' && !isspace((unsigned char) *name)) {
+        name++;
+    }
+    if (*name != '\0') {
+        *name++ = '\0';
+    }
+    name = vrt_topology_trim(name);
+
+    for (kind = 0; kind <= VRT_TOPOLOGY_RUNTIME; kind++) {
+        if (strcmp(kind_name, vrt_topology_kind_names[kind]) == 0) {
+            break;
+        }
+    }
+    if (kind > VRT_TOPOLOGY_RUNTIME) {
+        vrt_topology_error
+            ("Unknown section kind \"%s\" on line %u",
+             kind_name, line_number);
+        return -1;
+    }
+
+    if (*name == '\0' || strpbrk(name, " \t,") != NULL) {
+        vrt_topology_error
+            ("Invalid %s name \"%s\" on line %u",
+             kind_name, name, line_number);
+        return -1;
+    }
+
+    if (vrt_topology_find_section(topo, name) != NULL) {
+        vrt_topology_error
+            ("Duplicate section name \"%s\" on line %u", name, line_number);
+        return -1;
+    }
+
+    *section = vrt_topology_section_new(kind, name, line_number);
+    cork_array_append(&topo->sections, *section);
+    return 0;
+}
+
+static int
+vrt_topology_parse_entry(char *line, unsigned int line_number,
+                         struct vrt_topology_section *section)
+{
+    char  *equals = strchr(line, '=');
+    char  *key;
+    char  *value;
+
+    if (section == NULL) {
+        vrt_topology_error
+            ("Key outside of any section on line %u", line_number);
+        return -1;
+    }
+
+    if (equals == NULL) {
+        vrt_topology_error("Expected \"key = value\" on line %u", line_number);
+        return -1;
+    }
+
+    *equals = '\0';
+    key = vrt_topology_trim(line);
+    value = vrt_topology_trim(equals + 1);
+
+    if (*key == '\0') {
+        vrt_topology_error("Missing key on line %u", line_number);
+        return -1;
+    }
+
+    if (vrt_topology_section_find(section, key) != NULL) {
+        vrt_topology_error
+            ("Duplicate key \"%s\" on line %u", key, line_number);
+        return -1;
+    }
+
+    vrt_topology_section_set(section, key, value);
+    return 0;
+}
+
+int
+vrt_topology_load_string(struct vrt_topology *topo, const char *spec)
+{
+    struct cork_buffer  buf = CORK_BUFFER_INIT();
+    struct vrt_topology_section  *section = NULL;
+    unsigned int  line_number = 0;
+    char  *next;
+
+    if (topo->built) {
+        vrt_topology_error("Topology has already been built");
+        return -1;
+    }
+
+    /* Make a copy of the specification that we can tokenize in place. */
+    cork_buffer_set_string(&buf, spec);
+    next = buf.buf;
+
+    while (next != NULL) {
+        char  *line = next;
+        char  *comment;
+
+        line_number++;
+        next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+
+        comment = strpbrk(line, "#;");
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        line = vrt_topology_trim(line);
+        if (*line == '\0') {
+            continue;
+        }
+
+        if (*line == '[') {
+            ei_check(vrt_topology_parse_header
+                     (topo, line, line_number, &section));
+        } else {
+            ei_check(vrt_topology_parse_entry(line, line_number, section));
+        }
+    }
+
+    cork_buffer_done(&buf);
+    return 0;
+
+error:
+    cork_buffer_done(&buf);
+    return -1;
+}
+
+int
+vrt_topology_load_file(struct vrt_topology *topo, const char *path)
+{
+    struct cork_buffer  buf = CORK_BUFFER_INIT();
+    char  chunk[4096];
+    size_t  bytes_read;
+    FILE  *fp;
+    int  rc;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        cork_system_error_set();
+        return -1;
+    }
+
+    while ((bytes_read = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        cork_buffer_append(&buf, chunk, bytes_read);
+    }
+
+    if (ferror(fp)) {
+        cork_system_error_set();
+        fclose(fp);
+        cork_buffer_done(&buf);
+        return -1;
+    }
+
+    fclose(fp);
+    cork_buffer_append(&buf, "", 0);
+    rc = vrt_topology_load_string(topo, buf.buf);
+    cork_buffer_done(&buf);
+    return rc;
+}
+
+int
+vrt_topology_set(struct vrt_topology *topo, const char *section_name,
+                 const char *key, const char *value)
+{
+    struct vrt_topology_section  *section;
+
+    if (topo->built) {
+        vrt_topology_error("Topology has already been built");
+        return -1;
+    }
+
+    section = vrt_topology_find_section(topo, section_name);
+    if (section == NULL) {
+        vrt_topology_error("No section named %s", section_name);
+        return -1;
+    }
+
+    vrt_topology_section_set(section, key, value);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Building
+ */
+
+static struct vrt_value_type *
+vrt_topology_find_type(struct vrt_topology *topo, const char *name)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->types); i++) {
+        if (strcmp(cork_array_at(&topo->types, i).name, name) == 0) {
+            return cork_array_at(&topo->types, i).type;
+        }
+    }
+    return NULL;
+}
+
+static struct vrt_topology_handler *
+vrt_topology_find_handler(struct vrt_topology *topo, const char *name)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->handlers); i++) {
+        if (strcmp(cork_array_at(&topo->handlers, i).name, name) == 0) {
+            return &cork_array_at(&topo->handlers, i);
+        }
+    }
+    return NULL;
+}
+
+static int
+vrt_topology_build_queue(struct vrt_topology *topo,
+                         struct vrt_topology_section *section)
+{
+    const char  *type_name = vrt_topology_section_get(section, "type");
+    struct vrt_value_type  *type;
+    struct vrt_queue  *q;
+    unsigned int  size = 0;
+
+    if (type_name == NULL) {
+        vrt_topology_error
+            ("Queue %s (line %u) doesn't have a type",
+             section->name, section->line);
+        return -1;
+    }
+
+    type = vrt_topology_find_type(topo, type_name);
+    if (type == NULL) {
+        vrt_topology_error
+            ("Queue %s (line %u) uses unknown value type %s",
+             section->name, section->line, type_name);
+        return -1;
+    }
+
+    rii_check(vrt_topology_section_get_uint(section, "size", &size));
+    rip_check(q = vrt_queue_new(section->name, type, size));
+    cork_array_append(&topo->queues, q);
+    DEBUG("Built queue %s with %u values\n", q->name, vrt_queue_size(q));
+    return 0;
+}
+
+static int
+vrt_topology_build_client(struct vrt_topology *topo,
+                          struct vrt_topology_section *section)
+{
+    struct vrt_topology_client  *client;
+    struct vrt_yield_strategy  *yield;
+    struct vrt_queue  *q;
+    const char  *queue_name = vrt_topology_section_get(section, "queue");
+    const char  *yield_name = vrt_topology_section_get(section, "yield");
+    const char  *handler_name = vrt_topology_section_get(section, "handler");
+    unsigned int  batch_size = 0;
+    unsigned int  tick_usec = 0;
+    unsigned int  min_batch = 0;
+    unsigned int  batch_delay_usec = DEFAULT_BATCH_DELAY_USEC;
+    unsigned int  fuse_max_ns = DEFAULT_FUSE_MAX_NS;
+    const char  *fuse_name = vrt_topology_section_get(section, "fuse");
+    enum vrt_topology_fuse  fuse;
+    const char  *cpu_name;
+    unsigned int  cpu = UINT_MAX;
+
+    if (queue_name == NULL) {
+        vrt_topology_error
+            ("%s %s (line %u) doesn't have a queue",
+             vrt_topology_kind_titles[section->kind],
+             section->name, section->line);
+        return -1;
+    }
+
+    q = vrt_topology_queue(topo, queue_name);
+    if (q == NULL) {
+        vrt_topology_error
+            ("%s %s (line %u) uses unknown queue %s",
+             vrt_topology_kind_titles[section->kind],
+             section->name, section->line, queue_name);
+        return -1;
+    }
+
+    if (yield_name == NULL) {
+        yield_name = DEFAULT_YIELD_STRATEGY;
+    }
+
+    cpu_name = vrt_topology_section_get(section, "cpu");
+    if (cpu_name == NULL || strcmp(cpu_name, "auto") != 0) {
+        rii_check(vrt_topology_section_get_uint(section, "cpu", &cpu));
+    }
+    rii_check(vrt_topology_section_get_uint
+              (section, "batch_size", &batch_size));
+    rii_check(vrt_topology_section_get_uint
+              (section, "tick_usec", &tick_usec));
+    rii_check(vrt_topology_section_get_uint
+              (section, "min_batch", &min_batch));
+    rii_check(vrt_topology_section_get_uint
+              (section, "batch_delay_usec", &batch_delay_usec));
+    rii_check(vrt_topology_section_get_uint
+              (section, "fuse_max_ns", &fuse_max_ns));
+
+    if (fuse_name == NULL || strcmp(fuse_name, "no") == 0) {
+        fuse = VRT_TOPOLOGY_FUSE_NO;
+    } else if (strcmp(fuse_name, "yes") == 0) {
+        fuse = VRT_TOPOLOGY_FUSE_YES;
+    } else if (strcmp(fuse_name, "auto") == 0) {
+        fuse = VRT_TOPOLOGY_FUSE_AUTO;
+    } else {
+        vrt_topology_error
+            ("Invalid value \"%s\" for fuse in [consumer %s] (line %u)",
+             fuse_name, section->name, section->line);
+        return -1;
+    }
+
+    yield = vrt_yield_strategy_by_name(yield_name);
+    if (yield == NULL) {
+        vrt_topology_error
+            ("%s %s (line %u) uses unknown yield strategy %s",
+             vrt_topology_kind_titles[section->kind],
+             section->name, section->line, yield_name);
+        return -1;
+    }
+
+    client = cork_new(struct vrt_topology_client);
+    memset(client, 0, sizeof(struct vrt_topology_client));
+    cork_array_append(&topo->clients, client);
+    client->topology = topo;
+    client->section = section;
+    client->name = section->name;
+    client->cpu = (cpu == UINT_MAX)? -1: (int) cpu;
+    client->cpu_auto = (cpu_name != NULL && strcmp(cpu_name, "auto") == 0);
+    client->fuse = fuse;
+    client->fuse_max_ns = fuse_max_ns;
+
+    if (section->kind == VRT_TOPOLOGY_PRODUCER) {
+        client->producer = vrt_producer_new(section->name, batch_size, q);
+        if (client->producer == NULL) {
+            vrt_yield_strategy_free(yield);
+            return -1;
+        }
+        client->producer->yield = yield;
+    } else {
+        client->consumer = vrt_consumer_new(section->name, q);
+        if (client->consumer == NULL) {
+            vrt_yield_strategy_free(yield);
+            return -1;
+        }
+        client->consumer->yield = yield;
+        client->consumer->tick_interval = (uint64_t) tick_usec * 1000;
+        vrt_consumer_set_min_batch
+            (client->consumer, min_batch,
+             (uint64_t) batch_delay_usec * 1000);
+    }
+
+    if (handler_name != NULL) {
+        struct vrt_topology_handler  *handler =
+            vrt_topology_find_handler(topo, handler_name);
+        if (handler == NULL) {
+            vrt_topology_error
+                ("%s %s (line %u) uses unknown handler %s",
+                 vrt_topology_kind_titles[section->kind],
+                 section->name, section->line, handler_name);
+            return -1;
+        }
+        client->handler = handler->handler;
+        client->ud = handler->ud;
+    } else if (section->kind == VRT_TOPOLOGY_CONSUMER) {
+        vrt_topology_error
+            ("Consumer %s (line %u) doesn't have a handler",
+             section->name, section->line);
+        return -1;
+    }
+
+    DEBUG("Built %s %s on queue %s\n",
+          vrt_topology_kind_names[section->kind], client->name, q->name);
+    return 0;
+}
+
+static int
+vrt_topology_build_dependencies(struct vrt_topology *topo,
+                                struct vrt_topology_client *client)
+{
+    struct cork_buffer  buf = CORK_BUFFER_INIT();
+    const char  *depends =
+        vrt_topology_section_get(client->section, "depends");
+    char  *next;
+
+    if (depends == NULL) {
+        return 0;
+    }
+
+    cork_buffer_set_string(&buf, depends);
+    next = buf.buf;
+
+    while (*next != '\0') {
+        struct vrt_topology_client  *dep;
+        char  *name = next;
+
+        while (*next != '\0' && *next != ',' &&
+               !isspace((unsigned char) *next)) {
+            next++;
+        }
+        if (*next != '\0') {
+            *next++ = '\0';
+        }
+        while (*next == ',' || isspace((unsigned char) *next)) {
+            next++;
+        }
+
+        if (*name == '\0') {
+            continue;
+        }
+
+        dep = vrt_topology_client(topo, name);
+        if (dep == NULL || dep->consumer == NULL) {
+            vrt_topology_error
+                ("Consumer %s (line %u) depends on unknown consumer %s",
+                 client->name, client->section->line, name);
+            goto error;
+        }
+
+        if (dep == client) {
+            vrt_topology_error
+                ("Consumer %s (line %u) depends on itself",
+                 client->name, client->section->line);
+            goto error;
+        }
+
+        if (dep->consumer->queue != client->consumer->queue) {
+            vrt_topology_error
+                ("Consumer %s (line %u) depends on %s, "
+                 "which drains a different queue",
+                 client->name, client->section->line, name);
+            goto error;
+        }
+
+        vrt_consumer_add_dependency(client->consumer, dep->consumer);
+    }
+
+    cork_buffer_done(&buf);
+    return 0;
+
+error:
+    cork_buffer_done(&buf);
+    return -1;
+}
+
+/* Depth-first search for a dependency cycle that passes through
+ * consumer.  Each dependency chain is at most as long as the number of
+ * consumers on the queue, so we use that to bound the search. */
+static bool
+vrt_topology_has_cycle(struct vrt_consumer *start, struct vrt_consumer *c,
+                       size_t depth)
+{
+    size_t  i;
+    if (depth > cork_array_size(&start->queue->consumers)) {
+        return true;
+    }
+    for (i = 0; i < cork_array_size(&c->dependencies); i++) {
+        struct vrt_consumer  *dep = cork_array_at(&c->dependencies, i);
+        if (dep == start || vrt_topology_has_cycle(start, dep, depth + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Fuses a consumer onto the one consumer that it depends on, so that
+ * its handler runs right after that consumer's, in the same thread.
+ * Fused consumers form chains, each of which is led by a consumer that
+ * has a thread of its own. */
+static int
+vrt_topology_build_fusion(struct vrt_topology *topo,
+                          struct vrt_topology_client *client)
+{
+    struct vrt_consumer  *dep_consumer;
+    struct vrt_topology_client  *dep;
+
+    if (cork_array_size(&client->consumer->dependencies) != 1) {
+        vrt_topology_error
+            ("Consumer %s (line %u) can only be fused if it depends on "
+             "exactly one consumer",
+             client->name, client->section->line);
+        return -1;
+    }
+
+    if (client->consumer->tick_interval != 0) {
+        vrt_topology_error
+            ("Consumer %s (line %u) can't be fused, since it has ticks",
+             client->name, client->section->line);
+        return -1;
+    }
+
+    if (client->consumer->min_batch_size > 1) {
+        vrt_topology_error
+            ("Consumer %s (line %u) can't be fused, since it has a "
+             "minimum batch size",
+             client->name, client->section->line);
+        return -1;
+    }
+
+    dep_consumer = cork_array_at(&client->consumer->dependencies, 0);
+    dep = vrt_topology_client(topo, dep_consumer->name);
+    if (dep->fused_next != NULL) {
+        vrt_topology_error
+            ("Consumers %s and %s can't both be fused onto %s",
+             dep->fused_next->name, client->name, dep->name);
+        return -1;
+    }
+
+    DEBUG("Fusing %s onto %s\n", client->name, dep->name);
+    dep->fused_next = client;
+    client->fused_prev = dep;
+    return 0;
+}
+
+/* Whether a client will need a thread of its own when the topology
+ * starts, or might need one later on. */
+static bool
+vrt_topology_client_needs_thread(struct vrt_topology_client *client)
+{
+    return client->handler != NULL &&
+        client->fuse != VRT_TOPOLOGY_FUSE_YES;
+}
+
+static int
+vrt_topology_build_runtime(struct vrt_topology *topo,
+                           struct vrt_topology_section *section)
+{
+    struct vrt_topology_runtime  *runtime = &topo->runtime;
+    const char  *sched = vrt_topology_section_get(section, "sched");
+    const char  *cpus = vrt_topology_section_get(section, "cpus");
+    const char  *mlock = vrt_topology_section_get(section, "mlock");
+    unsigned int  priority = 0;
+
+    if (runtime->enabled) {
+        vrt_topology_error
+            ("Runtime %s (line %u) is the second runtime section",
+             section->name, section->line);
+        return -1;
+    }
+    runtime->enabled = true;
+
+    if (sched == NULL || strcmp(sched, "other") == 0) {
+        runtime->sched_policy = SCHED_OTHER;
+    } else if (strcmp(sched, "fifo") == 0) {
+        runtime->sched_policy = SCHED_FIFO;
+    } else if (strcmp(sched, "rr") == 0) {
+        runtime->sched_policy = SCHED_RR;
+    } else {
+        vrt_topology_error
+            ("Runtime %s (line %u) uses unknown scheduling policy %s",
+             section->name, section->line, sched);
+        return -1;
+    }
+
+    priority = sched_get_priority_min(runtime->sched_policy);
+    rii_check(vrt_topology_section_get_uint(section, "priority", &priority));
+    if ((int) priority < sched_get_priority_min(runtime->sched_policy) ||
+        (int) priority > sched_get_priority_max(runtime->sched_policy)) {
+        vrt_topology_error
+            ("Runtime %s (line %u) has invalid priority %u for %s",
+             section->name, section->line, priority,
+             (sched == NULL)? "other": sched);
+        return -1;
+    }
+    runtime->priority = priority;
+
+    if (cpus != NULL) {
+        int  rc;
+        if (strcmp(cpus, "isolated") == 0) {
+            rc = vrt_cpu_list_isolated(&runtime->cpus);
+        } else {
+            rc = vrt_cpu_list_parse(cpus, &runtime->cpus);
+        }
+        if (rc != 0 || cork_array_is_empty(&runtime->cpus)) {
+            vrt_topology_error
+                ("Runtime %s (line %u) has no usable CPUs in \"%s\"",
+                 section->name, section->line, cpus);
+            return -1;
+        }
+    }
+
+    if (mlock == NULL || strcmp(mlock, "no") == 0) {
+        runtime->mlock = false;
+    } else if (strcmp(mlock, "yes") == 0) {
+        runtime->mlock = true;
+    } else {
+        vrt_topology_error
+            ("Invalid value \"%s\" for mlock in [runtime %s] (line %u)",
+             mlock, section->name, section->line);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns the CPUs that the topology's clients can run on.  If the
+ * runtime names its CPUs, we take them as given, even if they're not in
+ * this process's affinity mask: CPUs that the kernel has isolated never
+ * are, but they're exactly where a runtime wants its clients to go. */
+static struct vrt_cpu_topology *
+vrt_topology_cpus(struct vrt_topology *topo)
+{
+    struct vrt_cpu_topology  *cpus;
+    if (cork_array_is_empty(&topo->runtime.cpus)) {
+        return vrt_cpu_topology_new(NULL);
+    }
+    cpus = vrt_cpu_topology_new_online(NULL);
+    vrt_cpu_topology_restrict(cpus, &topo->runtime.cpus);
+    return cpus;
+}
+
+/* Choose CPUs for the clients whose "cpu" key is "auto".  Clients are
+ * placed in the order that their sections appear, which is usually
+ * pipeline order.  If the runtime restricts clients to a set of CPUs,
+ * every client that isn't pinned already is placed within that set. */
+static int
+vrt_topology_place_clients(struct vrt_topology *topo)
+{
+    vrt_cpu_list  *allowed = &topo->runtime.cpus;
+    struct vrt_cpu_topology  *cpus;
+    struct vrt_topology_client  **clients;
+    bool  *spinning;
+    int  *placement;
+    size_t  count = 0;
+    size_t  i;
+
+    clients = cork_calloc(cork_array_size(&topo->clients),
+                          sizeof(struct vrt_topology_client *));
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (!vrt_topology_client_needs_thread(client)) {
+            continue;
+        }
+        if (!cork_array_is_empty(allowed) && client->cpu >= 0 &&
+            !vrt_cpu_list_contains(allowed, client->cpu)) {
+            vrt_topology_error
+                ("%s %s is pinned to CPU %d, which the runtime doesn't allow",
+                 vrt_topology_kind_titles[client->section->kind],
+                 client->name, client->cpu);
+            free(clients);
+            return -1;
+        }
+        if (client->cpu_auto ||
+            (!cork_array_is_empty(allowed) && client->cpu < 0)) {
+            clients[count++] = client;
+        }
+    }
+
+    if (count == 0) {
+        free(clients);
+        return 0;
+    }
+
+    spinning = cork_calloc(count, sizeof(bool));
+    placement = cork_calloc(count, sizeof(int));
+    for (i = 0; i < count; i++) {
+        struct vrt_yield_strategy  *yield = (clients[i]->producer != NULL)?
+            clients[i]->producer->yield: clients[i]->consumer->yield;
+        spinning[i] = !vrt_yield_strategy_blocks(yield);
+    }
+
+    cpus = vrt_topology_cpus(topo);
+    if (!cork_array_is_empty(allowed)) {
+        if (cork_array_is_empty(&cpus->cpus)) {
+            vrt_topology_error
+                ("None of the runtime's CPUs are online");
+            vrt_cpu_topology_free(cpus);
+            free(placement);
+            free(spinning);
+            free(clients);
+            return -1;
+        }
+    }
+
+    vrt_cpu_place(cpus, topo->cpu_policy, count, spinning, placement);
+    for (i = 0; i < count; i++) {
+        clients[i]->cpu = placement[i];
+        clients[i]->cpu_auto = true;
+        DEBUG("Placed %s on CPU %d\n", clients[i]->name, placement[i]);
+    }
+
+    vrt_cpu_topology_free(cpus);
+    free(placement);
+    free(spinning);
+    free(clients);
+    return 0;
+}
+
+/* A client whose yield strategy never sleeps (see
+ * vrt_yield_strategy_blocks) needs a core of its own: if it shares one
+ * with another client, it steals time from the client it's waiting for.
+ * With a real-time policy it can also starve the kernel's own threads
+ * on its CPU, which can lock up the machine, so a real-time client can
+ * only busy-wait on a CPU that the kernel has isolated.  In runtime
+ * mode we therefore only let a client busy-wait if it's pinned to a CPU
+ * in the runtime's CPU set (if there is one), no other client is pinned
+ * to the same physical core, and, for real-time policies, its CPU is
+ * isolated.  Any other such client falls back on the hybrid strategy,
+ * which eventually sleeps. */
+static void
+vrt_topology_check_spinning(struct vrt_topology *topo)
+{
+    struct vrt_cpu_topology  *cpus = vrt_topology_cpus(topo);
+    bool  realtime = (topo->runtime.sched_policy != SCHED_OTHER);
+    vrt_cpu_list  isolated;
+    size_t  i;
+    size_t  j;
+
+    cork_array_init(&isolated);
+    if (realtime && vrt_cpu_list_isolated(&isolated) != 0) {
+        /* No CPUs are isolated, so nothing can spin. */
+        cork_array_clear(&isolated);
+    }
+
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        struct vrt_yield_strategy  **yield = (client->producer != NULL)?
+            &client->producer->yield: &client->consumer->yield;
+        struct vrt_cpu  *cpu;
+        bool  dedicated;
+
+        if (!vrt_topology_client_needs_thread(client) ||
+            vrt_yield_strategy_blocks(*yield)) {
+            continue;
+        }
+
+        cpu = (client->cpu < 0)? NULL:
+            vrt_cpu_topology_get(cpus, client->cpu);
+        dedicated = (cpu != NULL);
+        if (realtime && !vrt_cpu_list_contains(&isolated, client->cpu)) {
+            dedicated = false;
+        }
+
+        for (j = 0; dedicated && j < cork_array_size(&topo->clients); j++) {
+            struct vrt_topology_client  *other =
+                cork_array_at(&topo->clients, j);
+            struct vrt_cpu  *other_cpu;
+            if (other == client ||
+                !vrt_topology_client_needs_thread(other)) {
+                continue;
+            }
+            other_cpu = vrt_cpu_topology_get(cpus, other->cpu);
+            /* An unpinned client could land anywhere. */
+            if (other->cpu < 0 || other->cpu == client->cpu ||
+                (other_cpu != NULL && other_cpu->core == cpu->core)) {
+                dedicated = false;
+            }
+        }
+
+        if (!dedicated) {
+            DEBUG("%s doesn't have a dedicated core; not busy-waiting\n",
+                  client->name);
+            vrt_yield_strategy_free(*yield);
+            *yield = vrt_yield_strategy_hybrid();
+            client->yield_fallback = true;
+        }
+    }
+
+    cork_array_done(&isolated);
+    vrt_cpu_topology_free(cpus);
+}
+
+int
+vrt_topology_build(struct vrt_topology *topo)
+{
+    size_t  i;
+
+    if (topo->built) {
+        return 0;
+    }
+
+    for (i = 0; i < cork_array_size(&topo->sections); i++) {
+        rii_check(vrt_topology_section_check_keys
+                  (cork_array_at(&topo->sections, i)));
+    }
+
+    for (i = 0; i < cork_array_size(&topo->sections); i++) {
+        struct vrt_topology_section  *section =
+            cork_array_at(&topo->sections, i);
+        if (section->kind == VRT_TOPOLOGY_QUEUE) {
+            rii_check(vrt_topology_build_queue(topo, section));
+        } else if (section->kind == VRT_TOPOLOGY_RUNTIME) {
+            rii_check(vrt_topology_build_runtime(topo, section));
+        }
+    }
+
+    for (i = 0; i < cork_array_size(&topo->sections); i++) {
+        struct vrt_topology_section  *section =
+            cork_array_at(&topo->sections, i);
+        if (section->kind == VRT_TOPOLOGY_PRODUCER ||
+            section->kind == VRT_TOPOLOGY_CONSUMER) {
+            rii_check(vrt_topology_build_client(topo, section));
+        }
+    }
+
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (client->consumer != NULL) {
+            rii_check(vrt_topology_build_dependencies(topo, client));
+        }
+    }
+
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (client->consumer != NULL &&
+            vrt_topology_has_cycle(client->consumer, client->consumer, 0)) {
+            vrt_topology_error
+                ("Consumer %s is part of a dependency cycle", client->name);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (client->consumer != NULL &&
+            client->fuse != VRT_TOPOLOGY_FUSE_NO) {
+            rii_check(vrt_topology_build_fusion(topo, client));
+        }
+    }
+
+    /* The consumer at the head of each chain moves the cursors of the
+     * rest of the chain along with its own. */
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        struct vrt_topology_client  *next;
+        if (client->fused_prev != NULL) {
+            continue;
+        }
+        for (next = client->fused_next; next != NULL;
+             next = next->fused_next) {
+            vrt_consumer_add_follower(client->consumer, next->consumer);
+        }
+    }
+
+    /* Every queue needs at least one producer and one consumer, or its
+     * clients would wait forever.  Consumers that have the same
+     * dependencies share a barrier. */
+    for (i = 0; i < cork_array_size(&topo->queues); i++) {
+        struct vrt_queue  *q = cork_array_at(&topo->queues, i);
+        if (cork_array_is_empty(&q->producers)) {
+            vrt_topology_error("Queue %s doesn't have any producers",
+                               q->name);
+            return -1;
+        }
+        if (cork_array_is_empty(&q->consumers)) {
+            vrt_topology_error("Queue %s doesn't have any consumers",
+                               q->name);
+            return -1;
+        }
+        vrt_queue_share_barriers(q);
+    }
+
+    rii_check(vrt_topology_place_clients(topo));
+    if (topo->runtime.enabled) {
+        vrt_topology_check_spinning(topo);
+    }
+    topo->built = true;
+    return 0;
+}
+
+int
+vrt_topology_set_cpu_policy(struct vrt_topology *topo,
+                            enum vrt_cpu_policy policy)
+{
+    if (topo->built) {
+        vrt_topology_error("Topology has already been built");
+        return -1;
+    }
+    topo->cpu_policy = policy;
+    return 0;
+}
+
+void
+vrt_topology_report_placement(struct vrt_topology *topo, FILE *out)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (client->handler == NULL) {
+            continue;
+        }
+        if (client->fused_prev != NULL) {
+            fprintf(out, "%-20s fused onto %s\n",
+                    client->name, client->fused_prev->name);
+        } else if (client->cpu >= 0) {
+            fprintf(out, "%-20s cpu %d%s\n", client->name, client->cpu,
+                    client->cpu_auto? " (auto)": "");
+        } else {
+            fprintf(out, "%-20s unpinned\n", client->name);
+        }
+        if (client->yield_fallback) {
+            fprintf(out, "%-20s no dedicated core; using hybrid "
+                    "instead of busy-waiting\n", client->name);
+        }
+    }
+}
+
+
+void
+vrt_topology_report_stages(struct vrt_topology *topo, FILE *out)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (client->consumer == NULL) {
+            continue;
+        }
+        fprintf(out, "%-20s %12" PRIu64 " values %8" PRIu64 " ns/value",
+                client->name, client->stats.value_count,
+                vrt_topology_client_cost(client));
+        if (client->fused_prev != NULL) {
+            fprintf(out, " (fused onto %s)", client->fused_prev->name);
+        } else if (client->fuse == VRT_TOPOLOGY_FUSE_AUTO) {
+            fprintf(out, " (unfused)");
+        }
+        fprintf(out, "\n");
+    }
+}
+
+uint64_t
+vrt_topology_client_cost(struct vrt_topology_client *client)
+{
+    if (client->stats.sample_count == 0) {
+        return 0;
+    }
+    return client->stats.sample_ns / client->stats.sample_count;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Running
+ */
+
+static int
+vrt_topology_run_producer(struct vrt_topology_client *client)
+{
+    struct vrt_producer  *p = client->producer;
+    while (true) {
+        struct vrt_value  *value;
+        int  rc;
+
+        rii_check(vrt_producer_claim(p, &value));
+        rc = client->handler(client, 0, value);
+        if (rc == 0) {
+            rii_check(vrt_producer_publish(p));
+        } else if (rc == VRT_QUEUE_FLUSH) {
+            rii_check(vrt_producer_skip(p));
+            rii_check(vrt_producer_flush(p));
+        } else if (rc == VRT_QUEUE_EOF) {
+            rii_check(vrt_producer_skip(p));
+            return vrt_producer_eof(p);
+        } else {
+            return rc;
+        }
+    }
+}
+
+static uint64_t
+vrt_topology_now(void)
+{
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Passes a value to a consumer's handler, timing one call out of every
+ * VRT_TOPOLOGY_SAMPLE_INTERVAL. */
+static int
+vrt_topology_run_stage(struct vrt_topology_client *client,
+                       struct vrt_value *value)
+{
+    struct vrt_topology_stage_stats  *stats = &client->stats;
+    if (stats->value_count++ % VRT_TOPOLOGY_SAMPLE_INTERVAL == 0) {
+        uint64_t  start = vrt_topology_now();
+        rii_check(client->handler(client, 0, value));
+        stats->sample_ns += vrt_topology_now() - start;
+        stats->sample_count++;
+        return 0;
+    } else {
+        return client->handler(client, 0, value);
+    }
+}
+
+/* Passes a value or event to each consumer in a fused chain, in order. */
+static int
+vrt_topology_run_chain(struct vrt_topology_client *client, int event,
+                       struct vrt_value *value)
+{
+    for (; client != NULL; client = client->fused_next) {
+        if (event == 0) {
+            rii_check(vrt_topology_run_stage(client, value));
+        } else {
+            rii_check(client->handler(client, event, NULL));
+        }
+    }
+    return 0;
+}
+
+static int
+vrt_topology_start_client(struct vrt_topology *topo,
+                          struct vrt_topology_client *client);
+
+/* Moves an automatically fused consumer, along with the rest of its
+ * chain, into a thread of its own.  This runs in the thread of the
+ * chain's head, between two values, so the consumer has already
+ * processed every value that the head has. */
+static int
+vrt_topology_unfuse(struct vrt_topology_client *head,
+                    struct vrt_topology_client *client)
+{
+    struct vrt_consumer  *hc = head->consumer;
+    struct vrt_consumer  *c = client->consumer;
+    struct vrt_topology_client  *next;
+
+    DEBUG("Unfusing %s from %s (%" PRIu64 " ns per value)\n",
+          client->name, client->fused_prev->name,
+          vrt_topology_client_cost(client));
+    client->fused_prev->fused_next = NULL;
+    client->fused_prev = NULL;
+
+    cork_array_clear(&hc->followers);
+    for (next = head->fused_next; next != NULL; next = next->fused_next) {
+        vrt_consumer_add_follower(hc, next->consumer);
+    }
+    for (next = client->fused_next; next != NULL; next = next->fused_next) {
+        vrt_consumer_add_follower(c, next->consumer);
+    }
+
+    /* Pick up where the head left off. */
+    c->current_id = hc->current_id;
+    c->last_available_id = hc->current_id;
+    c->eof_count = hc->eof_count;
+    return vrt_topology_start_client(head->topology, client);
+}
+
+/* Once we've timed enough of an automatically fused consumer's values,
+ * decide whether it's cheap enough to stay fused.  The head calls this
+ * once per VRT_TOPOLOGY_SAMPLE_INTERVAL values, so each consumer is
+ * only considered once. */
+static int
+vrt_topology_check_fusion(struct vrt_topology_client *head)
+{
+    struct vrt_topology_client  *client;
+    for (client = head->fused_next; client != NULL;
+         client = client->fused_next) {
+        if (client->fuse == VRT_TOPOLOGY_FUSE_AUTO &&
+            client->stats.sample_count == FUSE_DECISION_SAMPLES &&
+            vrt_topology_client_cost(client) > client->fuse_max_ns) {
+            return vrt_topology_unfuse(head, client);
+        }
+    }
+    return 0;
+}
+
+static int
+vrt_topology_run_consumer(struct vrt_topology_client *client)
+{
+    struct vrt_consumer  *c = client->consumer;
+    struct vrt_value  *value;
+    int  rc;
+
+    /* Start the tick clock now, rather than when the topology was
+     * built. */
+    vrt_consumer_set_tick(c, c->tick_interval);
+
+    while ((rc = vrt_consumer_next(c, &value)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            rii_check(vrt_topology_run_chain(client, 0, value));
+            if (client->fused_next != NULL &&
+                client->stats.value_count % VRT_TOPOLOGY_SAMPLE_INTERVAL
+                == 1) {
+                rii_check(vrt_topology_check_fusion(client));
+            }
+        } else if (rc == VRT_QUEUE_FLUSH) {
+            rii_check(vrt_topology_run_chain(client, rc, NULL));
+        } else if (rc == VRT_QUEUE_TICK) {
+            /* Fused consumers can't have ticks of their own. */
+            rii_check(client->handler(client, rc, NULL));
+        } else {
+            return rc;
+        }
+    }
+
+    return vrt_topology_run_chain(client, VRT_QUEUE_EOF, NULL);
+}
+
+static void *
+vrt_topology_client_thread(void *ud)
+{
+    struct vrt_topology_client  *client = ud;
+    DEBUG("Starting %s\n", client->name);
+    if (client->producer != NULL) {
+        client->result = vrt_topology_run_producer(client);
+    } else {
+        client->result = vrt_topology_run_consumer(client);
+    }
+    if (client->result == VRT_QUEUE_CANCELLED) {
+        /* Stopping because of vrt_topology_cancel isn't a failure. */
+        client->result = 0;
+    }
+    DEBUG("Finished %s (%d)\n", client->name, client->result);
+    return NULL;
+}
+
+/* Fills in the attributes for a client's thread, so that the thread is
+ * pinned and has the runtime's scheduling policy from its very first
+ * instruction, rather than running unpinned until we get around to
+ * fixing it up. */
+static int
+vrt_topology_thread_attr(struct vrt_topology *topo,
+                         struct vrt_topology_client *client,
+                         pthread_attr_t *attr)
+{
+    int  rc;
+
+    if (client->cpu >= 0) {
+#if defined(__linux__)
+        cpu_set_t  cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(client->cpu, &cpus);
+        rc = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+        if (rc != 0) {
+            vrt_topology_error
+                ("Cannot pin %s to CPU %d: %s",
+                 client->name, client->cpu, strerror(rc));
+            return -1;
+        }
+#else
+        vrt_topology_error
+            ("Cannot pin %s to CPU %d: not supported on this platform",
+             client->name, client->cpu);
+        return -1;
+#endif
+    }
+
+    if (topo->runtime.sched_policy != SCHED_OTHER) {
+        struct sched_param  param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = topo->runtime.priority;
+        if ((rc = pthread_attr_setinheritsched
+             (attr, PTHREAD_EXPLICIT_SCHED)) != 0 ||
+            (rc = pthread_attr_setschedpolicy
+             (attr, topo->runtime.sched_policy)) != 0 ||
+            (rc = pthread_attr_setschedparam(attr, &param)) != 0) {
+            vrt_topology_error
+                ("Cannot set scheduling policy of %s: %s",
+                 client->name, strerror(rc));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+vrt_topology_start_client(struct vrt_topology *topo,
+                          struct vrt_topology_client *client)
+{
+    pthread_attr_t  attr;
+    int  rc;
+
+    pthread_attr_init(&attr);
+    if (vrt_topology_thread_attr(topo, client, &attr) != 0) {
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+
+    /* If the affinity or scheduling policy can't be applied (usually
+     * because we don't have the privileges for a real-time policy),
+     * pthread_create fails, and the client never starts. */
+    pthread_mutex_lock(&topo->lock);
+    rc = pthread_create(&client->thread, &attr,
+                        vrt_topology_client_thread, client);
+    client->started = (rc == 0);
+    pthread_mutex_unlock(&topo->lock);
+    pthread_attr_destroy(&attr);
+
+    if (rc != 0) {
+        vrt_topology_error
+            ("Cannot start %s: %s", client->name, strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+int
+vrt_topology_start(struct vrt_topology *topo)
+{
+    size_t  i;
+
+    if (topo->running) {
+        vrt_topology_error("Topology is already running");
+        return -1;
+    }
+
+    rii_check(vrt_topology_build(topo));
+
+    if (topo->runtime.mlock &&
+        mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        vrt_topology_error("Cannot lock memory: %s", strerror(errno));
+        return -1;
+    }
+
+    topo->running = true;
+
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+
+        /* Fused consumers start out in the thread of their chain's head.
+         * (We can't look at fused_prev, since the head's thread might
+         * have already unfused the consumer.) */
+        if (client->handler == NULL ||
+            client->fuse != VRT_TOPOLOGY_FUSE_NO) {
+            continue;
+        }
+
+        /* If this fails, the clients that we've already started are
+         * left running; the caller must still call vrt_topology_join. */
+        rii_check(vrt_topology_start_client(topo, client));
+    }
+
+    return 0;
+}
+
+int
+vrt_topology_join(struct vrt_topology *topo)
+{
+    struct vrt_topology_client  *failed = NULL;
+    size_t  i;
+
+    if (!topo->running) {
+        vrt_topology_error("Topology isn't running");
+        return -1;
+    }
+
+    /* A running thread can start another one at any time, by unfusing a
+     * consumer, so keep going until there aren't any threads left. */
+    while (true) {
+        struct vrt_topology_client  *client = NULL;
+
+        pthread_mutex_lock(&topo->lock);
+        for (i = 0; i < cork_array_size(&topo->clients); i++) {
+            if (cork_array_at(&topo->clients, i)->started) {
+                client = cork_array_at(&topo->clients, i);
+                client->started = false;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&topo->lock);
+
+        if (client == NULL) {
+            break;
+        }
+        pthread_join(client->thread, NULL);
+        if (client->result != 0 && failed == NULL) {
+            failed = client;
+        }
+    }
+
+    topo->running = false;
+
+    if (failed != NULL) {
+        vrt_topology_error
+            ("Client %s failed with result %d", failed->name, failed->result);
+        return -1;
+    }
+    return 0;
+}
+
+void
+vrt_topology_cancel(struct vrt_topology *topo)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->queues); i++) {
+        vrt_queue_cancel(cork_array_at(&topo->queues, i));
+    }
+}
+
+int
+vrt_topology_run(struct vrt_topology *topo)
+{
+    int  rc = vrt_topology_start(topo);
+    if (topo->running) {
+        /* Even if we couldn't start every client, wait for the ones
+         * that did start. */
+        int  join_rc = vrt_topology_join(topo);
+        if (rc == 0) {
+            rc = join_rc;
+        }
+    }
+    return rc;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lookups
+ */
+
+struct vrt_queue *
+vrt_topology_queue(struct vrt_topology *topo, const char *name)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->queues); i++) {
+        struct vrt_queue  *q = cork_array_at(&topo->queues, i);
+        if (strcmp(q->name, name) == 0) {
+            return q;
+        }
+    }
+    return NULL;
+}
+
+struct vrt_topology_client *
+vrt_topology_client(struct vrt_topology *topo, const char *name)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (strcmp(client->name, name) == 0) {
+            return client;
+        }
+    }
+    return NULL;
+}
+
+struct vrt_producer *
+vrt_topology_producer(struct vrt_topology *topo, const char *name)
+{
+    struct vrt_topology_client  *client = vrt_topology_client(topo, name);
+    return (client == NULL)? NULL: client->producer;
+}
+
+const char *
+vrt_topology_client_param(struct vrt_topology_client *client,
+                          const char *name, const char *default_value)
+{
+    size_t  prefix_length = strlen(PARAM_PREFIX);
+    size_t  i;
+    for (i = 0; i < cork_array_size(&client->section->entries); i++) {
+        struct vrt_topology_entry  *entry =
+            &cork_array_at(&client->section->entries, i);
+        if (strncmp(entry->key, PARAM_PREFIX, prefix_length) == 0 &&
+            strcmp(entry->key + prefix_length, name) == 0) {
+            return entry->value;
+        }
+    }
+    return default_value;
+}
+
+long
+vrt_topology_client_param_long(struct vrt_topology_client *client,
+                               const char *name, long default_value)
+{
+    const char  *value = vrt_topology_client_param(client, name, NULL);
+    char  *end;
+    long  result;
+
+    if (value == NULL) {
+        return default_value;
+    }
+
+    result = strtol(value, &end, 10);
+    if (value[0] == '\0' || *end != '\0') {
+        return default_value;
+    }
+    return result;
+}
@@ -8,10 +8,23 @@
  * ----------------------------------------------------------------------
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #include <libcork/core.h>
 
+#include "vrt/cpu.h"
 #include "vrt/yield.h"
 
 
@@ -51,6 +64,101 @@
 #endif
 
 
+/*-----------------------------------------------------------------------
+ * CPU budget
+ */
+
+/* The threaded, hybrid, and UMWAIT strategies all spin for a while
+ * before giving up the CPU.  That's only worthwhile if each waiting
+ * client has a CPU to itself.  In a container with a CPU quota,
+ * spinning burns quota that the clients doing real work need, and once
+ * it's gone the whole cgroup stalls until the next period.  So we keep
+ * track of how many clients are using these strategies, and when they
+ * outnumber the CPU budget, each client spins for proportionally less
+ * time and moves on to sleeping sooner. */
+
+static double  cpu_budget = 0;
+static volatile int  client_count = 0;
+
+void
+vrt_yield_strategy_set_cpu_budget(double budget)
+{
+    cpu_budget = budget;
+}
+
+double
+vrt_yield_strategy_cpu_budget(void)
+{
+    /* It doesn't matter if two threads race to fill this in. */
+    if (cpu_budget <= 0) {
+        cpu_budget = vrt_cpu_budget();
+    }
+    return cpu_budget;
+}
+
+#define vrt_yield_client_added()  __sync_add_and_fetch(&client_count, 1)
+#define vrt_yield_client_removed()  __sync_sub_and_fetch(&client_count, 1)
+
+/* Returns the fraction of its usual spinning that each client can
+ * afford: 1 if every client has a CPU of its own, less if the clients
+ * oversubscribe the budget. */
+static double
+vrt_yield_spin_fraction(void)
+{
+    double  budget = vrt_yield_strategy_cpu_budget();
+    int  clients = client_count;
+    return (clients <= budget)? 1.0: budget / clients;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Alerts
+ */
+
+/* A client that has been waiting for a while sleeps for longer and
+ * longer intervals, which would keep it from noticing that its queue
+ * has been cancelled for tens of milliseconds.  So instead of calling
+ * usleep, we sleep on a process-wide alert word, and
+ * vrt_yield_strategy_alert bumps the word to wake every sleeping client
+ * at once.  A client reads the word when it starts waiting, and again
+ * after each step of the wait, and checks its queue after that, so it
+ * can't miss an alert that arrives just before it goes to sleep. */
+
+static volatile int  alert_epoch = 0;
+
+static int
+vrt_yield_alert_epoch(void)
+{
+    return alert_epoch;
+}
+
+static void
+vrt_yield_sleep(int epoch, unsigned int usec)
+{
+#if defined(__linux__)
+    struct timespec  ts;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    syscall(SYS_futex, &alert_epoch, FUTEX_WAIT_PRIVATE, epoch, &ts,
+            NULL, 0);
+#else
+    if (epoch == alert_epoch) {
+        usleep(usec);
+    }
+#endif
+}
+
+void
+vrt_yield_strategy_alert(void)
+{
+    __sync_add_and_fetch(&alert_epoch, 1);
+#if defined(__linux__)
+    syscall(SYS_futex, &alert_epoch, FUTEX_WAKE_PRIVATE, INT_MAX,
+            NULL, NULL, 0);
+#endif
+}
+
+
 /*-----------------------------------------------------------------------
  * Thread yielding strategy
  */
@@ -65,6 +173,7 @@ vrt_thread_yield_free(struct vrt_yield_strategy *vys)
 {
     struct vrt_thread_yield_strategy  *ys =
         cork_container_of(vys, struct vrt_thread_yield_strategy, parent);
+    vrt_yield_client_removed();
     free(ys);
 }
 
@@ -76,7 +185,7 @@ vrt_thread_yield(struct vrt_yield_strategy *vys, bool first,
         cork_container_of(vys, struct vrt_thread_yield_strategy, parent);
 
     if (first) {
-        ys->counter = SPIN_COUNT_BEFORE_YIELDING;
+        ys->counter = SPIN_COUNT_BEFORE_YIELDING * vrt_yield_spin_fraction();
     } else {
         if (ys->counter == 0) {
             DEBUG("[%s] %s: Yielding to other threads\n", queue_name, name);
@@ -97,6 +206,8 @@ vrt_yield_strategy_threaded(void)
         cork_new(struct vrt_thread_yield_strategy);
     vs->parent.yield = vrt_thread_yield;
     vs->parent.free = vrt_thread_yield_free;
+    vs->parent.wait = NULL;
+    vrt_yield_client_added();
     return &vs->parent;
 }
 
@@ -123,7 +234,8 @@ vrt_spin_wait_free(struct vrt_yield_strategy *vys)
 
 static const struct vrt_yield_strategy  vrt_spin_wait_strategy = {
     vrt_spin_wait_yield,
-    vrt_spin_wait_free
+    vrt_spin_wait_free,
+    NULL
 };
 
 struct vrt_yield_strategy *
@@ -137,9 +249,14 @@ vrt_yield_strategy_spin_wait(void)
  * Hybrid yielding strategy
  */
 
+#define HYBRID_SPIN_STEPS  20
+#define HYBRID_SLEEP_STEP  24
+
 struct vrt_hybrid_yield_strategy {
     struct vrt_yield_strategy  parent;
     int  counter;
+    bool  oversubscribed;
+    int  epoch;
 };
 
 static void
@@ -147,40 +264,71 @@ vrt_hybrid_yield_free(struct vrt_yield_strategy *vys)
 {
     struct vrt_hybrid_yield_strategy  *ys =
         cork_container_of(vys, struct vrt_hybrid_yield_strategy, parent);
+    vrt_yield_client_removed();
     free(ys);
 }
 
-static int
-vrt_hybrid_yield(struct vrt_yield_strategy *vys, bool first,
-                     const char *queue_name, const char *name)
+/* Start a new wait.  If the clients oversubscribe the CPU budget, we
+ * skip some of the spin-waits.  The first call counts as a step of its
+ * own, as it always has. */
+static void
+vrt_hybrid_start(struct vrt_hybrid_yield_strategy *ys)
+{
+    double  fraction = vrt_yield_spin_fraction();
+    ys->epoch = vrt_yield_alert_epoch();
+    ys->oversubscribed = (fraction < 1.0);
+    ys->counter = HYBRID_SPIN_STEPS - (int) (HYBRID_SPIN_STEPS * fraction);
+    ys->counter++;
+}
+
+static void
+vrt_hybrid_step(struct vrt_hybrid_yield_strategy *ys)
 {
     /* Adapted from
      * http://www.1024cores.net/home/lock-free-algorithms/tricks/spinning */
-    struct vrt_hybrid_yield_strategy  *ys =
-        cork_container_of(vys, struct vrt_hybrid_yield_strategy, parent);
-
-    if (first) {
-        ys->counter = 0;
-    } else if (ys->counter < 10) {
+    if (ys->counter < 10) {
         /* Spin-wait */
         PAUSE();
-    } else if (ys->counter < 20) {
+    } else if (ys->counter < HYBRID_SPIN_STEPS) {
         /* A more intense spin-wait */
         int  i;
         for (i = 0; i < 50; i++) {
             PAUSE();
         }
+    } else if (ys->oversubscribed && ys->counter < HYBRID_SLEEP_STEP) {
+        /* A thread that yields (or sleeps for 0 usec) still counts
+         * against the CPU quota, so go straight to sleeping. */
+        ys->counter = HYBRID_SLEEP_STEP;
+        vrt_yield_sleep(ys->epoch, 1);
     } else if (ys->counter < 22) {
         THREAD_YIELD();
-    } else if (ys->counter < 24) {
+    } else if (ys->counter < HYBRID_SLEEP_STEP) {
         usleep(0);
     } else if (ys->counter < 26) {
-        usleep(1);
+        vrt_yield_sleep(ys->epoch, 1);
     } else {
-        usleep((ys->counter - 25) * 10);
+        vrt_yield_sleep(ys->epoch, (ys->counter - 25) * 10);
     }
 
+    /* An alert for some other queue leaves our epoch stale, and a futex
+     * wait on a stale epoch returns right away, so pick up the current
+     * one.  Our caller checks its queue again after this, so an alert
+     * that's meant for us still can't slip by. */
+    ys->epoch = vrt_yield_alert_epoch();
     ys->counter++;
+}
+
+static int
+vrt_hybrid_yield(struct vrt_yield_strategy *vys, bool first,
+                     const char *queue_name, const char *name)
+{
+    struct vrt_hybrid_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_hybrid_yield_strategy, parent);
+    if (first) {
+        vrt_hybrid_start(ys);
+    } else {
+        vrt_hybrid_step(ys);
+    }
     return 0;
 }
 
@@ -191,5 +339,219 @@ vrt_yield_strategy_hybrid(void)
         cork_new(struct vrt_hybrid_yield_strategy);
     vs->parent.yield = vrt_hybrid_yield;
     vs->parent.free = vrt_hybrid_yield_free;
+    vs->parent.wait = NULL;
+    vrt_yield_client_added();
     return &vs->parent;
 }
+
+
+/*-----------------------------------------------------------------------
+ * UMWAIT yielding strategy
+ */
+
+/* UMONITOR arms address monitoring on the cache line containing an
+ * address; UMWAIT then sleeps until that line is written, an interrupt
+ * arrives, or a TSC deadline passes; TPAUSE sleeps until the deadline
+ * without monitoring anything.  Control bit 0 selects the lighter C0.1
+ * state, which wakes up faster than C0.2.  The kernel also caps each
+ * sleep (IA32_UMWAIT_CONTROL, 100000 cycles by default on Linux).  We
+ * encode the instructions by hand so that we don't need an assembler
+ * that knows about them. */
+
+#define UMWAIT_C0_1  1
+#define UMWAIT_DEADLINE_CYCLES  100000
+#define UMWAIT_SPIN_COUNT  10
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <cpuid.h>
+#define HAVE_UMWAIT  1
+
+static inline uint64_t
+vrt_rdtsc(void)
+{
+    uint32_t  lo;
+    uint32_t  hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+static inline void
+vrt_umonitor(volatile void *addr)
+{
+    /* umonitor %rax */
+    __asm__ __volatile__ (".byte 0xf3, 0x0f, 0xae, 0xf0"
+                          : : "a" (addr) : "memory");
+}
+
+static inline void
+vrt_umwait(uint64_t deadline)
+{
+    /* umwait %ecx */
+    __asm__ __volatile__ (".byte 0xf2, 0x0f, 0xae, 0xf1"
+                          : : "c" (UMWAIT_C0_1),
+                              "a" ((uint32_t) deadline),
+                              "d" ((uint32_t) (deadline >> 32))
+                          : "cc", "memory");
+}
+
+static inline void
+vrt_tpause(uint64_t deadline)
+{
+    /* tpause %ecx */
+    __asm__ __volatile__ (".byte 0x66, 0x0f, 0xae, 0xf1"
+                          : : "c" (UMWAIT_C0_1),
+                              "a" ((uint32_t) deadline),
+                              "d" ((uint32_t) (deadline >> 32))
+                          : "cc", "memory");
+}
+
+bool
+vrt_yield_strategy_umwait_available(void)
+{
+    unsigned int  eax;
+    unsigned int  ebx;
+    unsigned int  ecx;
+    unsigned int  edx;
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    /* CPUID.(EAX=7,ECX=0):ECX[bit 5] is WAITPKG */
+    return (ecx & (1 << 5)) != 0;
+}
+
+#else
+#define HAVE_UMWAIT  0
+
+bool
+vrt_yield_strategy_umwait_available(void)
+{
+    return false;
+}
+
+#endif
+
+#if HAVE_UMWAIT
+/* A core in UMWAIT still counts against a CPU quota, so if the clients
+ * oversubscribe the CPU budget, we sleep the same way that the hybrid
+ * strategy does. */
+struct vrt_umwait_yield_strategy {
+    struct vrt_yield_strategy  parent;
+    int  counter;
+    struct vrt_hybrid_yield_strategy  hybrid;
+};
+
+static void
+vrt_umwait_yield_free(struct vrt_yield_strategy *vys)
+{
+    struct vrt_umwait_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_umwait_yield_strategy, parent);
+    vrt_yield_client_removed();
+    free(ys);
+}
+
+/* Used when the queue can't tell us which cursor it's waiting on, so
+ * there's nothing to monitor.  We just sleep for a short while. */
+static int
+vrt_umwait_yield(struct vrt_yield_strategy *vys, bool first,
+                 const char *queue_name, const char *name)
+{
+    struct vrt_umwait_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_umwait_yield_strategy, parent);
+    if (first) {
+        ys->counter = 0;
+        vrt_hybrid_start(&ys->hybrid);
+    } else if (ys->hybrid.oversubscribed) {
+        vrt_hybrid_step(&ys->hybrid);
+    } else if (ys->counter++ < UMWAIT_SPIN_COUNT) {
+        PAUSE();
+    } else {
+        vrt_tpause(vrt_rdtsc() + UMWAIT_DEADLINE_CYCLES);
+    }
+    return 0;
+}
+
+static int
+vrt_umwait_wait(struct vrt_yield_strategy *vys, bool first,
+                volatile int *addr, int expected,
+                const char *queue_name, const char *name)
+{
+    struct vrt_umwait_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_umwait_yield_strategy, parent);
+
+    if (first) {
+        ys->counter = 0;
+        vrt_hybrid_start(&ys->hybrid);
+        return 0;
+    }
+
+    if (ys->hybrid.oversubscribed) {
+        vrt_hybrid_step(&ys->hybrid);
+        return 0;
+    }
+
+    /* A short spin first, since the value often arrives right away. */
+    if (ys->counter++ < UMWAIT_SPIN_COUNT) {
+        PAUSE();
+        return 0;
+    }
+
+    /* Arm the monitor, and then check the cursor again before we go to
+     * sleep, in case it was written after our caller last looked. */
+    vrt_umonitor(addr);
+    if (*addr == expected) {
+        DEBUG("[%s] %s: Waiting for cursor to move past %d\n",
+              queue_name, name, expected);
+        vrt_umwait(vrt_rdtsc() + UMWAIT_DEADLINE_CYCLES);
+    }
+    return 0;
+}
+#endif
+
+struct vrt_yield_strategy *
+vrt_yield_strategy_umwait(void)
+{
+#if HAVE_UMWAIT
+    if (vrt_yield_strategy_umwait_available()) {
+        struct vrt_umwait_yield_strategy  *vs =
+            cork_new(struct vrt_umwait_yield_strategy);
+        vs->parent.yield = vrt_umwait_yield;
+        vs->parent.free = vrt_umwait_yield_free;
+        vs->parent.wait = vrt_umwait_wait;
+        vrt_yield_client_added();
+        return &vs->parent;
+    }
+#endif
+    DEBUG("UMWAIT isn't available; using the hybrid strategy\n");
+    return vrt_yield_strategy_hybrid();
+}
+
+
+/*-----------------------------------------------------------------------
+ * Strategies by name
+ */
+
+struct vrt_yield_strategy *
+vrt_yield_strategy_by_name(const char *name)
+{
+    if (strcmp(name, "spin") == 0) {
+        return vrt_yield_strategy_spin_wait();
+    } else if (strcmp(name, "threaded") == 0) {
+        return vrt_yield_strategy_threaded();
+    } else if (strcmp(name, "hybrid") == 0) {
+        return vrt_yield_strategy_hybrid();
+    } else if (strcmp(name, "umwait") == 0) {
+        return vrt_yield_strategy_umwait();
+    } else {
+        return NULL;
+    }
+}
+
+bool
+vrt_yield_strategy_blocks(struct vrt_yield_strategy *self)
+{
+    /* sched_yield only lets threads of the same priority run, and UMWAIT
+     * keeps the core to itself unless the process is oversubscribed, so
+     * only the hybrid strategy is guaranteed to sleep. */
+    return self->yield == vrt_hybrid_yield;
+}
@@ -0,0 +1,855 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+/* vrt-tune: searches for the queue sizes, batch sizes, and yield
+ * strategy that work best for a workload described by a topology file.
+ *
+ * The workload's clients use the synthetic handlers defined below
+ * ("source", "work", and "sink"), or real handlers loaded from a plugin
+ * that exports a vrt_tune_register function.  Each trial builds the
+ * topology with a different set of overrides and runs it for real;
+ * successive halving spends most of the run time on the most promising
+ * configurations. */
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt.h"
+
+#include "histogram.h"
+
+
+#define DEFAULT_CONFIG_COUNT  16
+#define DEFAULT_VALUE_COUNT  100000
+#define DEFAULT_ETA  3
+#define DEFAULT_VALUE_SIZE  0
+
+#define MINIMUM_QUEUE_SIZE_SHIFT  6     /* 64 */
+#define MAXIMUM_QUEUE_SIZE_SHIFT  16    /* 65536 */
+#define MAXIMUM_BATCH_SIZE_SHIFT  10    /* 1024 */
+
+static const char  *yield_names[] = {
+    "spin", "threaded", "hybrid"
+};
+#define YIELD_COUNT  (sizeof(yield_names) / sizeof(yield_names[0]))
+
+
+/*-----------------------------------------------------------------------
+ * Clocks
+ */
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static uint64_t
+cpu_ns(void)
+{
+    struct rusage  usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+               * UINT64_C(1000000000)
+         + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)
+               * UINT64_C(1000);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Synthetic value type
+ */
+
+static size_t  value_size = DEFAULT_VALUE_SIZE;
+
+struct tune_value {
+    struct vrt_value  parent;
+    uint64_t  stamp;
+    char  payload[];
+};
+
+static struct vrt_value *
+tune_value_new(struct vrt_value_type *type)
+{
+    struct tune_value  *self =
+        cork_malloc(sizeof(struct tune_value) + value_size);
+    memset(self, 0, sizeof(struct tune_value) + value_size);
+    return &self->parent;
+}
+
+static void
+tune_value_free(struct vrt_value_type *type, struct vrt_value *vself)
+{
+    struct tune_value  *self =
+        cork_container_of(vself, struct tune_value, parent);
+    free(self);
+}
+
+static struct vrt_value_type  tune_value_type = {
+    tune_value_new,
+    tune_value_free
+};
+
+
+/*-----------------------------------------------------------------------
+ * Synthetic handlers
+ */
+
+/* Each synthetic handler keeps its parameters and results here, so that
+ * it doesn't have to look up its parameters for every value. */
+struct tune_state {
+    long  cost_ns;
+    uint64_t  produced;
+    struct vrt_histogram  latency;
+};
+
+static struct tune_state *
+tune_state(struct vrt_topology_client *client)
+{
+    struct tune_state  *state = client->state;
+    if (CORK_UNLIKELY(state == NULL)) {
+        state = cork_new(struct tune_state);
+        memset(state, 0, sizeof(struct tune_state));
+        state->cost_ns =
+            vrt_topology_client_param_long(client, "cost_ns", 0);
+        client->state = state;
+    }
+    return state;
+}
+
+static void
+burn(long cost_ns)
+{
+    if (cost_ns > 0) {
+        uint64_t  deadline = now_ns() + cost_ns;
+        while (now_ns() < deadline) {
+            /* spin */
+        }
+    }
+}
+
+/* The number of values that each source produces during a trial */
+static uint64_t  values_per_source;
+
+static int
+source_handler(struct vrt_topology_client *client, int event,
+               struct vrt_value *vvalue)
+{
+    struct tune_state  *state = tune_state(client);
+    struct tune_value  *value =
+        cork_container_of(vvalue, struct tune_value, parent);
+    if (state->produced >= values_per_source) {
+        return VRT_QUEUE_EOF;
+    }
+    if (value_size > 0) {
+        memset(value->payload, (int) state->produced, value_size);
+    }
+    state->produced++;
+    burn(state->cost_ns);
+    value->stamp = now_ns();
+    return 0;
+}
+
+static void
+touch_value(struct tune_value *value)
+{
+    size_t  i;
+    volatile char  sum = 0;
+    for (i = 0; i < value_size; i += 64) {
+        sum += value->payload[i];
+    }
+}
+
+static int
+work_handler(struct vrt_topology_client *client, int event,
+             struct vrt_value *vvalue)
+{
+    struct tune_state  *state = tune_state(client);
+    if (event == 0) {
+        touch_value(cork_container_of(vvalue, struct tune_value, parent));
+        burn(state->cost_ns);
+    }
+    return 0;
+}
+
+static int
+sink_handler(struct vrt_topology_client *client, int event,
+             struct vrt_value *vvalue)
+{
+    struct tune_state  *state = tune_state(client);
+    if (event == 0) {
+        struct tune_value  *value =
+            cork_container_of(vvalue, struct tune_value, parent);
+        touch_value(value);
+        burn(state->cost_ns);
+        vrt_histogram_add(&state->latency, now_ns() - value->stamp);
+    }
+    return 0;
+}
+
+static bool
+is_synthetic(struct vrt_topology_client *client)
+{
+    return client->handler == source_handler ||
+           client->handler == work_handler ||
+           client->handler == sink_handler;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Configurations and trials
+ */
+
+struct tune_tunables {
+    size_t  queue_count;
+    const char  **queue_names;
+    size_t  producer_count;
+    const char  **producer_names;
+    size_t  consumer_count;
+    const char  **consumer_names;
+    size_t  source_count;
+};
+
+struct tune_config {
+    unsigned int  id;
+    /* The shift of each queue's size, or 0 to leave it alone */
+    unsigned int  *queue_shifts;
+    /* The shift of each producer's batch size, or -1 to leave it alone */
+    int  *batch_shifts;
+    /* The index of the yield strategy, or -1 to leave them alone */
+    int  yield;
+
+    /* The results of the most recent trial */
+    uint64_t  budget;
+    bool  valid;
+    double  throughput;
+    double  p99_us;
+    double  efficiency;
+};
+
+enum tune_objective {
+    OBJECTIVE_THROUGHPUT,
+    OBJECTIVE_P99,
+    OBJECTIVE_EFFICIENCY
+};
+
+static const char  *objective_names[] = {
+    "throughput", "p99", "efficiency"
+};
+
+static const char  *topology_path;
+static const char  *plugin_path;
+static int (*plugin_register)(struct vrt_topology *topo);
+
+static struct vrt_topology *
+tune_new_topology(void)
+{
+    struct vrt_topology  *topo = vrt_topology_new();
+    rpi_check(vrt_topology_register_type(topo, "tune", &tune_value_type));
+    rpi_check(vrt_topology_register_handler
+              (topo, "source", source_handler, NULL));
+    rpi_check(vrt_topology_register_handler
+              (topo, "work", work_handler, NULL));
+    rpi_check(vrt_topology_register_handler
+              (topo, "sink", sink_handler, NULL));
+    if (plugin_register != NULL) {
+        rpi_check(plugin_register(topo));
+    }
+    rpi_check(vrt_topology_load_file(topo, topology_path));
+    return topo;
+}
+
+/* Builds the workload once, as written, to find out which queues and
+ * producers there are to tune. */
+static int
+tune_probe(struct tune_tunables *tunables)
+{
+    struct vrt_topology  *topo;
+    size_t  i;
+
+    rip_check(topo = tune_new_topology());
+    ei_check(vrt_topology_build(topo));
+
+    tunables->queue_count = cork_array_size(&topo->queues);
+    tunables->queue_names =
+        cork_calloc(tunables->queue_count, sizeof(const char *));
+    for (i = 0; i < tunables->queue_count; i++) {
+        tunables->queue_names[i] =
+            cork_strdup(cork_array_at(&topo->queues, i)->name);
+    }
+
+    tunables->producer_count = 0;
+    tunables->consumer_count = 0;
+    tunables->source_count = 0;
+    tunables->producer_names =
+        cork_calloc(cork_array_size(&topo->clients), sizeof(const char *));
+    tunables->consumer_names =
+        cork_calloc(cork_array_size(&topo->clients), sizeof(const char *));
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (client->producer != NULL) {
+            tunables->producer_names[tunables->producer_count++] =
+                cork_strdup(client->name);
+            if (client->handler == source_handler) {
+                tunables->source_count++;
+            }
+        } else {
+            tunables->consumer_names[tunables->consumer_count++] =
+                cork_strdup(client->name);
+        }
+    }
+
+    vrt_topology_free(topo);
+    if (tunables->source_count == 0) {
+        fprintf(stderr, "Workload doesn't have any \"source\" producers\n");
+        return -1;
+    }
+    return 0;
+
+error:
+    vrt_topology_free(topo);
+    return -1;
+}
+
+static uint64_t  random_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t
+random_next(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * UINT64_C(2685821657736338717);
+}
+
+static struct tune_config *
+tune_config_new(struct tune_tunables *tunables, unsigned int id,
+                bool baseline)
+{
+    struct tune_config  *config = cork_new(struct tune_config);
+    size_t  i;
+    memset(config, 0, sizeof(struct tune_config));
+    config->id = id;
+    config->queue_shifts =
+        cork_calloc(tunables->queue_count + 1, sizeof(unsigned int));
+    config->batch_shifts =
+        cork_calloc(tunables->producer_count + 1, sizeof(int));
+
+    if (baseline) {
+        /* The baseline configuration is the workload exactly as it's
+         * written. */
+        for (i = 0; i < tunables->producer_count; i++) {
+            config->batch_shifts[i] = -1;
+        }
+        config->yield = -1;
+        return config;
+    }
+
+    for (i = 0; i < tunables->queue_count; i++) {
+        config->queue_shifts[i] = MINIMUM_QUEUE_SIZE_SHIFT +
+            random_next() %
+            (MAXIMUM_QUEUE_SIZE_SHIFT - MINIMUM_QUEUE_SIZE_SHIFT + 1);
+    }
+
+    /* A batch can't be larger than a quarter of the smallest queue. */
+    for (i = 0; i < tunables->producer_count; i++) {
+        unsigned int  limit = MAXIMUM_BATCH_SIZE_SHIFT;
+        size_t  j;
+        for (j = 0; j < tunables->queue_count; j++) {
+            if (config->queue_shifts[j] - 2 < limit) {
+                limit = config->queue_shifts[j] - 2;
+            }
+        }
+        config->batch_shifts[i] = random_next() % (limit + 1);
+    }
+
+    config->yield = random_next() % YIELD_COUNT;
+    return config;
+}
+
+static void
+tune_config_free(struct tune_config *config)
+{
+    free(config->queue_shifts);
+    free(config->batch_shifts);
+    free(config);
+}
+
+static int
+tune_apply(struct vrt_topology *topo, struct tune_tunables *tunables,
+           struct tune_config *config)
+{
+    char  buf[32];
+    size_t  i;
+
+    for (i = 0; i < tunables->queue_count; i++) {
+        if (config->queue_shifts[i] != 0) {
+            snprintf(buf, sizeof(buf), "%u", 1u << config->queue_shifts[i]);
+            rii_check(vrt_topology_set
+                      (topo, tunables->queue_names[i], "size", buf));
+        }
+    }
+
+    for (i = 0; i < tunables->producer_count; i++) {
+        if (config->batch_shifts[i] >= 0) {
+            snprintf(buf, sizeof(buf), "%u", 1u << config->batch_shifts[i]);
+            rii_check(vrt_topology_set
+                      (topo, tunables->producer_names[i], "batch_size", buf));
+        }
+    }
+
+    /* The yield strategy goes in through the spec, like everything
+     * else, so that CPU placement and the runtime's busy-wait checks see
+     * the strategy that the trial actually uses. */
+    if (config->yield >= 0) {
+        for (i = 0; i < tunables->producer_count; i++) {
+            rii_check(vrt_topology_set
+                      (topo, tunables->producer_names[i], "yield",
+                       yield_names[config->yield]));
+        }
+        for (i = 0; i < tunables->consumer_count; i++) {
+            rii_check(vrt_topology_set
+                      (topo, tunables->consumer_names[i], "yield",
+                       yield_names[config->yield]));
+        }
+    }
+
+    return 0;
+}
+
+static void
+tune_free_states(struct vrt_topology *topo)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (is_synthetic(client)) {
+            free(client->state);
+            client->state = NULL;
+        }
+    }
+}
+
+static int
+tune_trial(struct tune_tunables *tunables, struct tune_config *config,
+           uint64_t budget)
+{
+    struct vrt_topology  *topo;
+    struct vrt_histogram  latency;
+    uint64_t  start_ns;
+    uint64_t  start_cpu;
+    uint64_t  elapsed_ns;
+    uint64_t  elapsed_cpu;
+    size_t  i;
+
+    values_per_source = budget / tunables->source_count;
+    config->budget = budget;
+    config->valid = false;
+
+    rip_check(topo = tune_new_topology());
+    ei_check(tune_apply(topo, tunables, config));
+    ei_check(vrt_topology_build(topo));
+
+    start_ns = now_ns();
+    start_cpu = cpu_ns();
+    ei_check(vrt_topology_run(topo));
+    elapsed_ns = now_ns() - start_ns;
+    elapsed_cpu = cpu_ns() - start_cpu;
+
+    vrt_histogram_init(&latency);
+    for (i = 0; i < cork_array_size(&topo->clients); i++) {
+        struct vrt_topology_client  *client =
+            cork_array_at(&topo->clients, i);
+        if (client->handler == sink_handler && client->state != NULL) {
+            struct tune_state  *state = client->state;
+            vrt_histogram_merge(&latency, &state->latency);
+        }
+    }
+    tune_free_states(topo);
+
+    config->valid = true;
+    config->throughput =
+        (double) values_per_source * tunables->source_count
+        / elapsed_ns * 1e9;
+    config->efficiency = (elapsed_cpu == 0)? 0:
+        (double) values_per_source * tunables->source_count
+        / elapsed_cpu * 1e9;
+    config->p99_us = (latency.count == 0)? NAN:
+        vrt_histogram_percentile(&latency, 99.0) / 1000.0;
+
+    vrt_topology_free(topo);
+    return 0;
+
+error:
+    tune_free_states(topo);
+    vrt_topology_free(topo);
+    return -1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Reporting
+ */
+
+static enum tune_objective  objective = OBJECTIVE_THROUGHPUT;
+
+/* Returns true if a is a better result than b. */
+static bool
+tune_better(struct tune_config *a, struct tune_config *b)
+{
+    if (!a->valid || !b->valid) {
+        return a->valid;
+    }
+    switch (objective) {
+        case OBJECTIVE_THROUGHPUT:
+            return a->throughput > b->throughput;
+        case OBJECTIVE_P99:
+            if (isnan(b->p99_us)) {
+                return !isnan(a->p99_us);
+            }
+            return a->p99_us < b->p99_us;
+        case OBJECTIVE_EFFICIENCY:
+            return a->efficiency > b->efficiency;
+        default:
+            cork_unreachable();
+    }
+}
+
+/* Returns true if a is at least as good as b on every metric, and
+ * better on at least one. */
+static bool
+tune_dominates(struct tune_config *a, struct tune_config *b)
+{
+    bool  a_p99 = !isnan(a->p99_us) && !isnan(b->p99_us);
+    bool  at_least = a->throughput >= b->throughput &&
+        a->efficiency >= b->efficiency &&
+        (!a_p99 || a->p99_us <= b->p99_us);
+    bool  better = a->throughput > b->throughput ||
+        a->efficiency > b->efficiency ||
+        (a_p99 && a->p99_us < b->p99_us);
+    return at_least && better;
+}
+
+static void
+tune_print_config(struct tune_tunables *tunables, struct tune_config *config)
+{
+    size_t  i;
+    printf("  #%-3u %-9s", config->id,
+           (config->yield < 0)? "(as-is)": yield_names[config->yield]);
+    for (i = 0; i < tunables->queue_count; i++) {
+        if (config->queue_shifts[i] == 0) {
+            printf(" %s/size=(as-is)", tunables->queue_names[i]);
+        } else {
+            printf(" %s/size=%u", tunables->queue_names[i],
+                   1u << config->queue_shifts[i]);
+        }
+    }
+    for (i = 0; i < tunables->producer_count; i++) {
+        if (config->batch_shifts[i] < 0) {
+            printf(" %s/batch=(as-is)", tunables->producer_names[i]);
+        } else {
+            printf(" %s/batch=%u", tunables->producer_names[i],
+                   1u << config->batch_shifts[i]);
+        }
+    }
+    if (config->valid) {
+        printf("\n       %.0f values/sec  p99 %.1f usec"
+               "  %.0f values/cpu-sec\n",
+               config->throughput, config->p99_us, config->efficiency);
+    } else {
+        printf("\n       failed\n");
+    }
+}
+
+static void
+tune_print_recommendation(struct tune_tunables *tunables,
+                          struct tune_config *config)
+{
+    bool  changed = false;
+    size_t  i;
+    printf("\nRecommended settings (objective: %s, config #%u):\n",
+           objective_names[objective], config->id);
+    for (i = 0; i < tunables->queue_count; i++) {
+        if (config->queue_shifts[i] != 0) {
+            printf("  [queue %s]\n  size = %u\n",
+                   tunables->queue_names[i], 1u << config->queue_shifts[i]);
+            changed = true;
+        }
+    }
+    for (i = 0; i < tunables->producer_count; i++) {
+        if (config->batch_shifts[i] < 0 && config->yield < 0) {
+            continue;
+        }
+        printf("  [producer %s]\n", tunables->producer_names[i]);
+        if (config->batch_shifts[i] >= 0) {
+            printf("  batch_size = %u\n", 1u << config->batch_shifts[i]);
+        }
+        if (config->yield >= 0) {
+            printf("  yield = %s\n", yield_names[config->yield]);
+        }
+        changed = true;
+    }
+    if (config->yield >= 0) {
+        for (i = 0; i < tunables->consumer_count; i++) {
+            printf("  [consumer %s]\n  yield = %s\n",
+                   tunables->consumer_names[i], yield_names[config->yield]);
+        }
+        changed = true;
+    }
+    if (!changed) {
+        printf("  (keep the workload as written)\n");
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Successive halving
+ */
+
+static int
+tune_compare(const void *va, const void *vb)
+{
+    struct tune_config  *a = *(struct tune_config **) va;
+    struct tune_config  *b = *(struct tune_config **) vb;
+    if (tune_better(a, b)) {
+        return -1;
+    } else if (tune_better(b, a)) {
+        return 1;
+    } else {
+        return (int) a->id - (int) b->id;
+    }
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "Usage: vrt-tune [options] <topology file>\n"
+        "\n"
+        "Options:\n"
+        "  -o, --objective=NAME   throughput (default), p99, or efficiency\n"
+        "  -c, --configs=N        initial number of configurations [%u]\n"
+        "  -n, --values=N         values per trial in the first round [%u]\n"
+        "  -e, --eta=N            keep 1/N of the configurations per round [%u]\n"
+        "  -s, --value-size=N     payload bytes in each synthetic value [%u]\n"
+        "  -r, --seed=N           random seed\n"
+        "  -p, --plugin=FILE      load handlers from a shared library\n"
+        "\n"
+        "The workload can use the \"tune\" value type, and the \"source\",\n"
+        "\"work\", and \"sink\" handlers.  Each handler burns param.cost_ns\n"
+        "nanoseconds per value; sinks measure end-to-end latency.  A plugin\n"
+        "must export \"int vrt_tune_register(struct vrt_topology *)\".\n",
+        DEFAULT_CONFIG_COUNT, DEFAULT_VALUE_COUNT, DEFAULT_ETA,
+        DEFAULT_VALUE_SIZE);
+}
+
+static bool
+parse_count(const char *str, unsigned long *dest)
+{
+    char  *end;
+    *dest = strtoul(str, &end, 10);
+    return str[0] != '\0' && str[0] != '-' && *end == '\0';
+}
+
+int
+main(int argc, char **argv)
+{
+    static struct option  options[] = {
+        { "objective", required_argument, NULL, 'o' },
+        { "configs", required_argument, NULL, 'c' },
+        { "values", required_argument, NULL, 'n' },
+        { "eta", required_argument, NULL, 'e' },
+        { "value-size", required_argument, NULL, 's' },
+        { "seed", required_argument, NULL, 'r' },
+        { "plugin", required_argument, NULL, 'p' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    unsigned long  config_count = DEFAULT_CONFIG_COUNT;
+    unsigned long  budget = DEFAULT_VALUE_COUNT;
+    unsigned long  eta = DEFAULT_ETA;
+    unsigned long  number;
+    struct tune_tunables  tunables;
+    struct tune_config  **configs;
+    struct tune_config  *best;
+    size_t  live;
+    size_t  i;
+    unsigned int  round = 0;
+    int  ch;
+
+    while ((ch = getopt_long(argc, argv, "o:c:n:e:s:r:p:h",
+                             options, NULL)) != -1) {
+        switch (ch) {
+            case 'o':
+                for (i = 0; i <= OBJECTIVE_EFFICIENCY; i++) {
+                    if (strcmp(optarg, objective_names[i]) == 0) {
+                        objective = i;
+                        break;
+                    }
+                }
+                if (i > OBJECTIVE_EFFICIENCY) {
+                    fprintf(stderr, "Unknown objective \"%s\"\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+            case 'n':
+            case 'e':
+            case 's':
+            case 'r':
+                if (!parse_count(optarg, &number)) {
+                    fprintf(stderr, "Invalid number \"%s\"\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                if (ch == 'c') {
+                    config_count = number;
+                } else if (ch == 'n') {
+                    budget = number;
+                } else if (ch == 'e') {
+                    eta = number;
+                } else if (ch == 's') {
+                    value_size = number;
+                } else {
+                    random_state ^= number * UINT64_C(0x9e3779b97f4a7c15);
+                }
+                break;
+            case 'p':
+                plugin_path = optarg;
+                break;
+            case 'h':
+                usage();
+                return EXIT_SUCCESS;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    topology_path = argv[optind];
+
+    if (config_count < 1 || eta < 2 || budget < 1) {
+        fprintf(stderr, "Need at least 1 configuration, 1 value, "
+                "and an eta of at least 2\n");
+        return EXIT_FAILURE;
+    }
+
+    if (plugin_path != NULL) {
+        void  *plugin = dlopen(plugin_path, RTLD_NOW);
+        if (plugin == NULL) {
+            fprintf(stderr, "%s\n", dlerror());
+            return EXIT_FAILURE;
+        }
+        *(void **) &plugin_register = dlsym(plugin, "vrt_tune_register");
+        if (plugin_register == NULL) {
+            fprintf(stderr, "%s\n", dlerror());
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (tune_probe(&tunables) != 0) {
+        if (cork_error_occurred()) {
+            fprintf(stderr, "%s\n", cork_error_message());
+        }
+        return EXIT_FAILURE;
+    }
+
+    /* Configuration #0 is always the workload as written, so that the
+     * report shows how much the tuning actually helped. */
+    configs = cork_calloc(config_count, sizeof(struct tune_config *));
+    for (i = 0; i < config_count; i++) {
+        configs[i] = tune_config_new(&tunables, i, i == 0);
+    }
+
+    live = config_count;
+    while (true) {
+        printf("Round %u: %zu configuration%s x %lu values\n",
+               round, live, (live == 1)? "": "s", budget);
+        for (i = 0; i < live; i++) {
+            if (tune_trial(&tunables, configs[i], budget) != 0) {
+                fprintf(stderr, "Config #%u failed: %s\n",
+                        configs[i]->id, cork_error_message());
+                cork_error_clear();
+            }
+            tune_print_config(&tunables, configs[i]);
+        }
+
+        qsort(configs, live, sizeof(struct tune_config *), tune_compare);
+        if (live == 1) {
+            break;
+        }
+        live = (live + eta - 1) / eta;
+        budget *= eta;
+        round++;
+    }
+
+    best = configs[0];
+    if (!best->valid) {
+        fprintf(stderr, "Every configuration failed\n");
+        return EXIT_FAILURE;
+    }
+    tune_print_recommendation(&tunables, best);
+
+    /* The frontier is the set of configurations that no other
+     * configuration beats on every metric, using each configuration's
+     * largest-budget measurement. */
+    printf("\nMeasured frontier (values/sec, p99, values/cpu-sec):\n");
+    for (i = 0; i < config_count; i++) {
+        size_t  j;
+        bool  dominated = !configs[i]->valid;
+        for (j = 0; j < config_count && !dominated; j++) {
+            if (j != i && configs[j]->valid &&
+                configs[j]->budget == configs[i]->budget &&
+                tune_dominates(configs[j], configs[i])) {
+                dominated = true;
+            }
+        }
+        if (!dominated) {
+            printf("  (%lu values)", (unsigned long) configs[i]->budget);
+            tune_print_config(&tunables, configs[i]);
+        }
+    }
+
+    for (i = 0; i < config_count; i++) {
+        tune_config_free(configs[i]);
+    }
+    free(configs);
+    for (i = 0; i < tunables.queue_count; i++) {
+        cork_strfree(tunables.queue_names[i]);
+    }
+    free(tunables.queue_names);
+    for (i = 0; i < tunables.producer_count; i++) {
+        cork_strfree(tunables.producer_names[i]);
+    }
+    free(tunables.producer_names);
+    for (i = 0; i < tunables.consumer_count; i++) {
+        cork_strfree(tunables.consumer_names[i]);
+    }
+    free(tunables.consumer_names);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_TESTS_BASELINE
+#define VRT_TESTS_BASELINE
+
+/*
+ * Reference implementations of conventional queues, so that the
+ * benchmarks can compare varon-t against them:
+ *
+ *   - a ring buffer protected by a mutex, with condition variables for
+ *     waiting while it's empty or full;
+ *   - a lock-free single-producer, single-consumer ring, in which each
+ *     side caches the other side's position;
+ *   - Dmitry Vyukov's bounded multi-producer, multi-consumer queue, in
+ *     which each slot carries a sequence number.
+ *
+ * Each queue stores fixed-size items, which are copied in and out, and
+ * unlike a vrt_queue, each item is delivered to exactly one consumer.
+ * The lock-free queues spin for a while when they have to wait, and
+ * then fall back on sched_yield.
+ */
+
+#include <libcork/core.h>
+
+
+enum vrt_baseline_kind {
+    VRT_BASELINE_MUTEX,
+    VRT_BASELINE_SPSC,
+    VRT_BASELINE_MPMC
+};
+
+struct vrt_baseline_queue;
+
+/** Return a short name for a kind of queue. */
+const char *
+vrt_baseline_kind_name(enum vrt_baseline_kind kind);
+
+/** Allocate a new queue that holds @a size items (rounded up to a power
+ * of 2) of @a item_size bytes each. */
+struct vrt_baseline_queue *
+vrt_baseline_queue_new(enum vrt_baseline_kind kind, size_t size,
+                       size_t item_size);
+
+void
+vrt_baseline_queue_free(struct vrt_baseline_queue *q);
+
+/** Add @a count items from @a items to the queue, waiting for room if
+ * necessary.  The queue can make the whole batch visible to consumers
+ * at once if it supports that. */
+void
+vrt_baseline_push(struct vrt_baseline_queue *q, const void *items,
+                  size_t count);
+
+/** Remove at least one and at most @a max items from the queue, waiting
+ * for one if necessary, and copy them into @a items.  Returns the number
+ * of items removed. */
+size_t
+vrt_baseline_pop(struct vrt_baseline_queue *q, void *items, size_t max);
+
+
+#endif /* VRT_TESTS_BASELINE */
@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <libcork/core.h>
 
@@ -59,4 +60,38 @@ typedef uint64_t  vrt_clock;
     } while (0)
 
 
+/* The CPU time (user plus system) used by the calling thread, in
+ * microseconds.  On platforms without RUSAGE_THREAD, this falls back
+ * on the CPU time of the whole process.  (You'll need to define
+ * _GNU_SOURCE before including any system headers to get
+ * RUSAGE_THREAD on Linux.) */
+
+#if defined(RUSAGE_THREAD)
+#define VRT_RUSAGE_CALLER  RUSAGE_THREAD
+#else
+#define VRT_RUSAGE_CALLER  RUSAGE_SELF
+#endif
+
+#define vrt_get_cpu_clock(clk) \
+    do { \
+        struct rusage  __ru; \
+        getrusage(VRT_RUSAGE_CALLER, &__ru); \
+        *(clk) = (__ru.ru_utime.tv_sec + __ru.ru_stime.tv_sec) * 1000000 \
+               + __ru.ru_utime.tv_usec + __ru.ru_stime.tv_usec; \
+    } while (0)
+
+
+/* nanoseconds, from a monotonic clock.  Use this for latencies, where
+ * vrt_clock isn't fine-grained enough and wall-clock adjustments would
+ * skew the results. */
+typedef uint64_t  vrt_nsec;
+
+#define vrt_get_nsec(ns) \
+    do { \
+        struct timespec  __ts; \
+        clock_gettime(CLOCK_MONOTONIC, &__ts); \
+        *(ns) = __ts.tv_sec * UINT64_C(1000000000) + __ts.tv_nsec; \
+    } while (0)
+
+
 #endif /* VRT_TESTS_HELPERS */
@@ -0,0 +1,69 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_TESTS_HISTOGRAM
+#define VRT_TESTS_HISTOGRAM
+
+#include <libcork/core.h>
+
+
+/*-----------------------------------------------------------------------
+ * Latency histograms
+ */
+
+/* A log-linear histogram for recording latencies.  Each power of two is
+ * split into eight sub-buckets, so every bucket is within 12.5% of the
+ * values that land in it, no matter how large they are.  Percentiles are
+ * reported as the upper bound of the bucket they fall in (or the largest
+ * value recorded, if that's smaller), so they can come out high, but
+ * never low. */
+
+#define VRT_HISTOGRAM_SUB_BITS  3
+#define VRT_HISTOGRAM_BUCKETS  (64 << VRT_HISTOGRAM_SUB_BITS)
+
+/** A histogram of unsigned values, usually latencies in nanoseconds. */
+struct vrt_histogram {
+    /** The number of values recorded */
+    uint64_t  count;
+
+    /** The largest value recorded */
+    uint64_t  max;
+
+    /** The number of values that landed in each bucket */
+    uint64_t  buckets[VRT_HISTOGRAM_BUCKETS];
+};
+
+/** Clear out a histogram. */
+void
+vrt_histogram_init(struct vrt_histogram *h);
+
+/** Record a single value. */
+void
+vrt_histogram_add(struct vrt_histogram *h, uint64_t value);
+
+/** Add all of the values in @a src to @a dest. */
+void
+vrt_histogram_merge(struct vrt_histogram *dest,
+                    const struct vrt_histogram *src);
+
+/** Return the (approximate) value at the given percentile, which should
+ * be between 0 and 100.  This is the upper bound of the bucket that the
+ * percentile falls in, capped at the largest value recorded, so it's
+ * never less than the exact percentile. */
+uint64_t
+vrt_histogram_percentile(const struct vrt_histogram *h, double percentile);
+
+/** Print the count, median, p99, p99.9, and maximum of a histogram of
+ * nanosecond values, in microseconds. */
+void
+vrt_histogram_report(const struct vrt_histogram *h);
+
+
+#endif /* VRT_HISTOGRAM_H */
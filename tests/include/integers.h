@@ -19,6 +19,7 @@
 #include <libcork/helpers/errors.h>
 
 #include "vrt/queue.h"
+#include "vrt/rpc.h"
 #include "vrt/value.h"
 
 
@@ -34,6 +35,16 @@ struct vrt_value_int {
 struct vrt_value_type *
 vrt_value_type_int(void);
 
+/* The same, but usable as the request type of a vrt_rpc. */
+
+struct vrt_value_rpc_int {
+    struct vrt_rpc_request  parent;
+    int32_t  value;
+};
+
+struct vrt_value_type *
+vrt_value_type_rpc_int(void);
+
 
 /*-----------------------------------------------------------------------
  * Generate processor
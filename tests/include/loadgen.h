@@ -0,0 +1,131 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_TESTS_LOADGEN
+#define VRT_TESTS_LOADGEN
+
+/*
+ * An open-loop load generator.  The closed-loop producers in
+ * integers.h claim values as fast as the queue lets them, so when the
+ * queue is full they just wait, and the time that they spend waiting
+ * never shows up in any latency measurement ("coordinated omission").
+ * This generator instead decides ahead of time when each value should
+ * be sent, following a fixed, Poisson, or bursty on/off schedule.  Each
+ * value carries its *intended* send time, and the consumer measures
+ * latency against that, so any time the producer spends blocked on a
+ * full queue is charged to the values that were delayed by it.
+ */
+
+#include <libcork/core.h>
+
+#include "vrt/queue.h"
+#include "vrt/value.h"
+
+#include "helpers.h"
+#include "histogram.h"
+
+
+/*-----------------------------------------------------------------------
+ * Timestamped value type
+ */
+
+struct vrt_value_timed {
+    struct vrt_value  parent;
+    /** When the load generator's schedule says this value should have
+     * been sent */
+    vrt_nsec  intended;
+    /** When the producer actually managed to claim a slot for it */
+    vrt_nsec  sent;
+};
+
+struct vrt_value_type *
+vrt_value_type_timed(void);
+
+
+/*-----------------------------------------------------------------------
+ * Schedules
+ */
+
+enum vrt_loadgen_pattern {
+    /** Values are sent at exactly 1/rate second intervals. */
+    VRT_LOADGEN_FIXED,
+    /** The gaps between values are exponentially distributed with a
+     * mean of 1/rate seconds. */
+    VRT_LOADGEN_POISSON,
+    /** Values are sent at fixed intervals for on_period nanoseconds,
+     * followed by off_period nanoseconds of silence. */
+    VRT_LOADGEN_ON_OFF
+};
+
+struct vrt_loadgen_schedule {
+    enum vrt_loadgen_pattern  pattern;
+    /** The send rate, in values per second.  For an on/off schedule,
+     * this is the rate during the "on" periods. */
+    double  rate;
+    vrt_nsec  on_period;
+    vrt_nsec  off_period;
+    /** Seeds the random number generator for Poisson schedules */
+    uint64_t  seed;
+};
+
+/** Return the average number of values per second that a schedule will
+ * offer. */
+double
+vrt_loadgen_offered_rate(const struct vrt_loadgen_schedule *schedule);
+
+/** Return a short description of a schedule's pattern. */
+const char *
+vrt_loadgen_pattern_name(enum vrt_loadgen_pattern pattern);
+
+
+/*-----------------------------------------------------------------------
+ * Open-loop producer
+ */
+
+struct vrt_loadgen_producer_config {
+    struct vrt_producer  *p;
+    struct vrt_loadgen_schedule  schedule;
+    uint64_t  count;
+    /** Filled in by the producer: the intended send time of the first
+     * value. */
+    vrt_nsec  start;
+};
+
+/** Send @a count timestamped values to a producer, according to its
+ * schedule, and then send an EOF.  The producer flushes any partially
+ * filled batch whenever it has to wait for the next scheduled send, so
+ * that values don't sit in an unpublished batch while the producer is
+ * idle. */
+void *
+vrt_loadgen_produce(void *ud);
+
+
+/*-----------------------------------------------------------------------
+ * Latency-measuring consumer
+ */
+
+struct vrt_loadgen_consumer_config {
+    struct vrt_consumer  *c;
+    /** Latency measured from each value's intended send time */
+    struct vrt_histogram  intended;
+    /** Latency measured from each value's actual send time; this is
+     * what a closed-loop benchmark would report. */
+    struct vrt_histogram  sent;
+    /** When the last value was received */
+    vrt_nsec  finish;
+};
+
+/** Drain timestamped values from a consumer until EOF, recording their
+ * latencies. */
+void *
+vrt_loadgen_consume(void *ud);
+
+
+#endif /* VRT_TESTS_LOADGEN */
@@ -18,6 +18,7 @@
 
 #include <libcork/core.h>
 
+#include "vrt/cpu.h"
 #include "vrt/queue.h"
 
 #include "helpers.h"
@@ -32,9 +33,24 @@ struct vrt_queue_client {
 
     /** The parameter to pass into the function */
     void  *ud;
+
+    /** Filled in by the runner: the CPU time used by the client's
+     * thread, in microseconds */
+    vrt_clock  cpu_time;
+
+    /** Filled in by the runner: the CPU that the client's thread was
+     * pinned to, or -1 */
+    int  cpu;
 };
 
 
+/** Choose how the runners pin client threads to CPUs.  The clients are
+ * placed in the order that they appear in the clients array.  The
+ * default is VRT_CPU_POLICY_NONE, which leaves them unpinned. */
+void
+vrt_test_queue_set_placement(enum vrt_cpu_policy policy);
+
+
 /** Run each client in a separate thread */
 int
 vrt_test_queue_threaded(struct vrt_queue *q,
@@ -55,5 +71,21 @@ vrt_test_queue_threaded_hybrid(struct vrt_queue *q,
                                struct vrt_queue_client *clients,
                                vrt_clock *elapsed);
 
+/** Run each client in a separate thread, but use the UMWAIT yield
+ * strategy (which is the hybrid strategy on CPUs that don't support
+ * UMWAIT) */
+int
+vrt_test_queue_threaded_umwait(struct vrt_queue *q,
+                               struct vrt_queue_client *clients,
+                               vrt_clock *elapsed);
+
+/** Run each client in a separate thread, without touching any queue.
+ * This is for clients that don't use a vrt_queue at all, such as the
+ * baseline queues that we compare against, so that they're run and
+ * measured the same way as everything else. */
+int
+vrt_test_clients_threaded(struct vrt_queue_client *clients,
+                          vrt_clock *elapsed);
+
 
 #endif /* VRT_TESTS_QUEUE */
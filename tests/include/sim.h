@@ -0,0 +1,149 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_TESTS_SIM
+#define VRT_TESTS_SIM
+
+/*
+ * A deterministic interleaving simulator.  Producers and consumers run
+ * as cooperatively scheduled actors, all on a single thread.  When the
+ * queue code is compiled with VRT_SCHEDULE_HOOK, every access to a
+ * shared padded value calls vrt_schedule_point, which hands control
+ * back to the simulator's scheduler; the scheduler then decides which
+ * actor runs next.  Since nothing else decides, the same schedule
+ * always produces exactly the same interleaving.
+ *
+ * There are two ways to pick schedules:
+ *
+ *   - Random: each decision is made by a PRNG seeded with a number that
+ *     you provide.  A failing seed replays exactly.
+ *
+ *   - Systematic: every schedule with at most a given number of
+ *     preemptions is tried, one per run, in a fixed order.  (Switching
+ *     away from an actor that is waiting for some other actor doesn't
+ *     count as a preemption.)
+ *
+ * An actor that yields is waiting for some other actor to change the
+ * shared state, and wait loops only read that state.  So a waiting
+ * actor isn't scheduled again until some other actor has written to a
+ * shared value since the actor's first read in its current wait loop
+ * iteration; otherwise it would just spin, and the number of possible
+ * schedules would be infinite.  If every unfinished actor is waiting
+ * and nothing has been written, the run is deadlocked.
+ */
+
+#include <ucontext.h>
+
+#include <libcork/core.h>
+
+#include "vrt/yield.h"
+
+
+#define VRT_SIM_MAX_ACTORS  8
+
+typedef void
+(*vrt_sim_actor_f)(void *ud);
+
+struct vrt_sim_actor {
+    const char  *name;
+    vrt_sim_actor_f  run;
+    void  *ud;
+    ucontext_t  context;
+    char  *stack;
+    bool  started;
+    bool  finished;
+    /** Whether the actor is waiting for another actor */
+    bool  waiting;
+    /** The simulator's write count as of the first read that the
+     * actor's current wait is based on */
+    size_t  wait_writes;
+    /** Whether the actor has read a shared value since it last wrote
+     * one or yielded, and the write count when it did */
+    bool  have_read;
+    size_t  first_read_writes;
+};
+
+struct vrt_sim {
+    struct vrt_sim_actor  actors[VRT_SIM_MAX_ACTORS];
+    unsigned int  actor_count;
+    struct vrt_sim_actor  *current;
+    ucontext_t  scheduler;
+
+    /** The number of scheduling decisions made so far in this run */
+    size_t  steps;
+    /** The number of writes to shared values so far in this run */
+    size_t  writes;
+    /** A run that takes more steps than this is reported as a
+     * livelock. */
+    size_t  max_steps;
+    bool  aborted;
+    bool  deadlocked;
+
+    /** Print each context switch to stderr */
+    bool  trace;
+
+    /* Random mode.  Each decision switches to a random actor with
+     * probability 1/switch_odds, and otherwise keeps running the
+     * current one; switch_odds is chosen per seed, so that we get both
+     * fine- and coarse-grained interleavings. */
+    bool  random;
+    uint64_t  rng;
+    unsigned int  switch_odds;
+
+    /* Systematic mode.  Each of these arrays has max_steps entries. */
+    unsigned int  *prefix;
+    size_t  prefix_length;
+    unsigned int  *chosen;
+    unsigned int  *options;
+    unsigned int  *preemptions_before;
+    bool  *preemptible;
+    unsigned int  preemptions;
+    unsigned int  preemption_bound;
+};
+
+/** Prepare a simulator that chooses schedules randomly, starting from
+ * the given seed. */
+void
+vrt_sim_init_random(struct vrt_sim *sim, uint64_t seed, size_t max_steps);
+
+/** Prepare a simulator that enumerates every schedule with at most
+ * @a preemption_bound preemptions.  Call vrt_sim_next_schedule after
+ * each run to move on to the next schedule. */
+void
+vrt_sim_init_systematic(struct vrt_sim *sim, unsigned int preemption_bound,
+                        size_t max_steps);
+
+void
+vrt_sim_done(struct vrt_sim *sim);
+
+/** Add an actor for the next run. */
+void
+vrt_sim_add_actor(struct vrt_sim *sim, const char *name,
+                  vrt_sim_actor_f run, void *ud);
+
+/** Run all of the actors until they finish.  Returns 0 if they all
+ * finished, or -1 if they deadlocked or the run took more than max_steps
+ * scheduling decisions.  Either way, the actors are removed
+ * afterwards. */
+int
+vrt_sim_run(struct vrt_sim *sim);
+
+/** Move on to the next systematic schedule.  Returns false once every
+ * schedule has been tried. */
+bool
+vrt_sim_next_schedule(struct vrt_sim *sim);
+
+/** A yield strategy that tells the scheduler that the calling actor is
+ * waiting for some other actor to make progress. */
+struct vrt_yield_strategy *
+vrt_yield_strategy_sim(void);
+
+
+#endif /* VRT_TESTS_SIM */
@@ -0,0 +1,370 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+
+#include "vrt/atomic.h"
+
+#include "baseline.h"
+
+#define SPIN_COUNT  1000
+
+/* A position that's on a cache line of its own. */
+struct vrt_baseline_position {
+    char  __pad0[64 - sizeof(size_t)];
+    volatile size_t  value;
+    char  __pad1[64 - sizeof(size_t)];
+};
+
+struct vrt_baseline_queue {
+    enum vrt_baseline_kind  kind;
+    size_t  mask;
+    size_t  item_size;
+
+    /* The distance between slots.  For the MPMC queue, each slot starts
+     * with its sequence number. */
+    size_t  stride;
+    char  *slots;
+
+    /* Mutex ring: items head through tail-1 are in the queue. */
+    pthread_mutex_t  lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    size_t  head;
+    size_t  tail;
+
+    /* SPSC ring: the shared positions, and each side's cached copy of
+     * the other side's.  MPMC queue: the next positions to enqueue and
+     * dequeue. */
+    struct vrt_baseline_position  read_pos;
+    struct vrt_baseline_position  write_pos;
+    struct vrt_baseline_position  cached_read_pos;
+    struct vrt_baseline_position  cached_write_pos;
+};
+
+#define vrt_baseline_slot(q, pos) \
+    ((q)->slots + ((pos) & (q)->mask) * (q)->stride)
+
+#define vrt_baseline_sequence(q, pos) \
+    (*(volatile size_t *) vrt_baseline_slot((q), (pos)))
+
+#define vrt_baseline_data(q, pos) \
+    (vrt_baseline_slot((q), (pos)) + \
+     (((q)->kind == VRT_BASELINE_MPMC)? sizeof(size_t): 0))
+
+static void
+vrt_baseline_backoff(unsigned int *spins)
+{
+    if (*spins < SPIN_COUNT) {
+        (*spins)++;
+    } else {
+        sched_yield();
+    }
+}
+
+const char *
+vrt_baseline_kind_name(enum vrt_baseline_kind kind)
+{
+    switch (kind) {
+        case VRT_BASELINE_MUTEX:
+            return "mutex";
+        case VRT_BASELINE_SPSC:
+            return "spsc";
+        case VRT_BASELINE_MPMC:
+            return "mpmc";
+        default:
+            cork_unreachable();
+    }
+}
+
+struct vrt_baseline_queue *
+vrt_baseline_queue_new(enum vrt_baseline_kind kind, size_t size,
+                       size_t item_size)
+{
+    struct vrt_baseline_queue  *q;
+    size_t  count = 1;
+    size_t  i;
+    void  *mem;
+
+    while (count < size) {
+        count <<= 1;
+    }
+
+    if (posix_memalign(&mem, 64, sizeof(struct vrt_baseline_queue)) != 0) {
+        return NULL;
+    }
+    q = mem;
+    memset(q, 0, sizeof(struct vrt_baseline_queue));
+    q->kind = kind;
+    q->mask = count - 1;
+    q->item_size = item_size;
+    q->stride = (item_size + 7) & ~(size_t) 7;
+    if (kind == VRT_BASELINE_MPMC) {
+        q->stride += sizeof(size_t);
+    }
+    q->slots = cork_calloc(count, q->stride);
+
+    if (kind == VRT_BASELINE_MUTEX) {
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->not_empty, NULL);
+        pthread_cond_init(&q->not_full, NULL);
+    } else if (kind == VRT_BASELINE_MPMC) {
+        for (i = 0; i < count; i++) {
+            vrt_baseline_sequence(q, i) = i;
+        }
+    }
+    return q;
+}
+
+void
+vrt_baseline_queue_free(struct vrt_baseline_queue *q)
+{
+    if (q->kind == VRT_BASELINE_MUTEX) {
+        pthread_cond_destroy(&q->not_full);
+        pthread_cond_destroy(&q->not_empty);
+        pthread_mutex_destroy(&q->lock);
+    }
+    free(q->slots);
+    free(q);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Mutex ring
+ */
+
+static void
+vrt_baseline_mutex_push(struct vrt_baseline_queue *q, const char *items,
+                        size_t count)
+{
+    pthread_mutex_lock(&q->lock);
+    while (count > 0) {
+        while (q->tail - q->head > q->mask) {
+            pthread_cond_wait(&q->not_full, &q->lock);
+        }
+        while (count > 0 && q->tail - q->head <= q->mask) {
+            memcpy(vrt_baseline_data(q, q->tail), items, q->item_size);
+            items += q->item_size;
+            q->tail++;
+            count--;
+        }
+        pthread_cond_broadcast(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static size_t
+vrt_baseline_mutex_pop(struct vrt_baseline_queue *q, char *items,
+                       size_t max)
+{
+    size_t  count = 0;
+    pthread_mutex_lock(&q->lock);
+    while (q->head == q->tail) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    while (count < max && q->head != q->tail) {
+        memcpy(items, vrt_baseline_data(q, q->head), q->item_size);
+        items += q->item_size;
+        q->head++;
+        count++;
+    }
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lock-free SPSC ring
+ */
+
+static void
+vrt_baseline_spsc_push(struct vrt_baseline_queue *q, const char *items,
+                       size_t count)
+{
+    size_t  tail = q->write_pos.value;
+    size_t  head = q->cached_read_pos.value;
+    unsigned int  spins = 0;
+
+    while (count > 0) {
+        if (tail - head > q->mask) {
+            /* Let the consumer see what we have so far before we wait
+             * for it. */
+            vrt_atomic_write_barrier();
+            q->write_pos.value = tail;
+            head = q->read_pos.value;
+            vrt_atomic_read_barrier();
+            if (tail - head > q->mask) {
+                vrt_baseline_backoff(&spins);
+                continue;
+            }
+            spins = 0;
+        }
+        memcpy(vrt_baseline_data(q, tail), items, q->item_size);
+        items += q->item_size;
+        tail++;
+        count--;
+    }
+
+    vrt_atomic_write_barrier();
+    q->write_pos.value = tail;
+    q->cached_read_pos.value = head;
+}
+
+static size_t
+vrt_baseline_spsc_pop(struct vrt_baseline_queue *q, char *items,
+                      size_t max)
+{
+    size_t  head = q->read_pos.value;
+    size_t  tail = q->cached_write_pos.value;
+    size_t  count = 0;
+    unsigned int  spins = 0;
+
+    while (head == tail) {
+        tail = q->write_pos.value;
+        vrt_atomic_read_barrier();
+        if (head == tail) {
+            vrt_baseline_backoff(&spins);
+        }
+    }
+
+    while (count < max && head != tail) {
+        memcpy(items, vrt_baseline_data(q, head), q->item_size);
+        items += q->item_size;
+        head++;
+        count++;
+    }
+
+    /* We have to finish reading the slots before the producer can
+     * reuse them. */
+    __sync_synchronize();
+    q->read_pos.value = head;
+    q->cached_write_pos.value = tail;
+    return count;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Vyukov's bounded MPMC queue
+ */
+
+static void
+vrt_baseline_mpmc_push(struct vrt_baseline_queue *q, const char *items,
+                       size_t count)
+{
+    for (; count > 0; count--, items += q->item_size) {
+        unsigned int  spins = 0;
+        size_t  pos = q->write_pos.value;
+        while (true) {
+            size_t  seq = vrt_baseline_sequence(q, pos);
+            intptr_t  diff;
+            vrt_atomic_read_barrier();
+            diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap
+                    (&q->write_pos.value, pos, pos + 1)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                /* The queue is full. */
+                vrt_baseline_backoff(&spins);
+            }
+            pos = q->write_pos.value;
+        }
+
+        memcpy(vrt_baseline_data(q, pos), items, q->item_size);
+        vrt_atomic_write_barrier();
+        vrt_baseline_sequence(q, pos) = pos + 1;
+    }
+}
+
+static size_t
+vrt_baseline_mpmc_pop(struct vrt_baseline_queue *q, char *items,
+                      size_t max)
+{
+    size_t  count = 0;
+    unsigned int  spins = 0;
+
+    while (count < max) {
+        size_t  pos = q->read_pos.value;
+        while (true) {
+            size_t  seq = vrt_baseline_sequence(q, pos);
+            intptr_t  diff;
+            vrt_atomic_read_barrier();
+            diff = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap
+                    (&q->read_pos.value, pos, pos + 1)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                /* The queue is empty.  Return what we have, if
+                 * anything. */
+                if (count > 0) {
+                    return count;
+                }
+                vrt_baseline_backoff(&spins);
+            }
+            pos = q->read_pos.value;
+        }
+
+        memcpy(items, vrt_baseline_data(q, pos), q->item_size);
+        items += q->item_size;
+        count++;
+        __sync_synchronize();
+        vrt_baseline_sequence(q, pos) = pos + q->mask + 1;
+    }
+    return count;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Dispatch
+ */
+
+void
+vrt_baseline_push(struct vrt_baseline_queue *q, const void *items,
+                  size_t count)
+{
+    switch (q->kind) {
+        case VRT_BASELINE_MUTEX:
+            vrt_baseline_mutex_push(q, items, count);
+            break;
+        case VRT_BASELINE_SPSC:
+            vrt_baseline_spsc_push(q, items, count);
+            break;
+        case VRT_BASELINE_MPMC:
+            vrt_baseline_mpmc_push(q, items, count);
+            break;
+        default:
+            cork_unreachable();
+    }
+}
+
+size_t
+vrt_baseline_pop(struct vrt_baseline_queue *q, void *items, size_t max)
+{
+    switch (q->kind) {
+        case VRT_BASELINE_MUTEX:
+            return vrt_baseline_mutex_pop(q, items, max);
+        case VRT_BASELINE_SPSC:
+            return vrt_baseline_spsc_pop(q, items, max);
+        case VRT_BASELINE_MPMC:
+            return vrt_baseline_mpmc_pop(q, items, max);
+        default:
+            cork_unreachable();
+    }
+}
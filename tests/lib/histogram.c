@@ -0,0 +1,108 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <libcork/core.h>
+
+#include "histogram.h"
+
+#define SUB_BUCKETS  (1 << VRT_HISTOGRAM_SUB_BITS)
+#define SUB_MASK  (SUB_BUCKETS - 1)
+
+static unsigned int
+vrt_histogram_bucket(uint64_t value)
+{
+    unsigned int  shift;
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    shift = 63 - __builtin_clzll(value) - VRT_HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << VRT_HISTOGRAM_SUB_BITS)
+         + ((value >> shift) & SUB_MASK);
+}
+
+/* Returns the largest value that lands in a bucket. */
+static uint64_t
+vrt_histogram_bucket_max(unsigned int bucket)
+{
+    unsigned int  shift;
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    shift = (bucket >> VRT_HISTOGRAM_SUB_BITS) - 1;
+    return (((uint64_t) (SUB_BUCKETS + (bucket & SUB_MASK) + 1)) << shift)
+         - 1;
+}
+
+void
+vrt_histogram_init(struct vrt_histogram *h)
+{
+    memset(h, 0, sizeof(struct vrt_histogram));
+}
+
+void
+vrt_histogram_add(struct vrt_histogram *h, uint64_t value)
+{
+    h->count++;
+    h->buckets[vrt_histogram_bucket(value)]++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void
+vrt_histogram_merge(struct vrt_histogram *dest,
+                    const struct vrt_histogram *src)
+{
+    unsigned int  i;
+    dest->count += src->count;
+    if (src->max > dest->max) {
+        dest->max = src->max;
+    }
+    for (i = 0; i < VRT_HISTOGRAM_BUCKETS; i++) {
+        dest->buckets[i] += src->buckets[i];
+    }
+}
+
+uint64_t
+vrt_histogram_percentile(const struct vrt_histogram *h, double percentile)
+{
+    /* Round the rank up, so that p100 is the last value and not one
+     * past it. */
+    double  rank = h->count * percentile / 100.0;
+    uint64_t  threshold = (uint64_t) rank;
+    uint64_t  seen = 0;
+    unsigned int  i;
+    if (threshold < rank || threshold == 0) {
+        threshold++;
+    }
+    for (i = 0; i < VRT_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= threshold) {
+            uint64_t  value = vrt_histogram_bucket_max(i);
+            return (value < h->max)? value: h->max;
+        }
+    }
+    return h->max;
+}
+
+void
+vrt_histogram_report(const struct vrt_histogram *h)
+{
+    printf("%" PRIu64 " values\tp50 %.1lf\tp99 %.1lf\tp99.9 %.1lf\t"
+           "max %.1lf usec\n",
+           h->count,
+           vrt_histogram_percentile(h, 50.0) / 1000.0,
+           vrt_histogram_percentile(h, 99.0) / 1000.0,
+           vrt_histogram_percentile(h, 99.9) / 1000.0,
+           h->max / 1000.0);
+}
@@ -40,3 +40,31 @@ vrt_value_type_int(void)
 {
     return &_vrt_value_type_int;
 }
+
+
+static struct vrt_value *
+vrt_value_rpc_int_new(struct vrt_value_type *type)
+{
+    struct vrt_value_rpc_int  *self = cork_new(struct vrt_value_rpc_int);
+    return &self->parent.parent;
+}
+
+static void
+vrt_value_rpc_int_free(struct vrt_value_type *type, struct vrt_value *vself)
+{
+    struct vrt_value_rpc_int  *self =
+        cork_container_of(vself, struct vrt_value_rpc_int, parent.parent);
+    free(self);
+}
+
+static struct vrt_value_type  _vrt_value_type_rpc_int = {
+    vrt_value_rpc_int_new,
+    vrt_value_rpc_int_free
+};
+
+
+struct vrt_value_type *
+vrt_value_type_rpc_int(void)
+{
+    return &_vrt_value_type_rpc_int;
+}
@@ -0,0 +1,244 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/queue.h"
+
+#include "helpers.h"
+#include "histogram.h"
+#include "loadgen.h"
+
+
+/*-----------------------------------------------------------------------
+ * Timestamped value type
+ */
+
+static struct vrt_value *
+vrt_value_timed_new(struct vrt_value_type *type)
+{
+    struct vrt_value_timed  *self = cork_new(struct vrt_value_timed);
+    return &self->parent;
+}
+
+static void
+vrt_value_timed_free(struct vrt_value_type *type, struct vrt_value *vself)
+{
+    struct vrt_value_timed  *self =
+        cork_container_of(vself, struct vrt_value_timed, parent);
+    free(self);
+}
+
+static struct vrt_value_type  _vrt_value_type_timed = {
+    vrt_value_timed_new,
+    vrt_value_timed_free
+};
+
+struct vrt_value_type *
+vrt_value_type_timed(void)
+{
+    return &_vrt_value_type_timed;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Schedules
+ */
+
+/* If the next send is further away than this, we sleep instead of
+ * spinning on the clock. */
+#define SLEEP_THRESHOLD  100000  /* nsec */
+/* ...but we wake up this early, since nanosleep tends to oversleep. */
+#define SLEEP_SLACK  50000  /* nsec */
+
+struct vrt_loadgen_clock {
+    const struct vrt_loadgen_schedule  *schedule;
+    vrt_nsec  interval;
+    vrt_nsec  next;
+    vrt_nsec  cycle_start;
+    uint64_t  rng;
+};
+
+static void
+vrt_loadgen_clock_init(struct vrt_loadgen_clock *clock,
+                       const struct vrt_loadgen_schedule *schedule,
+                       vrt_nsec start)
+{
+    clock->schedule = schedule;
+    clock->interval = 1000000000.0 / schedule->rate;
+    if (clock->interval == 0) {
+        clock->interval = 1;
+    }
+    clock->next = start;
+    clock->cycle_start = start;
+    clock->rng = (schedule->seed == 0)? 1: schedule->seed;
+}
+
+/* xorshift64*; we only need something cheap and repeatable. */
+static double
+vrt_loadgen_random(struct vrt_loadgen_clock *clock)
+{
+    clock->rng ^= clock->rng >> 12;
+    clock->rng ^= clock->rng << 25;
+    clock->rng ^= clock->rng >> 27;
+    /* 53 random bits, giving a value in [0, 1) */
+    return ((clock->rng * UINT64_C(2685821657736338717)) >> 11)
+         / 9007199254740992.0;
+}
+
+static void
+vrt_loadgen_clock_advance(struct vrt_loadgen_clock *clock)
+{
+    const struct vrt_loadgen_schedule  *schedule = clock->schedule;
+    switch (schedule->pattern) {
+        case VRT_LOADGEN_FIXED:
+            clock->next += clock->interval;
+            break;
+
+        case VRT_LOADGEN_POISSON:
+            clock->next += -log(1.0 - vrt_loadgen_random(clock))
+                         * (1000000000.0 / schedule->rate);
+            break;
+
+        case VRT_LOADGEN_ON_OFF:
+            clock->next += clock->interval;
+            if (clock->next - clock->cycle_start >= schedule->on_period) {
+                clock->cycle_start +=
+                    schedule->on_period + schedule->off_period;
+                clock->next = clock->cycle_start;
+            }
+            break;
+
+        default:
+            cork_unreachable();
+    }
+}
+
+double
+vrt_loadgen_offered_rate(const struct vrt_loadgen_schedule *schedule)
+{
+    if (schedule->pattern == VRT_LOADGEN_ON_OFF) {
+        return schedule->rate * schedule->on_period
+             / (schedule->on_period + schedule->off_period);
+    } else {
+        return schedule->rate;
+    }
+}
+
+const char *
+vrt_loadgen_pattern_name(enum vrt_loadgen_pattern pattern)
+{
+    switch (pattern) {
+        case VRT_LOADGEN_FIXED:
+            return "fixed";
+        case VRT_LOADGEN_POISSON:
+            return "poisson";
+        case VRT_LOADGEN_ON_OFF:
+            return "on/off";
+        default:
+            cork_unreachable();
+    }
+}
+
+static void
+vrt_loadgen_wait_until(vrt_nsec when)
+{
+    vrt_nsec  now;
+    vrt_get_nsec(&now);
+    if (when > now + SLEEP_THRESHOLD) {
+        struct timespec  ts;
+        vrt_nsec  duration = when - now - SLEEP_SLACK;
+        ts.tv_sec = duration / 1000000000;
+        ts.tv_nsec = duration % 1000000000;
+        nanosleep(&ts, NULL);
+    }
+    do {
+        vrt_get_nsec(&now);
+    } while (now < when);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Open-loop producer
+ */
+
+void *
+vrt_loadgen_produce(void *ud)
+{
+    struct vrt_loadgen_producer_config  *c = ud;
+    struct vrt_producer  *p = c->p;
+    struct vrt_loadgen_clock  clock;
+    uint64_t  i;
+
+    vrt_get_nsec(&c->start);
+    vrt_loadgen_clock_init(&clock, &c->schedule, c->start);
+
+    for (i = 0; i < c->count; i++) {
+        struct vrt_value  *vvalue;
+        struct vrt_value_timed  *value;
+        vrt_nsec  now;
+
+        vrt_get_nsec(&now);
+        if (now < clock.next) {
+            /* We're ahead of schedule.  Make sure that nothing we've
+             * already produced is stuck in a partial batch, and then
+             * wait for the next send time. */
+            if (vrt_mod_lt(p->last_produced_id, p->last_claimed_id)) {
+                rpi_check(vrt_producer_flush(p));
+            }
+            vrt_loadgen_wait_until(clock.next);
+        }
+
+        /* If we're behind schedule, we send right away, but the value
+         * still carries the time that it *should* have been sent. */
+        rpi_check(vrt_producer_claim(p, &vvalue));
+        value = cork_container_of(vvalue, struct vrt_value_timed, parent);
+        value->intended = clock.next;
+        vrt_get_nsec(&value->sent);
+        rpi_check(vrt_producer_publish(p));
+        vrt_loadgen_clock_advance(&clock);
+    }
+
+    rpi_check(vrt_producer_eof(p));
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Latency-measuring consumer
+ */
+
+void *
+vrt_loadgen_consume(void *ud)
+{
+    int  rc;
+    struct vrt_loadgen_consumer_config  *c = ud;
+    struct vrt_value  *vvalue;
+
+    vrt_histogram_init(&c->intended);
+    vrt_histogram_init(&c->sent);
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_timed  *value =
+                cork_container_of(vvalue, struct vrt_value_timed, parent);
+            vrt_get_nsec(&c->finish);
+            vrt_histogram_add(&c->intended, c->finish - value->intended);
+            vrt_histogram_add(&c->sent, c->finish - value->sent);
+        } else if (rc != VRT_QUEUE_FLUSH) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
@@ -8,17 +8,80 @@
  * ----------------------------------------------------------------------
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <sched.h>
 #include <stdlib.h>
 
 #include <libcork/core.h>
 #include <libcork/helpers/errors.h>
 #include <pthread.h>
 
+#include "vrt/cpu.h"
 #include "vrt/queue.h"
 
 #include "helpers.h"
 #include "queue.h"
 
+/* Runs a client's function, and then records how much CPU time its
+ * thread used. */
+static void *
+vrt_test_queue_client_thread(void *ud)
+{
+    struct vrt_queue_client  *client = ud;
+    void  *result = client->run(client->ud);
+    vrt_get_cpu_clock(&client->cpu_time);
+    return result;
+}
+
+static enum vrt_cpu_policy  placement = VRT_CPU_POLICY_NONE;
+
+void
+vrt_test_queue_set_placement(enum vrt_cpu_policy policy)
+{
+    placement = policy;
+}
+
+/* Starts a thread for each client, pinning it to a CPU chosen by the
+ * current placement policy. */
+static void
+vrt_test_queue_start(struct vrt_queue_client *clients, size_t client_count,
+                     pthread_t *thread_ids, bool spinning)
+{
+    struct vrt_cpu_topology  *topo = vrt_cpu_topology_new(NULL);
+    bool  *spins = cork_calloc(client_count, sizeof(bool));
+    int  *cpus = cork_calloc(client_count, sizeof(int));
+    size_t  i;
+
+    for (i = 0; i < client_count; i++) {
+        spins[i] = spinning;
+    }
+    vrt_cpu_place(topo, placement, client_count, spins, cpus);
+
+    for (i = 0; i < client_count; i++) {
+        pthread_attr_t  attr;
+        pthread_attr_init(&attr);
+        clients[i].cpu = cpus[i];
+#if defined(__linux__)
+        if (cpus[i] >= 0) {
+            cpu_set_t  set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+#endif
+        pthread_create(&thread_ids[i], &attr,
+                       vrt_test_queue_client_thread, &clients[i]);
+        pthread_attr_destroy(&attr);
+    }
+
+    free(cpus);
+    free(spins);
+    vrt_cpu_topology_free(topo);
+}
+
 int
 vrt_test_queue_threaded(struct vrt_queue *q,
                             struct vrt_queue_client *clients,
@@ -49,9 +112,7 @@ vrt_test_queue_threaded(struct vrt_queue *q,
         c->yield = vrt_yield_strategy_threaded();
     }
 
-    for (i = 0; i < client_count; i++) {
-        pthread_create(&thread_ids[i], NULL, clients[i].run, clients[i].ud);
-    }
+    vrt_test_queue_start(clients, client_count, thread_ids, false);
 
     for (i = 0; i < client_count; i++) {
         pthread_join(thread_ids[i], NULL);
@@ -94,9 +155,7 @@ vrt_test_queue_threaded_spin(struct vrt_queue *q,
         c->yield = vrt_yield_strategy_spin_wait();
     }
 
-    for (i = 0; i < client_count; i++) {
-        pthread_create(&thread_ids[i], NULL, clients[i].run, clients[i].ud);
-    }
+    vrt_test_queue_start(clients, client_count, thread_ids, true);
 
     for (i = 0; i < client_count; i++) {
         pthread_join(thread_ids[i], NULL);
@@ -139,10 +198,83 @@ vrt_test_queue_threaded_hybrid(struct vrt_queue *q,
         c->yield = vrt_yield_strategy_hybrid();
     }
 
+    vrt_test_queue_start(clients, client_count, thread_ids, false);
+
     for (i = 0; i < client_count; i++) {
-        pthread_create(&thread_ids[i], NULL, clients[i].run, clients[i].ud);
+        pthread_join(thread_ids[i], NULL);
     }
 
+    free(thread_ids);
+    vrt_get_clock(&end_time);
+
+    *elapsed = (end_time - start_time);
+    return 0;
+}
+
+int
+vrt_test_queue_threaded_umwait(struct vrt_queue *q,
+                               struct vrt_queue_client *clients,
+                               vrt_clock *elapsed)
+{
+    vrt_clock  start_time;
+    vrt_clock  end_time;
+
+    vrt_get_clock(&start_time);
+
+    size_t  i;
+    size_t  client_count = 0;
+    struct vrt_queue_client  *client;
+    for (client = clients; client->run != NULL; client++) {
+        client_count++;
+    }
+
+    pthread_t  *thread_ids;
+    thread_ids = cork_calloc(client_count, sizeof(pthread_t));
+
+    for (i = 0; i < cork_array_size(&q->producers); i++) {
+        struct vrt_producer  *p = cork_array_at(&q->producers, i);
+        p->yield = vrt_yield_strategy_umwait();
+    }
+
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        c->yield = vrt_yield_strategy_umwait();
+    }
+
+    vrt_test_queue_start(clients, client_count, thread_ids, false);
+
+    for (i = 0; i < client_count; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    free(thread_ids);
+    vrt_get_clock(&end_time);
+
+    *elapsed = (end_time - start_time);
+    return 0;
+}
+
+int
+vrt_test_clients_threaded(struct vrt_queue_client *clients,
+                          vrt_clock *elapsed)
+{
+    vrt_clock  start_time;
+    vrt_clock  end_time;
+
+    vrt_get_clock(&start_time);
+
+    size_t  i;
+    size_t  client_count = 0;
+    struct vrt_queue_client  *client;
+    for (client = clients; client->run != NULL; client++) {
+        client_count++;
+    }
+
+    pthread_t  *thread_ids;
+    thread_ids = cork_calloc(client_count, sizeof(pthread_t));
+
+    vrt_test_queue_start(clients, client_count, thread_ids, false);
+
     for (i = 0; i < client_count; i++) {
         pthread_join(thread_ids[i], NULL);
     }
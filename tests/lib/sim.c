@@ -0,0 +1,324 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include <libcork/core.h>
+
+#include "vrt/atomic.h"
+#include "vrt/yield.h"
+
+#include "sim.h"
+
+#define STACK_SIZE  (64 * 1024)
+
+/* The simulator that's currently running, if any.  Schedule points
+ * outside of a run (while setting up a queue, for instance) are
+ * ignored. */
+static struct vrt_sim  *active_sim = NULL;
+
+
+/*-----------------------------------------------------------------------
+ * Setup
+ */
+
+/* xorshift64 */
+static uint64_t
+vrt_sim_random(struct vrt_sim *sim)
+{
+    sim->rng ^= sim->rng << 13;
+    sim->rng ^= sim->rng >> 7;
+    sim->rng ^= sim->rng << 17;
+    return sim->rng;
+}
+
+static void
+vrt_sim_init(struct vrt_sim *sim, size_t max_steps)
+{
+    memset(sim, 0, sizeof(struct vrt_sim));
+    sim->max_steps = max_steps;
+}
+
+void
+vrt_sim_init_random(struct vrt_sim *sim, uint64_t seed, size_t max_steps)
+{
+    vrt_sim_init(sim, max_steps);
+    sim->random = true;
+    /* Run the seed through splitmix64 so that consecutive seeds give
+     * unrelated schedules. */
+    seed += UINT64_C(0x9e3779b97f4a7c15);
+    seed = (seed ^ (seed >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    seed = (seed ^ (seed >> 27)) * UINT64_C(0x94d049bb133111eb);
+    sim->rng = (seed ^ (seed >> 31)) | 1;
+    sim->switch_odds = 1 << (vrt_sim_random(sim) % 6);
+}
+
+void
+vrt_sim_init_systematic(struct vrt_sim *sim, unsigned int preemption_bound,
+                        size_t max_steps)
+{
+    vrt_sim_init(sim, max_steps);
+    sim->random = false;
+    sim->preemption_bound = preemption_bound;
+    sim->prefix = cork_calloc(max_steps, sizeof(unsigned int));
+    sim->chosen = cork_calloc(max_steps, sizeof(unsigned int));
+    sim->options = cork_calloc(max_steps, sizeof(unsigned int));
+    sim->preemptions_before = cork_calloc(max_steps, sizeof(unsigned int));
+    sim->preemptible = cork_calloc(max_steps, sizeof(bool));
+}
+
+void
+vrt_sim_done(struct vrt_sim *sim)
+{
+    if (!sim->random) {
+        free(sim->prefix);
+        free(sim->chosen);
+        free(sim->options);
+        free(sim->preemptions_before);
+        free(sim->preemptible);
+    }
+}
+
+void
+vrt_sim_add_actor(struct vrt_sim *sim, const char *name,
+                  vrt_sim_actor_f run, void *ud)
+{
+    struct vrt_sim_actor  *actor;
+    assert(sim->actor_count < VRT_SIM_MAX_ACTORS);
+    actor = &sim->actors[sim->actor_count++];
+    memset(actor, 0, sizeof(struct vrt_sim_actor));
+    actor->name = name;
+    actor->run = run;
+    actor->ud = ud;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Scheduling
+ */
+
+/* A waiting actor can run again once some other actor has written to a
+ * shared value. */
+#define vrt_sim_can_run(sim, actor) \
+    (!(actor)->finished && \
+     (!(actor)->waiting || (actor)->wait_writes < (sim)->writes))
+
+static struct vrt_sim_actor *
+vrt_sim_choose(struct vrt_sim *sim)
+{
+    struct vrt_sim_actor  *candidates[VRT_SIM_MAX_ACTORS];
+    struct vrt_sim_actor  *current = sim->current;
+    bool  can_continue =
+        (current != NULL && !current->finished && !current->waiting);
+    bool  preemptible;
+    unsigned int  count = 0;
+    unsigned int  unfinished = 0;
+    unsigned int  index;
+    unsigned int  i;
+
+    /* The current actor (if it can keep going) always comes first, so
+     * that choice 0 means "don't switch". */
+    if (can_continue) {
+        candidates[count++] = current;
+    }
+    for (i = 0; i < sim->actor_count; i++) {
+        struct vrt_sim_actor  *actor = &sim->actors[i];
+        if (!actor->finished) {
+            unfinished++;
+        }
+        if (actor != current && vrt_sim_can_run(sim, actor)) {
+            candidates[count++] = actor;
+        }
+    }
+    if (current != NULL && current->waiting && vrt_sim_can_run(sim, current)) {
+        candidates[count++] = current;
+    }
+
+    if (count == 0) {
+        sim->deadlocked = (unfinished > 0);
+        return NULL;
+    }
+
+    preemptible = can_continue && count > 1;
+    if (sim->random) {
+        if (can_continue && vrt_sim_random(sim) % sim->switch_odds != 0) {
+            index = 0;
+        } else {
+            index = vrt_sim_random(sim) % count;
+        }
+    } else {
+        size_t  step = sim->steps;
+        index = (step < sim->prefix_length)? sim->prefix[step]: 0;
+        if (index >= count) {
+            index = 0;
+        }
+        sim->chosen[step] = index;
+        sim->options[step] = count;
+        sim->preemptible[step] = preemptible;
+        sim->preemptions_before[step] = sim->preemptions;
+    }
+
+    if (preemptible && index != 0) {
+        sim->preemptions++;
+    }
+    sim->steps++;
+    return candidates[index];
+}
+
+static void
+vrt_sim_actor_main(void)
+{
+    struct vrt_sim_actor  *actor = active_sim->current;
+    actor->run(actor->ud);
+    actor->finished = true;
+    /* Returning resumes the scheduler, via uc_link. */
+}
+
+void
+vrt_schedule_point(bool is_write)
+{
+    struct vrt_sim  *sim = active_sim;
+    struct vrt_sim_actor  *actor;
+    if (sim == NULL || sim->current == NULL) {
+        return;
+    }
+    actor = sim->current;
+    swapcontext(&actor->context, &sim->scheduler);
+    actor->waiting = false;
+    /* The access happens as soon as we return, before the next schedule
+     * point. */
+    if (is_write) {
+        sim->writes++;
+        actor->have_read = false;
+    } else if (!actor->have_read) {
+        actor->have_read = true;
+        actor->first_read_writes = sim->writes;
+    }
+}
+
+int
+vrt_sim_run(struct vrt_sim *sim)
+{
+    struct vrt_sim_actor  *next;
+    unsigned int  i;
+
+    active_sim = sim;
+    sim->current = NULL;
+    sim->steps = 0;
+    sim->writes = 0;
+    sim->preemptions = 0;
+    sim->aborted = false;
+    sim->deadlocked = false;
+
+    while (true) {
+        if (sim->steps >= sim->max_steps) {
+            sim->aborted = true;
+            break;
+        }
+
+        next = vrt_sim_choose(sim);
+        if (next == NULL) {
+            break;
+        }
+
+        if (sim->trace && next != sim->current) {
+            fprintf(stderr, "    [%zu] switch to %s\n",
+                    sim->steps, next->name);
+        }
+
+        sim->current = next;
+        if (!next->started) {
+            next->started = true;
+            next->stack = cork_malloc(STACK_SIZE);
+            getcontext(&next->context);
+            next->context.uc_stack.ss_sp = next->stack;
+            next->context.uc_stack.ss_size = STACK_SIZE;
+            next->context.uc_link = &sim->scheduler;
+            makecontext(&next->context, vrt_sim_actor_main, 0);
+        }
+        swapcontext(&sim->scheduler, &next->context);
+    }
+
+    /* If we aborted, any unfinished actors are simply abandoned. */
+    for (i = 0; i < sim->actor_count; i++) {
+        free(sim->actors[i].stack);
+    }
+    sim->actor_count = 0;
+    sim->current = NULL;
+    active_sim = NULL;
+    return (sim->aborted || sim->deadlocked)? -1: 0;
+}
+
+bool
+vrt_sim_next_schedule(struct vrt_sim *sim)
+{
+    /* Find the latest decision that still has an untried alternative
+     * within the preemption bound, and replay everything before it. */
+    size_t  step = sim->steps;
+    while (step-- > 0) {
+        unsigned int  next = sim->chosen[step] + 1;
+        unsigned int  preemptions = sim->preemptions_before[step];
+        if (next >= sim->options[step]) {
+            continue;
+        }
+        if (sim->preemptible[step]) {
+            preemptions++;
+        }
+        if (preemptions > sim->preemption_bound) {
+            continue;
+        }
+        memcpy(sim->prefix, sim->chosen, step * sizeof(unsigned int));
+        sim->prefix[step] = next;
+        sim->prefix_length = step + 1;
+        return true;
+    }
+    return false;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Yield strategy
+ */
+
+static int
+vrt_sim_yield(struct vrt_yield_strategy *self, bool first,
+              const char *queue_name, const char *name)
+{
+    if (active_sim != NULL && active_sim->current != NULL) {
+        struct vrt_sim_actor  *actor = active_sim->current;
+        actor->waiting = true;
+        actor->wait_writes = actor->have_read?
+            actor->first_read_writes: active_sim->writes;
+        actor->have_read = false;
+        vrt_schedule_point(false);
+    }
+    return 0;
+}
+
+static void
+vrt_sim_yield_free(struct vrt_yield_strategy *self)
+{
+    /* No-op; this is a static object */
+}
+
+static struct vrt_yield_strategy  vrt_sim_yield_strategy = {
+    vrt_sim_yield,
+    vrt_sim_yield_free
+};
+
+struct vrt_yield_strategy *
+vrt_yield_strategy_sim(void)
+{
+    return &vrt_sim_yield_strategy;
+}
@@ -0,0 +1,402 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+
+#include <check.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * A fake sysfs tree
+ */
+
+/* Two packages, each with two cores, each with two hyperthreads.  CPU n
+ * and n+4 are SMT siblings, like on most Intel machines:
+ *
+ *   package 0: core 0 (CPUs 0, 4), core 1 (CPUs 1, 5)
+ *   package 1: core 2 (CPUs 2, 6), core 3 (CPUs 3, 7)
+ *
+ * Each core has its own L1 and L2 caches, and each package has a shared
+ * L3 cache. */
+
+#define ROOT_TEMPLATE  "/tmp/vrt-cpu-XXXXXX"
+static char  root[] = ROOT_TEMPLATE;
+
+static void
+write_file(const char *path, const char *contents)
+{
+    char  full[4096];
+    char  *slash;
+    FILE  *fp;
+
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    for (slash = strchr(full + strlen(root) + 1, '/'); slash != NULL;
+         slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(full, 0700);
+        *slash = '/';
+    }
+
+    fp = fopen(full, "w");
+    fail_if(fp == NULL, "Cannot create %s", full);
+    fprintf(fp, "%s\n", contents);
+    fclose(fp);
+}
+
+static void
+write_cache(int cpu, int index, int level, const char *type,
+            const char *shared)
+{
+    char  path[256];
+    char  value[32];
+    snprintf(path, sizeof(path), "cpu%d/cache/index%d/level", cpu, index);
+    snprintf(value, sizeof(value), "%d", level);
+    write_file(path, value);
+    snprintf(path, sizeof(path), "cpu%d/cache/index%d/type", cpu, index);
+    write_file(path, type);
+    snprintf(path, sizeof(path),
+             "cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+    write_file(path, shared);
+}
+
+static void
+create_fake_sysfs(void)
+{
+    int  cpu;
+    strcpy(root, ROOT_TEMPLATE);
+    fail_if(mkdtemp(root) == NULL, "Cannot create temporary directory");
+    write_file("online", "0-7");
+    for (cpu = 0; cpu < 8; cpu++) {
+        char  path[256];
+        char  value[32];
+        int  core = cpu % 4;
+        int  package = core / 2;
+
+        snprintf(path, sizeof(path),
+                 "cpu%d/topology/physical_package_id", cpu);
+        snprintf(value, sizeof(value), "%d", package);
+        write_file(path, value);
+
+        snprintf(path, sizeof(path),
+                 "cpu%d/topology/thread_siblings_list", cpu);
+        snprintf(value, sizeof(value), "%d,%d", core, core + 4);
+        write_file(path, value);
+
+        write_cache(cpu, 0, 1, "Data", value);
+        write_cache(cpu, 1, 1, "Instruction", value);
+        write_cache(cpu, 2, 2, "Unified", value);
+        snprintf(value, sizeof(value), "%d-%d,%d-%d",
+                 package * 2, package * 2 + 1,
+                 package * 2 + 4, package * 2 + 5);
+        write_cache(cpu, 3, 3, "Unified", value);
+    }
+}
+
+static int
+remove_entry(const char *path, const struct stat *sb, int flag,
+             struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void
+remove_fake_sysfs(void)
+{
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static struct vrt_cpu_topology *
+fake_topology(void)
+{
+    struct vrt_cpu_topology  *topo;
+    create_fake_sysfs();
+    topo = vrt_cpu_topology_new(root);
+    remove_fake_sysfs();
+    return topo;
+}
+
+#define check_placement(topo, policy, count, spinning, expected) \
+    do { \
+        int  __cpus[count]; \
+        size_t  __i; \
+        vrt_cpu_place((topo), (policy), (count), (spinning), __cpus); \
+        for (__i = 0; __i < (count); __i++) { \
+            fail_unless(__cpus[__i] == (expected)[__i], \
+                        "Stage %zu placed on CPU %d, expected %d", \
+                        __i, __cpus[__i], (expected)[__i]); \
+        } \
+    } while (0)
+
+
+/*-----------------------------------------------------------------------
+ * Reading the topology
+ */
+
+START_TEST(test_cpu_topology)
+{
+    DESCRIBE_TEST;
+    struct vrt_cpu_topology  *topo = fake_topology();
+    struct vrt_cpu  *cpu;
+
+    fail_unless(cork_array_size(&topo->cpus) == 8,
+                "Expected 8 CPUs, got %zu", cork_array_size(&topo->cpus));
+
+    fail_if((cpu = vrt_cpu_topology_get(topo, 5)) == NULL,
+            "Missing CPU 5");
+    fail_unless(cpu->package == 0 && cpu->core == 1 &&
+                cpu->l2 == 1 && cpu->llc == 0,
+                "Wrong topology for CPU 5: %d/%d/%d/%d",
+                cpu->package, cpu->core, cpu->l2, cpu->llc);
+
+    fail_if((cpu = vrt_cpu_topology_get(topo, 6)) == NULL,
+            "Missing CPU 6");
+    fail_unless(cpu->package == 1 && cpu->core == 2 &&
+                cpu->l2 == 2 && cpu->llc == 2,
+                "Wrong topology for CPU 6: %d/%d/%d/%d",
+                cpu->package, cpu->core, cpu->l2, cpu->llc);
+
+    fail_unless(vrt_cpu_topology_get(topo, 8) == NULL,
+                "Unexpected CPU 8");
+
+#define check_distance(a, b, expected) \
+    fail_unless(vrt_cpu_distance(vrt_cpu_topology_get(topo, a), \
+                                 vrt_cpu_topology_get(topo, b)) \
+                == expected, \
+                "Unexpected distance between CPU %d and %d", a, b)
+    check_distance(0, 0, 0);
+    check_distance(0, 4, 1);
+    check_distance(0, 5, 3);
+    check_distance(1, 2, 5);
+#undef check_distance
+
+    vrt_cpu_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_cpu_missing_topology)
+{
+    DESCRIBE_TEST;
+    struct vrt_cpu_topology  *topo =
+        vrt_cpu_topology_new("/nonexistent/vrt/cpu");
+    size_t  i;
+    fail_if(cork_array_size(&topo->cpus) == 0, "No CPUs");
+    for (i = 0; i < cork_array_size(&topo->cpus); i++) {
+        struct vrt_cpu  *cpu = &cork_array_at(&topo->cpus, i);
+        fail_unless(cpu->core == cpu->id && cpu->llc == cpu->id,
+                    "CPU %d should be its own core", cpu->id);
+    }
+    vrt_cpu_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_cpu_real_topology)
+{
+    DESCRIBE_TEST;
+    struct vrt_cpu_topology  *topo = vrt_cpu_topology_new(NULL);
+    int  cpus[4];
+    size_t  i;
+    fail_if(cork_array_size(&topo->cpus) == 0, "No CPUs");
+    vrt_cpu_place(topo, VRT_CPU_POLICY_COMPACT, 4, NULL, cpus);
+    for (i = 0; i < 4; i++) {
+        fail_if(vrt_cpu_topology_get(topo, cpus[i]) == NULL,
+                "Stage %zu placed on unknown CPU %d", i, cpus[i]);
+    }
+    vrt_cpu_topology_free(topo);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Placement
+ */
+
+START_TEST(test_cpu_policy_names)
+{
+    DESCRIBE_TEST;
+    fail_unless(vrt_cpu_policy_by_name("compact") ==
+                VRT_CPU_POLICY_COMPACT, "Unexpected policy");
+    fail_unless(vrt_cpu_policy_by_name("scatter") ==
+                VRT_CPU_POLICY_SCATTER, "Unexpected policy");
+    fail_unless(vrt_cpu_policy_by_name("none") ==
+                VRT_CPU_POLICY_NONE, "Unexpected policy");
+    fail_unless(vrt_cpu_policy_by_name("random") == -1,
+                "Unexpected policy");
+    fail_unless(strcmp(vrt_cpu_policy_name(VRT_CPU_POLICY_SCATTER),
+                       "scatter") == 0, "Unexpected policy name");
+}
+END_TEST
+
+START_TEST(test_cpu_place_compact)
+{
+    DESCRIBE_TEST;
+    struct vrt_cpu_topology  *topo = fake_topology();
+
+    /* Adjacent stages that yield can share a core. */
+    int  expected[] = { 0, 4, 1 };
+    check_placement(topo, VRT_CPU_POLICY_COMPACT, 3, NULL, expected);
+
+    /* Spinning stages each get a core of their own, staying in the same
+     * package for as long as possible. */
+    bool  spinning[] = { true, true, true };
+    int  expected_spin[] = { 0, 1, 2 };
+    check_placement(topo, VRT_CPU_POLICY_COMPACT, 3, spinning,
+                    expected_spin);
+
+    /* A yielding stage can't go on a spinning stage's sibling. */
+    bool  mixed[] = { true, false, false };
+    int  expected_mixed[] = { 0, 1, 5 };
+    check_placement(topo, VRT_CPU_POLICY_COMPACT, 3, mixed, expected_mixed);
+
+    vrt_cpu_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_cpu_place_scatter)
+{
+    DESCRIBE_TEST;
+    struct vrt_cpu_topology  *topo = fake_topology();
+    int  expected[] = { 0, 2, 1, 3 };
+    check_placement(topo, VRT_CPU_POLICY_SCATTER, 4, NULL, expected);
+    vrt_cpu_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_cpu_place_oversubscribed)
+{
+    DESCRIBE_TEST;
+    struct vrt_cpu_topology  *topo = fake_topology();
+    bool  spinning[10];
+    int  cpus[10];
+    size_t  shared;
+    size_t  i;
+
+    /* Once every core is taken, spinning stages fall back to SMT
+     * siblings before they share a CPU. */
+    for (i = 0; i < 10; i++) {
+        spinning[i] = true;
+    }
+    shared = vrt_cpu_place(topo, VRT_CPU_POLICY_COMPACT, 5, spinning, cpus);
+    fail_unless(shared == 0, "Unexpected sharing");
+    fail_unless(cpus[4] == 7, "Stage 4 placed on CPU %d", cpus[4]);
+
+    shared = vrt_cpu_place(topo, VRT_CPU_POLICY_COMPACT, 10, spinning, cpus);
+    fail_unless(shared == 2, "Expected 2 shared stages, got %zu", shared);
+
+    vrt_cpu_place(topo, VRT_CPU_POLICY_NONE, 10, spinning, cpus);
+    for (i = 0; i < 10; i++) {
+        fail_unless(cpus[i] == -1, "Stage %zu shouldn't be pinned", i);
+    }
+
+    vrt_cpu_topology_free(topo);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * CPU budget
+ */
+
+START_TEST(test_cpu_quota)
+{
+    DESCRIBE_TEST;
+    struct vrt_cpu_throttling  throttling;
+    char  dir[256];
+    double  quota;
+
+    /* The pod's quota is tighter than the container's, and the root
+     * cgroup doesn't have a cpu.max at all. */
+    strcpy(root, ROOT_TEMPLATE);
+    fail_if(mkdtemp(root) == NULL, "Cannot create temporary directory");
+    write_file("pod/cpu.max", "150000 100000");
+    write_file("pod/container/cpu.max", "max 100000");
+    write_file("pod/container/cpu.stat",
+               "usage_usec 1000\n"
+               "nr_periods 40\n"
+               "nr_throttled 7\n"
+               "throttled_usec 123456");
+    write_file("unlimited/cpu.max", "max 100000");
+
+    snprintf(dir, sizeof(dir), "%s/pod/container", root);
+    quota = vrt_cpu_quota(dir);
+    fail_unless(quota == 1.5, "Unexpected quota %.2lf", quota);
+    vrt_cpu_throttling_get(dir, &throttling);
+    fail_unless(throttling.periods == 40 &&
+                throttling.throttled_periods == 7 &&
+                throttling.throttled_usec == 123456,
+                "Unexpected throttling statistics");
+
+    snprintf(dir, sizeof(dir), "%s/unlimited", root);
+    quota = vrt_cpu_quota(dir);
+    fail_unless(quota == 0, "Unexpected quota %.2lf", quota);
+    vrt_cpu_throttling_get(dir, &throttling);
+    fail_unless(throttling.periods == 0, "Unexpected throttling statistics");
+
+    remove_fake_sysfs();
+
+    fail_unless(vrt_cpu_budget() > 0, "No CPU budget");
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("cpu");
+
+    TCase  *tc_topology = tcase_create("topology");
+    tcase_add_test(tc_topology, test_cpu_topology);
+    tcase_add_test(tc_topology, test_cpu_missing_topology);
+    tcase_add_test(tc_topology, test_cpu_real_topology);
+    suite_add_tcase(s, tc_topology);
+
+    TCase  *tc_place = tcase_create("place");
+    tcase_add_test(tc_place, test_cpu_policy_names);
+    tcase_add_test(tc_place, test_cpu_place_compact);
+    tcase_add_test(tc_place, test_cpu_place_scatter);
+    tcase_add_test(tc_place, test_cpu_place_oversubscribed);
+    suite_add_tcase(s, tc_place);
+
+    TCase  *tc_budget = tcase_create("budget");
+    tcase_add_test(tc_budget, test_cpu_quota);
+    suite_add_tcase(s, tc_budget);
+
+    return s;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -0,0 +1,353 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include <check.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+#include "integers.h"
+#include "queue.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define LANE_COUNT  3
+#define PRODUCER_COUNT  2
+#define VALUE_COUNT  100000
+
+static struct vrt_lanes *
+new_lanes(void)
+{
+    struct vrt_lanes  *lanes;
+    fail_if_error(lanes = vrt_lanes_new
+                  ("lanes", vrt_value_type_int(), LANE_COUNT, 64));
+    return lanes;
+}
+
+static struct vrt_lanes_producer *
+new_producer(struct vrt_lanes *lanes, unsigned int batch_size)
+{
+    struct vrt_lanes_producer  *lp;
+    unsigned int  i;
+    fail_if_error(lp = vrt_lanes_producer_new("produce", lanes, batch_size));
+    for (i = 0; i < lanes->lane_count; i++) {
+        lp->producers[i]->yield = vrt_yield_strategy_hybrid();
+    }
+    return lp;
+}
+
+static struct vrt_lanes_consumer *
+new_consumer(struct vrt_lanes *lanes)
+{
+    struct vrt_lanes_consumer  *lc;
+    fail_if_error(lc = vrt_lanes_consumer_new("consume", lanes));
+    lc->yield = vrt_yield_strategy_hybrid();
+    return lc;
+}
+
+static void
+publish_int(struct vrt_lanes_producer *lp, unsigned int lane, int32_t value)
+{
+    struct vrt_value  *vvalue;
+    fail_if_error(vrt_lanes_producer_claim(lp, lane, &vvalue));
+    cork_container_of(vvalue, struct vrt_value_int, parent)->value = value;
+    fail_if_error(vrt_lanes_producer_publish(lp, lane));
+}
+
+/* Checks that the next value comes from the expected lane, and has the
+ * expected contents. */
+static void
+expect_int(struct vrt_lanes_consumer *lc, unsigned int lane, int32_t value)
+{
+    struct vrt_value  *vvalue;
+    struct vrt_value_int  *actual;
+    fail_unless(vrt_lanes_consumer_next(lc, &vvalue) == 0,
+                "Expected value %d", value);
+    actual = cork_container_of(vvalue, struct vrt_value_int, parent);
+    fail_unless(lc->lane == lane && actual->value == value,
+                "Expected value %d from lane %u, got %d from lane %u",
+                value, lane, actual->value, lc->lane);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Single-threaded tests
+ */
+
+START_TEST(test_lanes_strict)
+{
+    DESCRIBE_TEST;
+    struct vrt_lanes  *lanes = new_lanes();
+    struct vrt_lanes_producer  *lp = new_producer(lanes, 1);
+    struct vrt_lanes_consumer  *lc = new_consumer(lanes);
+    struct vrt_value  *vvalue;
+
+    /* A backlog in the lowest lane doesn't hold up the higher ones. */
+    publish_int(lp, 2, 1);
+    publish_int(lp, 2, 2);
+    publish_int(lp, 2, 3);
+    publish_int(lp, 1, 4);
+    publish_int(lp, 0, 5);
+    expect_int(lc, 0, 5);
+    expect_int(lc, 1, 4);
+    expect_int(lc, 2, 1);
+
+    /* Something new in a higher lane jumps ahead of the rest. */
+    publish_int(lp, 0, 6);
+    expect_int(lc, 0, 6);
+    expect_int(lc, 2, 2);
+    expect_int(lc, 2, 3);
+
+    fail_if_error(vrt_lanes_producer_eof(lp));
+    fail_unless(vrt_lanes_consumer_next(lc, &vvalue) == VRT_QUEUE_EOF,
+                "Expected EOF");
+    fail_unless(lc->value_counts[0] == 2 && lc->value_counts[1] == 1 &&
+                lc->value_counts[2] == 3, "Wrong per-lane counts");
+
+    vrt_lanes_consumer_free(lc);
+    vrt_lanes_producer_free(lp);
+    vrt_lanes_free(lanes);
+}
+END_TEST
+
+START_TEST(test_lanes_weighted)
+{
+    DESCRIBE_TEST;
+    static const unsigned int  weights[LANE_COUNT] = { 2, 1, 1 };
+    static const unsigned int  bad_weights[LANE_COUNT] = { 2, 0, 1 };
+    struct vrt_lanes  *lanes = new_lanes();
+    struct vrt_lanes_producer  *lp = new_producer(lanes, 1);
+    struct vrt_lanes_consumer  *lc = new_consumer(lanes);
+    int32_t  i;
+
+    fail_unless_error(vrt_lanes_consumer_set_weights(lc, bad_weights),
+                      "Lane weights must be at least 1");
+    cork_error_clear();
+    fail_if_error(vrt_lanes_consumer_set_weights(lc, weights));
+
+    for (i = 0; i < 6; i++) {
+        publish_int(lp, 0, i);
+        publish_int(lp, 1, 100 + i);
+    }
+
+    /* The busy high lane can't starve the low lane... */
+    expect_int(lc, 0, 0);
+    expect_int(lc, 0, 1);
+    expect_int(lc, 1, 100);
+    expect_int(lc, 0, 2);
+    expect_int(lc, 0, 3);
+    expect_int(lc, 1, 101);
+    expect_int(lc, 0, 4);
+    expect_int(lc, 0, 5);
+    expect_int(lc, 1, 102);
+
+    /* ...and once it's empty, the low lane doesn't have to wait for it.
+     * The high lane still goes first within a round. */
+    expect_int(lc, 1, 103);
+    publish_int(lp, 0, 6);
+    expect_int(lc, 0, 6);
+    expect_int(lc, 1, 104);
+    expect_int(lc, 1, 105);
+
+    vrt_lanes_consumer_free(lc);
+    vrt_lanes_producer_free(lp);
+    vrt_lanes_free(lanes);
+}
+END_TEST
+
+START_TEST(test_lanes_errors)
+{
+    DESCRIBE_TEST;
+    struct vrt_lanes  *lanes;
+    struct vrt_lanes_producer  *lp;
+    struct vrt_lanes_consumer  *lc;
+    struct vrt_consumer  *upstream;
+    struct vrt_value  *vvalue;
+
+    fail_unless_error(vrt_lanes_new
+                      ("lanes", vrt_value_type_int(), 0, 64),
+                      "Lanes need at least one lane");
+    cork_error_clear();
+    fail_unless_error(vrt_lanes_new
+                      ("lanes", vrt_value_type_int(), VRT_LANES_MAX + 1, 64),
+                      "Lanes can't have too many lanes");
+    cork_error_clear();
+
+    lanes = new_lanes();
+    lp = new_producer(lanes, 1);
+    fail_unless_error(vrt_lanes_producer_claim(lp, LANE_COUNT, &vvalue),
+                      "Can't claim a value in a lane that doesn't exist");
+    cork_error_clear();
+
+    /* A lane consumer can't follow some other consumer of its lanes. */
+    upstream = vrt_consumer_new("upstream", lanes->lanes[1]);
+    lc = new_consumer(lanes);
+    vrt_consumer_add_dependency(lc->consumers[1], upstream);
+    publish_int(lp, 1, 1);
+    fail_unless_error(vrt_lanes_consumer_next(lc, &vvalue),
+                      "Lane consumers can't have dependencies");
+    cork_error_clear();
+
+    vrt_lanes_consumer_free(lc);
+    vrt_lanes_producer_free(lp);
+    vrt_lanes_free(lanes);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Threaded tests
+ */
+
+struct produce_config {
+    struct vrt_lanes_producer  *lp;
+    int64_t  count;
+};
+
+/* Spreads the values 0..count-1 across the lanes. */
+static void *
+produce_lanes(void *ud)
+{
+    struct produce_config  *c = ud;
+    int32_t  i;
+    for (i = 0; i < c->count; i++) {
+        unsigned int  lane = i % LANE_COUNT;
+        struct vrt_value  *vvalue;
+        rpi_check(vrt_lanes_producer_claim(c->lp, lane, &vvalue));
+        cork_container_of(vvalue, struct vrt_value_int, parent)->value = i;
+        rpi_check(vrt_lanes_producer_publish(c->lp, lane));
+    }
+    rpi_check(vrt_lanes_producer_eof(c->lp));
+    return NULL;
+}
+
+struct consume_config {
+    struct vrt_lanes_consumer  *lc;
+    int64_t  sum;
+    unsigned int  failures;
+};
+
+/* Sums every value, and checks that each one arrives in the lane that it
+ * was sent to. */
+static void *
+consume_lanes(void *ud)
+{
+    struct consume_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int  rc;
+    while ((rc = vrt_lanes_consumer_next(c->lc, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_int  *value =
+                cork_container_of(vvalue, struct vrt_value_int, parent);
+            c->sum += value->value;
+            if (value->value % LANE_COUNT != (int32_t) c->lc->lane) {
+                c->failures++;
+            }
+        } else if (rc != VRT_QUEUE_FLUSH) {
+            c->failures++;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+START_TEST(test_lanes_threaded)
+{
+    DESCRIBE_TEST;
+    struct vrt_lanes  *lanes = new_lanes();
+    struct produce_config  produce_configs[PRODUCER_COUNT];
+    struct consume_config  consume_configs[2];
+    struct vrt_queue_client  clients[PRODUCER_COUNT + 3];
+    int64_t  per_producer = VALUE_COUNT / PRODUCER_COUNT;
+    int64_t  expected_sum =
+        PRODUCER_COUNT * (per_producer * (per_producer - 1) / 2);
+    vrt_clock  elapsed;
+    unsigned int  i;
+
+    for (i = 0; i < PRODUCER_COUNT; i++) {
+        produce_configs[i].lp = new_producer(lanes, 4);
+        produce_configs[i].count = per_producer;
+        clients[i].run = produce_lanes;
+        clients[i].ud = &produce_configs[i];
+    }
+
+    /* Every lane consumer sees every value. */
+    for (i = 0; i < 2; i++) {
+        consume_configs[i].lc = new_consumer(lanes);
+        consume_configs[i].sum = 0;
+        consume_configs[i].failures = 0;
+        clients[PRODUCER_COUNT + i].run = consume_lanes;
+        clients[PRODUCER_COUNT + i].ud = &consume_configs[i];
+    }
+    clients[PRODUCER_COUNT + 2].run = NULL;
+    clients[PRODUCER_COUNT + 2].ud = NULL;
+
+    fail_if_error(vrt_test_clients_threaded(clients, &elapsed));
+    vrt_report_clock(elapsed, VALUE_COUNT);
+    vrt_report_lanes_consumer(consume_configs[0].lc);
+
+    for (i = 0; i < 2; i++) {
+        fail_unless(consume_configs[i].failures == 0,
+                    "Consumer %u got %u values from the wrong lane",
+                    i, consume_configs[i].failures);
+        fail_unless(consume_configs[i].sum == expected_sum,
+                    "Consumer %u got sum %" PRId64 ", expected %" PRId64,
+                    i, consume_configs[i].sum, expected_sum);
+        vrt_lanes_consumer_free(consume_configs[i].lc);
+    }
+    for (i = 0; i < PRODUCER_COUNT; i++) {
+        vrt_lanes_producer_free(produce_configs[i].lp);
+    }
+    vrt_lanes_free(lanes);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("lanes");
+
+    TCase  *tc_lanes = tcase_create("lanes");
+    tcase_add_test(tc_lanes, test_lanes_strict);
+    tcase_add_test(tc_lanes, test_lanes_weighted);
+    tcase_add_test(tc_lanes, test_lanes_errors);
+    tcase_add_test(tc_lanes, test_lanes_threaded);
+    suite_add_tcase(s, tc_lanes);
+
+    return s;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
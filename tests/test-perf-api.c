@@ -0,0 +1,296 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+#include <vrt.h>
+
+#include "helpers.h"
+#include "integers.h"
+
+/* Measures the instruction cost of each producer and consumer API path,
+ * without any cross-core traffic.  A single thread drives both ends of
+ * a queue: it produces a round of values, then consumes a round, always
+ * keeping a backlog in the queue so that it's never full or empty.  The
+ * two halves of each round are timed separately, giving the cost per
+ * operation of each path for a range of batch sizes.
+ *
+ * (A consumer only publishes its cursor when it catches up with the
+ * values it knows are available, so the producer can get as far as
+ * about two backlogs plus two rounds ahead of the consumer's published
+ * cursor.  The queue has to be big enough for that, even for paths
+ * that use up a whole batch per operation.)
+ *
+ * Run it with a round count to get more stable numbers; the default is
+ * small enough to run on every change. */
+
+#define DEFAULT_ROUNDS  200
+#define ROUND_SIZE  128
+#define BACKLOG  256
+#define QUEUE_SIZE  64 * 1024
+
+#define API_TEST_ERROR  0x3b9ac417
+
+
+/*-----------------------------------------------------------------------
+ * Timestamps
+ */
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define UNIT  "cycles"
+
+static inline uint64_t
+timestamp(void)
+{
+    uint32_t  lo;
+    uint32_t  hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+#else
+#define UNIT  "nsec"
+
+static inline uint64_t
+timestamp(void)
+{
+    vrt_nsec  now;
+    vrt_get_nsec(&now);
+    return now;
+}
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * A yield strategy that never waits
+ */
+
+/* The backlog is supposed to keep us from ever blocking.  If we do
+ * block, there's no other thread to unblock us, so fail loudly. */
+static int
+never_yield(struct vrt_yield_strategy *self, bool first,
+            const char *queue_name, const char *name)
+{
+    cork_error_set_printf
+        (API_TEST_ERROR, "[%s] %s would block", queue_name, name);
+    return -1;
+}
+
+static void
+never_free(struct vrt_yield_strategy *self)
+{
+}
+
+static struct vrt_yield_strategy  never_strategy = {
+    never_yield,
+    never_free
+};
+
+
+/*-----------------------------------------------------------------------
+ * API paths
+ */
+
+/* Each path produces one "operation" worth of values, and tells us
+ * what the calls to vrt_consumer_next that consume them should return. */
+#define MAX_NEXTS  2
+
+struct api_path {
+    const char  *name;
+    int
+    (*produce)(struct vrt_producer *p);
+    unsigned int  nexts;
+    int  expected_rc[MAX_NEXTS];
+};
+
+static int
+produce_value(struct vrt_producer *p)
+{
+    struct vrt_value  *vvalue;
+    struct vrt_value_int  *value;
+    rii_check(vrt_producer_claim(p, &vvalue));
+    value = cork_container_of(vvalue, struct vrt_value_int, parent);
+    value->value = 0;
+    return vrt_producer_publish(p);
+}
+
+/* A hole followed by a value; vrt_consumer_next skips the hole
+ * internally, so this costs a single next. */
+static int
+produce_hole(struct vrt_producer *p)
+{
+    struct vrt_value  *vvalue;
+    rii_check(vrt_producer_claim(p, &vvalue));
+    rii_check(vrt_producer_skip(p));
+    return produce_value(p);
+}
+
+static int
+produce_flush(struct vrt_producer *p)
+{
+    return vrt_producer_flush(p);
+}
+
+static int
+produce_eof(struct vrt_producer *p)
+{
+    return vrt_producer_eof(p);
+}
+
+static int
+consume(struct vrt_consumer *c, const struct api_path *path)
+{
+    unsigned int  i;
+    for (i = 0; i < path->nexts; i++) {
+        struct vrt_value  *vvalue;
+        int  rc = vrt_consumer_next(c, &vvalue);
+        if (rc != path->expected_rc[i]) {
+            if (!cork_error_occurred()) {
+                cork_error_set_printf
+                    (API_TEST_ERROR, "Unexpected result %d from "
+                     "vrt_consumer_next", rc);
+            }
+            return -1;
+        }
+        if (rc == VRT_QUEUE_EOF) {
+            /* Pretend that the producer is still running, so that we
+             * can keep measuring EOFs. */
+            c->eof_count = 0;
+        }
+    }
+    return 0;
+}
+
+static int
+api_test(const struct api_path *path, unsigned int batch_size,
+         unsigned int rounds)
+{
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    unsigned int  i;
+    unsigned int  j;
+    uint64_t  start;
+    uint64_t  elapsed;
+    uint64_t  produce_total = 0;
+    uint64_t  produce_min = UINT64_MAX;
+    uint64_t  consume_total = 0;
+    uint64_t  consume_min = UINT64_MAX;
+
+    q = vrt_queue_new("queue_api", vrt_value_type_int(), QUEUE_SIZE);
+    p = vrt_producer_new("producer", batch_size, q);
+    c = vrt_consumer_new("consumer", q);
+    p->yield = &never_strategy;
+    c->yield = &never_strategy;
+
+    for (j = 0; j < BACKLOG; j++) {
+        ei_check(path->produce(p));
+    }
+
+    for (i = 0; i < rounds; i++) {
+        start = timestamp();
+        for (j = 0; j < ROUND_SIZE; j++) {
+            ei_check(path->produce(p));
+        }
+        elapsed = timestamp() - start;
+        produce_total += elapsed;
+        if (elapsed < produce_min) {
+            produce_min = elapsed;
+        }
+
+        start = timestamp();
+        for (j = 0; j < ROUND_SIZE; j++) {
+            ei_check(consume(c, path));
+        }
+        elapsed = timestamp() - start;
+        consume_total += elapsed;
+        if (elapsed < consume_min) {
+            consume_min = elapsed;
+        }
+    }
+
+    printf("%-14s %5u  %8.1lf %8.1lf  %8.1lf %8.1lf\n",
+           path->name, batch_size,
+           ((double) produce_total) / rounds / ROUND_SIZE,
+           ((double) produce_min) / ROUND_SIZE,
+           ((double) consume_total) / rounds / ROUND_SIZE,
+           ((double) consume_min) / ROUND_SIZE);
+
+    /* Don't let vrt_queue_free try to free our static strategy. */
+    p->yield = NULL;
+    c->yield = NULL;
+    vrt_queue_free(q);
+    return 0;
+
+error:
+    fprintf(stderr, "%s (batch size %u): %s\n",
+            path->name, batch_size, cork_error_message());
+    p->yield = NULL;
+    c->yield = NULL;
+    vrt_queue_free(q);
+    return -1;
+}
+
+static const struct api_path  PATHS[] = {
+    { "value", produce_value, 1, { 0 } },
+    { "hole+value", produce_hole, 1, { 0 } },
+    { "flush", produce_flush, 1, { VRT_QUEUE_FLUSH } },
+    /* An EOF is always followed by a FLUSH */
+    { "eof+flush", produce_eof, 2, { VRT_QUEUE_EOF, VRT_QUEUE_FLUSH } },
+    { NULL }
+};
+
+/* A flush or EOF uses up the rest of the producer's batch, so large
+ * batches would overrun the queue. */
+#define MAX_CONTROL_BATCH_SIZE  64
+
+static const unsigned int  BATCH_SIZES[] = { 1, 16, 64, 256, 0 };
+
+int
+main(int argc, const char * argv[])
+{
+    unsigned int  rounds = DEFAULT_ROUNDS;
+    const struct api_path  *path;
+    unsigned int  i;
+    int  failed = 0;
+
+    if (argc > 1) {
+        rounds = atoi(argv[1]);
+        if (rounds == 0) {
+            fprintf(stderr, "Usage: test-perf-api [rounds]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    fprintf(stdout, "\nSINGLE-THREAD API COST (%s per operation, "
+                    "%u rounds of %u)\n"
+                    "===================================================\n"
+                    "%-14s %5s  %8s %8s  %8s %8s\n",
+                    UNIT, rounds, ROUND_SIZE,
+                    "path", "batch", "produce", "(min)", "consume", "(min)");
+
+    for (path = PATHS; path->name != NULL; path++) {
+        for (i = 0; BATCH_SIZES[i] != 0; i++) {
+            if (path->expected_rc[0] != 0 &&
+                BATCH_SIZES[i] > MAX_CONTROL_BATCH_SIZE) {
+                continue;
+            }
+            if (api_test(path, BATCH_SIZES[i], rounds) != 0) {
+                failed = 1;
+            }
+        }
+    }
+
+    return failed? EXIT_FAILURE: EXIT_SUCCESS;
+}
@@ -0,0 +1,316 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+#include <vrt.h>
+
+#include "baseline.h"
+#include "helpers.h"
+#include "histogram.h"
+#include "queue.h"
+
+/* Compares varon-t against conventional queues (see baseline.h), using
+ * the same client harness, topologies, batch sizes, and payload sizes for
+ * each.  Every item carries the time that it was sent, followed by
+ * enough padding to make up the payload size.  The producers copy each
+ * item into the queue, and the consumers copy it back out, so that every
+ * queue does the same work per item.
+ *
+ * For each run, we report the throughput, the median and 99th percentile
+ * latency from send to receipt, and the CPU time that all of the
+ * clients used per item.  A client that spins while waiting burns CPU
+ * time, so the last column shows what each design costs to get its
+ * latency. */
+
+#define QUEUE_SIZE  1024
+#define ITEM_COUNT  200000
+#define MAX_PAYLOAD  512
+#define MAX_PRODUCERS  3
+#define POP_SIZE  64
+
+static const size_t  PAYLOAD_SIZES[] = { 16, 128, 512, 0 };
+static const unsigned int  BATCH_SIZES[] = { 1, 16, 0 };
+
+struct item {
+    vrt_nsec  sent;
+    int64_t  value;
+};
+
+
+/*-----------------------------------------------------------------------
+ * Payload values
+ */
+
+struct vrt_value_blob {
+    struct vrt_value  parent;
+    char  data[MAX_PAYLOAD];
+};
+
+static struct vrt_value *
+vrt_value_blob_new(struct vrt_value_type *type)
+{
+    struct vrt_value_blob  *self = cork_new(struct vrt_value_blob);
+    return &self->parent;
+}
+
+static void
+vrt_value_blob_free(struct vrt_value_type *type, struct vrt_value *vself)
+{
+    struct vrt_value_blob  *self =
+        cork_container_of(vself, struct vrt_value_blob, parent);
+    free(self);
+}
+
+static struct vrt_value_type  vrt_value_type_blob = {
+    vrt_value_blob_new,
+    vrt_value_blob_free
+};
+
+
+/*-----------------------------------------------------------------------
+ * Clients
+ */
+
+struct bench_producer {
+    struct vrt_producer  *p;
+    struct vrt_baseline_queue  *bq;
+    size_t  payload_size;
+    unsigned int  batch_size;
+    int64_t  count;
+};
+
+struct bench_consumer {
+    struct vrt_consumer  *c;
+    struct vrt_baseline_queue  *bq;
+    size_t  payload_size;
+    int64_t  count;
+    int64_t  sum;
+    struct vrt_histogram  latency;
+};
+
+static void *
+vrt_bench_producer(void *ud)
+{
+    struct bench_producer  *c = ud;
+    char  item[MAX_PAYLOAD];
+    int64_t  i;
+    memset(item, 0, sizeof(item));
+    for (i = 0; i < c->count; i++) {
+        struct vrt_value  *vvalue;
+        struct vrt_value_blob  *value;
+        struct item  *header = (struct item *) item;
+        rpi_check(vrt_producer_claim(c->p, &vvalue));
+        value = cork_container_of(vvalue, struct vrt_value_blob, parent);
+        vrt_get_nsec(&header->sent);
+        header->value = i;
+        memcpy(value->data, item, c->payload_size);
+        rpi_check(vrt_producer_publish(c->p));
+    }
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+static void *
+vrt_bench_consumer(void *ud)
+{
+    struct bench_consumer  *c = ud;
+    char  item[MAX_PAYLOAD];
+    struct vrt_value  *vvalue;
+    int  rc;
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_blob  *value =
+                cork_container_of(vvalue, struct vrt_value_blob, parent);
+            struct item  *header = (struct item *) item;
+            vrt_nsec  now;
+            memcpy(item, value->data, c->payload_size);
+            vrt_get_nsec(&now);
+            vrt_histogram_add(&c->latency, now - header->sent);
+            c->sum += header->value;
+            c->count++;
+        }
+    }
+    return NULL;
+}
+
+static void *
+baseline_producer(void *ud)
+{
+    struct bench_producer  *c = ud;
+    char  *items = cork_calloc(c->batch_size, MAX_PAYLOAD);
+    int64_t  i = 0;
+    while (i < c->count) {
+        unsigned int  j;
+        for (j = 0; j < c->batch_size && i < c->count; j++, i++) {
+            struct item  *header =
+                (struct item *) (items + j * c->payload_size);
+            vrt_get_nsec(&header->sent);
+            header->value = i;
+        }
+        vrt_baseline_push(c->bq, items, j);
+    }
+    free(items);
+    return NULL;
+}
+
+static void *
+baseline_consumer(void *ud)
+{
+    struct bench_consumer  *c = ud;
+    char  *items = cork_calloc(POP_SIZE, MAX_PAYLOAD);
+    int64_t  expected = c->count;
+    c->count = 0;
+    while (c->count < expected) {
+        size_t  count = vrt_baseline_pop(c->bq, items, POP_SIZE);
+        size_t  j;
+        vrt_nsec  now;
+        vrt_get_nsec(&now);
+        for (j = 0; j < count; j++) {
+            struct item  *header =
+                (struct item *) (items + j * c->payload_size);
+            vrt_histogram_add(&c->latency, now - header->sent);
+            c->sum += header->value;
+        }
+        c->count += count;
+    }
+    free(items);
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Runs
+ */
+
+/* kind is -1 for varon-t itself. */
+static int
+bench_run(int kind, unsigned int producer_count, unsigned int batch_size,
+          size_t payload_size)
+{
+    struct vrt_queue  *q = NULL;
+    struct vrt_baseline_queue  *bq = NULL;
+    struct bench_producer  producers[MAX_PRODUCERS];
+    struct bench_consumer  consumer;
+    struct vrt_queue_client  clients[MAX_PRODUCERS + 2];
+    int64_t  per_producer = ITEM_COUNT / producer_count;
+    int64_t  expected_sum;
+    vrt_clock  elapsed;
+    vrt_clock  cpu_time = 0;
+    unsigned int  i;
+
+    memset(&consumer, 0, sizeof(consumer));
+    vrt_histogram_init(&consumer.latency);
+    consumer.payload_size = payload_size;
+    consumer.count = per_producer * producer_count;
+
+    if (kind < 0) {
+        rip_check(q = vrt_queue_new
+                  ("queue_baseline", &vrt_value_type_blob, QUEUE_SIZE));
+        rip_check(consumer.c = vrt_consumer_new("consumer", q));
+    } else {
+        bq = vrt_baseline_queue_new(kind, QUEUE_SIZE, payload_size);
+        consumer.bq = bq;
+    }
+
+    for (i = 0; i < producer_count; i++) {
+        producers[i].payload_size = payload_size;
+        producers[i].batch_size = batch_size;
+        producers[i].count = per_producer;
+        producers[i].bq = bq;
+        producers[i].p = NULL;
+        if (kind < 0) {
+            rip_check(producers[i].p = vrt_producer_new
+                      ("producer", batch_size, q));
+        }
+        clients[i].run = (kind < 0)? vrt_bench_producer: baseline_producer;
+        clients[i].ud = &producers[i];
+    }
+    clients[producer_count].run =
+        (kind < 0)? vrt_bench_consumer: baseline_consumer;
+    clients[producer_count].ud = &consumer;
+    clients[producer_count + 1].run = NULL;
+    clients[producer_count + 1].ud = NULL;
+
+    if (kind < 0) {
+        rii_check(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    } else {
+        rii_check(vrt_test_clients_threaded(clients, &elapsed));
+    }
+
+    for (i = 0; i <= producer_count; i++) {
+        cpu_time += clients[i].cpu_time;
+    }
+    expected_sum = producer_count * (per_producer * (per_producer - 1) / 2);
+
+    printf("  %-8s %8.2lf Mvalues/sec %8.1lf usec p50 %8.1lf usec p99 "
+           "%7.1lf ns cpu/value%s\n",
+           (kind < 0)? "varon-t": vrt_baseline_kind_name(kind),
+           (double) consumer.count / elapsed,
+           vrt_histogram_percentile(&consumer.latency, 50.0) / 1000.0,
+           vrt_histogram_percentile(&consumer.latency, 99.0) / 1000.0,
+           (double) cpu_time * 1000.0 / consumer.count,
+           (consumer.sum == expected_sum)? "": "  WRONG SUM");
+
+    if (q != NULL) {
+        vrt_queue_free(q);
+    }
+    if (bq != NULL) {
+        vrt_baseline_queue_free(bq);
+    }
+    return (consumer.sum == expected_sum)? 0: -1;
+}
+
+static int
+bench_sweep(const char *title, unsigned int producer_count)
+{
+    unsigned int  i;
+    unsigned int  j;
+    int  result = 0;
+
+    fprintf(stdout, "\n%s\n", title);
+    fprintf(stdout, "-----------------------------------\n");
+    for (i = 0; PAYLOAD_SIZES[i] != 0; i++) {
+        for (j = 0; BATCH_SIZES[j] != 0; j++) {
+            fprintf(stdout, "payload %zu bytes, batch %u\n",
+                    PAYLOAD_SIZES[i], BATCH_SIZES[j]);
+            result |= bench_run
+                (-1, producer_count, BATCH_SIZES[j], PAYLOAD_SIZES[i]);
+            result |= bench_run
+                (VRT_BASELINE_MUTEX, producer_count,
+                 BATCH_SIZES[j], PAYLOAD_SIZES[i]);
+            if (producer_count == 1) {
+                result |= bench_run
+                    (VRT_BASELINE_SPSC, producer_count,
+                     BATCH_SIZES[j], PAYLOAD_SIZES[i]);
+            }
+            result |= bench_run
+                (VRT_BASELINE_MPMC, producer_count,
+                 BATCH_SIZES[j], PAYLOAD_SIZES[i]);
+        }
+    }
+    return result;
+}
+
+int
+main(int argc, const char * argv[])
+{
+    int  result = 0;
+    fprintf(stdout, "\nBASELINE COMPARISON\n"
+                    "===================\n");
+    result |= bench_sweep("Unicast: 1P -> 1C", 1);
+    result |= bench_sweep("Sequencer: 3P -> 1C", 3);
+    return (result == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
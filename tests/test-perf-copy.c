@@ -0,0 +1,276 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+#include <vrt.h>
+
+#include "helpers.h"
+#include "queue.h"
+
+/* Measures the cost of filling large values with ordinary stores versus
+ * non-temporal ones.  The producer copies a payload into each value that
+ * it claims, and the consumer reads every byte of it.  For each payload
+ * size, we run both kinds of store and compare them, and then report the
+ * crossover: the smallest size from which the non-temporal stores win at
+ * every larger size that we tried.  VRT_COPY_DEFAULT_NT_THRESHOLD is
+ * based on this. */
+
+#define QUEUE_SIZE  256
+#define BATCH_SIZE  16
+#define MAX_PAYLOAD  131072
+#define BYTES_PER_RUN  (256 * 1024 * 1024)
+#define MAX_COUNT  1000000
+
+static const size_t  PAYLOAD_SIZES[] = {
+    64, 256, 1024, 2048, 4096, 8192, 16384, 32768, 65536, 131072, 0
+};
+
+
+/*-----------------------------------------------------------------------
+ * Payload values
+ */
+
+struct vrt_value_payload {
+    struct vrt_value  parent;
+    size_t  size;
+    char  *data;
+};
+
+static struct vrt_value *
+vrt_value_payload_new(struct vrt_value_type *type)
+{
+    struct vrt_value_payload  *self = cork_new(struct vrt_value_payload);
+    void  *data;
+    if (posix_memalign(&data, 64, MAX_PAYLOAD) != 0) {
+        free(self);
+        return NULL;
+    }
+    self->size = 0;
+    self->data = data;
+    return &self->parent;
+}
+
+static void
+vrt_value_payload_free(struct vrt_value_type *type, struct vrt_value *vself)
+{
+    struct vrt_value_payload  *self =
+        cork_container_of(vself, struct vrt_value_payload, parent);
+    free(self->data);
+    free(self);
+}
+
+static struct vrt_value_type  vrt_value_type_payload = {
+    vrt_value_payload_new,
+    vrt_value_payload_free
+};
+
+
+/*-----------------------------------------------------------------------
+ * Clients
+ */
+
+static char  source[MAX_PAYLOAD];
+
+struct copy_producer_config {
+    struct vrt_producer  *p;
+    size_t  size;
+    uint64_t  count;
+};
+
+struct copy_consumer_config {
+    struct vrt_consumer  *c;
+    uint64_t  sum;
+};
+
+static void *
+copy_producer(void *ud)
+{
+    struct copy_producer_config  *c = ud;
+    uint64_t  i;
+    for (i = 0; i < c->count; i++) {
+        struct vrt_value  *vvalue;
+        struct vrt_value_payload  *value;
+        rpi_check(vrt_producer_claim(c->p, &vvalue));
+        value = cork_container_of(vvalue, struct vrt_value_payload, parent);
+        vrt_copy_payload(value->data, source, c->size);
+        value->size = c->size;
+        vrt_copy_fence();
+        rpi_check(vrt_producer_publish(c->p));
+    }
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+static void *
+copy_consumer(void *ud)
+{
+    int  rc;
+    struct copy_consumer_config  *c = ud;
+    struct vrt_value  *vvalue;
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_payload  *value =
+                cork_container_of(vvalue, struct vrt_value_payload, parent);
+            const uint64_t  *words = (const uint64_t *) value->data;
+            size_t  i;
+            for (i = 0; i < value->size / sizeof(uint64_t); i++) {
+                c->sum += words[i];
+            }
+        } else if (rc != VRT_QUEUE_FLUSH) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Sweep
+ */
+
+/* Runs one payload size with the given threshold, and fills in the
+ * average time per value, in nanoseconds. */
+static int
+copy_test(size_t size, size_t threshold, double *ns_per_value)
+{
+    struct vrt_queue  *q;
+    struct copy_producer_config  pc;
+    struct copy_consumer_config  cc;
+    const uint64_t  *words = (const uint64_t *) source;
+    uint64_t  expected = 0;
+    vrt_clock  elapsed;
+    size_t  i;
+
+    vrt_copy_set_nt_threshold(threshold);
+    rip_check(q = vrt_queue_new
+              ("queue_copy", &vrt_value_type_payload, QUEUE_SIZE));
+    pc.p = vrt_producer_new("copy", BATCH_SIZE, q);
+    pc.size = size;
+    pc.count = BYTES_PER_RUN / size;
+    if (pc.count > MAX_COUNT) {
+        pc.count = MAX_COUNT;
+    }
+    cc.c = vrt_consumer_new("read", q);
+    cc.sum = 0;
+
+    struct vrt_queue_client  clients[] = {
+        {copy_producer, &pc},
+        {copy_consumer, &cc},
+        {NULL, NULL}
+    };
+
+    rii_check(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    for (i = 0; i < size / sizeof(uint64_t); i++) {
+        expected += words[i];
+    }
+    expected *= pc.count;
+
+    *ns_per_value = (double) elapsed * 1000.0 / pc.count;
+    vrt_queue_free(q);
+    if (cc.sum != expected) {
+        printf("  %6zu bytes: WRONG SUM\n", size);
+        return -1;
+    }
+    return 0;
+}
+
+/* Checks the copy and fill helpers at every alignment and length that
+ * touches their head, body, and tail cases. */
+static int
+check_helpers(void)
+{
+    char  dest[512];
+    char  expected[512];
+    size_t  offset;
+    size_t  size;
+    for (offset = 0; offset < 64; offset++) {
+        for (size = 0; size < 300; size++) {
+            memset(dest, 0, sizeof(dest));
+            vrt_copy_nt(dest + offset, source, size);
+            vrt_copy_fence();
+            if (memcmp(dest + offset, source, size) != 0 ||
+                (offset > 0 && dest[offset - 1] != 0) ||
+                dest[offset + size] != 0) {
+                printf("vrt_copy_nt failed (offset %zu, size %zu)\n",
+                       offset, size);
+                return -1;
+            }
+
+            vrt_fill_nt(dest + offset, 0x5a, size);
+            vrt_copy_fence();
+            memset(expected, 0x5a, size);
+            if (memcmp(dest + offset, expected, size) != 0 ||
+                (offset > 0 && dest[offset - 1] != 0) ||
+                dest[offset + size] != 0) {
+                printf("vrt_fill_nt failed (offset %zu, size %zu)\n",
+                       offset, size);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int
+main(int argc, const char * argv[])
+{
+    unsigned int  i;
+    int  result = 0;
+    size_t  crossover = 0;
+
+    for (i = 0; i < MAX_PAYLOAD; i++) {
+        source[i] = (char) (i * 7 + 1);
+    }
+    if (check_helpers() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "\nPAYLOAD COPIES\n"
+                    "==============\n");
+    if (!vrt_copy_nt_available()) {
+        fprintf(stdout, "(Non-temporal stores aren't available; "
+                        "both sweeps use memcpy.)\n");
+    }
+
+    fprintf(stdout, "\n   payload    ordinary  non-temporal   nt/ordinary\n"
+                    "-------------------------------------------------\n");
+    for (i = 0; PAYLOAD_SIZES[i] != 0; i++) {
+        double  ordinary_ns = 0;
+        double  nt_ns = 0;
+        result |= copy_test(PAYLOAD_SIZES[i], SIZE_MAX, &ordinary_ns);
+        result |= copy_test(PAYLOAD_SIZES[i], 0, &nt_ns);
+        printf("  %6zu B  %8.1lf ns   %8.1lf ns   %8.2lfx\n",
+               PAYLOAD_SIZES[i], ordinary_ns, nt_ns, nt_ns / ordinary_ns);
+        if (nt_ns >= ordinary_ns) {
+            crossover = 0;
+        } else if (crossover == 0) {
+            crossover = PAYLOAD_SIZES[i];
+        }
+    }
+
+    if (crossover == 0) {
+        printf("\nNon-temporal stores never win; "
+               "the default threshold is %u bytes.\n",
+               VRT_COPY_DEFAULT_NT_THRESHOLD);
+    } else {
+        printf("\nNon-temporal stores win from %zu bytes up; "
+               "the default threshold is %u bytes.\n",
+               crossover, VRT_COPY_DEFAULT_NT_THRESHOLD);
+    }
+
+    vrt_copy_set_nt_threshold(VRT_COPY_DEFAULT_NT_THRESHOLD);
+    return (result == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -0,0 +1,210 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <vrt.h>
+
+#include "helpers.h"
+#include "integers.h"
+#include "loadgen.h"
+#include "queue.h"
+
+/* Measures how much CPU each yield strategy spends, rather than how fast
+ * it goes.  For each strategy we find the peak (closed-loop) throughput
+ * of a 1P -> 1C queue, and then offer 50%, 10%, and 0% of that load
+ * using the open-loop load generator.  For each load we report the CPU
+ * time used by the producer and consumer threads, the number of cores
+ * that works out to, and the number of values processed per CPU-second.
+ *
+ * The load generator paces itself by spinning on the clock whenever the
+ * next send is less than 100 usec away, so at partial loads the
+ * producer's CPU time mostly measures the generator.  The consumer's
+ * CPU time is the one that reflects the yield strategy; at 0% load it's
+ * pure idle burn.
+ *
+ * In a container with a CPU quota, we also report how often the
+ * container was throttled during each strategy's runs. */
+
+#define QUEUE_SIZE  8 * 1024
+#define BATCH_SIZE  64
+#define PEAK_COUNT  10000000
+#define RUN_DURATION  500000  /* usec */
+
+struct idle_config {
+    struct vrt_producer  *p;
+    vrt_clock  duration;
+};
+
+/* A producer that doesn't send anything for a while, and then sends an
+ * EOF. */
+static void *
+idle_producer(void *ud)
+{
+    struct idle_config  *c = ud;
+    struct timespec  ts;
+    ts.tv_sec = c->duration / 1000000;
+    ts.tv_nsec = (c->duration % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+static void
+report_cpu(const char *load, uint64_t count, vrt_clock elapsed,
+           struct vrt_queue_client *clients)
+{
+    vrt_clock  producer = clients[0].cpu_time;
+    vrt_clock  consumer = clients[1].cpu_time;
+    vrt_clock  total = producer + consumer;
+    printf("%-5s %8" PRIu64 " values  %7" PRIu64 " usec  "
+           "cpu %7" PRIu64 " + %7" PRIu64 " usec  (%.2lf + %.2lf cores)",
+           load, count, elapsed, producer, consumer,
+           ((double) producer) / elapsed, ((double) consumer) / elapsed);
+    if (count > 0 && total > 0) {
+        printf("  %.0lf values/cpu-sec\n", ((double) count) / total * 1e6);
+    } else {
+        printf("\n");
+    }
+}
+
+/* Returns the peak throughput, in values per second. */
+static double
+peak_test(int (*run_func)
+              (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    int64_t  result = 0;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new("queue_cpu", vrt_value_type_int(), QUEUE_SIZE);
+    p = vrt_producer_new("generate", BATCH_SIZE, q);
+    c = vrt_consumer_new("noop", q);
+
+    struct generate_config  gc = {
+        p, PEAK_COUNT
+    };
+
+    struct noop_config nc = {
+        c, &result
+    };
+
+    struct vrt_queue_client  clients[] = {
+        {generate_integers, &gc},
+        {noop_integers, &nc},
+        {NULL, NULL}
+    };
+
+    run_func(q, clients, &elapsed);
+    report_cpu("100%", PEAK_COUNT, elapsed, clients);
+    vrt_queue_free(q);
+    return ((double) PEAK_COUNT) / elapsed * 1e6;
+}
+
+static void
+load_test(const char *load, double rate,
+          int (*run_func)
+              (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new("queue_cpu", vrt_value_type_timed(), QUEUE_SIZE);
+    p = vrt_producer_new("loadgen", BATCH_SIZE, q);
+    c = vrt_consumer_new("latency", q);
+
+    struct vrt_loadgen_producer_config  pc;
+    memset(&pc, 0, sizeof(pc));
+    pc.p = p;
+    pc.schedule.pattern = VRT_LOADGEN_FIXED;
+    pc.schedule.rate = rate;
+    pc.count = rate * RUN_DURATION / 1e6;
+
+    struct idle_config  ic = {
+        p, RUN_DURATION
+    };
+
+    struct vrt_loadgen_consumer_config  cc;
+    memset(&cc, 0, sizeof(cc));
+    cc.c = c;
+
+    struct vrt_queue_client  clients[] = {
+        {NULL, NULL},
+        {vrt_loadgen_consume, &cc},
+        {NULL, NULL}
+    };
+
+    if (rate == 0) {
+        clients[0].run = idle_producer;
+        clients[0].ud = &ic;
+    } else {
+        clients[0].run = vrt_loadgen_produce;
+        clients[0].ud = &pc;
+    }
+
+    run_func(q, clients, &elapsed);
+    report_cpu(load, cc.intended.count, elapsed, clients);
+    vrt_queue_free(q);
+}
+
+static void
+cpu_test(const char *run_name,
+         int (*run_func)
+             (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    double  peak;
+    struct vrt_cpu_throttling  before;
+    struct vrt_cpu_throttling  after;
+    fprintf(stdout, "\n%s\n", run_name);
+    fprintf(stdout, "-----------------------------------\n");
+    vrt_cpu_throttling_get(NULL, &before);
+    peak = peak_test(run_func);
+    load_test("50%", peak * 0.5, run_func);
+    load_test("10%", peak * 0.1, run_func);
+    load_test("0%", 0, run_func);
+    vrt_cpu_throttling_get(NULL, &after);
+    if (after.periods > before.periods) {
+        printf("throttled in %" PRIu64 " of %" PRIu64 " periods "
+               "(%" PRIu64 " usec)\n",
+               after.throttled_periods - before.throttled_periods,
+               after.periods - before.periods,
+               after.throttled_usec - before.throttled_usec);
+    }
+}
+
+int
+main(int argc, const char * argv[])
+{
+    fprintf(stdout, "\n1-1 UNICAST CPU EFFICIENCY (BATCH SIZE = %u)\n"
+                    "============================================\n",
+                    BATCH_SIZE);
+    fprintf(stdout, "CPU budget: %.2lf\n", vrt_yield_strategy_cpu_budget());
+    cpu_test("vrt_test_queue_threaded", vrt_test_queue_threaded);
+    cpu_test("vrt_test_queue_threaded_spin", vrt_test_queue_threaded_spin);
+    cpu_test("vrt_test_queue_threaded_hybrid",
+             vrt_test_queue_threaded_hybrid);
+    cpu_test(vrt_yield_strategy_umwait_available()?
+             "vrt_test_queue_threaded_umwait":
+             "vrt_test_queue_threaded_umwait (hybrid fallback)",
+             vrt_test_queue_threaded_umwait);
+    return EXIT_SUCCESS;
+}
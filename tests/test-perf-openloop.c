@@ -0,0 +1,153 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <vrt.h>
+
+#include "helpers.h"
+#include "histogram.h"
+#include "loadgen.h"
+#include "queue.h"
+
+/* Sweeps the offered load on a 1P -> 1C queue, using an open-loop load
+ * generator, until the queue saturates.  For each rate we report the
+ * achieved throughput and two latency distributions: one measured from
+ * each value's intended send time, and one measured from when the
+ * producer actually sent it.  Below saturation the two agree; above it,
+ * only the first one shows the queueing delay that users would see. */
+
+#define QUEUE_SIZE  8 * 1024
+#define RUN_DURATION  200000000  /* nsec */
+#define MIN_COUNT  1000
+
+/* A rate counts as saturated once the queue keeps up with less than
+ * this fraction of it. */
+#define SATURATION  0.95
+
+static const double  RATES[] = {
+    1e4, 3e4, 1e5, 3e5, 1e6, 3e6, 1e7, 0
+};
+
+static int
+openloop_test(const struct vrt_loadgen_schedule *schedule,
+              unsigned int batch_size,
+              int (*run_func)
+                  (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    vrt_clock  elapsed;
+    double  offered = vrt_loadgen_offered_rate(schedule);
+    double  achieved;
+
+    q = vrt_queue_new("queue_openloop", vrt_value_type_timed(), QUEUE_SIZE);
+    p = vrt_producer_new("loadgen", batch_size, q);
+    c = vrt_consumer_new("latency", q);
+
+    struct vrt_loadgen_producer_config  pc;
+    memset(&pc, 0, sizeof(pc));
+    pc.p = p;
+    pc.schedule = *schedule;
+    pc.count = offered * (RUN_DURATION / 1e9);
+    if (pc.count < MIN_COUNT) {
+        pc.count = MIN_COUNT;
+    }
+
+    struct vrt_loadgen_consumer_config  cc;
+    memset(&cc, 0, sizeof(cc));
+    cc.c = c;
+
+    struct vrt_queue_client  clients[] = {
+        {vrt_loadgen_produce, &pc},
+        {vrt_loadgen_consume, &cc},
+        {NULL, NULL}
+    };
+
+    run_func(q, clients, &elapsed);
+    achieved = cc.intended.count / ((cc.finish - pc.start) / 1e9);
+
+    printf("offered %10.0lf/sec  achieved %10.0lf/sec%s\n",
+           offered, achieved,
+           (achieved < offered * SATURATION)? "  SATURATED": "");
+    printf("  from intended: ");
+    vrt_histogram_report(&cc.intended);
+    printf("  from sent:     ");
+    vrt_histogram_report(&cc.sent);
+
+    vrt_queue_free(q);
+    return achieved < offered * SATURATION;
+}
+
+static void
+sweep(enum vrt_loadgen_pattern pattern, unsigned int batch_size,
+      const char *run_name,
+      int (*run_func)
+          (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    unsigned int  i;
+    fprintf(stdout, "\n%s (%s, batch size = %u)\n"
+                    "----------------------------------------\n",
+            run_name, vrt_loadgen_pattern_name(pattern), batch_size);
+
+    for (i = 0; RATES[i] != 0; i++) {
+        struct vrt_loadgen_schedule  schedule;
+        memset(&schedule, 0, sizeof(schedule));
+        schedule.pattern = pattern;
+        schedule.seed = 0x5eed + i;
+        if (pattern == VRT_LOADGEN_ON_OFF) {
+            /* Bursts at four times the average rate: 5ms on, 15ms off */
+            schedule.rate = RATES[i] * 4;
+            schedule.on_period = 5000000;
+            schedule.off_period = 15000000;
+        } else {
+            schedule.rate = RATES[i];
+        }
+
+        /* Once we've found the saturation point, higher rates won't
+         * tell us anything new. */
+        if (openloop_test(&schedule, batch_size, run_func)) {
+            break;
+        }
+    }
+}
+
+#define SWEEP_ALL(pattern, batch_size) \
+    do { \
+        sweep(pattern, batch_size, "vrt_test_queue_threaded", \
+              vrt_test_queue_threaded); \
+        sweep(pattern, batch_size, "vrt_test_queue_threaded_spin", \
+              vrt_test_queue_threaded_spin); \
+        sweep(pattern, batch_size, "vrt_test_queue_threaded_hybrid", \
+              vrt_test_queue_threaded_hybrid); \
+    } while (0)
+
+int
+main(int argc, const char * argv[])
+{
+    fprintf(stdout, "\n1-1 OPEN-LOOP UNICAST TEST (FIXED RATE)\n"
+                    "=======================================\n");
+    SWEEP_ALL(VRT_LOADGEN_FIXED, 1);
+    SWEEP_ALL(VRT_LOADGEN_FIXED, 64);
+
+    fprintf(stdout, "\n1-1 OPEN-LOOP UNICAST TEST (POISSON)\n"
+                    "====================================\n");
+    SWEEP_ALL(VRT_LOADGEN_POISSON, 1);
+
+    fprintf(stdout, "\n1-1 OPEN-LOOP UNICAST TEST (ON/OFF BURSTS)\n"
+                    "==========================================\n");
+    SWEEP_ALL(VRT_LOADGEN_ON_OFF, 1);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libcork/core.h>
+#include <vrt.h>
+
+#include "helpers.h"
+#include "integers.h"
+#include "queue.h"
+
+/* Compares the CPU placement policies.  For each policy and yield
+ * strategy, we run a 1P -> 1C unicast queue and a 1P -> 1C -> 1C
+ * pipeline, and report the throughput along with the CPU that each
+ * client was pinned to.  The "none" policy leaves the threads wherever
+ * the scheduler puts them. */
+
+#define QUEUE_SIZE  64 * 1024
+#define BATCH_SIZE  64
+#define GENERATE_COUNT  10000000
+
+static void
+report_placement(struct vrt_queue_client *clients)
+{
+    struct vrt_queue_client  *client;
+    printf("  cpus");
+    for (client = clients; client->run != NULL; client++) {
+        if (client->cpu >= 0) {
+            printf(" %d", client->cpu);
+        } else {
+            printf(" -");
+        }
+    }
+    printf("\n");
+}
+
+static void
+unicast_test(int (*run_func)
+                 (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    int64_t  result = 0;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new("queue_placement", vrt_value_type_int(), QUEUE_SIZE);
+    p = vrt_producer_new("generate", BATCH_SIZE, q);
+    c = vrt_consumer_new("noop", q);
+
+    struct generate_config  gc = {
+        p, GENERATE_COUNT
+    };
+
+    struct noop_config nc = {
+        c, &result
+    };
+
+    struct vrt_queue_client  clients[] = {
+        {generate_integers, &gc},
+        {noop_integers, &nc},
+        {NULL, NULL}
+    };
+
+    run_func(q, clients, &elapsed);
+    printf("unicast   ");
+    vrt_report_clock(elapsed, GENERATE_COUNT);
+    report_placement(clients);
+    vrt_queue_free(q);
+}
+
+static void
+pipeline_test(int (*run_func)
+                  (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    int64_t  result = 0;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c1;
+    struct vrt_consumer  *c2;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new("queue_placement", vrt_value_type_int(), QUEUE_SIZE);
+    p = vrt_producer_new("generate", BATCH_SIZE, q);
+    c1 = vrt_consumer_new("multiply", q);
+    c2 = vrt_consumer_new("sum", q);
+    vrt_consumer_add_dependency(c2, c1);
+
+    struct generate_config  gc = {
+        p, GENERATE_COUNT
+    };
+
+    struct multiply_config  mc = {
+        c1, 3
+    };
+
+    struct sum_config  sc = {
+        c2, &result
+    };
+
+    struct vrt_queue_client  clients[] = {
+        {generate_integers, &gc},
+        {multiply_integers, &mc},
+        {sum_integers, &sc},
+        {NULL, NULL}
+    };
+
+    run_func(q, clients, &elapsed);
+    printf("pipeline  ");
+    vrt_report_clock(elapsed, GENERATE_COUNT);
+    report_placement(clients);
+    vrt_queue_free(q);
+}
+
+static void
+placement_test(const char *run_name,
+               int (*run_func)
+                   (struct vrt_queue *, struct vrt_queue_client *,
+                    vrt_clock *))
+{
+    enum vrt_cpu_policy  policy;
+    fprintf(stdout, "\n%s\n", run_name);
+    fprintf(stdout, "-----------------------------------\n");
+    for (policy = VRT_CPU_POLICY_NONE; policy <= VRT_CPU_POLICY_SCATTER;
+         policy++) {
+        printf("%s:\n", vrt_cpu_policy_name(policy));
+        vrt_test_queue_set_placement(policy);
+        unicast_test(run_func);
+        pipeline_test(run_func);
+    }
+    vrt_test_queue_set_placement(VRT_CPU_POLICY_NONE);
+}
+
+int
+main(int argc, const char * argv[])
+{
+    struct vrt_cpu_topology  *topo = vrt_cpu_topology_new(NULL);
+    fprintf(stdout, "\nCPU PLACEMENT (%zu CPUS, BATCH SIZE = %u)\n"
+                    "=======================================\n",
+                    cork_array_size(&topo->cpus), BATCH_SIZE);
+    vrt_cpu_topology_free(topo);
+    placement_test("vrt_test_queue_threaded", vrt_test_queue_threaded);
+    placement_test("vrt_test_queue_threaded_spin",
+                   vrt_test_queue_threaded_spin);
+    placement_test("vrt_test_queue_threaded_hybrid",
+                   vrt_test_queue_threaded_hybrid);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,262 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+#include <vrt.h>
+
+#include "helpers.h"
+#include "histogram.h"
+#include "integers.h"
+#include "queue.h"
+
+/* Compares a vrt_rpc against the obvious way to get replies back to a
+ * requester: a second queue running in the opposite direction (a
+ * "ping-pong").  Each requester keeps up to a fixed number of requests
+ * outstanding; with a window of 1, this measures round-trip latency,
+ * and with larger windows, it measures throughput.
+ *
+ * The ping-pong only has one requester, since a shared reply queue
+ * would deliver every reply to every requester. */
+
+#define QUEUE_SIZE  1024
+#define ROUND_TRIPS  200000
+
+static const unsigned int  WINDOWS[] = { 1, 8, 64, 0 };
+
+struct requester_config {
+    unsigned int  window;
+    uint64_t  count;
+    struct vrt_histogram  latency;
+    /* A ring of send times for the outstanding requests */
+    vrt_nsec  sent[QUEUE_SIZE];
+
+    /* For the rpc */
+    struct vrt_rpc_requester  *r;
+
+    /* For the ping-pong */
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+};
+
+static void
+record_reply(struct requester_config *c, uint64_t i)
+{
+    vrt_nsec  now;
+    vrt_get_nsec(&now);
+    vrt_histogram_add(&c->latency, now - c->sent[i % QUEUE_SIZE]);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Request/reply
+ */
+
+static void *
+rpc_requester(void *ud)
+{
+    struct requester_config  *c = ud;
+    struct vrt_value  *v;
+    uint64_t  i;
+    uint64_t  oldest = 0;
+    for (i = 0; i < c->count; i++) {
+        rpi_check(vrt_rpc_requester_claim(c->r, &v));
+        cork_container_of(v, struct vrt_value_rpc_int, parent.parent)
+            ->value = i;
+        vrt_get_nsec(&c->sent[i % QUEUE_SIZE]);
+        rpi_check(vrt_rpc_requester_publish(c->r));
+        if (vrt_rpc_requester_outstanding(c->r) == c->window) {
+            rpi_check(vrt_rpc_requester_receive(c->r, &v));
+            record_reply(c, oldest++);
+        }
+    }
+    while (oldest < i) {
+        rpi_check(vrt_rpc_requester_receive(c->r, &v));
+        record_reply(c, oldest++);
+    }
+    rpi_check(vrt_rpc_requester_eof(c->r));
+    return NULL;
+}
+
+static void *
+rpc_service(void *ud)
+{
+    struct vrt_rpc_service  *s = ud;
+    struct vrt_value  *request;
+    struct vrt_value  *reply;
+    while (vrt_rpc_service_next(s, &request) == 0) {
+        rpi_check(vrt_rpc_service_reply(s, &reply));
+        cork_container_of(reply, struct vrt_value_int, parent)->value =
+            cork_container_of(request, struct vrt_value_rpc_int,
+                              parent.parent)->value;
+    }
+    return NULL;
+}
+
+static void
+rpc_test(unsigned int requester_count, unsigned int window)
+{
+    struct vrt_rpc  *rpc;
+    struct requester_config  *configs;
+    struct vrt_queue_client  clients[requester_count + 2];
+    struct vrt_histogram  latency;
+    vrt_clock  elapsed;
+    unsigned int  i;
+
+    rpc = vrt_rpc_new("rpc", vrt_value_type_rpc_int(), QUEUE_SIZE,
+                      vrt_value_type_int(), window + 1);
+    configs = cork_calloc(requester_count, sizeof(struct requester_config));
+    vrt_histogram_init(&latency);
+    for (i = 0; i < requester_count; i++) {
+        char  name[32];
+        snprintf(name, sizeof(name), "requester%u", i);
+        configs[i].r = vrt_rpc_requester_new(rpc, name, 1);
+        configs[i].window = window;
+        configs[i].count = ROUND_TRIPS / requester_count;
+        vrt_histogram_init(&configs[i].latency);
+        clients[i].run = rpc_requester;
+        clients[i].ud = &configs[i];
+    }
+    clients[i].run = rpc_service;
+    clients[i].ud = vrt_rpc_service_new(rpc, "service");
+    clients[i+1].run = NULL;
+
+    vrt_test_queue_threaded_hybrid(rpc->requests, clients, &elapsed);
+    for (i = 0; i < requester_count; i++) {
+        vrt_histogram_merge(&latency, &configs[i].latency);
+    }
+    printf("rpc (%u requesters), window %2u: ", requester_count, window);
+    vrt_report_clock(elapsed, ROUND_TRIPS);
+    printf("    round trip: ");
+    vrt_histogram_report(&latency);
+    free(configs);
+    vrt_rpc_free(rpc);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Ping-pong
+ */
+
+static void *
+pingpong_requester(void *ud)
+{
+    int  rc;
+    struct requester_config  *c = ud;
+    struct vrt_value  *v;
+    uint64_t  i;
+    uint64_t  oldest = 0;
+    for (i = 0; i < c->count || oldest < i; ) {
+        if (i < c->count && i - oldest < c->window) {
+            rpi_check(vrt_producer_claim(c->p, &v));
+            cork_container_of(v, struct vrt_value_int, parent)->value = i;
+            vrt_get_nsec(&c->sent[i % QUEUE_SIZE]);
+            rpi_check(vrt_producer_publish(c->p));
+            i++;
+        } else {
+            rc = vrt_consumer_next(c->c, &v);
+            if (rc == 0) {
+                record_reply(c, oldest++);
+            } else if (rc != VRT_QUEUE_FLUSH) {
+                return NULL;
+            }
+        }
+    }
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+struct pingpong_service_config {
+    struct vrt_consumer  *c;
+    struct vrt_producer  *p;
+};
+
+static void *
+pingpong_service(void *ud)
+{
+    int  rc;
+    struct pingpong_service_config  *c = ud;
+    struct vrt_value  *request;
+    struct vrt_value  *reply;
+    while ((rc = vrt_consumer_next(c->c, &request)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            rpi_check(vrt_producer_claim(c->p, &reply));
+            cork_container_of(reply, struct vrt_value_int, parent)->value =
+                cork_container_of(request, struct vrt_value_int, parent)
+                    ->value;
+            rpi_check(vrt_producer_publish(c->p));
+        } else if (rc != VRT_QUEUE_FLUSH) {
+            return NULL;
+        }
+    }
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+static void
+pingpong_test(unsigned int window)
+{
+    struct vrt_queue  *requests;
+    struct vrt_queue  *replies;
+    struct requester_config  *rc;
+    struct pingpong_service_config  sc;
+    vrt_clock  elapsed;
+
+    requests = vrt_queue_new("requests", vrt_value_type_int(), QUEUE_SIZE);
+    replies = vrt_queue_new("replies", vrt_value_type_int(), QUEUE_SIZE);
+    rc = cork_new(struct requester_config);
+    memset(rc, 0, sizeof(struct requester_config));
+    rc->window = window;
+    rc->count = ROUND_TRIPS;
+    vrt_histogram_init(&rc->latency);
+    rc->p = vrt_producer_new("requester", 1, requests);
+    rc->c = vrt_consumer_new("requester", replies);
+    sc.c = vrt_consumer_new("service", requests);
+    sc.p = vrt_producer_new("service", 1, replies);
+
+    /* The test runner only fills in the yield strategies of the request
+     * queue's clients. */
+    rc->c->yield = vrt_yield_strategy_hybrid();
+    sc.p->yield = vrt_yield_strategy_hybrid();
+
+    struct vrt_queue_client  clients[] = {
+        {pingpong_requester, rc},
+        {pingpong_service, &sc},
+        {NULL, NULL}
+    };
+
+    vrt_test_queue_threaded_hybrid(requests, clients, &elapsed);
+    printf("ping-pong,       window %2u: ", window);
+    vrt_report_clock(elapsed, ROUND_TRIPS);
+    printf("    round trip: ");
+    vrt_histogram_report(&rc->latency);
+    free(rc);
+    vrt_queue_free(requests);
+    vrt_queue_free(replies);
+}
+
+int
+main(int argc, const char * argv[])
+{
+    unsigned int  i;
+    fprintf(stdout, "\nREQUEST/REPLY ROUND TRIPS\n"
+                    "=========================\n");
+    for (i = 0; WINDOWS[i] != 0; i++) {
+        fprintf(stdout, "\n");
+        pingpong_test(WINDOWS[i]);
+        rpc_test(1, WINDOWS[i]);
+        rpc_test(4, WINDOWS[i]);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+#include <vrt.h>
+
+#include "helpers.h"
+#include "histogram.h"
+#include "loadgen.h"
+#include "queue.h"
+
+/* Measures how long an idle consumer takes to notice a new value.  The
+ * producer waits until the consumer has seen the previous value, leaves
+ * the queue empty for a fixed idle period, and then publishes a single
+ * value stamped with the current time.  The consumer records the time
+ * between that stamp and when vrt_consumer_next returns it.
+ *
+ * The longer a consumer has been waiting, the further it has backed off
+ * through its yield strategy's tiers (pause, longer pauses,
+ * sched_yield, and progressively longer sleeps, for the hybrid
+ * strategy), so sweeping the idle period shows what each tier costs in
+ * wake-up latency. */
+
+#define QUEUE_SIZE  1024
+#define MAX_SAMPLES  2000
+#define SAMPLE_DURATION  500000000  /* nsec of idle time per period */
+
+static const vrt_nsec  IDLE_PERIODS[] = {
+    1000, 10000, 100000, 1000000, 10000000, 0
+};
+
+struct wakeup_producer_config {
+    struct vrt_producer  *p;
+    vrt_nsec  idle_period;
+    uint64_t  count;
+    volatile uint64_t  *observed;
+};
+
+struct wakeup_consumer_config {
+    struct vrt_consumer  *c;
+    struct vrt_histogram  latency;
+    volatile uint64_t  observed;
+};
+
+static void
+wait_for(vrt_nsec duration)
+{
+    vrt_nsec  start;
+    vrt_nsec  now;
+    vrt_get_nsec(&start);
+    if (duration >= 100000) {
+        struct timespec  ts;
+        ts.tv_sec = duration / 1000000000;
+        ts.tv_nsec = duration % 1000000000;
+        nanosleep(&ts, NULL);
+    }
+    do {
+        vrt_get_nsec(&now);
+    } while (now - start < duration);
+}
+
+static void *
+wakeup_producer(void *ud)
+{
+    struct wakeup_producer_config  *c = ud;
+    uint64_t  i;
+    for (i = 0; i < c->count; i++) {
+        struct vrt_value  *vvalue;
+        struct vrt_value_timed  *value;
+
+        /* Wait for the consumer to see the previous value, so that it
+         * starts the idle period already waiting for the next one. */
+        while (*c->observed < i) {
+            sched_yield();
+        }
+        wait_for(c->idle_period);
+
+        rpi_check(vrt_producer_claim(c->p, &vvalue));
+        value = cork_container_of(vvalue, struct vrt_value_timed, parent);
+        vrt_get_nsec(&value->sent);
+        value->intended = value->sent;
+        rpi_check(vrt_producer_publish(c->p));
+    }
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+static void *
+wakeup_consumer(void *ud)
+{
+    int  rc;
+    struct wakeup_consumer_config  *c = ud;
+    struct vrt_value  *vvalue;
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_timed  *value =
+                cork_container_of(vvalue, struct vrt_value_timed, parent);
+            vrt_nsec  now;
+            vrt_get_nsec(&now);
+            vrt_histogram_add(&c->latency, now - value->sent);
+            c->observed++;
+        } else if (rc != VRT_QUEUE_FLUSH) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static void
+wakeup_test(vrt_nsec idle_period,
+            int (*run_func)
+                (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new("queue_wakeup", vrt_value_type_timed(), QUEUE_SIZE);
+    /* An unbatched producer, so that each value is published as soon as
+     * it's claimed. */
+    p = vrt_producer_new("wakeup", 1, q);
+    c = vrt_consumer_new("observe", q);
+
+    struct wakeup_consumer_config  cc;
+    memset(&cc, 0, sizeof(cc));
+    cc.c = c;
+    vrt_histogram_init(&cc.latency);
+
+    struct wakeup_producer_config  pc;
+    memset(&pc, 0, sizeof(pc));
+    pc.p = p;
+    pc.idle_period = idle_period;
+    pc.count = SAMPLE_DURATION / idle_period;
+    if (pc.count > MAX_SAMPLES) {
+        pc.count = MAX_SAMPLES;
+    }
+    pc.observed = &cc.observed;
+
+    struct vrt_queue_client  clients[] = {
+        {wakeup_producer, &pc},
+        {wakeup_consumer, &cc},
+        {NULL, NULL}
+    };
+
+    run_func(q, clients, &elapsed);
+    printf("idle %8.0lf usec: ", idle_period / 1000.0);
+    vrt_histogram_report(&cc.latency);
+    vrt_queue_free(q);
+}
+
+static void
+sweep(const char *run_name,
+      int (*run_func)
+          (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    unsigned int  i;
+    fprintf(stdout, "\n%s\n", run_name);
+    fprintf(stdout, "-----------------------------------\n");
+    for (i = 0; IDLE_PERIODS[i] != 0; i++) {
+        wakeup_test(IDLE_PERIODS[i], run_func);
+    }
+}
+
+int
+main(int argc, const char * argv[])
+{
+    fprintf(stdout, "\n1-1 WAKE-UP LATENCY\n"
+                    "===================\n");
+    sweep("vrt_test_queue_threaded", vrt_test_queue_threaded);
+    sweep("vrt_test_queue_threaded_spin", vrt_test_queue_threaded_spin);
+    sweep("vrt_test_queue_threaded_hybrid", vrt_test_queue_threaded_hybrid);
+    sweep(vrt_yield_strategy_umwait_available()?
+          "vrt_test_queue_threaded_umwait":
+          "vrt_test_queue_threaded_umwait (hybrid fallback)",
+          vrt_test_queue_threaded_umwait);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,234 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include <check.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+#include "integers.h"
+#include "queue.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+struct pool_config {
+    struct vrt_pool  *pool;
+    useconds_t  delay;
+    int64_t  value_count;
+    int64_t  eof_count;
+};
+
+/* Doubles each value in place, which is only safe because the consumers
+ * downstream of the pool depend on it. */
+static int
+double_handler(struct vrt_pool_worker *w, int event, struct vrt_value *vv)
+{
+    struct pool_config  *c = w->pool->ud;
+    if (event == VRT_QUEUE_EOF) {
+        __sync_add_and_fetch(&c->eof_count, 1);
+    } else if (event == 0) {
+        struct vrt_value_int  *v =
+            cork_container_of(vv, struct vrt_value_int, parent);
+        v->value *= 2;
+        __sync_add_and_fetch(&c->value_count, 1);
+        if (c->delay > 0) {
+            usleep(c->delay);
+        }
+    }
+    return 0;
+}
+
+static void *
+run_pool(void *ud)
+{
+    struct pool_config  *c = ud;
+    rpi_check(vrt_pool_start(c->pool));
+    rpi_check(vrt_pool_join(c->pool));
+    return NULL;
+}
+
+/* Sends a burst of values, then goes quiet for a while before sending
+ * its EOF, so that the pool has a chance to shrink again. */
+struct burst_config {
+    struct vrt_producer  *p;
+    int64_t  count;
+    useconds_t  quiet;
+};
+
+static void *
+generate_burst(void *ud)
+{
+    struct burst_config  *c = ud;
+    int32_t  i;
+    for (i = 0; i < c->count; i++) {
+        struct vrt_value  *vvalue;
+        struct vrt_value_int  *value;
+        rpi_check(vrt_producer_claim(c->p, &vvalue));
+        value = cork_container_of(vvalue, struct vrt_value_int, parent);
+        value->value = i;
+        rpi_check(vrt_producer_publish(c->p));
+    }
+    rpi_check(vrt_producer_flush(c->p));
+    usleep(c->quiet);
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Pool tests
+ */
+
+#define POOL_COUNT  100000
+
+START_TEST(test_pool_sum)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *sum;
+    struct pool_config  pool_config;
+    int64_t  result = 0;
+    int64_t  expected = (int64_t) POOL_COUNT * (POOL_COUNT - 1);
+    vrt_clock  elapsed;
+
+    memset(&pool_config, 0, sizeof(pool_config));
+    fail_if_error(q = vrt_queue_new("pool_sum", vrt_value_type_int(), 64));
+    fail_if_error(p = vrt_producer_new("generate", 4, q));
+    fail_if_error(pool_config.pool = vrt_pool_new
+                  ("double", q, double_handler, &pool_config));
+    fail_if_error(vrt_pool_set_workers(pool_config.pool, 1, 4));
+    fail_if_error(sum = vrt_consumer_new("sum", q));
+    cork_array_append(&sum->dependencies, pool_config.pool->consumer);
+
+    struct generate_config  generate_config = { p, POOL_COUNT };
+    struct sum_config  sum_config = { sum, &result };
+    struct vrt_queue_client  clients[] = {
+        { generate_integers, &generate_config },
+        { run_pool, &pool_config },
+        { sum_integers, &sum_config },
+        { NULL, NULL }
+    };
+
+    fail_if_error(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    vrt_report_clock(elapsed, POOL_COUNT);
+    vrt_report_pool(pool_config.pool);
+
+    fail_unless(pool_config.value_count == POOL_COUNT,
+                "Pool processed %" PRId64 " values, expected %d",
+                pool_config.value_count, POOL_COUNT);
+    fail_unless(result == expected,
+                "Sum is %" PRId64 ", expected %" PRId64, result, expected);
+    fail_unless(pool_config.eof_count ==
+                pool_config.pool->stats.scale_ups +
+                pool_config.pool->min_workers,
+                "Every worker should see exactly one EOF");
+
+    vrt_pool_free(pool_config.pool);
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_pool_scaling)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_pool  *pool;
+    struct pool_config  pool_config;
+    vrt_clock  elapsed;
+
+    memset(&pool_config, 0, sizeof(pool_config));
+    pool_config.delay = 100;
+    fail_if_error(q = vrt_queue_new("pool_scale", vrt_value_type_int(), 256));
+    fail_if_error(p = vrt_producer_new("generate", 1, q));
+    fail_if_error(pool = vrt_pool_new
+                  ("slow", q, double_handler, &pool_config));
+    fail_if_error(vrt_pool_set_workers(pool, 1, 4));
+    pool->sample_interval = 1000000;
+    pool->grow_samples = 2;
+    pool->idle_samples = 5;
+    pool_config.pool = pool;
+
+    struct burst_config  burst_config = { p, 2000, 200000 };
+    struct vrt_queue_client  clients[] = {
+        { generate_burst, &burst_config },
+        { run_pool, &pool_config },
+        { NULL, NULL }
+    };
+
+    fail_if_error(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    vrt_report_pool(pool);
+
+    fail_unless(pool_config.value_count == 2000,
+                "Pool processed %" PRId64 " values, expected 2000",
+                pool_config.value_count);
+    fail_unless(pool->stats.scale_ups > 0, "Pool never grew");
+    fail_unless(pool->stats.peak_workers > 1,
+                "Pool never ran more than one worker");
+    fail_unless(pool->stats.scale_downs > 0, "Pool never shrank");
+    fail_unless(pool->stats.workers == 0,
+                "Pool has %u workers left over", pool->stats.workers);
+
+    fail_unless_error(vrt_pool_set_workers(pool, 0, 4),
+                      "Pool should need at least one worker");
+    cork_error_clear();
+    fail_unless_error(vrt_pool_set_workers(pool, 3, 2),
+                      "Pool's worker range should be ordered");
+    cork_error_clear();
+
+    vrt_pool_free(pool);
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("pool");
+
+    TCase  *tc_pool = tcase_create("pool");
+    tcase_set_timeout(tc_pool, 20.0);
+    tcase_add_test(tc_pool, test_pool_sum);
+    tcase_add_test(tc_pool, test_pool_scaling);
+    suite_add_tcase(s, tc_pool);
+
+    return s;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
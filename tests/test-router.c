@@ -0,0 +1,206 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include <check.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+#include "integers.h"
+#include "queue.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define OUTPUT_COUNT  4
+#define VALUE_COUNT  100000
+
+static unsigned int
+route_int(void *ud, struct vrt_value *vvalue)
+{
+    struct vrt_value_int  *value =
+        cork_container_of(vvalue, struct vrt_value_int, parent);
+    return value->value % OUTPUT_COUNT;
+}
+
+static int
+copy_int(void *ud, struct vrt_value *vdest, struct vrt_value *vsrc)
+{
+    struct vrt_value_int  *dest =
+        cork_container_of(vdest, struct vrt_value_int, parent);
+    struct vrt_value_int  *src =
+        cork_container_of(vsrc, struct vrt_value_int, parent);
+    dest->value = src->value;
+    return 0;
+}
+
+struct router_config {
+    struct vrt_router  *router;
+    int  result;
+};
+
+static void *
+run_router(void *ud)
+{
+    struct router_config  *c = ud;
+    c->result = vrt_router_run(c->router);
+    return NULL;
+}
+
+struct check_config {
+    struct vrt_consumer  *c;
+    unsigned int  index;
+    int64_t  count;
+    unsigned int  failures;
+};
+
+/* Checks that an output sees exactly the values that belong to it, in
+ * order. */
+static void *
+check_output(void *ud)
+{
+    struct check_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int32_t  expected = c->index;
+    int  rc;
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_int  *value =
+                cork_container_of(vvalue, struct vrt_value_int, parent);
+            if (value->value != expected) {
+                c->failures++;
+            }
+            expected = value->value + OUTPUT_COUNT;
+            c->count++;
+        }
+    }
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Router tests
+ */
+
+START_TEST(test_router)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_queue  *outputs[OUTPUT_COUNT];
+    struct vrt_producer  *p;
+    struct router_config  router_config;
+    struct generate_config  generate_config;
+    struct check_config  check_configs[OUTPUT_COUNT];
+    struct vrt_queue_client  clients[OUTPUT_COUNT + 3];
+    int64_t  total = 0;
+    vrt_clock  elapsed;
+    unsigned int  i;
+
+    fail_if_error(q = vrt_queue_new("input", vrt_value_type_int(), 64));
+    fail_if_error(p = vrt_producer_new("generate", 4, q));
+    fail_if_error(router_config.router = vrt_router_new
+                  ("router", q, 0, route_int, copy_int, NULL));
+    router_config.result = 0;
+    generate_config.p = p;
+    generate_config.count = VALUE_COUNT;
+    clients[0].run = generate_integers;
+    clients[0].ud = &generate_config;
+    clients[1].run = run_router;
+    clients[1].ud = &router_config;
+
+    for (i = 0; i < OUTPUT_COUNT; i++) {
+        struct vrt_producer  *output;
+        struct check_config  *c = &check_configs[i];
+        fail_if_error(outputs[i] = vrt_queue_new
+                      ("output", vrt_value_type_int(), 64));
+        fail_if_error(output = vrt_router_add_output
+                      (router_config.router, outputs[i]));
+        output->yield = vrt_yield_strategy_hybrid();
+        fail_if_error(c->c = vrt_consumer_new("check", outputs[i]));
+        c->c->yield = vrt_yield_strategy_hybrid();
+        c->index = i;
+        c->count = 0;
+        c->failures = 0;
+        clients[i + 2].run = check_output;
+        clients[i + 2].ud = c;
+    }
+    clients[OUTPUT_COUNT + 2].run = NULL;
+    clients[OUTPUT_COUNT + 2].ud = NULL;
+
+    fail_unless_error(vrt_router_add_output(router_config.router,
+                                            outputs[0]),
+                      "A router must be its outputs' only producer");
+    cork_error_clear();
+
+    fail_if_error(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    vrt_report_clock(elapsed, VALUE_COUNT);
+    vrt_report_router(router_config.router);
+
+    fail_unless(router_config.result == 0, "Router failed");
+    for (i = 0; i < OUTPUT_COUNT; i++) {
+        struct vrt_router_output  *output =
+            cork_array_at(&router_config.router->outputs, i);
+        fail_unless(check_configs[i].failures == 0,
+                    "Output %u got %u values out of order",
+                    i, check_configs[i].failures);
+        fail_unless(output->batch_count < output->value_count,
+                    "Output %u wasn't batched", i);
+        total += check_configs[i].count;
+    }
+    fail_unless(total == VALUE_COUNT,
+                "Routed %" PRId64 " values, expected %d",
+                total, VALUE_COUNT);
+
+    vrt_router_free(router_config.router);
+    for (i = 0; i < OUTPUT_COUNT; i++) {
+        vrt_queue_free(outputs[i]);
+    }
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("router");
+
+    TCase  *tc_router = tcase_create("router");
+    tcase_add_test(tc_router, test_router);
+    suite_add_tcase(s, tc_router);
+
+    return s;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
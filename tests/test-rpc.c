@@ -0,0 +1,290 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include <check.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+#include "integers.h"
+#include "queue.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+static int
+send_request(struct vrt_rpc_requester *r, int32_t value)
+{
+    struct vrt_value  *vrequest;
+    struct vrt_value_rpc_int  *request;
+    rii_check(vrt_rpc_requester_claim(r, &vrequest));
+    request = cork_container_of(vrequest, struct vrt_value_rpc_int,
+                                parent.parent);
+    request->value = value;
+    return vrt_rpc_requester_publish(r);
+}
+
+static int
+receive_reply(struct vrt_rpc_requester *r, int32_t *value)
+{
+    struct vrt_value  *vreply;
+    rii_check(vrt_rpc_requester_receive(r, &vreply));
+    *value = cork_container_of(vreply, struct vrt_value_int, parent)->value;
+    return 0;
+}
+
+/* Answers every request with (3 * value + requester). */
+static int
+serve_one(struct vrt_rpc_service *s)
+{
+    int  rc;
+    struct vrt_value  *vrequest;
+    struct vrt_value  *vreply;
+    struct vrt_value_rpc_int  *request;
+    struct vrt_value_int  *reply;
+
+    rc = vrt_rpc_service_next(s, &vrequest);
+    if (rc != 0) {
+        return rc;
+    }
+    request = cork_container_of(vrequest, struct vrt_value_rpc_int,
+                                parent.parent);
+    rii_check(vrt_rpc_service_reply(s, &vreply));
+    reply = cork_container_of(vreply, struct vrt_value_int, parent);
+    reply->value = 3 * request->value + request->parent.reply_to;
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Single-threaded tests
+ */
+
+START_TEST(test_rpc_single_threaded)
+{
+    DESCRIBE_TEST;
+    struct vrt_rpc  *rpc;
+    struct vrt_rpc_requester  *r0;
+    struct vrt_rpc_requester  *r1;
+    struct vrt_rpc_service  *s;
+    struct vrt_value  *v;
+    int32_t  value;
+
+    rpc = vrt_rpc_new("rpc", vrt_value_type_rpc_int(), 16,
+                      vrt_value_type_int(), 4);
+    fail_if_error(r0 = vrt_rpc_requester_new(rpc, "r0", 1));
+    fail_if_error(r1 = vrt_rpc_requester_new(rpc, "r1", 1));
+    fail_if_error(s = vrt_rpc_service_new(rpc, "service"));
+    fail_unless_error(vrt_rpc_service_new(rpc, "service2"),
+                      "Shouldn't be able to create a second service");
+    cork_error_clear();
+
+    /* A reply ring of 4 allows 3 outstanding requests. */
+    fail_if_error(send_request(r0, 1));
+    fail_if_error(send_request(r1, 10));
+    fail_if_error(send_request(r0, 2));
+    fail_if_error(send_request(r0, 3));
+    fail_unless_error(send_request(r0, 4),
+                      "Shouldn't be able to send a fourth request");
+    cork_error_clear();
+    fail_unless(vrt_rpc_requester_outstanding(r0) == 3,
+                "Unexpected number of outstanding requests");
+
+    fail_unless_error(vrt_rpc_service_reply(s, &v),
+                      "Shouldn't be able to reply without a request");
+    cork_error_clear();
+    fail_if_error(vrt_rpc_service_next(s, &v));
+    fail_unless_error(vrt_rpc_service_next(s, &v),
+                      "Shouldn't be able to skip a reply");
+    cork_error_clear();
+    fail_if_error(vrt_rpc_service_reply(s, &v));
+    cork_container_of(v, struct vrt_value_int, parent)->value = 3;
+    fail_if_error(serve_one(s));
+    fail_if_error(serve_one(s));
+    fail_if_error(serve_one(s));
+
+    /* Nothing is published until the service flushes. */
+    fail_unless(vrt_padded_int_get(&r0->published) == 0,
+                "Replies were published too early");
+    vrt_rpc_service_flush(s);
+
+    fail_if_error(receive_reply(r0, &value));
+    fail_unless(value == 3, "Unexpected reply %d", value);
+    fail_if_error(receive_reply(r1, &value));
+    fail_unless(value == 31, "Unexpected reply %d", value);
+    fail_if_error(receive_reply(r0, &value));
+    fail_unless(value == 6, "Unexpected reply %d", value);
+    fail_if_error(receive_reply(r0, &value));
+    fail_unless(value == 9, "Unexpected reply %d", value);
+    fail_unless_error(receive_reply(r0, &value),
+                      "Shouldn't be able to wait without a request");
+    cork_error_clear();
+
+    fail_if_error(vrt_rpc_requester_eof(r0));
+    fail_if_error(vrt_rpc_requester_eof(r1));
+    fail_unless(vrt_rpc_service_next(s, &v) == VRT_QUEUE_EOF,
+                "Expected EOF");
+    vrt_rpc_free(rpc);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Threaded tests
+ */
+
+#define REQUESTER_COUNT  4
+#define REQUEST_COUNT  10000
+
+struct requester_config {
+    struct vrt_rpc_requester  *r;
+    unsigned int  window;
+    int64_t  count;
+    int64_t  failures;
+};
+
+static int
+check_reply(struct requester_config *c, int32_t sent)
+{
+    int32_t  value;
+    rii_check(receive_reply(c->r, &value));
+    if (value != 3 * sent + (int32_t) c->r->index) {
+        c->failures++;
+    }
+    return 0;
+}
+
+static void *
+requester(void *ud)
+{
+    struct requester_config  *c = ud;
+    int32_t  i;
+    int32_t  oldest = 0;
+    for (i = 0; i < c->count; i++) {
+        rpi_check(send_request(c->r, i));
+        if (vrt_rpc_requester_outstanding(c->r) == c->window) {
+            rpi_check(check_reply(c, oldest++));
+        }
+    }
+    while (oldest < i) {
+        rpi_check(check_reply(c, oldest++));
+    }
+    rpi_check(vrt_rpc_requester_eof(c->r));
+    return NULL;
+}
+
+static void *
+service(void *ud)
+{
+    int  rc;
+    struct vrt_rpc_service  *s = ud;
+    while ((rc = serve_one(s)) == 0) {
+    }
+    return NULL;
+}
+
+static void
+run_rpc_test(unsigned int batch_size, unsigned int window,
+             unsigned int reply_ring_size)
+{
+    struct vrt_rpc  *rpc;
+    struct vrt_rpc_service  *s;
+    struct requester_config  configs[REQUESTER_COUNT];
+    struct vrt_queue_client  clients[REQUESTER_COUNT + 2];
+    vrt_clock  elapsed;
+    unsigned int  i;
+
+    rpc = vrt_rpc_new("rpc", vrt_value_type_rpc_int(), 256,
+                      vrt_value_type_int(), reply_ring_size);
+    for (i = 0; i < REQUESTER_COUNT; i++) {
+        char  name[16];
+        snprintf(name, sizeof(name), "requester%u", i);
+        configs[i].r = vrt_rpc_requester_new(rpc, name, batch_size);
+        configs[i].window = window;
+        configs[i].count = REQUEST_COUNT;
+        configs[i].failures = 0;
+        clients[i].run = requester;
+        clients[i].ud = &configs[i];
+    }
+    s = vrt_rpc_service_new(rpc, "service");
+    clients[i].run = service;
+    clients[i].ud = s;
+    clients[i+1].run = NULL;
+    clients[i+1].ud = NULL;
+
+    fail_if_error(vrt_test_queue_threaded_hybrid
+                  (rpc->requests, clients, &elapsed));
+    vrt_report_clock(elapsed, REQUESTER_COUNT * REQUEST_COUNT);
+    for (i = 0; i < REQUESTER_COUNT; i++) {
+        fail_unless(configs[i].r->received == REQUEST_COUNT,
+                    "Requester %u only received %u replies",
+                    i, configs[i].r->received);
+        fail_unless(configs[i].failures == 0,
+                    "Requester %u received %" PRId64 " wrong replies",
+                    i, configs[i].failures);
+    }
+    vrt_rpc_free(rpc);
+}
+
+START_TEST(test_rpc_threaded_unbatched)
+{
+    DESCRIBE_TEST;
+    run_rpc_test(1, 1, 0);
+}
+END_TEST
+
+START_TEST(test_rpc_threaded_windowed)
+{
+    DESCRIBE_TEST;
+    run_rpc_test(16, 31, 32);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("rpc");
+
+    TCase  *tc_rpc = tcase_create("rpc");
+    tcase_add_test(tc_rpc, test_rpc_single_threaded);
+    tcase_add_test(tc_rpc, test_rpc_threaded_unbatched);
+    tcase_add_test(tc_rpc, test_rpc_threaded_windowed);
+    suite_add_tcase(s, tc_rpc);
+
+    return s;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -0,0 +1,553 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+
+#include <check.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+#include "sim.h"
+
+/* Stress tests for the queue protocol, using the deterministic
+ * interleaving simulator.  This test case is compiled against its own
+ * copy of the queue code, built with VRT_SCHEDULE_HOOK, so that every
+ * access to a shared cursor is a point where the simulator can switch
+ * to a different producer or consumer.  After each run we check that:
+ *
+ *   - no producer claimed a slot that some consumer hadn't finished
+ *     with yet,
+ *   - no consumer saw a value before the consumers it depends on had
+ *     finished with it,
+ *   - each consumer saw every producer's values exactly once, in
+ *     order.
+ *
+ * To replay a failing random schedule, with a trace of every context
+ * switch, run
+ *
+ *     VRT_SIM_SCENARIO=<name> VRT_SIM_SEED=<seed> ./test-sim
+ */
+
+#define MAX_PRODUCERS  3
+#define MAX_CONSUMERS  3
+#define MAX_STEPS  200000
+
+#define RANDOM_RUNS  300
+#define MAX_SYSTEMATIC_RUNS  20000
+#define PREEMPTION_BOUND  1
+
+
+/*-----------------------------------------------------------------------
+ * Scenarios
+ */
+
+struct sim_scenario {
+    const char  *name;
+    unsigned int  queue_size;
+    unsigned int  batch_size;
+    unsigned int  producer_count;
+    unsigned int  consumer_count;
+    /** Whether each consumer depends on the one before it */
+    bool  chained;
+    /** The number of values sent by each producer */
+    int  value_count;
+    /** Whether the producers skip waiting for free slots (used to make
+     * sure that the simulator catches real bugs) */
+    bool  broken;
+};
+
+static const struct sim_scenario  SCENARIOS[] = {
+    /* name           size batch  P  C  chained count broken */
+    { "unicast",        16,   1,  1, 1, false,   40, false },
+    { "unicast-batch",  16,   4,  1, 1, false,   40, false },
+    { "multicast",      16,   2,  1, 2, false,   40, false },
+    { "pipeline",       16,   2,  1, 3, true,    40, false },
+    { "sequencer",      16,   1,  2, 1, false,   20, false },
+    { "sequencer-batch", 16,  2,  3, 2, false,   12, false },
+    { NULL }
+};
+
+static const struct sim_scenario  BROKEN_SCENARIO =
+    { "broken",         16,   1,  1, 1, false,   40, true };
+
+
+/*-----------------------------------------------------------------------
+ * Values
+ */
+
+struct sim_value {
+    struct vrt_value  parent;
+    unsigned int  producer;
+    int  seq;
+};
+
+static struct vrt_value *
+sim_value_new(struct vrt_value_type *type)
+{
+    struct sim_value  *self = cork_new(struct sim_value);
+    memset(self, 0, sizeof(struct sim_value));
+    return &self->parent;
+}
+
+static void
+sim_value_free(struct vrt_value_type *type, struct vrt_value *vself)
+{
+    struct sim_value  *self =
+        cork_container_of(vself, struct sim_value, parent);
+    free(self);
+}
+
+static struct vrt_value_type  sim_value_type = {
+    sim_value_new,
+    sim_value_free
+};
+
+
+/*-----------------------------------------------------------------------
+ * Actors
+ */
+
+/* What the test knows about each slot in the ring buffer */
+struct sim_slot {
+    vrt_value_id  id;
+    /** The number of consumers that haven't finished with the value */
+    unsigned int  remaining;
+};
+
+struct sim_run;
+
+struct sim_producer {
+    struct sim_run  *run;
+    unsigned int  index;
+    struct vrt_producer  *p;
+};
+
+struct sim_consumer {
+    struct sim_run  *run;
+    unsigned int  index;
+    struct vrt_consumer  *c;
+    int  expected[MAX_PRODUCERS];
+    /** The last value that this consumer has finished with */
+    bool  done_any;
+    vrt_value_id  done_through;
+};
+
+struct sim_run {
+    const struct sim_scenario  *scenario;
+    struct vrt_queue  *q;
+    struct sim_producer  producers[MAX_PRODUCERS];
+    struct sim_consumer  consumers[MAX_CONSUMERS];
+    struct sim_slot  *slots;
+    /** The first invariant violation we found, if any */
+    char  violation[256];
+};
+
+static void
+sim_violation(struct sim_run *run, const char *fmt, ...)
+{
+    if (run->violation[0] == '\0') {
+        va_list  args;
+        va_start(args, fmt);
+        vsnprintf(run->violation, sizeof(run->violation), fmt, args);
+        va_end(args);
+    }
+}
+
+/* Claims a batch without waiting for the slots to be free. */
+static int
+sim_broken_claim(struct vrt_queue *q, struct vrt_producer *p)
+{
+    p->last_claimed_id += p->batch_size;
+    return 0;
+}
+
+static void
+sim_producer_run(void *ud)
+{
+    struct sim_producer  *self = ud;
+    struct sim_run  *run = self->run;
+    int  seq;
+
+    for (seq = 0; seq < run->scenario->value_count; seq++) {
+        struct vrt_value  *vvalue;
+        struct sim_value  *value;
+        struct sim_slot  *slot;
+
+        if (vrt_producer_claim(self->p, &vvalue) != 0) {
+            sim_violation(run, "%s: claim failed", self->p->name);
+            return;
+        }
+
+        slot = &run->slots[vvalue->id & run->q->value_mask];
+        if (slot->remaining > 0) {
+            sim_violation(run, "%s overwrote value %d with value %d "
+                          "before %u consumer(s) finished with it",
+                          self->p->name, slot->id, vvalue->id,
+                          slot->remaining);
+        }
+        slot->id = vvalue->id;
+        slot->remaining = run->scenario->consumer_count;
+
+        value = cork_container_of(vvalue, struct sim_value, parent);
+        value->producer = self->index;
+        value->seq = seq;
+
+        if (vrt_producer_publish(self->p) != 0) {
+            sim_violation(run, "%s: publish failed", self->p->name);
+            return;
+        }
+    }
+
+    if (vrt_producer_eof(self->p) != 0) {
+        sim_violation(run, "%s: EOF failed", self->p->name);
+    }
+}
+
+static void
+sim_consumer_check(struct sim_consumer *self, struct sim_value *value)
+{
+    struct sim_run  *run = self->run;
+    const char  *name = self->c->name;
+    vrt_value_id  id = value->parent.id;
+    struct sim_slot  *slot = &run->slots[id & run->q->value_mask];
+
+    if (slot->id != id) {
+        sim_violation(run, "%s read value %d, but its slot holds value %d",
+                      name, id, slot->id);
+        return;
+    }
+
+    if (value->producer >= run->scenario->producer_count) {
+        sim_violation(run, "%s read a value from unknown producer %u",
+                      name, value->producer);
+        return;
+    }
+
+    if (value->seq != self->expected[value->producer]) {
+        sim_violation(run, "%s expected value %d from producer %u, "
+                      "got value %d",
+                      name, self->expected[value->producer],
+                      value->producer, value->seq);
+    }
+    self->expected[value->producer] = value->seq + 1;
+
+    if (run->scenario->chained && self->index > 0) {
+        struct sim_consumer  *dep = &run->consumers[self->index - 1];
+        if (!dep->done_any || vrt_mod_lt(dep->done_through, id)) {
+            sim_violation(run, "%s saw value %d before %s finished with it",
+                          name, id, dep->c->name);
+        }
+    }
+}
+
+static void
+sim_consumer_run(void *ud)
+{
+    struct sim_consumer  *self = ud;
+    struct sim_run  *run = self->run;
+    struct sim_slot  *current = NULL;
+    vrt_value_id  current_id = 0;
+    unsigned int  i;
+    int  rc;
+
+    while (true) {
+        struct vrt_value  *vvalue;
+
+        /* Calling vrt_consumer_next means that we're done with the
+         * previous value. */
+        if (current != NULL) {
+            if (current->remaining > 0) {
+                current->remaining--;
+            }
+            self->done_any = true;
+            self->done_through = current_id;
+            current = NULL;
+        }
+
+        rc = vrt_consumer_next(self->c, &vvalue);
+        if (rc == VRT_QUEUE_EOF) {
+            break;
+        } else if (rc == VRT_QUEUE_FLUSH) {
+            continue;
+        } else if (rc != 0) {
+            sim_violation(run, "%s: next failed", self->c->name);
+            return;
+        }
+
+        sim_consumer_check
+            (self, cork_container_of(vvalue, struct sim_value, parent));
+        current_id = vvalue->id;
+        current = &run->slots[current_id & run->q->value_mask];
+    }
+
+    for (i = 0; i < run->scenario->producer_count; i++) {
+        if (self->expected[i] != run->scenario->value_count) {
+            sim_violation(run, "%s received %d of %d values from "
+                          "producer %u",
+                          self->c->name, self->expected[i],
+                          run->scenario->value_count, i);
+        }
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Running scenarios
+ */
+
+static const char  *PRODUCER_NAMES[] = { "p0", "p1", "p2" };
+static const char  *CONSUMER_NAMES[] = { "c0", "c1", "c2" };
+
+/* Runs one schedule of a scenario.  Returns 0 if every invariant held;
+ * otherwise fills in @a violation. */
+static int
+sim_run_scenario(struct vrt_sim *sim, const struct sim_scenario *scenario,
+                 char *violation, size_t violation_size)
+{
+    struct sim_run  run;
+    unsigned int  i;
+    int  rc;
+
+    memset(&run, 0, sizeof(run));
+    run.scenario = scenario;
+    run.q = vrt_queue_new(scenario->name, &sim_value_type,
+                          scenario->queue_size);
+    run.slots = cork_calloc(vrt_queue_size(run.q), sizeof(struct sim_slot));
+
+    for (i = 0; i < scenario->producer_count; i++) {
+        struct sim_producer  *producer = &run.producers[i];
+        producer->run = &run;
+        producer->index = i;
+        producer->p = vrt_producer_new
+            (PRODUCER_NAMES[i], scenario->batch_size, run.q);
+        producer->p->yield = vrt_yield_strategy_sim();
+    }
+
+    for (i = 0; i < scenario->consumer_count; i++) {
+        struct sim_consumer  *consumer = &run.consumers[i];
+        consumer->run = &run;
+        consumer->index = i;
+        consumer->c = vrt_consumer_new(CONSUMER_NAMES[i], run.q);
+        consumer->c->yield = vrt_yield_strategy_sim();
+        if (scenario->chained && i > 0) {
+            vrt_consumer_add_dependency
+                (consumer->c, run.consumers[i - 1].c);
+        }
+    }
+
+    /* The claim functions are chosen as producers are added, so we have
+     * to break them afterwards. */
+    if (scenario->broken) {
+        for (i = 0; i < scenario->producer_count; i++) {
+            run.producers[i].p->claim = sim_broken_claim;
+        }
+    }
+
+    for (i = 0; i < scenario->producer_count; i++) {
+        vrt_sim_add_actor(sim, PRODUCER_NAMES[i],
+                          sim_producer_run, &run.producers[i]);
+    }
+    for (i = 0; i < scenario->consumer_count; i++) {
+        vrt_sim_add_actor(sim, CONSUMER_NAMES[i],
+                          sim_consumer_run, &run.consumers[i]);
+    }
+
+    if (vrt_sim_run(sim) != 0) {
+        if (sim->deadlocked) {
+            sim_violation(&run, "deadlock after %zu steps: every actor "
+                          "is waiting", sim->steps);
+        } else {
+            sim_violation(&run, "livelock: no progress after %zu steps",
+                          sim->steps);
+        }
+    }
+
+    vrt_queue_free(run.q);
+    free(run.slots);
+
+    rc = (run.violation[0] == '\0')? 0: -1;
+    snprintf(violation, violation_size, "%s", run.violation);
+    return rc;
+}
+
+static int
+sim_run_seed(const struct sim_scenario *scenario, uint64_t seed, bool trace,
+             char *violation, size_t violation_size, size_t *steps)
+{
+    struct vrt_sim  sim;
+    int  rc;
+    vrt_sim_init_random(&sim, seed, MAX_STEPS);
+    sim.trace = trace;
+    rc = sim_run_scenario(&sim, scenario, violation, violation_size);
+    if (steps != NULL) {
+        *steps = sim.steps;
+    }
+    vrt_sim_done(&sim);
+    return rc;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Test cases
+ */
+
+START_TEST(test_sim_random)
+{
+    DESCRIBE_TEST;
+    const struct sim_scenario  *scenario;
+    for (scenario = SCENARIOS; scenario->name != NULL; scenario++) {
+        uint64_t  seed;
+        for (seed = 0; seed < RANDOM_RUNS; seed++) {
+            char  violation[256];
+            if (sim_run_seed(scenario, seed, false,
+                             violation, sizeof(violation), NULL) != 0) {
+                fail("%s, seed %" PRIu64 ": %s\n"
+                     "Replay with VRT_SIM_SCENARIO=%s VRT_SIM_SEED=%"
+                     PRIu64, scenario->name, seed, violation,
+                     scenario->name, seed);
+            }
+        }
+        fprintf(stderr, "  %s: %u random schedules\n",
+                scenario->name, RANDOM_RUNS);
+    }
+}
+END_TEST
+
+START_TEST(test_sim_systematic)
+{
+    DESCRIBE_TEST;
+    const struct sim_scenario  *scenario;
+    for (scenario = SCENARIOS; scenario->name != NULL; scenario++) {
+        /* Keep the schedule space small enough to cover. */
+        struct sim_scenario  small = *scenario;
+        struct vrt_sim  sim;
+        size_t  runs = 0;
+        small.value_count = small.queue_size / small.producer_count + 2;
+
+        vrt_sim_init_systematic(&sim, PREEMPTION_BOUND, MAX_STEPS);
+        do {
+            char  violation[256];
+            if (sim_run_scenario(&sim, &small,
+                                 violation, sizeof(violation)) != 0) {
+                fail("%s, systematic schedule %zu: %s",
+                     small.name, runs, violation);
+            }
+            runs++;
+        } while (runs < MAX_SYSTEMATIC_RUNS && vrt_sim_next_schedule(&sim));
+        vrt_sim_done(&sim);
+
+        fprintf(stderr, "  %s: %zu schedules with <= %u preemptions%s\n",
+                small.name, runs, PREEMPTION_BOUND,
+                (runs == MAX_SYSTEMATIC_RUNS)? " (truncated)": "");
+    }
+}
+END_TEST
+
+START_TEST(test_sim_finds_bugs)
+{
+    DESCRIBE_TEST;
+    /* A producer that doesn't wait for free slots should be caught
+     * quickly, and its failing schedule should replay exactly. */
+    uint64_t  seed;
+    char  violation[256];
+    char  replayed[256];
+    size_t  steps;
+    size_t  replayed_steps;
+
+    for (seed = 0; seed < RANDOM_RUNS; seed++) {
+        if (sim_run_seed(&BROKEN_SCENARIO, seed, false,
+                         violation, sizeof(violation), &steps) != 0) {
+            break;
+        }
+    }
+    fail_unless(seed < RANDOM_RUNS,
+                "Simulator didn't catch a producer overwriting values");
+    fprintf(stderr, "  seed %" PRIu64 ": %s\n", seed, violation);
+
+    fail_unless(sim_run_seed(&BROKEN_SCENARIO, seed, false,
+                             replayed, sizeof(replayed),
+                             &replayed_steps) != 0,
+                "Seed %" PRIu64 " didn't fail when replayed", seed);
+    fail_unless(strcmp(violation, replayed) == 0 && steps == replayed_steps,
+                "Seed %" PRIu64 " didn't replay deterministically", seed);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("sim");
+
+    TCase  *tc_sim = tcase_create("sim");
+    tcase_set_timeout(tc_sim, 120);
+    tcase_add_test(tc_sim, test_sim_random);
+    tcase_add_test(tc_sim, test_sim_systematic);
+    tcase_add_test(tc_sim, test_sim_finds_bugs);
+    suite_add_tcase(s, tc_sim);
+
+    return s;
+}
+
+/* Replays a single seed of one (or every) scenario, with a trace. */
+static int
+replay(const char *scenario_name, const char *seed_str)
+{
+    const struct sim_scenario  *scenario;
+    uint64_t  seed = strtoull(seed_str, NULL, 0);
+    int  failed = 0;
+
+    for (scenario = SCENARIOS; scenario->name != NULL; scenario++) {
+        char  violation[256];
+        if (scenario_name != NULL &&
+            strcmp(scenario_name, scenario->name) != 0) {
+            continue;
+        }
+        fprintf(stderr, "%s, seed %" PRIu64 ":\n", scenario->name, seed);
+        if (sim_run_seed(scenario, seed, true,
+                         violation, sizeof(violation), NULL) != 0) {
+            fprintf(stderr, "  FAILED: %s\n", violation);
+            failed = 1;
+        } else {
+            fprintf(stderr, "  passed\n");
+        }
+    }
+    return failed? EXIT_FAILURE: EXIT_SUCCESS;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite;
+    SRunner  *runner;
+
+    if (getenv("VRT_SIM_SEED") != NULL) {
+        return replay(getenv("VRT_SIM_SCENARIO"), getenv("VRT_SIM_SEED"));
+    }
+
+    suite = test_suite();
+    runner = srunner_create(suite);
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -0,0 +1,350 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include <check.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+#include "integers.h"
+#include "queue.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define SINK_COUNT  100000
+#define HEADER  "ints"
+
+/* Writes each integer's raw bytes, straight out of its slot. */
+static int
+encode_int(void *ud, struct vrt_value *vvalue, struct iovec *iov)
+{
+    struct vrt_value_int  *value =
+        cork_container_of(vvalue, struct vrt_value_int, parent);
+    iov->iov_base = &value->value;
+    iov->iov_len = sizeof(value->value);
+    return 0;
+}
+
+/* Only writes the even integers. */
+static int
+encode_even_int(void *ud, struct vrt_value *vvalue, struct iovec *iov)
+{
+    struct vrt_value_int  *value =
+        cork_container_of(vvalue, struct vrt_value_int, parent);
+    iov->iov_base = &value->value;
+    iov->iov_len = (value->value % 2 == 0)? sizeof(value->value): 0;
+    return 0;
+}
+
+struct sink_config {
+    struct vrt_file_sink  *sink;
+    int  result;
+};
+
+static void *
+run_sink(void *ud)
+{
+    struct sink_config  *c = ud;
+    c->result = vrt_file_sink_run(c->sink);
+    return NULL;
+}
+
+/* Reads integers from a pipe, and checks that they're the even ones, in
+ * order. */
+struct read_config {
+    int  fd;
+    int32_t  count;
+    int32_t  failures;
+};
+
+static void *
+read_ints(void *ud)
+{
+    struct read_config  *c = ud;
+    int32_t  value;
+    size_t  have = 0;
+    ssize_t  got;
+    while ((got = read(c->fd, (char *) &value + have,
+                       sizeof(value) - have)) > 0) {
+        have += got;
+        if (have == sizeof(value)) {
+            if (value != c->count * 2) {
+                c->failures++;
+            }
+            c->count++;
+            have = 0;
+        }
+    }
+    return NULL;
+}
+
+static void
+test_file_sink(enum vrt_file_sink_backend backend, unsigned int queue_size,
+               unsigned int depth, unsigned int batch_size)
+{
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct sink_config  sink_config;
+    char  path[] = "/tmp/vrt-sink-XXXXXX";
+    char  header[sizeof(HEADER) - 1];
+    int32_t  *values;
+    int  fd;
+    int32_t  i;
+    off_t  end;
+    vrt_clock  elapsed;
+
+    fail_if((fd = mkstemp(path)) < 0, "Cannot create temporary file");
+    unlink(path);
+    fail_unless(write(fd, HEADER, sizeof(header)) == sizeof(header),
+                "Cannot write header");
+
+    fail_if_error(q = vrt_queue_new("sink", vrt_value_type_int(), queue_size));
+    fail_if_error(p = vrt_producer_new("generate", 4, q));
+    fail_if_error(sink_config.sink = vrt_file_sink_new
+                  ("sink", q, fd, encode_int, NULL));
+    sink_config.sink->backend = backend;
+    sink_config.sink->depth = depth;
+    sink_config.sink->batch_size = batch_size;
+    sink_config.result = 0;
+
+    struct generate_config  generate_config = { p, SINK_COUNT };
+    struct vrt_queue_client  clients[] = {
+        { generate_integers, &generate_config },
+        { run_sink, &sink_config },
+        { NULL, NULL }
+    };
+
+    fail_if_error(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    vrt_report_clock(elapsed, SINK_COUNT);
+    vrt_report_file_sink(sink_config.sink);
+    fail_unless(sink_config.result == 0, "Sink failed");
+    fail_unless(sink_config.sink->stats.value_count == SINK_COUNT,
+                "Sink wrote %" PRIu64 " values, expected %d",
+                sink_config.sink->stats.value_count, SINK_COUNT);
+
+    /* The file position should be right after the last value. */
+    end = lseek(fd, 0, SEEK_CUR);
+    fail_unless(end == sizeof(header) + SINK_COUNT * sizeof(int32_t),
+                "File position is %ld", (long) end);
+
+    values = cork_calloc(SINK_COUNT, sizeof(int32_t));
+    fail_unless(pread(fd, header, sizeof(header), 0) == sizeof(header),
+                "Cannot read header");
+    fail_unless(memcmp(header, HEADER, sizeof(header)) == 0,
+                "Sink overwrote the header");
+    fail_unless(pread(fd, values, SINK_COUNT * sizeof(int32_t),
+                      sizeof(header)) == SINK_COUNT * sizeof(int32_t),
+                "Cannot read values");
+    for (i = 0; i < SINK_COUNT; i++) {
+        fail_unless(values[i] == i, "Value %d is %d", i, values[i]);
+    }
+
+    free(values);
+    close(fd);
+    vrt_file_sink_free(sink_config.sink);
+    vrt_queue_free(q);
+}
+
+
+/* Runs a sink on a file descriptor that can't be written to, so that
+ * every write fails.  There are enough values for several batches, so
+ * that the io_uring backend has more than one in flight when the first
+ * one fails. */
+static void
+test_file_sink_error(enum vrt_file_sink_backend backend)
+{
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_file_sink  *sink;
+    char  path[] = "/tmp/vrt-sink-XXXXXX";
+    int  fd;
+    int32_t  i;
+
+    fail_if((fd = mkstemp(path)) < 0, "Cannot create temporary file");
+    close(fd);
+    fail_if((fd = open(path, O_RDONLY)) < 0, "Cannot reopen temporary file");
+    unlink(path);
+
+    fail_if_error(q = vrt_queue_new("sink", vrt_value_type_int(), 64));
+    fail_if_error(p = vrt_producer_new("generate", 1, q));
+    p->yield = vrt_yield_strategy_hybrid();
+    fail_if_error(sink = vrt_file_sink_new("sink", q, fd, encode_int, NULL));
+    sink->consumer->yield = vrt_yield_strategy_hybrid();
+    sink->backend = backend;
+    sink->depth = 4;
+    sink->batch_size = 4;
+
+    /* The queue is big enough to hold everything, so we can fill it
+     * before the sink starts. */
+    for (i = 0; i < 32; i++) {
+        struct vrt_value  *vvalue;
+        fail_if_error(vrt_producer_claim(p, &vvalue));
+        cork_container_of(vvalue, struct vrt_value_int, parent)->value = i;
+        fail_if_error(vrt_producer_publish(p));
+    }
+    fail_if_error(vrt_producer_eof(p));
+
+    fail_unless_error(vrt_file_sink_run(sink),
+                      "Writing to a read-only file should fail");
+    fprintf(stderr, "  (%s backend)\n",
+            (sink->backend == VRT_FILE_SINK_IO_URING)?
+            "io_uring": "pwritev");
+    cork_error_clear();
+    fail_unless(sink->pending == 0, "Sink left batches behind");
+
+    close(fd);
+    vrt_file_sink_free(sink);
+    vrt_queue_free(q);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Sink tests
+ */
+
+START_TEST(test_sink_file)
+{
+    DESCRIBE_TEST;
+    test_file_sink(VRT_FILE_SINK_AUTO, 0, 4, 64);
+}
+END_TEST
+
+/* A small queue, so that the producer is constantly waiting for writes
+ * to complete before it can reuse their slots. */
+START_TEST(test_sink_file_small)
+{
+    DESCRIBE_TEST;
+    test_file_sink(VRT_FILE_SINK_AUTO, 16, 4, 4);
+}
+END_TEST
+
+START_TEST(test_sink_file_pwritev)
+{
+    DESCRIBE_TEST;
+    test_file_sink(VRT_FILE_SINK_PWRITEV, 16, 4, 4);
+}
+END_TEST
+
+/* With io_uring, if it's available. */
+START_TEST(test_sink_error)
+{
+    DESCRIBE_TEST;
+    test_file_sink_error(VRT_FILE_SINK_AUTO);
+}
+END_TEST
+
+START_TEST(test_sink_error_pwritev)
+{
+    DESCRIBE_TEST;
+    test_file_sink_error(VRT_FILE_SINK_PWRITEV);
+}
+END_TEST
+
+START_TEST(test_sink_pipe)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct sink_config  sink_config;
+    struct read_config  read_config;
+    int  fds[2];
+    vrt_clock  elapsed;
+
+    fail_unless(pipe(fds) == 0, "Cannot create pipe");
+    fail_if_error(q = vrt_queue_new("sink", vrt_value_type_int(), 64));
+    fail_if_error(p = vrt_producer_new("generate", 4, q));
+    fail_if_error(sink_config.sink = vrt_file_sink_new
+                  ("sink", q, fds[1], encode_even_int, NULL));
+    sink_config.result = 0;
+    read_config.fd = fds[0];
+    read_config.count = 0;
+    read_config.failures = 0;
+
+    struct generate_config  generate_config = { p, SINK_COUNT };
+    struct vrt_queue_client  clients[] = {
+        { generate_integers, &generate_config },
+        { run_sink, &sink_config },
+        { NULL, NULL }
+    };
+
+    /* The reader has to outlive the sink, since it only stops once the
+     * pipe is closed. */
+    pthread_t  reader;
+    fail_unless(pthread_create(&reader, NULL, read_ints, &read_config) == 0,
+                "Cannot start reader");
+    fail_if_error(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    close(fds[1]);
+    pthread_join(reader, NULL);
+    close(fds[0]);
+
+    vrt_report_file_sink(sink_config.sink);
+    fail_unless(sink_config.result == 0, "Sink failed");
+    fail_unless(sink_config.sink->depth == 1,
+                "Writes to a pipe shouldn't overlap");
+    fail_unless(read_config.count == SINK_COUNT / 2,
+                "Reader got %d values, expected %d",
+                read_config.count, SINK_COUNT / 2);
+    fail_unless(read_config.failures == 0,
+                "Reader got %d values out of order", read_config.failures);
+
+    vrt_file_sink_free(sink_config.sink);
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("sink");
+
+    TCase  *tc_sink = tcase_create("sink");
+    tcase_add_test(tc_sink, test_sink_file);
+    tcase_add_test(tc_sink, test_sink_file_small);
+    tcase_add_test(tc_sink, test_sink_file_pwritev);
+    tcase_add_test(tc_sink, test_sink_error);
+    tcase_add_test(tc_sink, test_sink_error_pwritev);
+    tcase_add_test(tc_sink, test_sink_pipe);
+    suite_add_tcase(s, tc_sink);
+
+    return s;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
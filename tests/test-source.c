@@ -0,0 +1,371 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include <check.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+#include "queue.h"
+
+
+/*-----------------------------------------------------------------------
+ * Record values
+ */
+
+/* A value that points at a record in the source's arena. */
+struct vrt_value_record {
+    struct vrt_value  parent;
+    const char  *data;
+    size_t  length;
+};
+
+static struct vrt_value *
+vrt_value_record_new(struct vrt_value_type *type)
+{
+    struct vrt_value_record  *self = cork_new(struct vrt_value_record);
+    return &self->parent;
+}
+
+static void
+vrt_value_record_free(struct vrt_value_type *type, struct vrt_value *vself)
+{
+    struct vrt_value_record  *self =
+        cork_container_of(vself, struct vrt_value_record, parent);
+    free(self);
+}
+
+static struct vrt_value_type  vrt_value_type_record = {
+    vrt_value_record_new,
+    vrt_value_record_free
+};
+
+static int
+fill_record(struct vrt_fd_source *source, struct vrt_value *vvalue,
+            const char *record, size_t length)
+{
+    struct vrt_value_record  *value =
+        cork_container_of(vvalue, struct vrt_value_record, parent);
+    value->data = record;
+    value->length = length;
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define LINE_COUNT  20000
+#define RECORD_COUNT  100000
+
+/* Line i is "i:" followed by (i % 40) x's and a newline, except that the
+ * last line doesn't have a newline. */
+static size_t
+format_line(char *buf, size_t size, int i)
+{
+    int  length = snprintf(buf, size, "%d:", i);
+    memset(buf + length, 'x', i % 40);
+    length += i % 40;
+    if (i != LINE_COUNT - 1) {
+        buf[length++] = '\n';
+    }
+    return length;
+}
+
+struct write_config {
+    int  fd;
+};
+
+static void *
+write_lines(void *ud)
+{
+    struct write_config  *c = ud;
+    char  buf[64];
+    int  i;
+    for (i = 0; i < LINE_COUNT; i++) {
+        size_t  length = format_line(buf, sizeof(buf), i);
+        if (write(c->fd, buf, length) != length) {
+            break;
+        }
+    }
+    close(c->fd);
+    return NULL;
+}
+
+struct source_config {
+    struct vrt_fd_source  *source;
+    int  result;
+};
+
+static void *
+run_source(void *ud)
+{
+    struct source_config  *c = ud;
+    c->result = vrt_fd_source_run(c->source);
+    return NULL;
+}
+
+struct check_config {
+    struct vrt_consumer  *c;
+    int  count;
+    int  failures;
+};
+
+/* Checks that each record is the next line that write_lines wrote. */
+static void *
+check_lines(void *ud)
+{
+    struct check_config  *c = ud;
+    struct vrt_value  *vvalue;
+    char  expected[64];
+    int  rc;
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_record  *value =
+                cork_container_of(vvalue, struct vrt_value_record, parent);
+            size_t  length =
+                format_line(expected, sizeof(expected), c->count);
+            if (value->length != length ||
+                memcmp(value->data, expected, length) != 0) {
+                c->failures++;
+            }
+            c->count++;
+        }
+    }
+    return NULL;
+}
+
+/* Checks that each record is the next integer. */
+static void *
+check_ints(void *ud)
+{
+    struct check_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int  rc;
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_record  *value =
+                cork_container_of(vvalue, struct vrt_value_record, parent);
+            int32_t  i;
+            memcpy(&i, value->data, sizeof(i));
+            if (value->length != sizeof(i) || i != c->count) {
+                c->failures++;
+            }
+            c->count++;
+        }
+    }
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Source tests
+ */
+
+/* A small arena and a small queue, so that the source has to wait for
+ * the consumer, and move partial lines back to the start of the arena. */
+START_TEST(test_source_lines)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct source_config  source_config;
+    struct write_config  write_config;
+    struct check_config  check_config;
+    pthread_t  writer;
+    int  fds[2];
+    vrt_clock  elapsed;
+
+    fail_unless(pipe(fds) == 0, "Cannot create pipe");
+    fail_if_error(q = vrt_queue_new("source", &vrt_value_type_record, 16));
+    fail_if_error(source_config.source = vrt_fd_source_new
+                  ("source", q, fds[0], 256, 4,
+                   vrt_fd_source_split_lines, fill_record, NULL));
+    fail_if_error(check_config.c = vrt_consumer_new("check", q));
+    source_config.result = 0;
+    write_config.fd = fds[1];
+    check_config.count = 0;
+    check_config.failures = 0;
+
+    struct vrt_queue_client  clients[] = {
+        { run_source, &source_config },
+        { check_lines, &check_config },
+        { NULL, NULL }
+    };
+
+    fail_unless(pthread_create(&writer, NULL, write_lines, &write_config)
+                == 0, "Cannot start writer");
+    fail_if_error(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    pthread_join(writer, NULL);
+    close(fds[0]);
+
+    vrt_report_clock(elapsed, LINE_COUNT);
+    vrt_report_fd_source(source_config.source);
+    fail_unless(source_config.result == 0, "Source failed");
+    fail_unless(check_config.count == LINE_COUNT,
+                "Got %d lines, expected %d", check_config.count, LINE_COUNT);
+    fail_unless(check_config.failures == 0,
+                "Got %d wrong lines", check_config.failures);
+    fail_unless(source_config.source->stats.move_count > 0,
+                "Source never moved a partial line");
+
+    vrt_fd_source_free(source_config.source);
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_source_fixed)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct source_config  source_config;
+    struct check_config  check_config;
+    char  path[] = "/tmp/vrt-source-XXXXXX";
+    int32_t  *values;
+    int32_t  i;
+    int  fd;
+    vrt_clock  elapsed;
+
+    fail_if((fd = mkstemp(path)) < 0, "Cannot create temporary file");
+    unlink(path);
+    values = cork_calloc(RECORD_COUNT, sizeof(int32_t));
+    for (i = 0; i < RECORD_COUNT; i++) {
+        values[i] = i;
+    }
+    fail_unless(write(fd, values, RECORD_COUNT * sizeof(int32_t)) ==
+                RECORD_COUNT * sizeof(int32_t), "Cannot write records");
+    free(values);
+    lseek(fd, 0, SEEK_SET);
+
+    fail_if_error(q = vrt_queue_new("source", &vrt_value_type_record, 0));
+    fail_if_error(source_config.source = vrt_fd_source_new
+                  ("source", q, fd, 65536, 0,
+                   vrt_fd_source_split_fixed, fill_record, NULL));
+    source_config.source->record_size = sizeof(int32_t);
+    fail_if_error(check_config.c = vrt_consumer_new("check", q));
+    source_config.result = 0;
+    check_config.count = 0;
+    check_config.failures = 0;
+
+    struct vrt_queue_client  clients[] = {
+        { run_source, &source_config },
+        { check_ints, &check_config },
+        { NULL, NULL }
+    };
+
+    fail_if_error(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    close(fd);
+
+    vrt_report_clock(elapsed, RECORD_COUNT);
+    vrt_report_fd_source(source_config.source);
+    fail_unless(source_config.result == 0, "Source failed");
+    fail_unless(check_config.count == RECORD_COUNT,
+                "Got %d records, expected %d",
+                check_config.count, RECORD_COUNT);
+    fail_unless(check_config.failures == 0,
+                "Got %d wrong records", check_config.failures);
+
+    vrt_fd_source_free(source_config.source);
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_source_long_record)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_fd_source  *source;
+    char  path[] = "/tmp/vrt-source-XXXXXX";
+    char  line[300];
+    int  fd;
+
+    fail_if((fd = mkstemp(path)) < 0, "Cannot create temporary file");
+    unlink(path);
+    memset(line, 'x', sizeof(line));
+    fail_unless(write(fd, line, sizeof(line)) == sizeof(line),
+                "Cannot write record");
+    lseek(fd, 0, SEEK_SET);
+
+    fail_if_error(q = vrt_queue_new("source", &vrt_value_type_record, 16));
+    fail_if_error(source = vrt_fd_source_new
+                  ("source", q, fd, 256, 4,
+                   vrt_fd_source_split_lines, fill_record, NULL));
+    fail_if_error(vrt_consumer_new("check", q));
+    fail_unless_error(vrt_fd_source_run(source),
+                      "A record longer than the arena should fail");
+    cork_error_clear();
+
+    close(fd);
+    vrt_fd_source_free(source);
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_source_no_consumers)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_fd_source  *source;
+
+    fail_if_error(q = vrt_queue_new("source", &vrt_value_type_record, 16));
+    fail_if_error(source = vrt_fd_source_new
+                  ("source", q, -1, 256, 4,
+                   vrt_fd_source_split_lines, fill_record, NULL));
+    fail_unless_error(vrt_fd_source_run(source),
+                      "A source without any consumers should fail");
+    cork_error_clear();
+
+    vrt_fd_source_free(source);
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("source");
+
+    TCase  *tc_source = tcase_create("source");
+    tcase_add_test(tc_source, test_source_lines);
+    tcase_add_test(tc_source, test_source_fixed);
+    tcase_add_test(tc_source, test_source_long_record);
+    tcase_add_test(tc_source, test_source_no_consumers);
+    suite_add_tcase(s, tc_source);
+
+    return s;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
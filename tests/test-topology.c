@@ -0,0 +1,743 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2013, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+
+#include <check.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+#include "integers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Handlers
+ */
+
+static int
+generate_handler(struct vrt_topology_client *client, int event,
+                 struct vrt_value *vvalue)
+{
+    struct vrt_value_int  *value =
+        cork_container_of(vvalue, struct vrt_value_int, parent);
+    intptr_t  next = (intptr_t) client->state;
+    long  count = vrt_topology_client_param_long(client, "count", 10);
+    long  delay = vrt_topology_client_param_long(client, "delay_usec", 0);
+    if (next >= count) {
+        return VRT_QUEUE_EOF;
+    }
+    if (delay > 0) {
+        usleep(delay);
+    }
+    value->value = next;
+    client->state = (void *) (next + 1);
+    return 0;
+}
+
+static int
+multiply_handler(struct vrt_topology_client *client, int event,
+                 struct vrt_value *vvalue)
+{
+    if (event == 0) {
+        struct vrt_value_int  *value =
+            cork_container_of(vvalue, struct vrt_value_int, parent);
+        value->value *= vrt_topology_client_param_long(client, "factor", 1);
+    }
+    return 0;
+}
+
+static int
+delay_handler(struct vrt_topology_client *client, int event,
+              struct vrt_value *vvalue)
+{
+    if (event == 0) {
+        usleep(vrt_topology_client_param_long(client, "delay_usec", 0));
+    }
+    return 0;
+}
+
+static int
+sum_handler(struct vrt_topology_client *client, int event,
+            struct vrt_value *vvalue)
+{
+    int64_t  *sum = client->ud;
+    if (event == 0) {
+        struct vrt_value_int  *value =
+            cork_container_of(vvalue, struct vrt_value_int, parent);
+        *sum += value->value;
+    }
+    return 0;
+}
+
+static int
+count_ticks_handler(struct vrt_topology_client *client, int event,
+                    struct vrt_value *vvalue)
+{
+    unsigned int  *ticks = client->ud;
+    if (event == VRT_QUEUE_TICK) {
+        (*ticks)++;
+    }
+    return 0;
+}
+
+/* Copies each value into the queue fed by the passive producer named in
+ * param.output. */
+static int
+relay_handler(struct vrt_topology_client *client, int event,
+              struct vrt_value *vvalue)
+{
+    struct vrt_producer  *p = client->state;
+    if (p == NULL) {
+        p = vrt_topology_producer
+            (client->topology,
+             vrt_topology_client_param(client, "output", ""));
+        client->state = p;
+    }
+
+    if (event == 0) {
+        struct vrt_value_int  *in =
+            cork_container_of(vvalue, struct vrt_value_int, parent);
+        struct vrt_value  *vout;
+        struct vrt_value_int  *out;
+        rii_check(vrt_producer_claim(p, &vout));
+        out = cork_container_of(vout, struct vrt_value_int, parent);
+        out->value = in->value;
+        return vrt_producer_publish(p);
+    } else if (event == VRT_QUEUE_EOF) {
+        return vrt_producer_eof(p);
+    }
+    return 0;
+}
+
+static struct vrt_topology *
+new_topology(int64_t *sum)
+{
+    struct vrt_topology  *topo = vrt_topology_new();
+    *sum = 0;
+    fail_if_error(vrt_topology_register_type
+                  (topo, "int", vrt_value_type_int()));
+    fail_if_error(vrt_topology_register_handler
+                  (topo, "generate", generate_handler, NULL));
+    fail_if_error(vrt_topology_register_handler
+                  (topo, "multiply", multiply_handler, NULL));
+    fail_if_error(vrt_topology_register_handler
+                  (topo, "delay", delay_handler, NULL));
+    fail_if_error(vrt_topology_register_handler
+                  (topo, "relay", relay_handler, NULL));
+    fail_if_error(vrt_topology_register_handler
+                  (topo, "sum", sum_handler, sum));
+    return topo;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Building and running topologies
+ */
+
+START_TEST(test_topology_pipeline)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    fail_if_error(vrt_topology_load_string(topo,
+        "# A three-stage pipeline\n"
+        "[queue ints]\n"
+        "size = 64\n"
+        "type = int\n"
+        "\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "batch_size = 4\n"
+        "yield = threaded\n"
+        "handler = generate\n"
+        "param.count = 1000\n"
+        "\n"
+        "[consumer triple]\n"
+        "queue = ints          ; trailing comment\n"
+        "handler = multiply\n"
+        "param.factor = 3\n"
+        "\n"
+        "[consumer sum]\n"
+        "queue = ints\n"
+        "depends = triple\n"
+        "yield = hybrid\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_run(topo));
+    fail_unless(sum == 3 * (999 * 1000 / 2),
+                "Unexpected sum %" PRId64, sum);
+    fail_unless(vrt_queue_size(vrt_topology_queue(topo, "ints")) == 64,
+                "Unexpected queue size");
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_passive_producer)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    fail_if_error(vrt_topology_load_string(topo,
+        "[queue first]\n"
+        "type = int\n"
+        "size = 32\n"
+        "[queue second]\n"
+        "type = int\n"
+        "size = 32\n"
+        "[producer generate]\n"
+        "queue = first\n"
+        "handler = generate\n"
+        "param.count = 100\n"
+        "[consumer relay]\n"
+        "queue = first\n"
+        "handler = relay\n"
+        "param.output = forward\n"
+        "[producer forward]\n"
+        "queue = second\n"
+        "batch_size = 1\n"
+        "[consumer sum]\n"
+        "queue = second\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_run(topo));
+    fail_unless(sum == 99 * 100 / 2, "Unexpected sum %" PRId64, sum);
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_override)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    fail_if_error(vrt_topology_load_string(topo,
+        "[queue ints]\n"
+        "type = int\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "handler = generate\n"
+        "[consumer sum]\n"
+        "queue = ints\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_set(topo, "ints", "size", "16"));
+    fail_if_error(vrt_topology_set(topo, "generate", "batch_size", "2"));
+    fail_if_error(vrt_topology_set(topo, "generate", "param.count", "50"));
+    fail_if_error(vrt_topology_set(topo, "sum", "yield", "threaded"));
+    fail_if_error(vrt_topology_build(topo));
+    fail_unless(vrt_queue_size(vrt_topology_queue(topo, "ints")) == 16,
+                "Override didn't change queue size");
+    fail_unless(vrt_topology_producer(topo, "generate")->batch_size == 2,
+                "Override didn't change batch size");
+    fail_if_error(vrt_topology_run(topo));
+    fail_unless(sum == 49 * 50 / 2, "Unexpected sum %" PRId64, sum);
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_auto_cpu)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    struct vrt_cpu_topology  *cpus = vrt_cpu_topology_new(NULL);
+    struct vrt_topology_client  *client;
+    fail_if_error(vrt_topology_load_string(topo,
+        "[queue ints]\n"
+        "type = int\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "cpu = auto\n"
+        "handler = generate\n"
+        "param.count = 100\n"
+        "[consumer sum]\n"
+        "queue = ints\n"
+        "cpu = auto\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_set_cpu_policy(topo, VRT_CPU_POLICY_SCATTER));
+    fail_if_error(vrt_topology_build(topo));
+    client = vrt_topology_client(topo, "generate");
+    fail_unless(client->cpu_auto, "Producer CPU should be automatic");
+    fail_if(vrt_cpu_topology_get(cpus, client->cpu) == NULL,
+            "Producer placed on unknown CPU %d", client->cpu);
+    client = vrt_topology_client(topo, "sum");
+    fail_if(vrt_cpu_topology_get(cpus, client->cpu) == NULL,
+            "Consumer placed on unknown CPU %d", client->cpu);
+    fail_unless_error(vrt_topology_set_cpu_policy
+                      (topo, VRT_CPU_POLICY_COMPACT),
+                      "Shouldn't change policy after building");
+    cork_error_clear();
+    vrt_topology_report_placement(topo, stderr);
+    fail_if_error(vrt_topology_run(topo));
+    fail_unless(sum == 99 * 100 / 2, "Unexpected sum %" PRId64, sum);
+    vrt_cpu_topology_free(cpus);
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_runtime)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    struct vrt_topology_client  *client;
+    fail_if_error(vrt_topology_load_string(topo,
+        "[runtime shared]\n"
+        "sched = other\n"
+        "cpus = 0\n"
+        "mlock = no\n"
+        "[queue ints]\n"
+        "type = int\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "yield = spin\n"
+        "handler = generate\n"
+        "param.count = 100\n"
+        "[consumer sum]\n"
+        "queue = ints\n"
+        "yield = spin\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_build(topo));
+
+    /* Both clients have to share CPU 0, so neither of them can spin. */
+    client = vrt_topology_client(topo, "generate");
+    fail_unless(client->cpu == 0, "Producer placed on CPU %d", client->cpu);
+    fail_unless(client->yield_fallback, "Producer shouldn't spin");
+    fail_if(client->producer->yield == vrt_yield_strategy_spin_wait(),
+            "Producer shouldn't spin");
+    client = vrt_topology_client(topo, "sum");
+    fail_unless(client->cpu == 0, "Consumer placed on CPU %d", client->cpu);
+    fail_unless(client->yield_fallback, "Consumer shouldn't spin");
+
+    vrt_topology_report_placement(topo, stderr);
+    fail_if_error(vrt_topology_run(topo));
+    fail_unless(sum == 99 * 100 / 2, "Unexpected sum %" PRId64, sum);
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_runtime_dedicated_spin)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    struct vrt_topology_client  *client;
+
+    /* The producer is driven from outside the topology, so the consumer
+     * is the only client with a thread, and it has CPU 0 to itself. */
+    fail_if_error(vrt_topology_load_string(topo,
+        "[runtime dedicated]\n"
+        "sched = other\n"
+        "cpus = 0\n"
+        "mlock = no\n"
+        "[queue ints]\n"
+        "type = int\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "[consumer sum]\n"
+        "queue = ints\n"
+        "yield = spin\n"
+        "cpu = 0\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_build(topo));
+    client = vrt_topology_client(topo, "sum");
+    fail_unless(client->cpu == 0, "Consumer placed on CPU %d", client->cpu);
+    fail_if(client->yield_fallback, "Consumer should still spin");
+    fail_unless(client->consumer->yield == vrt_yield_strategy_spin_wait(),
+                "Consumer should still spin");
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_runtime_realtime_busy_wait)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    struct vrt_topology_client  *client;
+    vrt_cpu_list  isolated;
+
+    /* The consumer has CPU 0 to itself, but unless the kernel has
+     * isolated it, a real-time thread that never sleeps there would
+     * starve the kernel's own threads.  The threaded strategy doesn't
+     * sleep any more than a spin-wait does. */
+    fail_if_error(vrt_topology_load_string(topo,
+        "[runtime realtime]\n"
+        "sched = fifo\n"
+        "cpus = 0\n"
+        "[queue ints]\n"
+        "type = int\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "[consumer sum]\n"
+        "queue = ints\n"
+        "yield = threaded\n"
+        "cpu = 0\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_build(topo));
+
+    cork_array_init(&isolated);
+    client = vrt_topology_client(topo, "sum");
+    if (vrt_cpu_list_isolated(&isolated) != 0 ||
+        !vrt_cpu_list_contains(&isolated, 0)) {
+        fail_unless(client->yield_fallback, "Consumer shouldn't busy-wait");
+        fail_unless(vrt_yield_strategy_blocks(client->consumer->yield),
+                    "Consumer shouldn't busy-wait");
+    } else {
+        fail_if(client->yield_fallback, "Consumer should still busy-wait");
+    }
+    cork_array_done(&isolated);
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_runtime_unpinned_spin)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+
+    /* A real-time client that spins without a dedicated CPU set could
+     * lock up the machine, so we don't let it. */
+    fail_if_error(vrt_topology_load_string(topo,
+        "[runtime realtime]\n"
+        "sched = fifo\n"
+        "[queue ints]\n"
+        "type = int\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "handler = generate\n"
+        "[consumer sum]\n"
+        "queue = ints\n"
+        "yield = spin\n"
+        "cpu = 0\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_build(topo));
+    fail_unless(vrt_topology_client(topo, "sum")->yield_fallback,
+                "Consumer shouldn't spin");
+    fail_if(vrt_topology_client(topo, "generate")->yield_fallback,
+            "Producer wasn't spinning");
+    vrt_topology_free(topo);
+}
+END_TEST
+
+
+START_TEST(test_topology_ticks)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    unsigned int  ticks = 0;
+    struct vrt_topology  *topo = new_topology(&sum);
+    fail_if_error(vrt_topology_register_handler
+                  (topo, "count_ticks", count_ticks_handler, &ticks));
+    /* The producer takes at least 50ms, so a consumer that wants a tick
+     * every millisecond should see plenty of them. */
+    fail_if_error(vrt_topology_load_string(topo,
+        "[queue ints]\n"
+        "size = 16\n"
+        "type = int\n"
+        "\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "batch_size = 1\n"
+        "handler = generate\n"
+        "param.count = 10\n"
+        "param.delay_usec = 5000\n"
+        "\n"
+        "[consumer timer]\n"
+        "queue = ints\n"
+        "handler = count_ticks\n"
+        "tick_usec = 1000\n"
+        "\n"
+        "[consumer sum]\n"
+        "queue = ints\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_run(topo));
+    fail_unless(sum == 45, "Unexpected sum %" PRId64, sum);
+    fail_unless(ticks >= 10, "Only saw %u ticks", ticks);
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_cancel)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    /* The producer would take far longer than the test to finish, so
+     * the only way to stop it is to cancel the topology. */
+    fail_if_error(vrt_topology_load_string(topo,
+        "[queue ints]\n"
+        "size = 16\n"
+        "type = int\n"
+        "\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "batch_size = 4\n"
+        "handler = generate\n"
+        "param.count = 2000000000\n"
+        "\n"
+        "[consumer triple]\n"
+        "queue = ints\n"
+        "handler = multiply\n"
+        "param.factor = 3\n"
+        "\n"
+        "[consumer sum]\n"
+        "queue = ints\n"
+        "depends = triple\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_start(topo));
+    usleep(50000);
+    vrt_topology_cancel(topo);
+    fail_if_error(vrt_topology_join(topo));
+    fail_unless(sum > 0, "Pipeline never ran");
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_fusion)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    struct vrt_topology_client  *triple;
+    struct vrt_topology_client  *total;
+    fail_if_error(vrt_topology_load_string(topo,
+        "[queue ints]\n"
+        "size = 64\n"
+        "type = int\n"
+        "\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "batch_size = 4\n"
+        "handler = generate\n"
+        "param.count = 1000\n"
+        "\n"
+        "[consumer triple]\n"
+        "queue = ints\n"
+        "handler = multiply\n"
+        "param.factor = 3\n"
+        "\n"
+        "[consumer total]\n"
+        "queue = ints\n"
+        "depends = triple\n"
+        "fuse = yes\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_run(topo));
+    fail_unless(sum == 3 * (999 * 1000 / 2),
+                "Unexpected sum %" PRId64, sum);
+    triple = vrt_topology_client(topo, "triple");
+    total = vrt_topology_client(topo, "total");
+    fail_unless(total->fused_prev == triple, "total should be fused");
+    fail_unless(triple->stats.value_count == 1000 &&
+                total->stats.value_count == 1000,
+                "Each stage should have seen every value");
+    fail_unless(vrt_consumer_get_cursor(total->consumer) ==
+                vrt_consumer_get_cursor(triple->consumer),
+                "Fused cursor should have followed");
+    vrt_topology_report_stages(topo, stderr);
+    vrt_topology_free(topo);
+}
+END_TEST
+
+START_TEST(test_topology_fusion_auto)
+{
+    DESCRIBE_TEST;
+    int64_t  sum;
+    struct vrt_topology  *topo = new_topology(&sum);
+    struct vrt_topology_client  *slow;
+    struct vrt_topology_client  *total;
+    /* The slow stage costs far more than fuse_max_ns, so it should move
+     * to its own thread once it's been measured, taking the stage that's
+     * fused onto it along. */
+    fail_if_error(vrt_topology_load_string(topo,
+        "[queue ints]\n"
+        "size = 64\n"
+        "type = int\n"
+        "\n"
+        "[producer generate]\n"
+        "queue = ints\n"
+        "batch_size = 4\n"
+        "handler = generate\n"
+        "param.count = 2000\n"
+        "\n"
+        "[consumer triple]\n"
+        "queue = ints\n"
+        "handler = multiply\n"
+        "param.factor = 3\n"
+        "\n"
+        "[consumer slow]\n"
+        "queue = ints\n"
+        "depends = triple\n"
+        "fuse = auto\n"
+        "fuse_max_ns = 5000\n"
+        "handler = delay\n"
+        "param.delay_usec = 10\n"
+        "\n"
+        "[consumer total]\n"
+        "queue = ints\n"
+        "depends = slow\n"
+        "fuse = auto\n"
+        "handler = sum\n"));
+    fail_if_error(vrt_topology_run(topo));
+    fail_unless(sum == 3 * (1999 * 2000 / 2),
+                "Unexpected sum %" PRId64, sum);
+    slow = vrt_topology_client(topo, "slow");
+    total = vrt_topology_client(topo, "total");
+    fail_unless(slow->fused_prev == NULL, "slow should be unfused");
+    fail_unless(total->fused_prev == slow, "total should still be fused");
+    fail_unless(total->stats.value_count == 2000,
+                "total should have seen every value");
+    vrt_topology_report_stages(topo, stderr);
+    vrt_topology_free(topo);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Invalid specifications
+ */
+
+#define BAD_SPEC(spec) \
+    do { \
+        int64_t  sum; \
+        struct vrt_topology  *topo = new_topology(&sum); \
+        if (vrt_topology_load_string(topo, spec) == 0) { \
+            fail_unless_error(vrt_topology_build(topo), \
+                              "Expected an error building " #spec); \
+        } \
+        fprintf(stderr, "  %s\n", cork_error_message()); \
+        cork_error_clear(); \
+        vrt_topology_free(topo); \
+    } while (0)
+
+START_TEST(test_topology_errors)
+{
+    DESCRIBE_TEST;
+    BAD_SPEC("size = 16\n");
+    BAD_SPEC("[queue ints\n");
+    BAD_SPEC("[widget ints]\n");
+    BAD_SPEC("[queue ints]\nsize\n");
+    BAD_SPEC("[queue ints]\ntype = int\ntype = int\n");
+    BAD_SPEC("[queue ints]\ntype = int\n[queue ints]\ntype = int\n");
+    BAD_SPEC("[queue ints]\ntype = float\n");
+    BAD_SPEC("[queue ints]\ntype = int\nsize = -4\n");
+    BAD_SPEC("[queue ints]\ntype = int\ncolor = blue\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = other\nhandler = generate\n"
+             "[consumer c]\nqueue = ints\nhandler = sum\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer c]\nqueue = ints\nhandler = missing\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer c]\nqueue = ints\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nyield = lazy\n"
+             "[consumer c]\nqueue = ints\nhandler = sum\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer a]\nqueue = ints\nhandler = sum\ndepends = b\n"
+             "[consumer b]\nqueue = ints\nhandler = sum\ndepends = a\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer a]\nqueue = ints\nhandler = sum\ndepends = p\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer c]\nqueue = ints\nhandler = sum\ncpu = any\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "tick_usec = 1000\n"
+             "[consumer c]\nqueue = ints\nhandler = sum\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer c]\nqueue = ints\nhandler = sum\nfuse = yes\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer a]\nqueue = ints\nhandler = sum\n"
+             "[consumer b]\nqueue = ints\nhandler = sum\n"
+             "[consumer c]\nqueue = ints\nhandler = sum\n"
+             "depends = a, b\nfuse = yes\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer a]\nqueue = ints\nhandler = sum\n"
+             "[consumer b]\nqueue = ints\nhandler = sum\n"
+             "depends = a\nfuse = yes\n"
+             "[consumer c]\nqueue = ints\nhandler = sum\n"
+             "depends = a\nfuse = auto\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer a]\nqueue = ints\nhandler = sum\n"
+             "[consumer b]\nqueue = ints\nhandler = sum\n"
+             "depends = a\nfuse = yes\ntick_usec = 1000\n");
+    BAD_SPEC("[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\n"
+             "[consumer a]\nqueue = ints\nhandler = sum\n"
+             "[consumer b]\nqueue = ints\nhandler = sum\n"
+             "depends = a\nfuse = sometimes\n");
+    BAD_SPEC("[runtime rt]\nsched = idle\n");
+    BAD_SPEC("[runtime rt]\nsched = fifo\npriority = 1000\n");
+    BAD_SPEC("[runtime rt]\ncpus = 0-\n");
+    BAD_SPEC("[runtime rt]\nmlock = maybe\n");
+    BAD_SPEC("[runtime rt]\nnice = 5\n");
+    BAD_SPEC("[runtime a]\n[runtime b]\n");
+    BAD_SPEC("[runtime rt]\ncpus = 0\n"
+             "[queue ints]\ntype = int\n"
+             "[producer p]\nqueue = ints\nhandler = generate\ncpu = 1\n"
+             "[consumer c]\nqueue = ints\nhandler = sum\n");
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("topology");
+
+    TCase  *tc_topology = tcase_create("topology");
+    tcase_add_test(tc_topology, test_topology_pipeline);
+    tcase_add_test(tc_topology, test_topology_passive_producer);
+    tcase_add_test(tc_topology, test_topology_override);
+    tcase_add_test(tc_topology, test_topology_auto_cpu);
+    tcase_add_test(tc_topology, test_topology_runtime);
+    tcase_add_test(tc_topology, test_topology_runtime_dedicated_spin);
+    tcase_add_test(tc_topology, test_topology_runtime_realtime_busy_wait);
+    tcase_add_test(tc_topology, test_topology_runtime_unpinned_spin);
+    tcase_add_test(tc_topology, test_topology_ticks);
+    tcase_add_test(tc_topology, test_topology_cancel);
+    tcase_add_test(tc_topology, test_topology_fusion);
+    tcase_add_test(tc_topology, test_topology_fusion_auto);
+    tcase_add_test(tc_topology, test_topology_errors);
+    suite_add_tcase(s, tc_topology);
+
+    return s;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -11,8 +11,10 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <libcork/core.h>
 
@@ -109,6 +111,516 @@ START_TEST(test_sum_threaded_hybrid)
 END_TEST
 
 
+/* Pretend that we're in a container with half a CPU to work with. */
+START_TEST(test_sum_threaded_hybrid_quota)
+{
+    vrt_yield_strategy_set_cpu_budget(0.5);
+    RUN_TEST(16, 4, vrt_test_queue_threaded_hybrid);
+    vrt_yield_strategy_set_cpu_budget(0);
+}
+END_TEST
+
+
+START_TEST(test_sum_threaded_umwait_small)
+{
+    RUN_TEST(16, 4, vrt_test_queue_threaded_umwait);
+}
+END_TEST
+
+START_TEST(test_sum_threaded_umwait)
+{
+    RUN_TEST(0, 0, vrt_test_queue_threaded_umwait);
+}
+END_TEST
+
+
+/* A consumer waiting on an empty queue still gets its ticks, and a
+ * tick doesn't lose its place in the queue. */
+START_TEST(test_consumer_tick)
+{
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    struct vrt_value  *vvalue;
+    vrt_nsec  start;
+    vrt_nsec  now;
+
+    q = vrt_queue_new("queue_tick", vrt_value_type_int(), 16);
+    p = vrt_producer_new("producer", 1, q);
+    c = vrt_consumer_new("consumer", q);
+    p->yield = vrt_yield_strategy_threaded();
+    c->yield = vrt_yield_strategy_threaded();
+    vrt_get_nsec(&start);
+    vrt_consumer_set_tick(c, 2000000);
+
+    fail_unless(vrt_consumer_next(c, &vvalue) == VRT_QUEUE_TICK,
+                "Expected a tick");
+    vrt_get_nsec(&now);
+    fail_unless(now - start >= 2000000, "Tick arrived too early");
+
+    fail_if_error(vrt_producer_claim(p, &vvalue));
+    cork_container_of(vvalue, struct vrt_value_int, parent)->value = 42;
+    fail_if_error(vrt_producer_publish(p));
+    fail_unless(vrt_consumer_next(c, &vvalue) == 0, "Expected a value");
+    fail_unless(cork_container_of(vvalue, struct vrt_value_int, parent)
+                ->value == 42, "Unexpected value");
+
+    fail_unless(vrt_consumer_next(c, &vvalue) == VRT_QUEUE_TICK,
+                "Expected a second tick");
+    fail_if_error(vrt_producer_eof(p));
+    vrt_consumer_set_tick(c, 0);
+    fail_unless(vrt_consumer_next(c, &vvalue) == VRT_QUEUE_EOF,
+                "Expected EOF");
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/* A consumer with a minimum batch size holds back a smaller batch until
+ * its delay runs out, but not a full batch, or one that ends with an
+ * EOF. */
+
+static void
+publish_int(struct vrt_producer *p, int32_t value)
+{
+    struct vrt_value  *vvalue;
+    fail_if_error(vrt_producer_claim(p, &vvalue));
+    cork_container_of(vvalue, struct vrt_value_int, parent)->value = value;
+    fail_if_error(vrt_producer_publish(p));
+}
+
+START_TEST(test_consumer_min_batch)
+{
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    struct vrt_value  *vvalue;
+    vrt_nsec  start;
+    vrt_nsec  now;
+    int32_t  i;
+
+    q = vrt_queue_new("queue_min_batch", vrt_value_type_int(), 16);
+    p = vrt_producer_new("producer", 1, q);
+    c = vrt_consumer_new("consumer", q);
+    p->yield = vrt_yield_strategy_threaded();
+    c->yield = vrt_yield_strategy_threaded();
+    vrt_consumer_set_min_batch(c, 4, 2000000);
+
+    vrt_get_nsec(&start);
+    publish_int(p, 0);
+    fail_unless(vrt_consumer_next(c, &vvalue) == 0, "Expected a value");
+    vrt_get_nsec(&now);
+    fail_unless(now - start >= 2000000, "Small batch arrived too early");
+
+    /* With a long delay, the rest of the test would time out if anything
+     * were held back. */
+    vrt_consumer_set_min_batch(c, 4, 10000000000ULL);
+    vrt_get_nsec(&start);
+    for (i = 1; i <= 4; i++) {
+        publish_int(p, i);
+    }
+    for (i = 1; i <= 4; i++) {
+        fail_unless(vrt_consumer_next(c, &vvalue) == 0, "Expected a value");
+        fail_unless(cork_container_of(vvalue, struct vrt_value_int, parent)
+                    ->value == i, "Unexpected value");
+    }
+
+    publish_int(p, 5);
+    fail_if_error(vrt_producer_eof(p));
+    fail_unless(vrt_consumer_next(c, &vvalue) == 0, "Expected a value");
+    fail_unless(vrt_consumer_next(c, &vvalue) == VRT_QUEUE_EOF,
+                "Expected EOF");
+    vrt_get_nsec(&now);
+    fail_unless(now - start < 1000000000, "A batch was held back");
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/* A fan-out after a common stage: four consumers that all depend on the
+ * same two consumers share a barrier, and each of them still sees every
+ * value. */
+
+#define FAN_OUT  4
+
+START_TEST(test_shared_barrier)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *first[2];
+    struct vrt_consumer  *fan[FAN_OUT];
+    struct generate_config  generate_config;
+    struct sum_config  sum_configs[2 + FAN_OUT];
+    int64_t  results[2 + FAN_OUT];
+    struct vrt_queue_client  clients[3 + FAN_OUT + 1];
+    int64_t  expected = 0;
+    vrt_clock  elapsed;
+    unsigned int  i;
+    unsigned int  j;
+
+    fail_if_error(q = vrt_queue_new
+                  ("queue_barrier", vrt_value_type_int(), 64));
+    fail_if_error(p = vrt_producer_new("generate", 4, q));
+    generate_config.p = p;
+    generate_config.count = 100000;
+    clients[0].run = generate_integers;
+    clients[0].ud = &generate_config;
+
+    for (i = 0; i < 2; i++) {
+        fail_if_error(first[i] = vrt_consumer_new("first", q));
+        sum_configs[i].c = first[i];
+        sum_configs[i].result = &results[i];
+    }
+    for (i = 0; i < FAN_OUT; i++) {
+        fail_if_error(fan[i] = vrt_consumer_new("fan", q));
+        for (j = 0; j < 2; j++) {
+            vrt_consumer_add_dependency(fan[i], first[j]);
+        }
+        sum_configs[2 + i].c = fan[i];
+        sum_configs[2 + i].result = &results[2 + i];
+    }
+    for (i = 0; i < 2 + FAN_OUT; i++) {
+        clients[1 + i].run = sum_integers;
+        clients[1 + i].ud = &sum_configs[i];
+    }
+    clients[3 + FAN_OUT].run = NULL;
+    clients[3 + FAN_OUT].ud = NULL;
+
+    vrt_queue_share_barriers(q);
+    fail_unless(cork_array_size(&q->barriers) == 1,
+                "Expected one shared barrier");
+    fail_unless(first[0]->barrier == NULL, "Unexpected barrier");
+    for (i = 0; i < FAN_OUT; i++) {
+        fail_unless(fan[i]->barrier == cork_array_at(&q->barriers, 0),
+                    "Consumer %u isn't sharing the barrier", i);
+    }
+
+    fail_if_error(vrt_test_queue_threaded_hybrid(q, clients, &elapsed));
+    vrt_report_clock(elapsed, generate_config.count);
+    for (i = 0; i < generate_config.count; i++) {
+        expected += i;
+    }
+    for (i = 0; i < 2 + FAN_OUT; i++) {
+        fail_unless(results[i] == expected,
+                    "Consumer %u got %" PRId64 ", expected %" PRId64,
+                    i, results[i], expected);
+    }
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/* Quiesces a queue over and over while values are flowing through it.
+ * Each time, every published value must have been consumed, and nothing
+ * new can be published until we resume. */
+
+#define QUIESCE_COUNT  20
+
+struct quiesce_config {
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    volatile bool  done;
+    int64_t  sent;
+    int64_t  received;
+    unsigned int  failures;
+};
+
+static void *
+quiesce_producer(void *ud)
+{
+    struct quiesce_config  *c = ud;
+    int32_t  i;
+    for (i = 0; !c->done; i++) {
+        struct vrt_value  *vvalue;
+        rpi_check(vrt_producer_claim(c->p, &vvalue));
+        cork_container_of(vvalue, struct vrt_value_int, parent)->value = i;
+        rpi_check(vrt_producer_publish(c->p));
+        c->sent += i;
+    }
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+static void *
+quiesce_consumer(void *ud)
+{
+    int  rc;
+    struct quiesce_config  *c = ud;
+    struct vrt_value  *vvalue;
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            c->received +=
+                cork_container_of(vvalue, struct vrt_value_int, parent)
+                    ->value;
+        }
+    }
+    return NULL;
+}
+
+static void *
+quiesce_control(void *ud)
+{
+    struct quiesce_config  *c = ud;
+    unsigned int  i;
+    for (i = 0; i < QUIESCE_COUNT; i++) {
+        vrt_value_id  cursor;
+        usleep(500);
+        rpi_check(vrt_queue_quiesce(c->q, 1000000000));
+        cursor = vrt_queue_get_cursor(c->q);
+        if (vrt_consumer_get_cursor(c->c) != cursor) {
+            c->failures++;
+        }
+        usleep(200);
+        if (vrt_queue_get_cursor(c->q) != cursor) {
+            c->failures++;
+        }
+        vrt_queue_resume(c->q);
+    }
+    c->done = true;
+    return NULL;
+}
+
+START_TEST(test_queue_quiesce)
+{
+    DESCRIBE_TEST;
+    struct quiesce_config  config;
+    vrt_clock  elapsed;
+
+    memset(&config, 0, sizeof(config));
+    config.q = vrt_queue_new("queue_quiesce", vrt_value_type_int(), 64);
+    config.p = vrt_producer_new("generate", 4, config.q);
+    config.c = vrt_consumer_new("sum", config.q);
+
+    struct vrt_queue_client  clients[] = {
+        { quiesce_producer, &config },
+        { quiesce_consumer, &config },
+        { quiesce_control, &config },
+        { NULL, NULL }
+    };
+
+    fail_if_error(vrt_test_queue_threaded_hybrid
+                  (config.q, clients, &elapsed));
+    fail_unless(config.failures == 0,
+                "Queue moved while quiesced (%u times)", config.failures);
+    fail_unless(config.sent == config.received,
+                "Sent %" PRId64 ", but received %" PRId64,
+                config.sent, config.received);
+    vrt_queue_free(config.q);
+}
+END_TEST
+
+/* A queue whose consumer never catches up can't be quiesced. */
+START_TEST(test_queue_quiesce_timeout)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_value  *vvalue;
+
+    q = vrt_queue_new("queue_quiesce", vrt_value_type_int(), 16);
+    p = vrt_producer_new("generate", 1, q);
+    vrt_consumer_new("sum", q);
+    p->yield = vrt_yield_strategy_threaded();
+
+    fail_if_error(vrt_producer_claim(p, &vvalue));
+    fail_if_error(vrt_producer_publish(p));
+    fail_unless_error(vrt_queue_quiesce(q, 1000000),
+                      "Shouldn't be able to quiesce an undrained queue");
+    cork_error_clear();
+    fail_unless(vrt_padded_int_get(&q->quiesced) == 0,
+                "Queue should have been resumed");
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/* Cancels a queue while a producer is blocked waiting for a slot, and a
+ * consumer is blocked waiting for a value.  Both should notice right
+ * away, even though they've been waiting long enough to be sleeping. */
+
+#define CANCEL_DELAY_USEC  200000
+#define CANCEL_MAX_LATENCY  50000000
+
+struct cancel_config {
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    vrt_nsec  cancelled_at;
+    int  producer_rc;
+    int  consumer_rc;
+    vrt_nsec  producer_done;
+    vrt_nsec  consumer_done;
+};
+
+static void *
+cancel_producer(void *ud)
+{
+    struct cancel_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int  rc;
+    while ((rc = vrt_producer_claim(c->p, &vvalue)) == 0 &&
+           (rc = vrt_producer_publish(c->p)) == 0) {
+        /* keep going until the queue fills up */
+    }
+    vrt_get_nsec(&c->producer_done);
+    c->producer_rc = rc;
+    return NULL;
+}
+
+static void *
+cancel_consumer(void *ud)
+{
+    struct cancel_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int  rc;
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) == 0) {
+        /* keep going until the producer blocks */
+    }
+    vrt_get_nsec(&c->consumer_done);
+    c->consumer_rc = rc;
+    return NULL;
+}
+
+static void *
+cancel_control(void *ud)
+{
+    struct cancel_config  *c = ud;
+    usleep(CANCEL_DELAY_USEC);
+    vrt_get_nsec(&c->cancelled_at);
+    vrt_queue_cancel(c->q);
+    return NULL;
+}
+
+START_TEST(test_queue_cancel)
+{
+    DESCRIBE_TEST;
+    struct cancel_config  config;
+    vrt_clock  elapsed;
+
+    memset(&config, 0, sizeof(config));
+    config.q = vrt_queue_new("queue_cancel", vrt_value_type_int(), 16);
+    config.p = vrt_producer_new("generate", 1, config.q);
+    config.c = vrt_consumer_new("fast", config.q);
+    /* This consumer never runs, so the producer fills up the queue. */
+    vrt_consumer_new("stalled", config.q);
+
+    struct vrt_queue_client  clients[] = {
+        { cancel_producer, &config },
+        { cancel_consumer, &config },
+        { cancel_control, &config },
+        { NULL, NULL }
+    };
+
+    fail_if_error(vrt_test_queue_threaded_hybrid
+                  (config.q, clients, &elapsed));
+    fail_unless(config.producer_rc == VRT_QUEUE_CANCELLED,
+                "Producer should have been cancelled (got %d)",
+                config.producer_rc);
+    fail_unless(config.consumer_rc == VRT_QUEUE_CANCELLED,
+                "Consumer should have been cancelled (got %d)",
+                config.consumer_rc);
+    fail_unless(config.producer_done - config.cancelled_at
+                < CANCEL_MAX_LATENCY,
+                "Producer took %" PRIu64 " ns to notice cancellation",
+                config.producer_done - config.cancelled_at);
+    fail_unless(config.consumer_done - config.cancelled_at
+                < CANCEL_MAX_LATENCY,
+                "Consumer took %" PRIu64 " ns to notice cancellation",
+                config.consumer_done - config.cancelled_at);
+    fail_unless(vrt_consumer_get_cursor(config.c) ==
+                vrt_queue_get_cursor(config.q),
+                "Consumer should have processed every published value");
+    vrt_queue_free(config.q);
+}
+END_TEST
+
+/* Cancelling one queue wakes every sleeping client in the process, not
+ * just the ones using that queue.  A client waiting on some other queue
+ * should go right back to sleep, instead of spinning for the rest of its
+ * wait. */
+
+#define ALERT_SETTLE_USEC  100000
+#define ALERT_WATCH_USEC  200000
+#define ALERT_MAX_CPU_USEC  50000
+
+struct alert_config {
+    struct vrt_queue  *other;
+    struct vrt_queue  *q;
+    struct vrt_consumer  *c;
+    int  consumer_rc;
+    int64_t  cpu_usec;
+};
+
+static int64_t
+process_cpu_usec(void)
+{
+    struct rusage  ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * (int64_t) 1000000
+         + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void *
+alert_consumer(void *ud)
+{
+    struct alert_config  *c = ud;
+    struct vrt_value  *vvalue;
+    c->consumer_rc = vrt_consumer_next(c->c, &vvalue);
+    return NULL;
+}
+
+static void *
+alert_control(void *ud)
+{
+    struct alert_config  *c = ud;
+    int64_t  start;
+    usleep(ALERT_SETTLE_USEC);
+    vrt_queue_cancel(c->other);
+    /* This thread is asleep from here on, so any CPU time that the
+     * process uses belongs to the waiting consumer. */
+    start = process_cpu_usec();
+    usleep(ALERT_WATCH_USEC);
+    c->cpu_usec = process_cpu_usec() - start;
+    vrt_queue_cancel(c->q);
+    return NULL;
+}
+
+START_TEST(test_queue_cancel_other)
+{
+    DESCRIBE_TEST;
+    struct alert_config  config;
+    vrt_clock  elapsed;
+
+    memset(&config, 0, sizeof(config));
+    config.other = vrt_queue_new("other", vrt_value_type_int(), 16);
+    config.q = vrt_queue_new("queue_cancel_other", vrt_value_type_int(), 16);
+    /* This producer never runs, so the consumer waits until the queue is
+     * cancelled. */
+    vrt_producer_new("idle", 1, config.q);
+    config.c = vrt_consumer_new("waiting", config.q);
+
+    struct vrt_queue_client  clients[] = {
+        { alert_consumer, &config },
+        { alert_control, &config },
+        { NULL, NULL }
+    };
+
+    fail_if_error(vrt_test_queue_threaded_hybrid
+                  (config.q, clients, &elapsed));
+    fail_unless(config.consumer_rc == VRT_QUEUE_CANCELLED,
+                "Consumer should have been cancelled (got %d)",
+                config.consumer_rc);
+    fail_unless(config.cpu_usec < ALERT_MAX_CPU_USEC,
+                "Waiting consumer used %" PRId64 " usec of CPU in %u usec "
+                "after another queue was cancelled",
+                config.cpu_usec, ALERT_WATCH_USEC);
+    vrt_queue_free(config.q);
+    vrt_queue_free(config.other);
+}
+END_TEST
+
 /*----------------------------------------------------------------------
  * Testing harness
  */
@@ -125,6 +637,16 @@ test_suite()
     tcase_add_test(tc_vrt, test_sum_threaded_spin_small);
     tcase_add_test(tc_vrt, test_sum_threaded_hybrid);
     tcase_add_test(tc_vrt, test_sum_threaded_hybrid_small);
+    tcase_add_test(tc_vrt, test_sum_threaded_hybrid_quota);
+    tcase_add_test(tc_vrt, test_sum_threaded_umwait);
+    tcase_add_test(tc_vrt, test_sum_threaded_umwait_small);
+    tcase_add_test(tc_vrt, test_consumer_tick);
+    tcase_add_test(tc_vrt, test_consumer_min_batch);
+    tcase_add_test(tc_vrt, test_shared_barrier);
+    tcase_add_test(tc_vrt, test_queue_quiesce);
+    tcase_add_test(tc_vrt, test_queue_quiesce_timeout);
+    tcase_add_test(tc_vrt, test_queue_cancel);
+    tcase_add_test(tc_vrt, test_queue_cancel_other);
     suite_add_tcase(s, tc_vrt);
 
     return s;
@@ -0,0 +1,79 @@
+The auto-tuner needs a workload description.
+
+  $ vrt-tune
+  Usage: vrt-tune [options] <topology file>
+  
+  Options:
+    -o, --objective=NAME   throughput (default), p99, or efficiency
+    -c, --configs=N        initial number of configurations [16]
+    -n, --values=N         values per trial in the first round [100000]
+    -e, --eta=N            keep 1/N of the configurations per round [3]
+    -s, --value-size=N     payload bytes in each synthetic value [0]
+    -r, --seed=N           random seed
+    -p, --plugin=FILE      load handlers from a shared library
+  
+  The workload can use the "tune" value type, and the "source",
+  "work", and "sink" handlers.  Each handler burns param.cost_ns
+  nanoseconds per value; sinks measure end-to-end latency.  A plugin
+  must export "int vrt_tune_register(struct vrt_topology *)".
+  [1]
+
+  $ vrt-tune --objective fastest workload.ini
+  Unknown objective "fastest"
+  [1]
+
+  $ vrt-tune --configs many workload.ini
+  Invalid number "many"
+  [1]
+
+  $ vrt-tune missing.ini
+  No such file or directory
+  [1]
+
+The workload has to contain at least one synthetic source, so that the
+tuner can control how many values each trial sends.
+
+  $ cat > passive.ini <<EOF
+  > [queue values]
+  > type = tune
+  > [producer generate]
+  > queue = values
+  > [consumer store]
+  > queue = values
+  > handler = sink
+  > EOF
+  $ vrt-tune passive.ini
+  Workload doesn't have any "source" producers
+  [1]
+
+With a single configuration, the tuner just measures the workload as
+written.
+
+  $ cat > workload.ini <<EOF
+  > [queue values]
+  > type = tune
+  > size = 1024
+  > [producer generate]
+  > queue = values
+  > batch_size = 16
+  > handler = source
+  > [consumer parse]
+  > queue = values
+  > handler = work
+  > param.cost_ns = 50
+  > [consumer store]
+  > queue = values
+  > depends = parse
+  > handler = sink
+  > EOF
+  $ vrt-tune --configs 1 --values 1000 workload.ini
+  Round 0: 1 configuration x 1000 values
+    #0   (as-is)   values/size=(as-is) generate/batch=(as-is)
+         * values/sec  p99 * usec  * values/cpu-sec (glob)
+  
+  Recommended settings (objective: throughput, config #0):
+    (keep the workload as written)
+  
+  Measured frontier (values/sec, p99, values/cpu-sec):
+    (1000 values)  #0   (as-is)   values/size=(as-is) generate/batch=(as-is)
+         * values/sec  p99 * usec  * values/cpu-sec (glob)